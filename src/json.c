@@ -5,6 +5,17 @@
 #include <math.h> /* HUGE_VAL */
 #include <stdarg.h>
 #include <stdio.h>
+#include <limits.h> /* LONG_MAX */
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h> /* open */
+#include <sys/mman.h> /* mmap */
+#include <sys/stat.h> /* fstat */
+#include <unistd.h> /* close */
+#define JSON_MMAP
+#endif
 #include "json.h"
 
 #define ISDIGIT(c) ((c) >= '0' && (c) <= '9')
@@ -32,6 +43,10 @@ typedef struct {
     char *stack;
     size_t size;
     size_t top;
+    json_shape_cache *shapes;
+    json_dedup *dedup;
+    /* JSON_PARSE_* or JSON_JSONIFY_* flags of the options */
+    int flags;
 } json_context;
 
 static void json_context_init(json_context *c, const char *json)
@@ -39,6 +54,9 @@ static void json_context_init(json_context *c, const char *json)
     c->json = json;
     c->stack = NULL;
     c->size = c->top = 0;
+    c->shapes = NULL;
+    c->dedup = NULL;
+    c->flags = 0;
 }
 
 static void json_context_push(json_context *c, const void *v, size_t size)
@@ -68,6 +86,574 @@ static void json_context_free(json_context *c)
     free(c->stack);
 }
 
+/* ********************************Shape******************************************* *
+ * A 'json_shape' is one key sequence seen by the parser, in the spirit of hidden classes:
+ * each shape is the shape of its parent plus one more key. The shapes form a transition tree
+ * rooted at the empty shape of a 'json_shape_cache', children are kept most recently used first,
+ * so the first child is the predicted next key.
+ *   1). Objects parsed through a cache store their members in one block, in key order, and their
+ *       keys point to the keys of the shapes, so the key storage is shared by all of them.
+ *   2). The terminal shape of an object holds the lookup index, shared by all of them as well.
+ *   3). Shapes are reference counted: the cache, the children and the objects hold a reference,
+ *       so documents may outlive the cache.
+ */
+#define JSON_SHAPE_CACHE_LIMIT 4096
+#define JSON_SHAPE_INDEX_MIN 8
+
+struct json_shape {
+    size_t refcount;
+    json_shape *parent;
+    json_shape *children;
+    json_shape *sibling;
+    char *key;
+    size_t key_len;
+    size_t depth;
+    /* key has no escaped chars, its bytes in the json text are the same */
+    int plain;
+    /* open addressing, slot + 1 of each key, 0 for empty */
+    size_t *index;
+    size_t index_mask;
+};
+
+struct json_shape_cache {
+    json_shape *root;
+    size_t count;
+};
+
+/* FNV-1a */
+static size_t json_hash_bytes(const char *p, size_t len)
+{
+    size_t h = (size_t) 14695981039346656037ULL;
+
+    while (len--) {
+        h ^= (unsigned char) *p++;
+        h *= (size_t) 1099511628211ULL;
+    }
+    return h;
+}
+
+static json_shape *json_shape_new(json_shape *parent, const char *key, size_t len)
+{
+    json_shape *s;
+    size_t i;
+
+    s = (json_shape *) malloc(sizeof(json_shape));
+    s->refcount = 1;
+    s->parent = parent;
+    s->children = s->sibling = NULL;
+    s->key = NULL;
+    s->key_len = len;
+    s->depth = 0;
+    s->plain = 1;
+    s->index = NULL;
+    s->index_mask = 0;
+    if (parent) {
+        parent->refcount++;
+        s->depth = parent->depth + 1;
+        s->key = (char *) malloc(len + 1);
+        memcpy(s->key, key, len);
+        s->key[len] = '\0';
+        for (i = 0; i < len; i++)
+            if (key[i] == '\"' || key[i] == '\\' || (unsigned char) key[i] < 0x20) {
+                s->plain = 0;
+                break;
+            }
+    }
+    return s;
+}
+
+static void json_shape_release(json_shape *s)
+{
+    while (s && --s->refcount == 0) {
+        json_shape *parent = s->parent;
+        free(s->key);
+        free(s->index);
+        free(s);
+        s = parent;
+    }
+}
+
+/* Find the transition by 'key', move it to the front, and create it if the cache is not full */
+static json_shape *json_shape_transition(json_shape_cache *cache, json_shape *s, const char *key, size_t len)
+{
+    json_shape **p, *child;
+
+    for (p = &s->children; *p; p = &(*p)->sibling)
+        if ((*p)->key_len == len && !memcmp((*p)->key, key, len)) {
+            child = *p;
+            *p = child->sibling;
+            child->sibling = s->children;
+            s->children = child;
+            return child;
+        }
+    if (cache->count >= JSON_SHAPE_CACHE_LIMIT)
+        return NULL;
+    cache->count++;
+    child = json_shape_new(s, key, len);
+    child->sibling = s->children;
+    s->children = child;
+    return child;
+}
+
+static void json_shape_build_index(json_shape *s, const json_object *members)
+{
+    size_t i, size = 1;
+
+    while (size < s->depth * 2)
+        size <<= 1;
+    s->index_mask = size - 1;
+    s->index = (size_t *) calloc(size, sizeof(size_t));
+    for (i = 0; i < s->depth; i++) {
+        size_t h = json_hash_bytes(members[i].key, members[i].key_len) & s->index_mask;
+        while (s->index[h])
+            h = (h + 1) & s->index_mask;
+        s->index[h] = i + 1;
+    }
+}
+
+static json_value *json_shape_lookup(const json_shape *s, json_object *members, const char *key, size_t len)
+{
+    size_t i;
+
+    if (!s->index) {
+        for (i = 0; i < s->depth; i++)
+            if (members[i].key_len == len && !memcmp(members[i].key, key, len))
+                return &members[i].value;
+        return NULL;
+    }
+    for (i = json_hash_bytes(key, len) & s->index_mask; s->index[i]; i = (i + 1) & s->index_mask) {
+        json_object *o = &members[s->index[i] - 1];
+        if (o->key_len == len && !memcmp(o->key, key, len))
+            return &o->value;
+    }
+    return NULL;
+}
+
+json_shape_cache *json_shape_cache_new(void)
+{
+    json_shape_cache *cache;
+
+    cache = (json_shape_cache *) malloc(sizeof(json_shape_cache));
+    cache->root = json_shape_new(NULL, NULL, 0);
+    cache->count = 0;
+    return cache;
+}
+
+/* Drop the references of the cache in post order, shapes still used by objects are kept */
+void json_shape_cache_free(json_shape_cache *cache)
+{
+    json_shape *s;
+
+    if (!cache)
+        return;
+    s = cache->root;
+    while (s) {
+        json_shape *child = s->children;
+
+        if (child) {
+            s->children = child->sibling;
+            child->sibling = NULL;
+            s = child;
+        } else {
+            json_shape *parent = s->parent;
+            json_shape_release(s);
+            s = parent;
+        }
+    }
+    free(cache);
+}
+
+/* *****************************Object index*************************************** *
+ * A 'json_object_index' makes the modifications of an object O(1) expected:
+ *   1). 'tail' is the last member, so appending does not walk the list.
+ *   2). 'table' is built once the object has JSON_OBJECT_INDEX_MIN members. It is open addressing
+ *       by the hash of the key, and stores the member before each member rather than the member
+ *       itself, so that a member can be unlinked without walking the list. The first member is
+ *       stored as &json_object_head, since the link to it lives in the json_value, which may be
+ *       moved around by shallow copies.
+ * Shaped objects have no index, they are unshaped before a key is added or removed.
+ */
+#define JSON_OBJECT_INDEX_MIN 8
+
+struct json_object_index {
+    json_object *tail;
+    json_object **table;
+    size_t mask;
+};
+
+static json_object json_object_head;
+
+#define JSON_OBJECT_LINK(v, prev) ((prev) == &json_object_head ? (v)->object : (prev)->next)
+
+/* the slot of 'key', or the empty slot where it would be */
+static size_t json_object_index_find(const json_value *v, const char *key, size_t len)
+{
+    const json_object_index *ix = v->object_index;
+    size_t i;
+
+    for (i = json_hash_bytes(key, len) & ix->mask; ix->table[i]; i = (i + 1) & ix->mask) {
+        json_object *o = JSON_OBJECT_LINK(v, ix->table[i]);
+        if (o->key_len == len && !memcmp(o->key, key, len))
+            break;
+    }
+    return i;
+}
+
+/* the slot of the member 'o' itself, keys may be duplicated by json_object_append */
+static size_t json_object_index_find_member(const json_value *v, const json_object *o)
+{
+    const json_object_index *ix = v->object_index;
+    size_t i;
+
+    for (i = json_hash_bytes(o->key, o->key_len) & ix->mask; ; i = (i + 1) & ix->mask) {
+        assert(ix->table[i]);
+        if (JSON_OBJECT_LINK(v, ix->table[i]) == o)
+            return i;
+    }
+}
+
+static void json_object_index_insert(json_value *v, json_object *prev)
+{
+    json_object_index *ix = v->object_index;
+    json_object *o = JSON_OBJECT_LINK(v, prev);
+    size_t i;
+
+    for (i = json_hash_bytes(o->key, o->key_len) & ix->mask; ix->table[i]; i = (i + 1) & ix->mask)
+        ;
+    ix->table[i] = prev;
+}
+
+/* Keep the load factor under 1/2 */
+static void json_object_index_rebuild(json_value *v)
+{
+    json_object_index *ix = v->object_index;
+    json_object *prev, *o;
+    size_t size = 1;
+
+    while (size < v->object_size * 2 + 2)
+        size <<= 1;
+    free(ix->table);
+    ix->table = (json_object **) calloc(size, sizeof(json_object *));
+    ix->mask = size - 1;
+    for (prev = &json_object_head, o = v->object; o; prev = o, o = o->next)
+        json_object_index_insert(v, prev);
+}
+
+/* Backward shift deletion, no tombstones are left behind */
+static void json_object_index_erase(json_value *v, size_t i)
+{
+    json_object_index *ix = v->object_index;
+    size_t j = i;
+
+    for (;;) {
+        json_object *o;
+        size_t k;
+
+        j = (j + 1) & ix->mask;
+        if (!ix->table[j])
+            break;
+        o = JSON_OBJECT_LINK(v, ix->table[j]);
+        k = json_hash_bytes(o->key, o->key_len) & ix->mask;
+        /* move it back unless its home slot lies cyclically in (i, j] */
+        if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+            ix->table[i] = ix->table[j];
+            i = j;
+        }
+    }
+    ix->table[i] = NULL;
+}
+
+static json_object_index *json_object_index_get(json_value *v)
+{
+    json_object_index *ix = v->object_index;
+
+    if (!ix) {
+        ix = v->object_index = (json_object_index *) malloc(sizeof(json_object_index));
+        for (ix->tail = v->object; ix->tail && ix->tail->next; ix->tail = ix->tail->next)
+            ;
+        ix->table = NULL;
+        ix->mask = 0;
+        if (v->object_size >= JSON_OBJECT_INDEX_MIN)
+            json_object_index_rebuild(v);
+    }
+    return ix;
+}
+
+static void json_object_index_free(json_object_index *ix)
+{
+    if (ix) {
+        free(ix->table);
+        free(ix);
+    }
+}
+
+/* ********************************Share******************************************* *
+ * A shared value lives in a reference counted 'json_shared'. Every holder is a handle flagged
+ * JSON_FLAG_SHARED whose type is the type of the shared value, so attaching a subtree to several
+ * parents only bumps 'refcount'. The shared value is immutable: the access functions resolve a
+ * handle to it, and the modifying functions call json_unshare, which copies on write.
+ */
+struct json_shared {
+    size_t refcount;
+    /* json_hash of 'value', which never changes */
+    uint64_t hash;
+    int hashed;
+    json_value value;
+};
+
+#define JSON_RESOLVE(v) ((v)->flags & JSON_FLAG_SHARED ? &(v)->shared->value : (v))
+/* the number is exact in 'number_int64' or 'number_uint64' */
+#define JSON_FLAG_INTEGER (JSON_FLAG_INT64 | JSON_FLAG_UINT64)
+
+static void json_raw_decode(json_value *v);
+
+/* decode a JSON_PARSE_LAZY value before reading it, in place even through a const pointer */
+#define JSON_DECODE(v) ((v)->flags & JSON_FLAG_RAW ? json_raw_decode((json_value *) (v)) : (void) 0)
+
+/* a number 'array_doubles' can hold: a double, or an integer within 2^53 */
+#define JSON_PACKABLE(e) \
+    ((e)->type == JSON_NUMBER && \
+     ((e)->flags == 0 || ((e)->flags == JSON_FLAG_INT64 && (e)->number_int64 >= -9007199254740992LL && (e)->number_int64 <= 9007199254740992LL)))
+
+static void json_shared_release(json_shared *s)
+{
+    if (--s->refcount == 0) {
+        json_free(&s->value);
+        free(s);
+    }
+}
+
+/* ********************************Dedup******************************************* *
+ * A 'json_dedup' table hash-conses the values parsed through it. A string, or an array or object
+ * of at most 'max_subtree' elements that are scalars or interned themselves, is looked up by
+ * json_hash once parsed: the first occurrence is moved into a 'json_shared' the table holds a
+ * reference to, and every occurrence becomes a handle to it, so identical values share one
+ * storage and, being shared, stay immutable. Identical is stricter than json_equal: the members
+ * in the same order and the numbers bit for bit, so jsonify writes the same text, and a packed
+ * array only matches a packed one; json_array_unpack and the modifications unshare before they
+ * convert, so an interned array keeps its form. Interned elements are compared by their pointer.
+ * Documents hold their own references and may outlive the table, json_dedup_prune drops the
+ * values only the table holds.
+ */
+#define JSON_DEDUP_TABLE_SIZE 64
+
+struct json_dedup {
+    /* open addressing by the hash of the value */
+    json_shared **table;
+    size_t mask;
+    size_t max_subtree;
+    json_dedup_stats stats;
+};
+
+json_dedup *json_dedup_new(size_t max_subtree)
+{
+    json_dedup *d = (json_dedup *) malloc(sizeof(json_dedup));
+
+    d->table = (json_shared **) calloc(JSON_DEDUP_TABLE_SIZE, sizeof(json_shared *));
+    d->mask = JSON_DEDUP_TABLE_SIZE - 1;
+    d->max_subtree = max_subtree;
+    memset(&d->stats, 0, sizeof(json_dedup_stats));
+    return d;
+}
+
+void json_dedup_free(json_dedup *d)
+{
+    size_t i;
+
+    if (!d)
+        return;
+    for (i = 0; i <= d->mask; i++)
+        if (d->table[i])
+            json_shared_release(d->table[i]);
+    free(d->table);
+    free(d);
+}
+
+static void json_dedup_insert(json_shared **table, size_t mask, json_shared *s)
+{
+    size_t i;
+
+    for (i = (size_t) s->hash & mask; table[i]; i = (i + 1) & mask)
+        ;
+    table[i] = s;
+}
+
+/* Rebuild the table with 'capacity' slots, leaving out the values no document holds if 'prune' */
+static size_t json_dedup_rehash(json_dedup *d, size_t capacity, int prune)
+{
+    json_shared **table = (json_shared **) calloc(capacity, sizeof(json_shared *));
+    size_t i, pruned = 0;
+
+    for (i = 0; i <= d->mask; i++) {
+        json_shared *s = d->table[i];
+        if (!s)
+            continue;
+        if (prune && s->refcount == 1) {
+            json_shared_release(s);
+            pruned++;
+        } else
+            json_dedup_insert(table, capacity - 1, s);
+    }
+    free(d->table);
+    d->table = table;
+    d->mask = capacity - 1;
+    d->stats.entries -= pruned;
+    return pruned;
+}
+
+size_t json_dedup_prune(json_dedup *d)
+{
+    size_t pruned = 0, n;
+
+    assert(d);
+    /* a released subtree may leave its elements held by the table only */
+    while ((n = json_dedup_rehash(d, d->mask + 1, 1)) != 0)
+        pruned += n;
+    while (d->mask + 1 > JSON_DEDUP_TABLE_SIZE && d->stats.entries * 4 < d->mask + 1)
+        json_dedup_rehash(d, (d->mask + 1) >> 1, 0);
+    return pruned;
+}
+
+void json_dedup_get_stats(const json_dedup *d, json_dedup_stats *stats)
+{
+    assert(d && stats);
+    memcpy(stats, &d->stats, sizeof(json_dedup_stats));
+}
+
+/* The elements of an interned container: scalars, or interned values */
+#define JSON_DEDUP_ELEMENT(e) \
+    ((e)->flags & JSON_FLAG_SHARED || ((e)->type != JSON_ARRAY && (e)->type != JSON_OBJECT && !((e)->flags & JSON_FLAG_RAW)))
+
+static int json_dedup_candidate(const json_dedup *d, const json_value *v)
+{
+    const json_object *o;
+    size_t i;
+
+    switch (v->type) {
+    case JSON_STRING:
+        return !(v->flags & JSON_FLAG_RAW);
+    case JSON_ARRAY:
+        if (!v->array_size || v->array_size > d->max_subtree)
+            return 0;
+        if (!(v->flags & JSON_FLAG_PACKED))
+            for (i = 0; i < v->array_size; i++)
+                if (!JSON_DEDUP_ELEMENT(&v->array[i]))
+                    return 0;
+        return 1;
+    case JSON_OBJECT:
+        if (!v->object_size || v->object_size > d->max_subtree)
+            return 0;
+        for (o = v->object; o; o = o->next)
+            if (!JSON_DEDUP_ELEMENT(&o->value))
+                return 0;
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/* Whether the elements 'a' and 'b' of two candidates are identical */
+static int json_dedup_same_element(const json_value *a, const json_value *b)
+{
+    if ((a->flags | b->flags) & JSON_FLAG_SHARED)
+        return a->flags & b->flags & JSON_FLAG_SHARED && a->shared == b->shared;
+    if (a->type != b->type)
+        return 0;
+    if (a->type == JSON_STRING)
+        return a->string_len == b->string_len && !memcmp(a->string, b->string, a->string_len);
+    if (a->type == JSON_NUMBER)
+        return (a->flags & JSON_FLAG_INTEGER) == (b->flags & JSON_FLAG_INTEGER) &&
+               (a->flags & JSON_FLAG_INTEGER ? a->number_uint64 == b->number_uint64 : !memcmp(&a->number, &b->number, sizeof(double)));
+    return 1;
+}
+
+static int json_dedup_same(const json_value *a, const json_value *b)
+{
+    const json_object *o, *p;
+    size_t i;
+
+    if (a->type != b->type || (a->flags ^ b->flags) & JSON_FLAG_PACKED)
+        return 0;
+    switch (a->type) {
+    case JSON_ARRAY:
+        if (a->array_size != b->array_size)
+            return 0;
+        if (a->flags & JSON_FLAG_PACKED)
+            return !memcmp(a->array_doubles, b->array_doubles, sizeof(double) * a->array_size);
+        for (i = 0; i < a->array_size; i++)
+            if (!json_dedup_same_element(&a->array[i], &b->array[i]))
+                return 0;
+        return 1;
+    case JSON_OBJECT:
+        if (a->object_size != b->object_size)
+            return 0;
+        for (o = a->object, p = b->object; o; o = o->next, p = p->next)
+            if (o->key_len != p->key_len || memcmp(o->key, p->key, o->key_len) || !json_dedup_same_element(&o->value, &p->value))
+                return 0;
+        return 1;
+    default:
+        return json_dedup_same_element(a, b);
+    }
+}
+
+/* The bytes of its own storage a value drops when replaced by a handle */
+static size_t json_dedup_size(const json_value *v)
+{
+    const json_object *o;
+    size_t size;
+
+    switch (v->type) {
+    case JSON_STRING:
+        return v->string_len + 1;
+    case JSON_ARRAY:
+        return v->array_size * (v->flags & JSON_FLAG_PACKED ? sizeof(double) : sizeof(json_value));
+    case JSON_OBJECT:
+        size = sizeof(json_object) * v->object_size;
+        /* shaped objects share the keys */
+        if (!(v->flags & JSON_FLAG_SHAPED))
+            for (o = v->object; o; o = o->next)
+                size += o->key_len + 1;
+        return size;
+    default:
+        return 0;
+    }
+}
+
+/* Make 'v', just parsed, a handle to the interned value identical to it */
+static void json_dedup_intern(json_dedup *d, json_value *v)
+{
+    json_shared *s;
+    uint64_t h;
+    size_t i;
+
+    if (!json_dedup_candidate(d, v))
+        return;
+    h = json_hash(v);
+    d->stats.lookups++;
+    for (i = (size_t) h & d->mask; (s = d->table[i]) != NULL; i = (i + 1) & d->mask)
+        if (s->hash == h && json_dedup_same(&s->value, v)) {
+            d->stats.hits++;
+            d->stats.bytes_saved += json_dedup_size(v);
+            json_free(v);
+            v->type = s->value.type;
+            v->flags = JSON_FLAG_SHARED;
+            v->shared = s;
+            s->refcount++;
+            return;
+        }
+    s = (json_shared *) malloc(sizeof(json_shared));
+    /* the table and 'v' */
+    s->refcount = 2;
+    s->hash = h;
+    s->hashed = 1;
+    memcpy(&s->value, v, sizeof(json_value));
+    v->shared = s;
+    v->flags = JSON_FLAG_SHARED;
+    d->table[i] = s;
+    if (++d->stats.entries * 4 > (d->mask + 1) * 3)
+        json_dedup_rehash(d, (d->mask + 1) * 2, 0);
+}
+
 /* ********************************Parse******************************************* */
 static void json_parse_whitespace(json_context *c)
 {
@@ -88,11 +674,9 @@ static int json_parse_literal(json_context *c, json_value *v, const char *litera
     return JSON_PARSE_OK;
 }
 
-static int json_parse_number(json_context *c, json_value *v)
+/* The end of the number at 'p', NULL if it is not one */
+static const char *json_scan_number(const char *p)
 {
-    const char *p = c->json;
-
-    assert(ISDIGIT(*p) || *p == '-');
     if (*p == '-')
         p++;
     if (ISDIGIT(*p)) {
@@ -102,14 +686,14 @@ static int json_parse_number(json_context *c, json_value *v)
             for (p++; ISDIGIT(*p); p++)
                 ;
     } else
-        return JSON_PARSE_ERROR;
+        return NULL;
     if (*p == '.') {
         p++;
         if (ISDIGIT(*p))
             for (p++; ISDIGIT(*p); p++)
                 ;
         else
-            return JSON_PARSE_ERROR;
+            return NULL;
     }
     if (*p == 'e' || *p == 'E') {
         p++;
@@ -119,7 +703,56 @@ static int json_parse_number(json_context *c, json_value *v)
             for (p++; ISDIGIT(*p); p++)
                 ;
         else
-            return JSON_PARSE_ERROR;
+            return NULL;
+    }
+    return p;
+}
+
+/* Take the number in [p, end) exactly if it is an integer of int64_t or uint64_t, -0 aside */
+static int json_parse_integer_number(const char *p, const char *end, json_value *v)
+{
+    int negative = *p == '-';
+    uint64_t u = 0;
+    unsigned d;
+
+    for (p += negative; p < end; p++) {
+        if (!ISDIGIT(*p))
+            return 0;
+        d = *p - '0';
+        if (u > (UINT64_MAX - d) / 10)
+            return 0;
+        u = u * 10 + d;
+    }
+    if (negative) {
+        if (u == 0 || u > (uint64_t) INT64_MAX + 1)
+            return 0;
+        v->number_int64 = u == (uint64_t) INT64_MAX + 1 ? INT64_MIN : -(int64_t) u;
+        v->number = (double) v->number_int64;
+        v->flags = JSON_FLAG_INT64;
+    } else if (u <= INT64_MAX) {
+        v->number_int64 = (int64_t) u;
+        v->number = (double) v->number_int64;
+        v->flags = JSON_FLAG_INT64;
+    } else {
+        v->number_uint64 = u;
+        v->number = (double) u;
+        v->flags = JSON_FLAG_UINT64;
+    }
+    v->type = JSON_NUMBER;
+    return 1;
+}
+
+static int json_parse_number(json_context *c, json_value *v)
+{
+    const char *p;
+
+    assert(ISDIGIT(*c->json) || *c->json == '-');
+    if (!(p = json_scan_number(c->json)))
+        return JSON_PARSE_ERROR;
+    /* integers skip strtod, and keep all their digits */
+    if (json_parse_integer_number(c->json, p, v)) {
+        c->json = p;
+        return JSON_PARSE_OK;
     }
     errno = 0;
     v->number = strtod(c->json, NULL);
@@ -127,6 +760,7 @@ static int json_parse_number(json_context *c, json_value *v)
     if (errno == ERANGE && (v->number == HUGE_VAL || v->number == -HUGE_VAL))
         return JSON_PARSE_ERROR;
     v->type = JSON_NUMBER;
+    v->flags = 0;
     c->json = p;
     return JSON_PARSE_OK;
 }
@@ -169,12 +803,12 @@ static void json_encode_utf8(json_context *c, unsigned u)
     }
 }
 
-static char *json_generate_string(json_context *c, size_t *len)
+/* Decode the string at c->json onto the stack, the caller pops 'len' bytes */
+static int json_decode_string(json_context *c, size_t *len)
 {
     size_t head = c->top;
     const char *p = c->json;
     unsigned hex;
-    char *s;
 
     assert(*p == '\"');
     for (;;) {
@@ -182,13 +816,7 @@ static char *json_generate_string(json_context *c, size_t *len)
         case '\"':
             c->json = ++p;
             *len = c->top - head;
-            /* Bug: '\0'
-            return strndup(json_context_pop(c, *len), *len);
-             */
-            s = (char *) malloc(*len + 1);
-            memcpy(s, json_context_pop(c, *len), *len);
-            s[*len] = '\0';
-            return s;
+            return JSON_PARSE_OK;
 
         case '\\':
             switch (*++p) {
@@ -217,13 +845,13 @@ static char *json_generate_string(json_context *c, size_t *len)
             case 'u':
                 if (!(p = json_parse_hex4(++p, &hex))) {
                     c->top = head;
-                    return NULL;
+                    return JSON_PARSE_ERROR;
                 }
                 if (hex >= 0xD800 && hex <= 0xDBFF) {
                     unsigned u;
                     if (*++p != '\\' || *++p != 'u' || !(p = json_parse_hex4(++p, &u)) || !(u >= 0xDC00 && u <= 0xDFFF)) {
                         c->top = head;
-                        return NULL;
+                        return JSON_PARSE_ERROR;
                     }
                     hex = 0x10000 + ((hex - 0xD800) << 10) + (u - 0xDC00);
                 }
@@ -232,20 +860,35 @@ static char *json_generate_string(json_context *c, size_t *len)
 
             default:
                 c->top = head;
-                return NULL;
+                return JSON_PARSE_ERROR;
             }
             break;
 
         default:
-            if (*p < '\x20') {
+            if ((unsigned char) *p < 0x20) {
                 c->top = head;
-                return NULL;
+                return JSON_PARSE_ERROR;
             }
             PUTC(c, *p);
         }
     }
 }
 
+static char *json_generate_string(json_context *c, size_t *len)
+{
+    char *s;
+
+    if (json_decode_string(c, len) == JSON_PARSE_ERROR)
+        return NULL;
+    /* Bug: '\0'
+    return strndup(json_context_pop(c, *len), *len);
+     */
+    s = (char *) malloc(*len + 1);
+    memcpy(s, json_context_pop(c, *len), *len);
+    s[*len] = '\0';
+    return s;
+}
+
 static int json_parse_string(json_context *c, json_value *v)
 {
     v->string = json_generate_string(c, &v->string_len);
@@ -257,10 +900,13 @@ static int json_parse_string(json_context *c, json_value *v)
 
 static int json_parse_value(json_context *c, json_value *v);
 
+static int json_parse_raw(json_context *c, json_value *v);
+
 static int json_parse_array(json_context *c, json_value *v)
 {
     size_t head = c->top;
-    size_t size = 0;
+    size_t size = 0, i;
+    int packed = (c->flags & JSON_PARSE_PACK) != 0;
 
     assert(*c->json == '[');
     c->json++;
@@ -268,7 +914,7 @@ static int json_parse_array(json_context *c, json_value *v)
     if (*c->json == ']') {
         c->json++;
         v->type = JSON_ARRAY;
-        v->array_size = 0;
+        v->array_size = v->array_capacity = 0;
         v->array = NULL;
         return JSON_PARSE_OK;
     }
@@ -279,12 +925,21 @@ static int json_parse_array(json_context *c, json_value *v)
         if (json_parse_value(c, &e) == JSON_PARSE_ERROR)
             break;
         size++;
+        packed &= JSON_PACKABLE(&e);
         json_context_push(c, &e, sizeof(json_value));
         json_parse_whitespace(c);
         if (*c->json == ']') {
             c->json++;
             v->type = JSON_ARRAY;
-            v->array_size = size;
+            v->array_size = v->array_capacity = size;
+            if (packed) {
+                json_value *a = (json_value *) json_context_pop(c, sizeof(json_value) * size);
+                v->flags = JSON_FLAG_PACKED;
+                v->array_doubles = (double *) malloc(sizeof(double) * size);
+                for (i = 0; i < size; i++)
+                    v->array_doubles[i] = a[i].number;
+                return JSON_PARSE_OK;
+            }
             size = sizeof(json_value) * size;
             v->array = (json_value *) malloc(size);
             memcpy(v->array, json_context_pop(c, size), size);
@@ -300,66 +955,207 @@ static int json_parse_array(json_context *c, json_value *v)
     return JSON_PARSE_ERROR;
 }
 
+/*
+ * With JSON_PARSE_PACK, arrays of numbers are parsed into 'array_doubles' with JSON_FLAG_PACKED,
+ * a quarter of the memory and contiguous for the reader of json_get_array_doubles. Only numbers a
+ * double holds exactly are packed, integers past 2^53 keep their json_value. Readers take the
+ * elements from json_array_at and never convert the array, only the modifications and the calls
+ * below do, on a value of their own.
+ */
+void json_array_pack(json_value *v)
+{
+    size_t i;
+
+    assert(v && v->type == JSON_ARRAY);
+    json_unshare(v);
+    if (v->flags || !v->array_size)
+        return;
+    for (i = 0; i < v->array_size; i++) {
+        JSON_DECODE(&v->array[i]);
+        if (!JSON_PACKABLE(&v->array[i]))
+            return;
+    }
+    /* in place: the double i is written over json_value i / 4, already read */
+    for (i = 0; i < v->array_size; i++)
+        ((double *) v->array)[i] = v->array[i].number;
+    v->array_doubles = (double *) realloc(v->array, sizeof(double) * v->array_size);
+    v->array_capacity = v->array_size;
+    v->flags = JSON_FLAG_PACKED;
+}
+
+void json_array_unpack(json_value *v)
+{
+    json_value *a;
+    size_t i;
+
+    assert(v && v->type == JSON_ARRAY);
+    json_unshare(v);
+    if (!(v->flags & JSON_FLAG_PACKED))
+        return;
+    a = (json_value *) malloc(sizeof(json_value) * v->array_capacity);
+    for (i = 0; i < v->array_size; i++) {
+        a[i].type = JSON_NUMBER;
+        a[i].flags = 0;
+        a[i].number = v->array_doubles[i];
+    }
+    free(v->array_doubles);
+    v->array = a;
+    v->flags &= ~JSON_FLAG_PACKED;
+}
+
+/* Element i of 'v', built in 'e' if the array is packed */
+const json_value *json_array_at(const json_value *v, size_t i, json_value *e)
+{
+    assert(v && v->type == JSON_ARRAY && e);
+    v = JSON_RESOLVE(v);
+    assert(i < v->array_size);
+    if (!(v->flags & JSON_FLAG_PACKED))
+        return &v->array[i];
+    e->type = JSON_NUMBER;
+    e->flags = 0;
+    e->number = v->array_doubles[i];
+    return e;
+}
+
+/* Predict the next key by the most recent transition, a hit costs one comparison and no decoding */
+static int json_parse_key(json_context *c, json_shape **shape, json_object *o)
+{
+    json_shape *s = *shape;
+
+    if (s) {
+        json_shape *child = s->children;
+        /* strncmp stops at the end of json */
+        if (child && child->plain && !strncmp(c->json + 1, child->key, child->key_len) && c->json[child->key_len + 1] == '\"') {
+            c->json += child->key_len + 2;
+            o->key = child->key;
+            o->key_len = child->key_len;
+            *shape = child;
+            return JSON_PARSE_OK;
+        }
+    }
+    if (json_decode_string(c, &o->key_len) == JSON_PARSE_ERROR)
+        return JSON_PARSE_ERROR;
+    if (s && (*shape = json_shape_transition(c->shapes, s, c->stack + c->top - o->key_len, o->key_len))) {
+        c->top -= o->key_len;
+        o->key = (*shape)->key;
+        return JSON_PARSE_OK;
+    }
+    o->key = (char *) malloc(o->key_len + 1);
+    memcpy(o->key, json_context_pop(c, o->key_len), o->key_len);
+    o->key[o->key_len] = '\0';
+    return JSON_PARSE_OK;
+}
+
+/*
+ * Members are buffered on the stack. Objects matching a shape all the way are stored in one block
+ * sharing the keys of the shape, the others are linked one by one. 'shared' counts the leading
+ * members whose keys belong to a shape.
+ */
 static int json_parse_object(json_context *c, json_value *v)
 {
     size_t head = c->top;
-    json_object **tail = &v->object;
+    size_t size = 0, shared = 0;
+    json_shape *shape = c->shapes ? c->shapes->root : NULL;
+    json_object *o;
 
     assert(*c->json == '{');
-    v->type = JSON_OBJECT;
-    v->object_size = 0;
     c->json++;
     json_parse_whitespace(c);
     if (*c->json == '}') {
         c->json++;
+        v->type = JSON_OBJECT;
         v->object_size = 0;
         v->object = NULL;
+        v->object_index = NULL;
         return JSON_PARSE_OK;
     }
     for (;;) {
-        json_object o;
+        json_object m;
 
-        if (*c->json != '\"' || (o.key = json_generate_string(c, &o.key_len)) == NULL)
+        json_init(&m.value);
+        if (*c->json != '\"' || json_parse_key(c, &shape, &m) == JSON_PARSE_ERROR)
             break;
+        if (shape)
+            shared++;
         json_parse_whitespace(c);
         if (*c->json++ != ':') {
-            free(o.key);
+            if (!shape)
+                free(m.key);
             break;
         }
         json_parse_whitespace(c);
-        if (json_parse_value(c, &o.value) == JSON_PARSE_ERROR) {
-            free(o.key);
+        if (json_parse_value(c, &m.value) == JSON_PARSE_ERROR) {
+            if (!shape)
+                free(m.key);
             break;
         }
-        v->object_size++;
-        *tail = (json_object *) malloc(sizeof(json_object));
-        memcpy(*tail, &o, sizeof(json_object));
-        tail = &(*tail)->next;
+        size++;
+        json_context_push(c, &m, sizeof(json_object));
         json_parse_whitespace(c);
         if (*c->json == ',') {
             c->json++;
             json_parse_whitespace(c);
         } else if (*c->json == '}') {
+            size_t i;
+
             c->json++;
-            *tail = NULL;
+            v->type = JSON_OBJECT;
+            v->object_size = size;
+            o = (json_object *) json_context_pop(c, sizeof(json_object) * size);
+            if (shape) {
+                v->object = (json_object *) malloc(sizeof(json_object) * size);
+                memcpy(v->object, o, sizeof(json_object) * size);
+                for (i = 0; i < size; i++)
+                    v->object[i].next = i + 1 < size ? &v->object[i + 1] : NULL;
+                if (!shape->index && shape->depth > JSON_SHAPE_INDEX_MIN)
+                    json_shape_build_index(shape, v->object);
+                shape->refcount++;
+                v->flags |= JSON_FLAG_SHAPED;
+                v->object_shape = shape;
+                return JSON_PARSE_OK;
+            }
+            v->object_index = NULL;
+            for (i = size; i > 0; i--) {
+                json_object *n = (json_object *) malloc(sizeof(json_object));
+                memcpy(n, &o[i - 1], sizeof(json_object));
+                if (i <= shared) {
+                    n->key = (char *) malloc(n->key_len + 1);
+                    memcpy(n->key, o[i - 1].key, n->key_len + 1);
+                }
+                n->next = i < size ? v->object : NULL;
+                v->object = n;
+            }
             return JSON_PARSE_OK;
         } else
             break;
     }
+    for (o = (json_object *) (c->stack + head); size > 0; size--, o++) {
+        if (shared)
+            shared--;
+        else
+            free(o->key);
+        json_free(&o->value);
+    }
     c->top = head;
-    json_free(v);
     return JSON_PARSE_ERROR;
 }
 
 static int json_parse_value(json_context *c, json_value *v)
 {
+    int ret;
+
     switch (*c->json) {
     case '{':
-        return json_parse_object(c, v);
+        ret = json_parse_object(c, v);
+        break;
     case '[':
-        return json_parse_array(c, v);
+        ret = json_parse_array(c, v);
+        break;
     case '\"':
-        return json_parse_string(c, v);
+        if (c->flags & JSON_PARSE_LAZY)
+            return json_parse_raw(c, v);
+        ret = json_parse_string(c, v);
+        break;
     case 't':
         return json_parse_true(c, v);
     case 'f':
@@ -367,18 +1163,218 @@ static int json_parse_value(json_context *c, json_value *v)
     case 'n':
         return json_parse_null(c, v);
     default:
-        return (ISDIGIT(*c->json) || *c->json == '-') ? json_parse_number(c, v) : JSON_PARSE_ERROR;
+        if (!ISDIGIT(*c->json) && *c->json != '-')
+            return JSON_PARSE_ERROR;
+        return c->flags & JSON_PARSE_LAZY ? json_parse_raw(c, v) : json_parse_number(c, v);
+    }
+    if (ret == JSON_PARSE_OK && c->dedup)
+        json_dedup_intern(c->dedup, v);
+    return ret;
+}
+
+/* The chars json_skip_value stops at: JSON_SKIP_STRING inside strings, JSON_SKIP_VALUE outside */
+#define JSON_SKIP_STRING 1
+#define JSON_SKIP_VALUE 2
+
+static const unsigned char json_skip_stops[256] = {
+    ['\0'] = JSON_SKIP_STRING | JSON_SKIP_VALUE,
+    ['\"'] = JSON_SKIP_STRING | JSON_SKIP_VALUE,
+    ['\\'] = JSON_SKIP_STRING,
+    ['['] = JSON_SKIP_VALUE,
+    [']'] = JSON_SKIP_VALUE,
+    ['{'] = JSON_SKIP_VALUE,
+    ['}'] = JSON_SKIP_VALUE
+};
+
+/* Whether strtod overflows on the number in [p, end), by the decimal exponent of its first significant digit */
+static int json_scan_overflow(const char *p, const char *end)
+{
+    const char *q;
+    long magnitude = 0, exp = 0;
+    int point = 0, significant = 0, negative = 0;
+
+    for (q = p; q < end && *q != 'e' && *q != 'E'; q++) {
+        if (*q == '.')
+            point = 1;
+        else if (ISDIGIT(*q) && (significant || *q != '0')) {
+            significant = 1;
+            magnitude += !point;
+        } else if (*q == '0' && point)
+            magnitude--;
+    }
+    if (!significant)
+        return 0;
+    if (q < end) {
+        negative = *++q == '-';
+        for (q += *q == '-' || *q == '+'; q < end; q++)
+            if (exp < 100000)
+                exp = exp * 10 + (*q - '0');
+        magnitude += negative ? -exp : exp;
+    }
+    /* DBL_MAX is 1.8e308, 309 digits: only those decide by the digits */
+    if (magnitude != 309)
+        return magnitude > 309;
+    errno = 0;
+    strtod(p, NULL);
+    return errno == ERANGE;
+}
+
+/* The end of the string at 'p', NULL if it is not one */
+static const char *json_scan_string(const char *p)
+{
+    unsigned hex, low;
+
+    assert(*p == '\"');
+    for (p++;; p++) {
+        while ((unsigned char) *p >= 0x20 && !(json_skip_stops[(unsigned char) *p] & JSON_SKIP_STRING))
+            p++;
+        switch (*p) {
+        case '\"':
+            return p + 1;
+        case '\\':
+            switch (*++p) {
+            case '\"':
+            case '\\':
+            case '/':
+            case 'b':
+            case 'f':
+            case 'n':
+            case 'r':
+            case 't':
+                break;
+            case 'u':
+                if (!(p = json_parse_hex4(p + 1, &hex)))
+                    return NULL;
+                if (hex >= 0xD800 && hex <= 0xDBFF &&
+                    (p[1] != '\\' || p[2] != 'u' || !(p = json_parse_hex4(p + 3, &low)) || low < 0xDC00 || low > 0xDFFF))
+                    return NULL;
+                break;
+            default:
+                return NULL;
+            }
+            break;
+        default:
+            /* '\0' or a control char */
+            return NULL;
+        }
+    }
+}
+
+/*
+ * JSON_PARSE_LAZY: a string or number is checked with the grammar of json_parse and kept as the
+ * slice 'raw' of the text, with JSON_FLAG_RAW. JSON_DECODE decodes it in place when it is first
+ * read, and jsonify copies an undecoded slice as it is, so the values never read are never
+ * decoded. The text has to outlive the undecoded values.
+ */
+static int json_parse_raw(json_context *c, json_value *v)
+{
+    const char *end;
+
+    if (*c->json == '\"') {
+        if (!(end = json_scan_string(c->json)))
+            return JSON_PARSE_ERROR;
+        v->type = JSON_STRING;
+    } else {
+        if (!(end = json_scan_number(c->json)) || json_scan_overflow(c->json, end))
+            return JSON_PARSE_ERROR;
+        v->type = JSON_NUMBER;
     }
+    v->flags = JSON_FLAG_RAW;
+    v->raw = c->json;
+    v->raw_len = end - c->json;
+    c->json = end;
+    return JSON_PARSE_OK;
+}
+
+/* Decode the slice of a JSON_FLAG_RAW value, it was checked by json_parse_raw */
+static void json_raw_decode(json_value *v)
+{
+    json_context c;
+    int ret;
+
+    assert(v->flags & JSON_FLAG_RAW);
+    json_context_init(&c, v->raw);
+    if (v->type == JSON_STRING) {
+        ret = json_parse_string(&c, v);
+        v->flags &= ~JSON_FLAG_RAW;
+    } else
+        ret = json_parse_number(&c, v);
+    assert(ret == JSON_PARSE_OK);
+    (void) ret;
+    json_context_free(&c);
+}
+
+/*
+ * Move past a value nobody reads, checking only that strings end and brackets balance, so the
+ * value costs a scan and no allocation. Whitespace before the value has been skipped.
+ */
+static int json_skip_value(json_context *c)
+{
+    const char *p = c->json, *start;
+    size_t depth = 0;
+
+    do {
+        switch (*p) {
+        case '\"':
+            for (p++;; p++) {
+                while (!(json_skip_stops[(unsigned char) *p] & JSON_SKIP_STRING))
+                    p++;
+                if (*p == '\"')
+                    break;
+                if (*p == '\0' || *++p == '\0')
+                    return JSON_PARSE_ERROR;
+            }
+            p++;
+            break;
+        case '[':
+        case '{':
+            depth++;
+            p++;
+            break;
+        case ']':
+        case '}':
+            if (depth-- == 0)
+                return JSON_PARSE_ERROR;
+            p++;
+            break;
+        case '\0':
+            return JSON_PARSE_ERROR;
+        default:
+            if (depth) {
+                /* numbers, literals and separators between the strings and brackets */
+                for (p++; !(json_skip_stops[(unsigned char) *p] & JSON_SKIP_VALUE); p++)
+                    ;
+                break;
+            }
+            /* a number or a literal */
+            for (start = p; *p && !ISWHITESPACE(*p) && *p != ',' && *p != ']' && *p != '}'; p++)
+                ;
+            if (p == start)
+                return JSON_PARSE_ERROR;
+        }
+    } while (depth);
+    c->json = p;
+    return JSON_PARSE_OK;
 }
 
 /* Recursive descent parser */
 int json_parse(json_value *v, const char *json)
+{
+    return json_parse_ex(v, json, NULL);
+}
+
+int json_parse_ex(json_value *v, const char *json, const json_parse_options *options)
 {
     int ret;
     json_context c;
 
     assert(v && json);
     json_context_init(&c, json);
+    if (options) {
+        c.shapes = options->shape_cache;
+        c.flags = options->flags;
+        c.dedup = options->dedup;
+    }
     json_parse_whitespace(&c);
     if ((ret = json_parse_value(&c, v)) == JSON_PARSE_OK) {
         json_parse_whitespace(&c);
@@ -395,6 +1391,7 @@ void json_init(json_value *v)
 {
     assert(v);
     v->type = JSON_NULL;
+    v->flags = 0;
 }
 
 void json_free(json_value *v)
@@ -403,16 +1400,38 @@ void json_free(json_value *v)
     json_object *o;
 
     assert(v);
+    if (v->flags & JSON_FLAG_COMPACT) {
+        /* freed along with the block */
+        v->type = JSON_NULL;
+        v->flags = 0;
+        return;
+    }
+    if (v->flags & JSON_FLAG_SHARED) {
+        json_shared_release(v->shared);
+        v->type = JSON_NULL;
+        v->flags = 0;
+        return;
+    }
     switch (v->type) {
     case JSON_STRING:
-        free(v->string);
+        /* a raw string points into the parsed text */
+        if (!(v->flags & JSON_FLAG_RAW))
+            free(v->string);
         break;
     case JSON_ARRAY:
-        for (i = 0; i < v->array_size; i++)
-            json_free(&v->array[i]);
+        if (!(v->flags & JSON_FLAG_PACKED))
+            for (i = 0; i < v->array_size; i++)
+                json_free(&v->array[i]);
         free(v->array);
         break;
     case JSON_OBJECT:
+        if (v->flags & JSON_FLAG_SHAPED) {
+            for (i = 0; i < v->object_size; i++)
+                json_free(&v->object[i].value);
+            free(v->object);
+            json_shape_release(v->object_shape);
+            break;
+        }
         for (i = 0, o = v->object; i < v->object_size; i++) {
             json_object *next;
             free(o->key);
@@ -421,60 +1440,119 @@ void json_free(json_value *v)
             free(o);
             o = next;
         }
+        json_object_index_free(v->object_index);
         break;
     default:
         break;
     }
     v->type = JSON_NULL;
+    v->flags = 0;
 }
 
 /* *******************************Jsonify*********************************** */
-static const char *json_decode_utf8_to_codepoint(const char *p, unsigned *hex)
-{
-    *hex = 0;
-    if ((*p & 0x80) == 0)
-        *hex = (unsigned) *p;
-    else if ((*p & 0xE0) == 0xC0) {
-        *hex |= (*p++ & 0x1F) << 6;
-        if ((*p & 0xC0) != 0x80)
-            return NULL;
-        *hex |= (*p & 0x3F);
-    } else if ((*p & 0xF0) == 0xE0) {
-        *hex |= (*p++ & 0x0F) << 12;
-        if ((*p & 0xC0) != 0x80)
-            return NULL;
-        *hex |= (*p++ & 0x3F) << 6;
-        if ((*p & 0xC0) != 0x80)
-            return NULL;
-        *hex |= (*p & 0x3F);
-    } else if ((*p & 0xF8) == 0xF0) {
-        *hex |= (*p++ & 0x07) << 18;
-        if ((*p & 0xC0) != 0x80)
-            return NULL;
-        *hex |= (*p++ & 0x3F) << 12;
-        if ((*p & 0xC0) != 0x80)
-            return NULL;
-        *hex |= (*p++ & 0x3F) << 6;
-        if ((*p & 0xC0) != 0x80)
-            return NULL;
-        *hex |= (*p & 0x3F);
-    } else
-        return NULL;
+/*
+ * json_jsonify_string copies runs of bytes that need no escape in one push: json_escape_scan
+ * finds the end of a run 16 bytes at a time with SSE2, or 8 at a time by SWAR elsewhere, and
+ * 'json_escape_table' tells what to write for the byte that ends it: JSON_ESCAPE_UTF8 for the
+ * first byte of a UTF-8 sequence, 'u' for "\u00XX", otherwise the char after a '\'.
+ */
+#define JSON_ESCAPE_UTF8 1
+#define U JSON_ESCAPE_UTF8
+static const char json_escape_table[256] = {
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    0, 0, '"', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '/',
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '\\', 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    U, U, U, U, U, U, U, U, U, U, U, U, U, U, U, U,
+    U, U, U, U, U, U, U, U, U, U, U, U, U, U, U, U,
+    U, U, U, U, U, U, U, U, U, U, U, U, U, U, U, U,
+    U, U, U, U, U, U, U, U, U, U, U, U, U, U, U, U,
+    U, U, U, U, U, U, U, U, U, U, U, U, U, U, U, U,
+    U, U, U, U, U, U, U, U, U, U, U, U, U, U, U, U,
+    U, U, U, U, U, U, U, U, U, U, U, U, U, U, U, U,
+    U, U, U, U, U, U, U, U, U, U, U, U, U, U, U, U
+};
+#undef U
+
+#define JSON_SWAR_ONES 0x0101010101010101ULL
+#define JSON_SWAR_HIGHS 0x8080808080808080ULL
+/* a byte of 'w' is below 'n', which is at most 0x80 */
+#define JSON_SWAR_LESS(w, n) (((w) - JSON_SWAR_ONES * (n)) & ~(w) & JSON_SWAR_HIGHS)
+#define JSON_SWAR_HAS(w, c) JSON_SWAR_LESS((w) ^ (JSON_SWAR_ONES * (c)), 1)
+
+static const char *json_escape_scan(const char *p, const char *end)
+{
+#if defined(__SSE2__) && defined(__GNUC__)
+    const __m128i quote = _mm_set1_epi8('\"'), backslash = _mm_set1_epi8('\\'), slash = _mm_set1_epi8('/'), space = _mm_set1_epi8(' ');
+    __m128i s;
+    int mask;
+
+    for (; end - p >= 16; p += 16) {
+        s = _mm_loadu_si128((const __m128i *) p);
+        /* signed, so the bytes from 0x80 are below ' ' too */
+        mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(s, quote), _mm_cmpeq_epi8(s, backslash)),
+                                              _mm_or_si128(_mm_cmpeq_epi8(s, slash), _mm_cmplt_epi8(s, space))));
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+#else
+    uint64_t w;
+
+    for (; end - p >= 8; p += 8) {
+        memcpy(&w, p, 8);
+        if ((w & JSON_SWAR_HIGHS) || JSON_SWAR_LESS(w, ' ') || JSON_SWAR_HAS(w, '\"') || JSON_SWAR_HAS(w, '\\') || JSON_SWAR_HAS(w, '/'))
+            break;
+    }
+#endif
+    while (p < end && !json_escape_table[(unsigned char) *p])
+        p++;
     return p;
 }
 
+/* The length of the UTF-8 sequence at 'p', 0 if it is not a valid one before 'end' */
+static size_t json_utf8_length(const unsigned char *p, const unsigned char *end, unsigned *codepoint)
+{
+    static const unsigned min[] = {0, 0, 0x80, 0x800, 0x10000};
+    size_t len, i;
+
+    if (*p < 0x80)
+        len = 1, *codepoint = *p;
+    else if ((*p & 0xE0) == 0xC0)
+        len = 2, *codepoint = *p & 0x1F;
+    else if ((*p & 0xF0) == 0xE0)
+        len = 3, *codepoint = *p & 0x0F;
+    else if ((*p & 0xF8) == 0xF0)
+        len = 4, *codepoint = *p & 0x07;
+    else
+        return 0;
+    if ((size_t) (end - p) < len)
+        return 0;
+    for (i = 1; i < len; i++) {
+        if ((p[i] & 0xC0) != 0x80)
+            return 0;
+        *codepoint = (*codepoint << 6) | (p[i] & 0x3F);
+    }
+    /* overlong, a surrogate, or past Unicode */
+    if (*codepoint < min[len] || (*codepoint >= 0xD800 && *codepoint <= 0xDFFF) || *codepoint > 0x10FFFF)
+        return 0;
+    return len;
+}
+
 static void json_htos(json_context *c, unsigned hex)
 {
-    char s[4];
+    char *s;
     size_t i;
 
-    json_context_push(c, "\\u", 2);
-    /* underflow if use "for (i = 3; i >= 0; i--)" */
-    for (i = 4; i > 0; i--) {
-        s[i - 1] = "0123456789ABCDEF"[hex & 0xF];
+    json_context_push(c, "\\u0000", 6);
+    s = c->stack + c->top;
+    for (i = 0; i < 4; i++) {
+        *--s = "0123456789ABCDEF"[hex & 0xF];
         hex >>= 4;
     }
-    json_context_push(c, s, 4);
 }
 
 static void json_decode_utf8(json_context *c, unsigned codepoint)
@@ -493,67 +1571,108 @@ static void json_decode_utf8(json_context *c, unsigned codepoint)
 
 static int json_jsonify_string(json_context *c, const json_value *v)
 {
-    size_t head = c->top;
-    const char *p, *end;
+    size_t head = c->top, len;
+    const char *p, *run, *end;
+    unsigned codepoint;
+    char escape[2] = {'\\', 0};
 
     assert(v->type == JSON_STRING);
     PUTC(c, '\"');
-    for (p = v->string, end = v->string + v->string_len; p < end; p++)
-        switch (*p) {
-        case '\b':
-            json_context_push(c, "\\b", 2);
-            break;
-        case '\f':
-            json_context_push(c, "\\f", 2);
-            break;
-        case '\n':
-            json_context_push(c, "\\n", 2);
-            break;
-        case '\r':
-            json_context_push(c, "\\r", 2);
-            break;
-        case '\t':
-            json_context_push(c, "\\t", 2);
-            break;
-        case '\"':
-            json_context_push(c, "\\\"", 2);
-            break;
-        case '/':
-            json_context_push(c, "\\/", 2);
+    for (p = v->string, end = v->string + v->string_len;;) {
+        run = p;
+        p = json_escape_scan(p, end);
+        if (p != run)
+            json_context_push(c, run, p - run);
+        if (p == end)
             break;
-        case '\\':
-            json_context_push(c, "\\\\", 2);
-            break;
-        default:
-            if (*p & 0x80 || *p < '\x20') {
-                unsigned codepoint;
-                if (!(p = json_decode_utf8_to_codepoint(p, &codepoint)) || codepoint > 0x10FFFF) {
+        switch (escape[1] = json_escape_table[(unsigned char) *p]) {
+        case JSON_ESCAPE_UTF8:
+            /* non-ASCII text comes in runs, take them whole */
+            for (run = p; p < end && json_escape_table[(unsigned char) *p] == JSON_ESCAPE_UTF8; p += len) {
+                if (!(len = json_utf8_length((const unsigned char *) p, (const unsigned char *) end, &codepoint))) {
                     c->top = head;
                     return JSON_JSONIFY_ERROR;
                 }
-                json_decode_utf8(c, codepoint);
-            } else
-                PUTC(c, *p);
+                if (!(c->flags & JSON_JSONIFY_RAW_UTF8))
+                    json_decode_utf8(c, codepoint);
+            }
+            if (c->flags & JSON_JSONIFY_RAW_UTF8)
+                json_context_push(c, run, p - run);
+            continue;
+        case 'u':
+            json_htos(c, (unsigned char) *p);
             break;
+        case '/':
+            if (c->flags & JSON_JSONIFY_UNESCAPED_SLASH) {
+                PUTC(c, '/');
+                break;
+            }
+            /* fall through */
+        default:
+            json_context_push(c, escape, 2);
         }
+        p++;
+    }
     PUTC(c, '\"');
     return JSON_JSONIFY_OK;
 }
 
-static int json_jsonify_number(json_context *c, const json_value *v)
+/* Two digits at a time from the pairs "00" to "99" */
+static void json_jsonify_unsigned(json_context *c, uint64_t u, int negative)
+{
+    static const char pairs[] = "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+                                "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+                                "8081828384858687888990919293949596979899";
+    char d[21], *p = d + sizeof(d);
+
+    for (; u >= 100; u /= 100) {
+        p -= 2;
+        memcpy(p, pairs + u % 100 * 2, 2);
+    }
+    if (u >= 10) {
+        p -= 2;
+        memcpy(p, pairs + u * 2, 2);
+    } else
+        *--p = (char) ('0' + u);
+    if (negative)
+        *--p = '-';
+    json_context_push(c, p, d + sizeof(d) - p);
+}
+
+static void json_jsonify_integer(json_context *c, int64_t i)
+{
+    json_jsonify_unsigned(c, i < 0 ? 0 - (uint64_t) i : (uint64_t) i, i < 0);
+}
+
+static int json_jsonify_double(json_context *c, double number)
 {
     char d[50];
     int len;
-    size_t head = c->top;
 
-    assert(v->type == JSON_NUMBER);
-    if ((len = snprintf(d, 50, "%.17g", v->number)) < 0) {
-        c->top = head;
-        return JSON_JSONIFY_ERROR;
+    /* "%.17g" of an integer below 1e17 is its digits, -0 aside */
+    if (number > -1e17 && number < 1e17 && number == (double) (int64_t) number && (number != 0 || !signbit(number))) {
+        json_jsonify_integer(c, (int64_t) number);
+        return JSON_JSONIFY_OK;
     }
+    if ((len = snprintf(d, 50, "%.17g", number)) < 0)
+        return JSON_JSONIFY_ERROR;
     json_context_push(c, d, len);
     return JSON_JSONIFY_OK;
 }
+
+static int json_jsonify_number(json_context *c, const json_value *v)
+{
+    assert(v->type == JSON_NUMBER);
+    if (v->flags & JSON_FLAG_INT64) {
+        json_jsonify_integer(c, v->number_int64);
+        return JSON_JSONIFY_OK;
+    }
+    if (v->flags & JSON_FLAG_UINT64) {
+        json_jsonify_unsigned(c, v->number_uint64, 0);
+        return JSON_JSONIFY_OK;
+    }
+    return json_jsonify_double(c, v->number);
+}
 static int json_jsonify_value(json_context *c, const json_value *v);
 
 static int json_jsonify_array(json_context *c, const json_value *v)
@@ -563,6 +1682,18 @@ static int json_jsonify_array(json_context *c, const json_value *v)
 
     assert(v->type == JSON_ARRAY);
     PUTC(c, '[');
+    if (v->flags & JSON_FLAG_PACKED) {
+        for (i = 0; i < v->array_size; i++) {
+            if (i)
+                json_context_push(c, ", ", 2);
+            if (json_jsonify_double(c, v->array_doubles[i]) == JSON_JSONIFY_ERROR) {
+                c->top = head;
+                return JSON_JSONIFY_ERROR;
+            }
+        }
+        PUTC(c, ']');
+        return JSON_JSONIFY_OK;
+    }
     for (i = 0; i < v->array_size; i++) {
         if (json_jsonify_value(c, v->array + i) == JSON_JSONIFY_ERROR) {
             c->top = head;
@@ -600,6 +1731,11 @@ static int json_jsonify_object(json_context *c, const json_value *v)
 
 static int json_jsonify_value(json_context *c, const json_value *v)
 {
+    v = JSON_RESOLVE(v);
+    if (v->flags & JSON_FLAG_RAW) {
+        json_context_push(c, v->raw, v->raw_len);
+        return JSON_JSONIFY_OK;
+    }
     switch (v->type) {
     case JSON_NULL:
         json_context_push(c, "null", 4);
@@ -625,12 +1761,19 @@ static int json_jsonify_value(json_context *c, const json_value *v)
 }
 
 char *json_jsonify(const json_value *v, size_t *len)
+{
+    return json_jsonify_ex(v, len, NULL);
+}
+
+char *json_jsonify_ex(const json_value *v, size_t *len, const json_jsonify_options *options)
 {
     json_context c;
     char *json;
 
     assert(v);
     json_context_init(&c, NULL);
+    if (options)
+        c.flags = options->flags;
     if (json_jsonify_value(&c, v) == JSON_JSONIFY_OK) {
         if (len)
             *len = c.top;
@@ -656,37 +1799,84 @@ int json_get_type(const json_value *v)
 double json_get_number(const json_value *v)
 {
     assert(v && v->type == JSON_NUMBER);
+    v = JSON_RESOLVE(v);
+    JSON_DECODE(v);
     return v->number;
 }
 
+/* The exact integer if the number is one, else the double truncated and clamped to the range */
+int64_t json_get_int64(const json_value *v)
+{
+    assert(v && v->type == JSON_NUMBER);
+    v = JSON_RESOLVE(v);
+    JSON_DECODE(v);
+    if (v->flags & JSON_FLAG_INT64)
+        return v->number_int64;
+    if (v->flags & JSON_FLAG_UINT64 || v->number >= 9223372036854775808.0)
+        return INT64_MAX;
+    if (v->number < -9223372036854775808.0)
+        return INT64_MIN;
+    return v->number != v->number ? 0 : (int64_t) v->number;
+}
+
+uint64_t json_get_uint64(const json_value *v)
+{
+    assert(v && v->type == JSON_NUMBER);
+    v = JSON_RESOLVE(v);
+    JSON_DECODE(v);
+    if (v->flags & JSON_FLAG_UINT64)
+        return v->number_uint64;
+    if (v->flags & JSON_FLAG_INT64)
+        return v->number_int64 < 0 ? 0 : (uint64_t) v->number_int64;
+    if (v->number >= 18446744073709551616.0)
+        return UINT64_MAX;
+    return v->number > 0 ? (uint64_t) v->number : 0;
+}
+
 char *json_get_string(const json_value *v)
 {
     assert(v && v->type == JSON_STRING);
+    v = JSON_RESOLVE(v);
+    JSON_DECODE(v);
     return v->string;
 }
 
 size_t json_get_string_length(const json_value *v)
 {
     assert(v && v->type == JSON_STRING);
+    v = JSON_RESOLVE(v);
+    JSON_DECODE(v);
     return v->string_len;
 }
 
 json_value *json_get_array_element(const json_value *v, size_t i)
 {
     assert(v && v->type == JSON_ARRAY);
+    v = JSON_RESOLVE(v);
+    /* a packed array has no json_value to hand out, see json_array_at */
+    if (v->flags & JSON_FLAG_PACKED)
+        return NULL;
     return &v->array[i];
 }
 
 size_t json_get_array_size(const json_value *v)
 {
     assert(v && v->type == JSON_ARRAY);
-    return v->array_size;
+    return JSON_RESOLVE(v)->array_size;
+}
+
+const double *json_get_array_doubles(const json_value *v, size_t *n)
+{
+    assert(v && v->type == JSON_ARRAY && n);
+    v = JSON_RESOLVE(v);
+    *n = v->array_size;
+    return v->flags & JSON_FLAG_PACKED ? v->array_doubles : NULL;
 }
 
 size_t json_get_object_size(const json_value *v)
 {
     assert(v && v->type == JSON_OBJECT);
-    return v->object_size;
+    return JSON_RESOLVE(v)->object_size;
 }
 
 #define ASSERT_VALID_OBJECT_INDEX(v, index) \
@@ -696,9 +1886,11 @@ size_t json_get_object_size(const json_value *v)
 
 #define NTH_OBJECT(o, v, index) \
     do { \
-        o = v->object; \
-        for (; index > 0; index--) \
-            o = o->next; \
+        if (v->flags & (JSON_FLAG_SHAPED | JSON_FLAG_COMPACT)) \
+            o = v->object + index; \
+        else \
+            for (o = v->object; index > 0; index--) \
+                o = o->next; \
     } while (0)
 
 char *json_get_object_key(const json_value *v, size_t index)
@@ -706,6 +1898,7 @@ char *json_get_object_key(const json_value *v, size_t index)
     json_object *o;
 
     ASSERT_VALID_OBJECT_INDEX(v, index);
+    v = JSON_RESOLVE(v);
     NTH_OBJECT(o, v, index);
     return o->key;
 }
@@ -715,6 +1908,7 @@ size_t json_get_object_key_length(const json_value *v, size_t index)
     json_object *o;
 
     ASSERT_VALID_OBJECT_INDEX(v, index);
+    v = JSON_RESOLVE(v);
     NTH_OBJECT(o, v, index);
     return o->key_len;
 }
@@ -724,6 +1918,7 @@ json_value *json_get_object_value_index(const json_value *v, size_t index)
     json_object *o;
 
     ASSERT_VALID_OBJECT_INDEX(v, index);
+    v = JSON_RESOLVE(v);
     NTH_OBJECT(o, v, index);
     return &o->value;
 }
@@ -733,6 +1928,13 @@ json_value *json_get_object_value_n(const json_value *v, const char *key, size_t
     json_object *o;
 
     assert(v && v->type == JSON_OBJECT && key);
+    v = JSON_RESOLVE(v);
+    if (v->flags & JSON_FLAG_SHAPED)
+        return json_shape_lookup(v->object_shape, v->object, key, len);
+    if (v->object_index && v->object_index->table) {
+        size_t i = json_object_index_find(v, key, len);
+        return v->object_index->table[i] ? &JSON_OBJECT_LINK(v, v->object_index->table[i])->value : NULL;
+    }
     for (o = v->object; o; o = o->next)
         if (len == o->key_len && !memcmp(key, o->key, len))
             return &o->value;
@@ -743,18 +1945,21 @@ void json_set_null(json_value *v)
 {
     assert(v);
     v->type = JSON_NULL;
+    v->flags = 0;
 }
 
 void json_set_true(json_value *v)
 {
     assert(v);
     v->type = JSON_TRUE;
+    v->flags = 0;
 }
 
 void json_set_false(json_value *v)
 {
     assert(v);
     v->type = JSON_FALSE;
+    v->flags = 0;
 }
 
 /* no validation checking */
@@ -762,6 +1967,7 @@ void json_set_string(json_value *v, const char *string, size_t len)
 {
     assert(v && string && len >= 0);
     v->type = JSON_STRING;
+    v->flags = 0;
     v->string_len = len;
     v->string = (char *) malloc(len + 1);
     memcpy(v->string, string, len);
@@ -772,136 +1978,4486 @@ void json_set_number(json_value *v, double number)
 {
     assert(v);
     v->type = JSON_NUMBER;
+    v->flags = 0;
     v->number = number;
 }
 
-static json_object *json_object_deepcopy(const json_object *o);
+void json_set_int64(json_value *v, int64_t number)
+{
+    assert(v);
+    v->type = JSON_NUMBER;
+    v->flags = JSON_FLAG_INT64;
+    v->number_int64 = number;
+    v->number = (double) number;
+}
+
+void json_set_uint64(json_value *v, uint64_t number)
+{
+    if (number <= INT64_MAX) {
+        json_set_int64(v, (int64_t) number);
+        return;
+    }
+    v->type = JSON_NUMBER;
+    v->flags = JSON_FLAG_UINT64;
+    v->number_uint64 = number;
+    v->number = (double) number;
+}
 
-static json_value *json_value_deepcopy(const json_value *v)
+/* Write a deep copy of 'src' straight into 'dst', every block is sized in advance */
+void json_copy(json_value *dst, const json_value *src)
 {
-    json_value *copy;
     size_t i;
 
-    assert(v);
-    copy = (json_value *) malloc(sizeof(json_value));
-    switch (v->type) {
-    case JSON_NULL:
-    case JSON_TRUE:
-    case JSON_FALSE:
-        copy->type = v->type;
-        break;
+    assert(dst && src && dst != src);
+    if (src->flags & JSON_FLAG_SHARED) {
+        memcpy(dst, src, sizeof(json_value));
+        dst->shared->refcount++;
+        return;
+    }
+    /* a copy does not borrow the parsed text */
+    JSON_DECODE(src);
+    dst->type = src->type;
+    dst->flags = 0;
+    switch (src->type) {
     case JSON_STRING:
-        json_set_string(copy, v->string, v->string_len);
+        json_set_string(dst, src->string, src->string_len);
         break;
     case JSON_NUMBER:
-        copy->type = JSON_NUMBER;
-        copy->number = v->number;
+        dst->flags = src->flags & JSON_FLAG_INTEGER;
+        dst->number = src->number;
+        if (dst->flags)
+            dst->number_uint64 = src->number_uint64;
         break;
     case JSON_ARRAY:
-        copy->type = JSON_ARRAY;
-        copy->array_size = v->array_size;
-        copy->array = (json_value *) malloc(sizeof(json_value) * v->array_size);
-        for (i = 0; i < v->array_size; i++) {
-            json_value *e = json_value_deepcopy(v->array + i);
-            memcpy(copy->array + i, e, sizeof(json_value));
-            free(e);
+        dst->array_size = dst->array_capacity = src->array_size;
+        if (src->flags & JSON_FLAG_PACKED) {
+            dst->flags = JSON_FLAG_PACKED;
+            dst->array_doubles = (double *) malloc(sizeof(double) * src->array_size);
+            memcpy(dst->array_doubles, src->array_doubles, sizeof(double) * src->array_size);
+            break;
         }
+        dst->array = src->array_size ? (json_value *) malloc(sizeof(json_value) * src->array_size) : NULL;
+        for (i = 0; i < src->array_size; i++)
+            json_copy(&dst->array[i], &src->array[i]);
         break;
     case JSON_OBJECT:
-    {
-        json_object **o, *p;
-        copy->type = JSON_OBJECT;
-        copy->object_size = v->object_size;
-        for (o = &copy->object, p = v->object; p; o = &(*o)->next, p = p->next)
-            *o = json_object_deepcopy(p);
-        *o = NULL;
+        dst->object_size = src->object_size;
+        if (src->flags & JSON_FLAG_SHAPED) {
+            /* one block sharing the keys of the shape */
+            dst->flags = JSON_FLAG_SHAPED;
+            dst->object_shape = src->object_shape;
+            dst->object_shape->refcount++;
+            dst->object = (json_object *) malloc(sizeof(json_object) * src->object_size);
+            for (i = 0; i < src->object_size; i++) {
+                dst->object[i].key = src->object[i].key;
+                dst->object[i].key_len = src->object[i].key_len;
+                dst->object[i].next = i + 1 < src->object_size ? &dst->object[i + 1] : NULL;
+                json_copy(&dst->object[i].value, &src->object[i].value);
+            }
+        } else {
+            json_object **p, *o;
+
+            dst->object_index = NULL;
+            for (p = &dst->object, o = src->object; o; p = &(*p)->next, o = o->next) {
+                *p = (json_object *) malloc(sizeof(json_object));
+                (*p)->key_len = o->key_len;
+                (*p)->key = (char *) malloc(o->key_len + 1);
+                memcpy((*p)->key, o->key, o->key_len + 1);
+                json_copy(&(*p)->value, &o->value);
+            }
+            *p = NULL;
+        }
         break;
-    }
     default:
-        free(copy);
-        assert(0);
-        return NULL;
+        break;
+    }
+}
+
+/* Transfer the data of 'src' to 'dst' in O(1), 'src' becomes JSON_NULL */
+void json_move(json_value *dst, json_value *src)
+{
+    assert(dst && src);
+    if (dst == src)
+        return;
+    memcpy(dst, src, sizeof(json_value));
+    json_init(src);
+}
+
+void json_swap(json_value *a, json_value *b)
+{
+    json_value t;
+
+    assert(a && b);
+    memcpy(&t, a, sizeof(json_value));
+    memcpy(a, b, sizeof(json_value));
+    memcpy(b, &t, sizeof(json_value));
+}
+
+/* Make 'src' shared if it is not yet, and 'dst' another reference to it */
+void json_share(json_value *dst, json_value *src)
+{
+    assert(dst && src && dst != src);
+    /* the storage of a compacted tree belongs to its block */
+    assert(!(src->flags & JSON_FLAG_COMPACT));
+    if (!(src->flags & JSON_FLAG_SHARED)) {
+        json_shared *s = (json_shared *) malloc(sizeof(json_shared));
+        s->refcount = 1;
+        s->hashed = 0;
+        memcpy(&s->value, src, sizeof(json_value));
+        src->shared = s;
+        src->flags = JSON_FLAG_SHARED;
     }
-    return copy;
+    memcpy(dst, src, sizeof(json_value));
+    dst->shared->refcount++;
 }
 
-static json_object *json_object_deepcopy(const json_object *o)
+/* Copy on write: give 'v' its own value, taken over if 'v' is the last reference */
+json_value *json_unshare(json_value *v)
 {
-    json_object *copy;
-    json_value *value;
+    json_shared *s;
+
+    assert(v);
+    if (!(v->flags & JSON_FLAG_SHARED))
+        return v;
+    s = v->shared;
+    if (s->refcount == 1) {
+        memcpy(v, &s->value, sizeof(json_value));
+        free(s);
+    } else {
+        s->refcount--;
+        json_copy(v, &s->value);
+    }
+    return v;
+}
 
-    assert(o);
-    copy = (json_object *) malloc(sizeof(json_object));
-    copy->key_len = o->key_len;
-    copy->key = (char *) malloc(o->key_len + 1);
-    memcpy(copy->key, o->key, o->key_len);
-    copy->key[o->key_len] = '\0';
-    value = json_value_deepcopy(&o->value);
-    memcpy(&copy->value, value, sizeof(json_value));
-    free(value);
-    copy->next = o->next;
-    return copy;
+/* Deepcopy vs Shadowcopy */
+static void json_value_assign(json_value *dst, int deepcopy, json_value *src)
+{
+    if (deepcopy == JSON_SHARE)
+        json_share(dst, src);
+    else if (deepcopy)
+        json_copy(dst, src);
+    else
+        memcpy(dst, src, sizeof(json_value));
 }
 
+/* The arguments are collected first, so that the elements are copied into place */
 void json_set_array(json_value *v, int deepcopy, ...)
 {
     va_list ap;
     json_context c;
-    json_value *e;
+    json_value *e, **p;
+    size_t i;
 
     assert(v);
     json_context_init(&c, NULL);
-    v->type = JSON_ARRAY;
-    v->array_size = 0;
     va_start(ap, deepcopy);
-    /* Deepcopy vs Shadowcopy */
-    for (e = va_arg(ap, json_value *); e != NULL; e = va_arg(ap, json_value *)) {
-        if (deepcopy)
-            e = json_value_deepcopy(e);
-        json_context_push(&c, e, sizeof(json_value));
-        v->array_size++;
-        if (deepcopy)
-            free(e);
-    }
+    for (e = va_arg(ap, json_value *); e != NULL; e = va_arg(ap, json_value *))
+        json_context_push(&c, &e, sizeof(json_value *));
+    va_end(ap);
+    v->type = JSON_ARRAY;
+    v->flags = 0;
+    v->array_size = v->array_capacity = c.top / sizeof(json_value *);
     v->array = (json_value *) malloc(sizeof(json_value) * v->array_size);
-    memcpy(v->array, json_context_pop(&c, c.top), c.top);
+    for (i = 0, p = (json_value **) c.stack; i < v->array_size; i++)
+        json_value_assign(&v->array[i], deepcopy, p[i]);
     json_context_free(&c);
-    va_end(ap);
 }
 
-void json_object_append(json_value *v, int deepcopy, ...)
-{
-    va_list ap;
-    json_object **p;
-    char *key;
+#define JSON_ARRAY_CAPACITY 4
 
-    assert(v);
-    if (v->type != JSON_OBJECT) {
+/* Replace whatever 'v' holds by an empty array */
+static void json_array_init(json_value *v)
+{
+    json_free(v);
+    v->type = JSON_ARRAY;
+    v->flags = 0;
+    v->array = NULL;
+    v->array_size = v->array_capacity = 0;
+}
+
+/* Grow by 1.5x like the context stack, so that appends are amortized O(1) */
+static void json_array_grow(json_value *v, size_t size)
+{
+    size_t capacity = v->array_capacity;
+
+    if (size <= capacity)
+        return;
+    if (capacity < JSON_ARRAY_CAPACITY)
+        capacity = JSON_ARRAY_CAPACITY;
+    while (capacity < size)
+        capacity += capacity >> 1;
+    v->array = (json_value *) realloc(v->array, sizeof(json_value) * capacity);
+    v->array_capacity = capacity;
+}
+
+void json_array_reserve(json_value *v, size_t capacity)
+{
+    assert(v);
+    if (v->type != JSON_ARRAY)
+        json_array_init(v);
+    json_unshare(v);
+    /* compacted trees are read-only */
+    assert(!(v->flags & JSON_FLAG_COMPACT));
+    json_array_unpack(v);
+    if (capacity > v->array_capacity) {
+        v->array = (json_value *) realloc(v->array, sizeof(json_value) * capacity);
+        v->array_capacity = capacity;
+    }
+}
+
+void json_array_push(json_value *v, int deepcopy, json_value *e)
+{
+    assert(v);
+    if (v->type != JSON_ARRAY)
+        json_array_init(v);
+    json_array_insert(v, v->array_size, deepcopy, e);
+}
+
+void json_array_insert(json_value *v, size_t index, int deepcopy, json_value *e)
+{
+    json_value copy;
+
+    assert(v && v->type == JSON_ARRAY && !(v->flags & JSON_FLAG_COMPACT) && index <= v->array_size && e);
+    /* 'e' may be an element of 'v', copy it before the array moves */
+    json_value_assign(&copy, deepcopy, e);
+    json_unshare(v);
+    json_array_unpack(v);
+    json_array_grow(v, v->array_size + 1);
+    memmove(v->array + index + 1, v->array + index, sizeof(json_value) * (v->array_size - index));
+    memcpy(v->array + index, &copy, sizeof(json_value));
+    v->array_size++;
+}
+
+/* Move the element out of the array into 'e' */
+static void json_array_detach(json_value *v, size_t index, json_value *e)
+{
+    memcpy(e, &v->array[index], sizeof(json_value));
+    memmove(v->array + index, v->array + index + 1, sizeof(json_value) * (v->array_size - index - 1));
+    v->array_size--;
+}
+
+void json_array_remove(json_value *v, size_t index)
+{
+    json_value e;
+
+    assert(v && v->type == JSON_ARRAY && !(v->flags & JSON_FLAG_COMPACT) && index < v->array_size);
+    json_unshare(v);
+    json_array_unpack(v);
+    json_array_detach(v, index, &e);
+    json_free(&e);
+}
+
+/* Give a shaped object its own nodes and keys before a key is added or removed */
+static void json_object_unshape(json_value *v)
+{
+    json_object *block = v->object, **p = &v->object;
+    size_t i;
+
+    if (!(v->flags & JSON_FLAG_SHAPED))
+        return;
+    for (i = 0; i < v->object_size; i++) {
+        *p = (json_object *) malloc(sizeof(json_object));
+        memcpy(*p, &block[i], sizeof(json_object));
+        (*p)->key = (char *) malloc(block[i].key_len + 1);
+        memcpy((*p)->key, block[i].key, block[i].key_len + 1);
+        p = &(*p)->next;
+    }
+    *p = NULL;
+    free(block);
+    json_shape_release(v->object_shape);
+    v->flags &= ~JSON_FLAG_SHAPED;
+    v->object_index = NULL;
+}
+
+/* Prepare 'v' for adding or removing keys: owned keys, an index and a tail */
+static json_object_index *json_object_modify(json_value *v)
+{
+    if (v->type != JSON_OBJECT) {
         v->type = JSON_OBJECT;
+        v->flags = 0;
         v->object_size = 0;
-        p = &v->object;
-    } else
-        for (p = &v->object; *p; p = &(*p)->next)
-            ;
+        v->object = NULL;
+        v->object_index = NULL;
+    }
+    json_unshare(v);
+    /* compacted trees are read-only */
+    assert(!(v->flags & JSON_FLAG_COMPACT));
+    json_object_unshape(v);
+    return json_object_index_get(v);
+}
+
+/* Link a new member after 'prev', &json_object_head for the first */
+static void json_object_link_after(json_value *v, json_object *prev, const char *key, size_t len, json_value *value)
+{
+    json_object_index *ix = v->object_index;
+    json_object *o, *next = JSON_OBJECT_LINK(v, prev);
+    size_t i = 0;
+
+    o = (json_object *) malloc(sizeof(json_object));
+    o->key = (char *) malloc(len + 1);
+    memcpy(o->key, key, len);
+    o->key_len = len;
+    o->key[len] = '\0';
+    memcpy(&o->value, value, sizeof(json_value));
+    o->next = next;
+    if (ix->table && next)
+        i = json_object_index_find_member(v, next);
+    if (prev == &json_object_head)
+        v->object = o;
+    else
+        prev->next = o;
+    /* the member after 'prev' is now after 'o' */
+    if (ix->table && next)
+        ix->table[i] = o;
+    if (!next)
+        ix->tail = o;
+    v->object_size++;
+    if (ix->table && v->object_size * 2 <= ix->mask + 1)
+        json_object_index_insert(v, prev);
+    else if (v->object_size >= JSON_OBJECT_INDEX_MIN)
+        json_object_index_rebuild(v);
+}
+
+static void json_object_link(json_value *v, const char *key, size_t len, json_value *value)
+{
+    json_object_index *ix = v->object_index;
+
+    json_object_link_after(v, ix->tail ? ix->tail : &json_object_head, key, len, value);
+}
+
+void json_object_append(json_value *v, int deepcopy, ...)
+{
+    va_list ap;
+    char *key;
+
+    assert(v);
+    json_object_modify(v);
     va_start(ap, deepcopy);
     for (key = va_arg(ap, char *); key; key = va_arg(ap, char *)) {
         size_t key_len = va_arg(ap, size_t);
-        json_value *value = va_arg(ap, json_value *);
+        json_value *value = va_arg(ap, json_value *), copy;
 
-        *p = (json_object *) malloc(sizeof(json_object));
-        (*p)->key = (char *) malloc(key_len + 1);
-        memcpy((*p)->key, key, key_len);
-        (*p)->key_len = key_len;
-        (*p)->key[key_len] = '\0';
-        if (deepcopy) {
-            value = json_value_deepcopy(value);
-            memcpy(&(*p)->value, value, sizeof(json_value));
-            free(value);
-        } else
-            memcpy(&(*p)->value, value, sizeof(json_value));
-        p = &(*p)->next;
-        v->object_size++;
+        json_value_assign(&copy, deepcopy, value);
+        json_object_link(v, key, key_len, &copy);
     }
-    *p = NULL;
     va_end(ap);
 }
+
+/* Replace the value of 'key' in place, or append it */
+void json_object_set(json_value *v, const char *key, size_t len, int deepcopy, json_value *value)
+{
+    json_value copy, *old;
+
+    assert(v && key && value);
+    /* 'value' may be a member of 'v' */
+    json_value_assign(&copy, deepcopy, value);
+    if (v->type == JSON_OBJECT)
+        json_unshare(v);
+    if (v->type == JSON_OBJECT && (old = json_get_object_value_n(v, key, len)) != NULL) {
+        assert(!(v->flags & JSON_FLAG_COMPACT));
+        json_free(old);
+        memcpy(old, &copy, sizeof(json_value));
+    } else {
+        json_object_modify(v);
+        json_object_link(v, key, len, &copy);
+    }
+}
+
+static void json_object_unlink(json_value *v, json_object *prev, json_object *o)
+{
+    if (prev == &json_object_head)
+        v->object = o->next;
+    else
+        prev->next = o->next;
+}
+
+/* Unlink the member of 'key' and return it, NULL if it is not a member. '*before' is the member before it */
+static json_object *json_object_detach(json_value *v, const char *key, size_t len, json_object **before)
+{
+    json_object_index *ix;
+    json_object *prev, *o;
+
+    ix = json_object_modify(v);
+    if (ix->table) {
+        size_t i = json_object_index_find(v, key, len), next = 0;
+
+        if (!ix->table[i])
+            return NULL;
+        prev = ix->table[i];
+        o = JSON_OBJECT_LINK(v, prev);
+        if (o->next)
+            next = json_object_index_find_member(v, o->next);
+        json_object_unlink(v, prev, o);
+        /* the member after 'o' is now after 'prev' */
+        if (o->next)
+            ix->table[next] = prev;
+        json_object_index_erase(v, i);
+    } else {
+        for (prev = &json_object_head, o = v->object; o; prev = o, o = o->next)
+            if (o->key_len == len && !memcmp(o->key, key, len))
+                break;
+        if (!o)
+            return NULL;
+        json_object_unlink(v, prev, o);
+    }
+    if (ix->tail == o)
+        ix->tail = prev == &json_object_head ? NULL : prev;
+    v->object_size--;
+    *before = prev;
+    return o;
+}
+
+/* Return 1 if 'key' is removed, 0 if it is not a member */
+int json_object_remove(json_value *v, const char *key, size_t len)
+{
+    json_object *prev, *o;
+
+    assert(v && v->type == JSON_OBJECT && key);
+    if ((o = json_object_detach(v, key, len, &prev)) == NULL)
+        return 0;
+    free(o->key);
+    json_free(&o->value);
+    free(o);
+    return 1;
+}
+
+/* *********************************Equal******************************************* *
+ * json_hash is stable across runs and platforms and consistent with json_equal: the members of
+ * an object are combined by a sum, so their order does not matter, and -0 hashes as 0. Numbers
+ * are equal when their exact values are, and hash by their nearest double, which equal numbers
+ * share. Objects with repeated keys are equal when their members are the same multiset. The hash
+ * of a shared value is cached in its 'json_shared', so comparing shared subtrees is O(1) once
+ * hashed.
+ */
+static uint64_t json_hash_mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static uint64_t json_hash_string(const char *p, size_t len)
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    while (len--) {
+        h ^= (unsigned char) *p++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+uint64_t json_hash(const json_value *v)
+{
+    json_shared *s = NULL;
+    json_value e;
+    json_object *o;
+    uint64_t h, sum, bits;
+    double d;
+    size_t i;
+
+    assert(v);
+    if (v->flags & JSON_FLAG_SHARED) {
+        s = v->shared;
+        if (s->hashed)
+            return s->hash;
+        v = &s->value;
+    }
+    JSON_DECODE(v);
+    h = json_hash_mix(0x9e3779b97f4a7c15ULL + v->type);
+    switch (v->type) {
+    case JSON_STRING:
+        h = json_hash_mix(h ^ json_hash_string(v->string, v->string_len));
+        break;
+    case JSON_NUMBER:
+        d = v->number == 0.0 ? 0.0 : v->number;
+        memcpy(&bits, &d, sizeof(uint64_t));
+        h = json_hash_mix(h ^ bits);
+        break;
+    case JSON_ARRAY:
+        for (i = 0; i < v->array_size; i++)
+            h = json_hash_mix(h ^ json_hash(json_array_at(v, i, &e)));
+        break;
+    case JSON_OBJECT:
+        for (sum = 0, o = v->object; o; o = o->next)
+            sum += json_hash_mix(json_hash_string(o->key, o->key_len) ^ json_hash(&o->value));
+        h = json_hash_mix(h ^ sum);
+        break;
+    default:
+        break;
+    }
+    if (s) {
+        s->hash = h;
+        s->hashed = 1;
+    }
+    return h;
+}
+
+/* Return 1 if 'number' is the exact value of the number 'v' */
+static int json_number_exact(const json_value *v)
+{
+    if (v->flags & JSON_FLAG_INT64)
+        return v->number >= -9223372036854775808.0 && v->number < 9223372036854775808.0 && (int64_t) v->number == v->number_int64;
+    if (v->flags & JSON_FLAG_UINT64)
+        return v->number < 18446744073709551616.0 && (uint64_t) v->number == v->number_uint64;
+    return 1;
+}
+
+/* Return 1 if another member of 'v' has the key of 'o' */
+static int json_object_key_repeats(const json_value *v, const json_object *o)
+{
+    const json_object *q;
+
+    for (q = v->object; q; q = q->next)
+        if (q != o && q->key_len == o->key_len && !memcmp(q->key, o->key, o->key_len))
+            return 1;
+    return 0;
+}
+
+/* The members of 'v' equal to the member 'o' */
+static size_t json_object_count_member(const json_value *v, const json_object *o)
+{
+    const json_object *q;
+    size_t n = 0;
+
+    for (q = v->object; q; q = q->next)
+        if (q->key_len == o->key_len && !memcmp(q->key, o->key, o->key_len) && json_equal(&q->value, &o->value))
+            n++;
+    return n;
+}
+
+/* Compare objects of the same size with repeated keys as multisets of members, O(n^2) */
+static int json_object_equal_members(const json_value *a, const json_value *b)
+{
+    const json_object *o;
+
+    for (o = a->object; o; o = o->next)
+        if (json_object_count_member(a, o) != json_object_count_member(b, o))
+            return 0;
+    return 1;
+}
+
+int json_equal(const json_value *a, const json_value *b)
+{
+    json_object *o, *p;
+    size_t i;
+    json_value x, y;
+
+    assert(a && b);
+    if (a->flags & b->flags & JSON_FLAG_SHARED) {
+        if (a->shared == b->shared)
+            return 1;
+        if (json_hash(a) != json_hash(b))
+            return 0;
+    }
+    a = JSON_RESOLVE(a);
+    b = JSON_RESOLVE(b);
+    if (a == b)
+        return 1;
+    if (a->type != b->type)
+        return 0;
+    JSON_DECODE(a);
+    JSON_DECODE(b);
+    switch (a->type) {
+    case JSON_STRING:
+        return a->string_len == b->string_len && !memcmp(a->string, b->string, a->string_len);
+    case JSON_NUMBER:
+        /* integers past 2^53 can share a double, compare the exact values */
+        if (a->flags & JSON_FLAG_INTEGER && b->flags & JSON_FLAG_INTEGER)
+            return (a->flags & JSON_FLAG_INTEGER) == (b->flags & JSON_FLAG_INTEGER) && a->number_uint64 == b->number_uint64;
+        if (a->number != b->number)
+            return 0;
+        return json_number_exact(a) && json_number_exact(b);
+    case JSON_ARRAY:
+        if (a->array_size != b->array_size)
+            return 0;
+        if (a->flags & b->flags & JSON_FLAG_PACKED) {
+            for (i = 0; i < a->array_size; i++)
+                if (a->array_doubles[i] != b->array_doubles[i])
+                    return 0;
+            return 1;
+        }
+        for (i = 0; i < a->array_size; i++)
+            if (!json_equal(json_array_at(a, i, &x), json_array_at(b, i, &y)))
+                return 0;
+        return 1;
+    case JSON_OBJECT:
+        if (a->object_size != b->object_size)
+            return 0;
+        /* the members are usually in the same order, look the keys up only when they are not */
+        for (o = a->object, p = b->object; o; o = o->next, p = p->next) {
+            if (p->key_len != o->key_len || memcmp(p->key, o->key, o->key_len))
+                break;
+            if (!json_equal(&o->value, &p->value))
+                return json_object_key_repeats(a, o) ? json_object_equal_members(a, b) : 0;
+        }
+        if (!o)
+            return 1;
+        for (o = a->object; o; o = o->next) {
+            const json_value *w;
+
+            /* a repeated key may pair with any of its members in 'b' */
+            if (json_get_object_value_n(a, o->key, o->key_len) != &o->value)
+                return json_object_equal_members(a, b);
+            w = json_get_object_value_n(b, o->key, o->key_len);
+            if (!w || !json_equal(&o->value, w))
+                return json_object_key_repeats(a, o) ? json_object_equal_members(a, b) : 0;
+        }
+        return 1;
+    default:
+        return 1;
+    }
+}
+
+/* ********************************Pointer****************************************** *
+ * A compiled JSON Pointer (RFC 6901) is one block: the header, the tokens, and the unescaped keys
+ * of the tokens. A token that is an array index keeps it in 'index', so resolving does no parsing.
+ */
+#define JSON_POINTER_NONE ((size_t) -1)
+#define JSON_POINTER_END ((size_t) -2)
+
+typedef struct {
+    const char *key;
+    size_t len;
+    /* JSON_POINTER_NONE if it is not an index, JSON_POINTER_END for "-" */
+    size_t index;
+} json_pointer_token;
+
+struct json_pointer {
+    size_t size;
+    json_pointer_token *tokens;
+};
+
+static size_t json_pointer_index(const char *key, size_t len)
+{
+    size_t index = 0;
+
+    if (len == 1 && key[0] == '-')
+        return JSON_POINTER_END;
+    if (len == 0 || len > 18 || (key[0] == '0' && len > 1))
+        return JSON_POINTER_NONE;
+    for (; len; len--, key++) {
+        if (!ISDIGIT(*key))
+            return JSON_POINTER_NONE;
+        index = index * 10 + (*key - '0');
+    }
+    return index;
+}
+
+/* NULL if 'path' is not a JSON Pointer */
+json_pointer *json_pointer_compile_n(const char *path, size_t len)
+{
+    json_pointer *p;
+    json_pointer_token *t;
+    size_t size = 0, i;
+    char *s;
+
+    if (len && path[0] != '/')
+        return NULL;
+    for (i = 0; i < len; i++) {
+        if (path[i] == '/')
+            size++;
+        else if (path[i] == '~' && (i + 1 == len || (path[i + 1] != '0' && path[i + 1] != '1')))
+            return NULL;
+    }
+    /* the keys are no longer than the path, with a '\0' for each '/' */
+    p = (json_pointer *) malloc(sizeof(json_pointer) + sizeof(json_pointer_token) * size + len + 1);
+    p->size = size;
+    p->tokens = (json_pointer_token *) (p + 1);
+    s = (char *) (p->tokens + size);
+    for (i = 0, t = p->tokens; i < len; t++) {
+        t->key = s;
+        for (i++; i < len && path[i] != '/'; i++)
+            *s++ = path[i] == '~' ? (path[++i] == '0' ? '~' : '/') : path[i];
+        t->len = s - t->key;
+        *s++ = '\0';
+        t->index = json_pointer_index(t->key, t->len);
+    }
+    return p;
+}
+
+/*
+ * The value at the first 'n' tokens, NULL if there is none. An element of a packed array is built
+ * in 'e', or is none without 'e'.
+ */
+static json_value *json_pointer_resolve(const json_value *v, const json_pointer *p, size_t n, json_value *e)
+{
+    const json_pointer_token *t;
+
+    for (t = p->tokens; t < p->tokens + n && v; t++) {
+        v = JSON_RESOLVE(v);
+        if (v->type == JSON_OBJECT)
+            v = json_get_object_value_n(v, t->key, t->len);
+        else if (v->type != JSON_ARRAY || t->index >= v->array_size)
+            return NULL;
+        else if (!(v->flags & JSON_FLAG_PACKED))
+            v = &v->array[t->index];
+        else if (e)
+            v = json_array_at(v, t->index, e);
+        else
+            return NULL;
+    }
+    return (json_value *) v;
+}
+
+json_pointer *json_pointer_compile(const char *path)
+{
+    assert(path);
+    return json_pointer_compile_n(path, strlen(path));
+}
+
+void json_pointer_free(json_pointer *p)
+{
+    free(p);
+}
+
+json_value *json_pointer_get(const json_value *v, const json_pointer *p, json_value *e)
+{
+    assert(v && p && e);
+    return json_pointer_resolve(v, p, p->size, e);
+}
+
+/*
+ * Move 'c' to the value of the member 't' of the object at 'c'. A key is compared in place, and
+ * decoded only when it has escapes.
+ */
+static int json_extract_member(json_context *c, const json_pointer_token *t)
+{
+    const char *key;
+    size_t len;
+    int found;
+
+    assert(*c->json == '{');
+    c->json++;
+    json_parse_whitespace(c);
+    if (*c->json == '}')
+        return JSON_EXTRACT_MISSING;
+    for (;;) {
+        key = c->json;
+        if (*key != '\"' || json_skip_value(c) == JSON_PARSE_ERROR)
+            return JSON_EXTRACT_ERROR;
+        len = c->json - key - 2;
+        if (!memchr(key + 1, '\\', len))
+            found = len == t->len && !memcmp(key + 1, t->key, len);
+        else {
+            c->json = key;
+            if (json_decode_string(c, &len) == JSON_PARSE_ERROR)
+                return JSON_EXTRACT_ERROR;
+            found = len == t->len && !memcmp(json_context_pop(c, len), t->key, len);
+        }
+        json_parse_whitespace(c);
+        if (*c->json != ':')
+            return JSON_EXTRACT_ERROR;
+        c->json++;
+        json_parse_whitespace(c);
+        if (found)
+            return JSON_EXTRACT_OK;
+        if (json_skip_value(c) == JSON_PARSE_ERROR)
+            return JSON_EXTRACT_ERROR;
+        json_parse_whitespace(c);
+        if (*c->json == '}')
+            return JSON_EXTRACT_MISSING;
+        if (*c->json != ',')
+            return JSON_EXTRACT_ERROR;
+        c->json++;
+        json_parse_whitespace(c);
+    }
+}
+
+static int json_extract_element(json_context *c, const json_pointer_token *t)
+{
+    size_t i;
+
+    assert(*c->json == '[');
+    c->json++;
+    json_parse_whitespace(c);
+    if (*c->json == ']' || t->index >= JSON_POINTER_END)
+        return JSON_EXTRACT_MISSING;
+    for (i = 0; i < t->index; i++) {
+        if (json_skip_value(c) == JSON_PARSE_ERROR)
+            return JSON_EXTRACT_ERROR;
+        json_parse_whitespace(c);
+        if (*c->json == ']')
+            return JSON_EXTRACT_MISSING;
+        if (*c->json != ',')
+            return JSON_EXTRACT_ERROR;
+        c->json++;
+        json_parse_whitespace(c);
+    }
+    return JSON_EXTRACT_OK;
+}
+
+/*
+ * Parse only the value at 'p' in 'json': what comes before it is skipped by json_skip_value, and
+ * nothing after it is read, so the time depends on where the value is and not on the size of
+ * 'json', and the text after the value is not validated.
+ */
+int json_extract(json_value *v, const char *json, const json_pointer *p)
+{
+    const json_pointer_token *t;
+    json_context c;
+    int ret = JSON_EXTRACT_OK;
+
+    assert(v && json && p);
+    json_context_init(&c, json);
+    json_parse_whitespace(&c);
+    for (t = p->tokens; t < p->tokens + p->size && ret == JSON_EXTRACT_OK; t++)
+        if (*c.json == '{')
+            ret = json_extract_member(&c, t);
+        else if (*c.json == '[')
+            ret = json_extract_element(&c, t);
+        else
+            ret = JSON_EXTRACT_MISSING;
+    if (ret == JSON_EXTRACT_OK && json_parse_value(&c, v) == JSON_PARSE_ERROR)
+        ret = JSON_EXTRACT_ERROR;
+    json_context_free(&c);
+    return ret;
+}
+
+/* Like json_pointer_resolve, giving each value on the way its own copy of shared values */
+static json_value *json_pointer_resolve_mutable(json_value *v, const json_pointer *p, size_t n)
+{
+    const json_pointer_token *t;
+
+    for (t = p->tokens; t < p->tokens + n && v; t++) {
+        json_unshare(v);
+        if (v->type == JSON_OBJECT)
+            v = json_get_object_value_n(v, t->key, t->len);
+        else if (v->type == JSON_ARRAY && t->index < v->array_size) {
+            json_array_unpack(v);
+            v = &v->array[t->index];
+        } else
+            return NULL;
+    }
+    if (!v)
+        return NULL;
+    json_unshare(v);
+    if (v->type == JSON_ARRAY)
+        json_array_unpack(v);
+    return v;
+}
+
+/* *********************************Diff******************************************** *
+ * json_diff emits RFC 6902 operations while walking 'a' and 'b' together, the path of the current
+ * value is kept escaped on a context stack:
+ *   1). Objects are matched by key. The member at the same position is tried first and a lookup
+ *       realigns the walk, so inserted or moved keys do not make it quadratic.
+ *   2). Arrays drop their common prefix and suffix, then the rest is matched by the longest common
+ *       subsequence of the element hashes. Between two matches the elements are diffed in pairs,
+ *       and the extra ones removed or added. Above JSON_DIFF_LCS_MAX cells, the elements unique on
+ *       both sides that keep their order anchor the match, and the ranges between them recurse.
+ *   3). References to the same shared value are skipped without walking them, and the hashes of
+ *       shared values are cached, so diffing versions built by sharing scales with the change.
+ */
+#define JSON_DIFF_LCS_MAX (1 << 20)
+
+#define JSON_MEMBER(v) ((json_object *) ((char *) (v) - offsetof(json_object, value)))
+
+static void json_diff_value(json_value *patch, json_context *path, const json_value *a, const json_value *b);
+
+static void json_diff_push_key(json_context *path, const char *key, size_t len)
+{
+    PUTC(path, '/');
+    for (; len; len--, key++) {
+        if (*key == '~')
+            json_context_push(path, "~0", 2);
+        else if (*key == '/')
+            json_context_push(path, "~1", 2);
+        else
+            PUTC(path, *key);
+    }
+}
+
+static void json_diff_push_index(json_context *path, size_t index)
+{
+    char d[24];
+
+    json_context_push(path, d, sprintf(d, "/%lu", (unsigned long) index));
+}
+
+static void json_diff_op(json_value *patch, const char *op, const json_context *path, const json_value *value)
+{
+    json_value o, e;
+
+    json_init(&o);
+    json_set_string(&e, op, strlen(op));
+    json_object_set(&o, "op", 2, 0, &e);
+    json_set_string(&e, path->top ? path->stack : "", path->top);
+    json_object_set(&o, "path", 4, 0, &e);
+    if (value) {
+        json_copy(&e, value);
+        json_object_set(&o, "value", 5, 0, &e);
+    }
+    json_array_push(patch, 0, &o);
+}
+
+static void json_diff_object(json_value *patch, json_context *path, const json_value *a, const json_value *b)
+{
+    size_t head = path->top;
+    json_object *o, *p;
+    const json_value *w;
+
+    for (o = a->object, p = b->object; o; o = o->next) {
+        if (p && p->key_len == o->key_len && !memcmp(p->key, o->key, o->key_len))
+            w = &p->value;
+        else if ((w = json_get_object_value_n(b, o->key, o->key_len)) != NULL)
+            p = JSON_MEMBER(w);
+        json_diff_push_key(path, o->key, o->key_len);
+        if (w)
+            json_diff_value(patch, path, &o->value, w);
+        else
+            json_diff_op(patch, "remove", path, NULL);
+        path->top = head;
+        if (w)
+            p = p->next;
+    }
+    for (o = b->object, p = a->object; o; o = o->next) {
+        if (p && p->key_len == o->key_len && !memcmp(p->key, o->key, o->key_len))
+            w = &p->value;
+        else if ((w = json_get_object_value_n(a, o->key, o->key_len)) != NULL)
+            p = JSON_MEMBER(w);
+        if (w) {
+            p = p->next;
+            continue;
+        }
+        json_diff_push_key(path, o->key, o->key_len);
+        json_diff_op(patch, "add", path, &o->value);
+        path->top = head;
+    }
+}
+
+typedef struct {
+    json_value *patch;
+    json_context *path;
+    const json_value *a, *b;
+    const uint64_t *ha, *hb;
+} json_diff_arrays;
+
+typedef struct {
+    uint64_t hash;
+    size_t ia, ib, ca, cb;
+} json_diff_slot;
+
+static void json_diff_element(json_diff_arrays *d, size_t i, size_t j, size_t k)
+{
+    json_value x, y;
+    size_t head = d->path->top;
+
+    json_diff_push_index(d->path, k);
+    if (j == (size_t) -1)
+        json_diff_op(d->patch, "remove", d->path, NULL);
+    else if (i == (size_t) -1)
+        json_diff_op(d->patch, "add", d->path, json_array_at(d->b, j, &y));
+    else
+        json_diff_value(d->patch, d->path, json_array_at(d->a, i, &x), json_array_at(d->b, j, &y));
+    d->path->top = head;
+}
+
+/* Turn a[i, i + n) into b[j, j + m) at index k of the patched array, return the next index */
+static size_t json_diff_gap(json_diff_arrays *d, size_t i, size_t n, size_t j, size_t m, size_t k)
+{
+    for (; n && m; n--, m--)
+        json_diff_element(d, i++, j++, k++);
+    for (; n; n--)
+        json_diff_element(d, i++, (size_t) -1, k);
+    for (; m; m--)
+        json_diff_element(d, (size_t) -1, j++, k++);
+    return k;
+}
+
+static size_t json_diff_range(json_diff_arrays *d, size_t i, size_t n, size_t j, size_t m, size_t k);
+
+static size_t json_diff_lcs(json_diff_arrays *d, size_t i0, size_t n, size_t j0, size_t m, size_t k)
+{
+    const uint64_t *ha = d->ha + i0, *hb = d->hb + j0;
+    size_t i, j, *lcs;
+
+    /* lcs[i * (m + 1) + j] is the LCS length of the suffixes from i and j */
+    lcs = (size_t *) calloc((n + 1) * (m + 1), sizeof(size_t));
+    for (i = n; i-- > 0;)
+        for (j = m; j-- > 0;)
+            lcs[i * (m + 1) + j] = ha[i] == hb[j] ? lcs[(i + 1) * (m + 1) + j + 1] + 1 :
+                                   lcs[(i + 1) * (m + 1) + j] > lcs[i * (m + 1) + j + 1] ? lcs[(i + 1) * (m + 1) + j] : lcs[i * (m + 1) + j + 1];
+    for (i = j = 0;;) {
+        size_t gi = i, gj = j;
+
+        /* the next match, or the end of both */
+        while (i < n && j < m && !(ha[i] == hb[j] && lcs[i * (m + 1) + j] == lcs[(i + 1) * (m + 1) + j + 1] + 1)) {
+            if (lcs[(i + 1) * (m + 1) + j] >= lcs[i * (m + 1) + j + 1])
+                i++;
+            else
+                j++;
+        }
+        if (i == n || j == m) {
+            k = json_diff_gap(d, i0 + gi, n - gi, j0 + gj, m - gj, k);
+            break;
+        }
+        k = json_diff_gap(d, i0 + gi, i - gi, j0 + gj, j - gj, k);
+        /* the hashes match, diff in case they collide */
+        json_diff_element(d, i0 + i++, j0 + j++, k++);
+    }
+    free(lcs);
+    return k;
+}
+
+static json_diff_slot *json_diff_slot_find(json_diff_slot *slots, size_t mask, uint64_t hash)
+{
+    size_t h = (size_t) hash & mask;
+
+    while ((slots[h].ca || slots[h].cb) && slots[h].hash != hash)
+        h = (h + 1) & mask;
+    slots[h].hash = hash;
+    return &slots[h];
+}
+
+/* Patience: anchor on the elements unique on both sides that keep their order, diff between them */
+static size_t json_diff_anchors(json_diff_arrays *d, size_t i0, size_t n, size_t j0, size_t m, size_t k)
+{
+    size_t size = 1, i, j, c, x, lo, hi, count = 0, len = 0, *ia, *ib, *tails, *prev;
+    json_diff_slot *slots, *slot;
+
+    while (size < 2 * (n + m))
+        size <<= 1;
+    slots = (json_diff_slot *) calloc(size, sizeof(json_diff_slot));
+    for (i = 0; i < n; i++) {
+        slot = json_diff_slot_find(slots, size - 1, d->ha[i0 + i]);
+        slot->ia = i;
+        slot->ca++;
+    }
+    for (j = 0; j < m; j++) {
+        slot = json_diff_slot_find(slots, size - 1, d->hb[j0 + j]);
+        slot->ib = j;
+        slot->cb++;
+    }
+    ia = (size_t *) malloc(sizeof(size_t) * 4 * n);
+    ib = ia + n;
+    tails = ib + n;
+    prev = tails + n;
+    for (i = 0; i < n; i++) {
+        slot = json_diff_slot_find(slots, size - 1, d->ha[i0 + i]);
+        if (slot->ca == 1 && slot->cb == 1) {
+            ia[count] = i;
+            ib[count++] = slot->ib;
+        }
+    }
+    free(slots);
+    if (count == 0) {
+        free(ia);
+        return json_diff_gap(d, i0, n, j0, m, k);
+    }
+    /* the longest increasing run of 'ib', tails[l] ends the best run of length l + 1 */
+    for (c = 0; c < count; c++) {
+        for (lo = 0, hi = len; lo < hi;) {
+            x = lo + (hi - lo) / 2;
+            if (ib[tails[x]] < ib[c])
+                lo = x + 1;
+            else
+                hi = x;
+        }
+        prev[c] = lo ? tails[lo - 1] : 0;
+        tails[lo] = c;
+        if (lo == len)
+            len++;
+    }
+    for (c = tails[len - 1], x = len; x-- > 0; c = prev[c])
+        tails[x] = c;
+    for (i = j = x = 0; x < len; x++) {
+        c = tails[x];
+        k = json_diff_range(d, i0 + i, ia[c] - i, j0 + j, ib[c] - j, k);
+        json_diff_element(d, i0 + ia[c], j0 + ib[c], k++);
+        i = ia[c] + 1;
+        j = ib[c] + 1;
+    }
+    k = json_diff_range(d, i0 + i, n - i, j0 + j, m - j, k);
+    free(ia);
+    return k;
+}
+
+static int json_diff_same(json_diff_arrays *d, size_t i, size_t j)
+{
+    json_value x, y;
+
+    return d->ha[i] == d->hb[j] && json_equal(json_array_at(d->a, i, &x), json_array_at(d->b, j, &y));
+}
+
+static size_t json_diff_range(json_diff_arrays *d, size_t i, size_t n, size_t j, size_t m, size_t k)
+{
+    size_t suffix = 0;
+
+    for (; n && m && json_diff_same(d, i, j); n--, m--)
+        i++, j++, k++;
+    for (; n && m && json_diff_same(d, i + n - 1, j + m - 1); n--, m--)
+        suffix++;
+    if (n == 0 || m == 0)
+        k = json_diff_gap(d, i, n, j, m, k);
+    else if (n + 1 <= JSON_DIFF_LCS_MAX / (m + 1))
+        k = json_diff_lcs(d, i, n, j, m, k);
+    else
+        k = json_diff_anchors(d, i, n, j, m, k);
+    return k + suffix;
+}
+
+static void json_diff_array(json_value *patch, json_context *path, const json_value *a, const json_value *b)
+{
+    json_diff_arrays d;
+    json_value e;
+    uint64_t *h;
+    size_t i;
+
+    h = (uint64_t *) malloc(sizeof(uint64_t) * (a->array_size + b->array_size + 1));
+    for (i = 0; i < a->array_size; i++)
+        h[i] = json_hash(json_array_at(a, i, &e));
+    for (i = 0; i < b->array_size; i++)
+        h[a->array_size + i] = json_hash(json_array_at(b, i, &e));
+    d.patch = patch;
+    d.path = path;
+    d.a = a;
+    d.b = b;
+    d.ha = h;
+    d.hb = h + a->array_size;
+    json_diff_range(&d, 0, a->array_size, 0, b->array_size, 0);
+    free(h);
+}
+
+static void json_diff_value(json_value *patch, json_context *path, const json_value *a, const json_value *b)
+{
+    if ((a->flags & b->flags & JSON_FLAG_SHARED) && a->shared == b->shared)
+        return;
+    a = JSON_RESOLVE(a);
+    b = JSON_RESOLVE(b);
+    if (a == b)
+        return;
+    if (a->type == b->type && a->type == JSON_OBJECT)
+        json_diff_object(patch, path, a, b);
+    else if (a->type == b->type && a->type == JSON_ARRAY)
+        json_diff_array(patch, path, a, b);
+    else if (!json_equal(a, b))
+        json_diff_op(patch, "replace", path, b);
+}
+
+void json_diff(json_value *patch, const json_value *a, const json_value *b)
+{
+    json_context path;
+
+    assert(patch && a && b);
+    json_array_reserve(patch, 0);
+    json_context_init(&path, NULL);
+    json_diff_value(patch, &path, a, b);
+    json_context_free(&path);
+}
+
+/* *********************************Patch******************************************* *
+ * json_patch_apply changes the document in place and logs how to undo each change, so that a
+ * failing operation rolls the whole patch back. An entry keeps the compiled path of the change
+ * rather than a pointer to the parent, since arrays may move while the patch is applied:
+ *   1). JSON_UNDO_ROOT: put back the old document.
+ *   2). JSON_UNDO_SET: put back the old value of a member or an element.
+ *   3). JSON_UNDO_DELETE: take out an added member or element.
+ *   4). JSON_UNDO_INSERT: put back a removed member after the member it followed, or element.
+ * "move" detaches the value and attaches it elsewhere without a copy. Its entries are flagged
+ * 'keep': undoing the attach leaves the value in 'carry', and undoing the detach takes it from there.
+ */
+enum {
+    JSON_UNDO_ROOT,
+    JSON_UNDO_SET,
+    JSON_UNDO_DELETE,
+    JSON_UNDO_INSERT
+};
+
+typedef struct {
+    int op;
+    int keep;
+    const json_pointer *path;
+    /* the element of an array */
+    size_t index;
+    /* JSON_UNDO_INSERT into an object: the key of the member before, NULL for the first */
+    char *after;
+    size_t after_len;
+    json_value value;
+} json_patch_undo;
+
+typedef struct {
+    json_value *root;
+    json_context undo;
+    json_context pointers;
+    json_value carry;
+} json_patch_context;
+
+static void json_patch_log(json_patch_context *c, json_patch_undo *u, int op, int keep, const json_pointer *p)
+{
+    u->op = op;
+    u->keep = keep;
+    u->path = p;
+    json_context_push(&c->undo, u, sizeof(json_patch_undo));
+}
+
+/* Detach the value at 'p', into 'out' if 'keep', otherwise into the log */
+static int json_patch_take(json_patch_context *c, const json_pointer *p, json_value *out, int keep)
+{
+    const json_pointer_token *t;
+    json_value *parent;
+    json_patch_undo u;
+    json_object *o, *prev;
+
+    if (p->size == 0 || (parent = json_pointer_resolve_mutable(c->root, p, p->size - 1)) == NULL)
+        return JSON_PATCH_ERROR;
+    /* compacted trees are read-only */
+    assert(!(parent->flags & JSON_FLAG_COMPACT));
+    t = &p->tokens[p->size - 1];
+    u.after = NULL;
+    json_init(&u.value);
+    if (parent->type == JSON_OBJECT) {
+        if ((o = json_object_detach(parent, t->key, t->len, &prev)) == NULL)
+            return JSON_PATCH_ERROR;
+        if (prev != &json_object_head) {
+            u.after_len = prev->key_len;
+            u.after = (char *) malloc(prev->key_len + 1);
+            memcpy(u.after, prev->key, prev->key_len);
+        }
+        memcpy(keep ? out : &u.value, &o->value, sizeof(json_value));
+        free(o->key);
+        free(o);
+    } else if (parent->type == JSON_ARRAY && t->index < parent->array_size) {
+        u.index = t->index;
+        json_array_detach(parent, t->index, keep ? out : &u.value);
+    } else
+        return JSON_PATCH_ERROR;
+    json_patch_log(c, &u, JSON_UNDO_INSERT, keep, p);
+    return JSON_PATCH_OK;
+}
+
+/* Attach 'value' at 'p' like "add", or like "replace" if 'replace'. 'value' is taken over unless it fails */
+static int json_patch_put(json_patch_context *c, const json_pointer *p, json_value *value, int replace, int keep)
+{
+    const json_pointer_token *t;
+    json_value *parent, *old;
+    json_patch_undo u;
+    size_t i;
+
+    u.after = NULL;
+    json_init(&u.value);
+    if (p->size == 0) {
+        memcpy(&u.value, c->root, sizeof(json_value));
+        memcpy(c->root, value, sizeof(json_value));
+        json_patch_log(c, &u, JSON_UNDO_ROOT, keep, p);
+        return JSON_PATCH_OK;
+    }
+    if ((parent = json_pointer_resolve_mutable(c->root, p, p->size - 1)) == NULL)
+        return JSON_PATCH_ERROR;
+    assert(!(parent->flags & JSON_FLAG_COMPACT));
+    t = &p->tokens[p->size - 1];
+    if (parent->type == JSON_OBJECT) {
+        if ((old = json_get_object_value_n(parent, t->key, t->len)) != NULL) {
+            memcpy(&u.value, old, sizeof(json_value));
+            memcpy(old, value, sizeof(json_value));
+            json_patch_log(c, &u, JSON_UNDO_SET, keep, p);
+        } else if (replace)
+            return JSON_PATCH_ERROR;
+        else {
+            json_object_set(parent, t->key, t->len, 0, value);
+            json_patch_log(c, &u, JSON_UNDO_DELETE, keep, p);
+        }
+    } else if (parent->type == JSON_ARRAY) {
+        u.index = i = t->index == JSON_POINTER_END ? parent->array_size : t->index;
+        if (replace) {
+            if (i >= parent->array_size)
+                return JSON_PATCH_ERROR;
+            memcpy(&u.value, &parent->array[i], sizeof(json_value));
+            memcpy(&parent->array[i], value, sizeof(json_value));
+            json_patch_log(c, &u, JSON_UNDO_SET, keep, p);
+        } else {
+            if (i > parent->array_size)
+                return JSON_PATCH_ERROR;
+            json_array_insert(parent, i, 0, value);
+            json_patch_log(c, &u, JSON_UNDO_DELETE, keep, p);
+        }
+    } else
+        return JSON_PATCH_ERROR;
+    return JSON_PATCH_OK;
+}
+
+static void json_patch_rollback(json_patch_context *c)
+{
+    const json_pointer_token *t;
+    json_patch_undo *u;
+    json_value *parent, *target, displaced;
+    json_object *o, *prev;
+
+    while (c->undo.top) {
+        u = (json_patch_undo *) json_context_pop(&c->undo, sizeof(json_patch_undo));
+        json_init(&displaced);
+        if (u->op == JSON_UNDO_ROOT) {
+            memcpy(&displaced, c->root, sizeof(json_value));
+            memcpy(c->root, &u->value, sizeof(json_value));
+        } else {
+            parent = json_pointer_resolve_mutable(c->root, u->path, u->path->size - 1);
+            t = &u->path->tokens[u->path->size - 1];
+            assert(parent);
+            switch (u->op) {
+            case JSON_UNDO_SET:
+                target = parent->type == JSON_OBJECT ? json_get_object_value_n(parent, t->key, t->len) : &parent->array[u->index];
+                memcpy(&displaced, target, sizeof(json_value));
+                memcpy(target, &u->value, sizeof(json_value));
+                break;
+            case JSON_UNDO_DELETE:
+                if (parent->type == JSON_OBJECT) {
+                    o = json_object_detach(parent, t->key, t->len, &prev);
+                    memcpy(&displaced, &o->value, sizeof(json_value));
+                    free(o->key);
+                    free(o);
+                } else
+                    json_array_detach(parent, u->index, &displaced);
+                break;
+            case JSON_UNDO_INSERT:
+                if (u->keep)
+                    json_move(&u->value, &c->carry);
+                if (parent->type == JSON_OBJECT) {
+                    json_object_modify(parent);
+                    prev = u->after ? JSON_MEMBER(json_get_object_value_n(parent, u->after, u->after_len)) : &json_object_head;
+                    json_object_link_after(parent, prev, t->key, t->len, &u->value);
+                } else
+                    json_array_insert(parent, u->index, 0, &u->value);
+                break;
+            }
+        }
+        if (u->keep)
+            json_move(&c->carry, &displaced);
+        else
+            json_free(&displaced);
+        free(u->after);
+    }
+}
+
+static json_pointer *json_patch_pointer(json_patch_context *c, const json_value *op, const char *name)
+{
+    const json_value *s = json_get_object_value_n(op, name, strlen(name));
+    json_pointer *p;
+
+    if (!s || json_get_type(s) != JSON_STRING)
+        return NULL;
+    if ((p = json_pointer_compile_n(json_get_string(s), json_get_string_length(s))) != NULL)
+        json_context_push(&c->pointers, &p, sizeof(json_pointer *));
+    return p;
+}
+
+/* 'from' is 'path' or a parent of it */
+static int json_pointer_is_prefix(const json_pointer *from, const json_pointer *path)
+{
+    size_t i;
+
+    if (from->size > path->size)
+        return 0;
+    for (i = 0; i < from->size; i++)
+        if (from->tokens[i].len != path->tokens[i].len || memcmp(from->tokens[i].key, path->tokens[i].key, from->tokens[i].len))
+            return 0;
+    return 1;
+}
+
+#define JSON_PATCH_IS(s, name) \
+    (json_get_string_length(s) == sizeof(name) - 1 && !memcmp(json_get_string(s), name, sizeof(name) - 1))
+
+static int json_patch_op(json_patch_context *c, const json_value *op)
+{
+    const json_value *name, *value, *source;
+    json_pointer *path, *from;
+    json_value e, n;
+    int ret;
+
+    if (json_get_type(op) != JSON_OBJECT || (path = json_patch_pointer(c, op, "path")) == NULL ||
+        (name = json_get_object_value(op, "op")) == NULL || json_get_type(name) != JSON_STRING)
+        return JSON_PATCH_ERROR;
+    value = json_get_object_value(op, "value");
+    if (JSON_PATCH_IS(name, "add") || JSON_PATCH_IS(name, "replace")) {
+        if (!value)
+            return JSON_PATCH_ERROR;
+        json_copy(&e, value);
+        if ((ret = json_patch_put(c, path, &e, JSON_PATCH_IS(name, "replace"), 0)) != JSON_PATCH_OK)
+            json_free(&e);
+        return ret;
+    }
+    if (JSON_PATCH_IS(name, "remove"))
+        return json_patch_take(c, path, NULL, 0);
+    if (JSON_PATCH_IS(name, "test"))
+        return value && (source = json_pointer_resolve(c->root, path, path->size, &n)) != NULL && json_equal(source, value) ?
+               JSON_PATCH_OK : JSON_PATCH_ERROR;
+    if ((from = json_patch_pointer(c, op, "from")) == NULL)
+        return JSON_PATCH_ERROR;
+    if (JSON_PATCH_IS(name, "copy")) {
+        if ((source = json_pointer_resolve(c->root, from, from->size, &n)) == NULL)
+            return JSON_PATCH_ERROR;
+        json_copy(&e, source);
+        if ((ret = json_patch_put(c, path, &e, 0, 0)) != JSON_PATCH_OK)
+            json_free(&e);
+        return ret;
+    }
+    if (JSON_PATCH_IS(name, "move")) {
+        if (json_pointer_is_prefix(from, path))
+            return from->size == path->size ? JSON_PATCH_OK : JSON_PATCH_ERROR;
+        if ((ret = json_patch_take(c, from, &e, 1)) != JSON_PATCH_OK)
+            return ret;
+        /* on failure the rollback puts 'e' back */
+        if ((ret = json_patch_put(c, path, &e, 0, 1)) != JSON_PATCH_OK)
+            json_move(&c->carry, &e);
+        return ret;
+    }
+    return JSON_PATCH_ERROR;
+}
+
+int json_patch_apply(json_value *v, const json_value *patch)
+{
+    json_patch_context c;
+    json_patch_undo *u;
+    size_t i;
+    int ret = JSON_PATCH_OK;
+
+    assert(v && patch);
+    if (json_get_type(patch) != JSON_ARRAY)
+        return JSON_PATCH_ERROR;
+    c.root = v;
+    json_context_init(&c.undo, NULL);
+    json_context_init(&c.pointers, NULL);
+    json_init(&c.carry);
+    for (i = 0; i < json_get_array_size(patch) && ret == JSON_PATCH_OK; i++)
+        ret = json_patch_op(&c, json_get_array_element(patch, i));
+    if (ret != JSON_PATCH_OK)
+        json_patch_rollback(&c);
+    for (u = (json_patch_undo *) c.undo.stack; u < (json_patch_undo *) (c.undo.stack + c.undo.top); u++) {
+        json_free(&u->value);
+        free(u->after);
+    }
+    for (i = 0; i < c.pointers.top / sizeof(json_pointer *); i++)
+        free(((json_pointer **) c.pointers.stack)[i]);
+    json_context_free(&c.undo);
+    json_context_free(&c.pointers);
+    assert(json_get_type(&c.carry) == JSON_NULL);
+    return ret;
+}
+
+/* RFC 7396: objects are merged member by member, null removes a member, anything else replaces */
+void json_merge_patch_apply(json_value *v, const json_value *patch)
+{
+    const json_value *p;
+    json_value *target, e;
+    json_object *o;
+
+    assert(v && patch);
+    p = JSON_RESOLVE(patch);
+    if (p->type != JSON_OBJECT) {
+        json_free(v);
+        json_copy(v, patch);
+        return;
+    }
+    if (v->type != JSON_OBJECT)
+        json_free(v);
+    json_object_modify(v);
+    for (o = p->object; o; o = o->next) {
+        if (json_get_type(&o->value) == JSON_NULL)
+            json_object_remove(v, o->key, o->key_len);
+        else if ((target = json_get_object_value_n(v, o->key, o->key_len)) != NULL)
+            json_merge_patch_apply(target, &o->value);
+        else {
+            json_init(&e);
+            json_merge_patch_apply(&e, &o->value);
+            json_object_set(v, o->key, o->key_len, 0, &e);
+        }
+    }
+}
+
+/* *********************************Path******************************************** *
+ * A compiled JSONPath is a list of steps, each applying its selectors to the children of the
+ * values the previous steps reached ('..' to the children of their descendants as well).
+ * Evaluation walks the tree once, in document order, carrying for each value the set of steps
+ * that reached it as a bit mask: bit i means steps [0, i) led here, so bit 'size' is a match.
+ * The masks of a child depend only on the masks of its parent and its key or index, so the same
+ * walk runs over text: json_path_stream skips children without bits, descends into containers,
+ * and parses only the values it must see whole, a match, a value a filter tests, and an array
+ * indexed from its end. Memory is bounded by the largest of those values, not by the document.
+ */
+#define JSON_PATH_STEPS_MAX 63
+#define JSON_PATH_BIT(i) ((uint64_t) 1 << (i))
+/* the end of a slice without one */
+#define JSON_PATH_END LONG_MAX
+#define ISNAME(c) (ISDIGIT(c) || ((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z') || (c) == '_' || (c) == '$' || (c) == '-' || (unsigned char) (c) >= 0x80)
+
+enum {
+    JSON_PATH_KEY,
+    JSON_PATH_INDEX,
+    JSON_PATH_SLICE,
+    JSON_PATH_WILDCARD,
+    /* the only selector of its step */
+    JSON_PATH_FILTER
+};
+
+enum {
+    JSON_PATH_OR,
+    JSON_PATH_AND,
+    JSON_PATH_NOT,
+    JSON_PATH_EXISTS,
+    JSON_PATH_EQ,
+    JSON_PATH_NE,
+    JSON_PATH_LT,
+    JSON_PATH_LE,
+    JSON_PATH_GT,
+    JSON_PATH_GE
+};
+
+typedef struct json_path_expr json_path_expr;
+
+struct json_path_expr {
+    int op;
+    json_path_expr *left, *right;
+    /* the value under test, relative to '@' */
+    json_pointer *operand;
+    json_value literal;
+};
+
+typedef struct {
+    int type;
+    char *key;
+    size_t len;
+    /* JSON_PATH_INDEX is 'start', negative from the end */
+    long start, end, step;
+    json_path_expr *filter;
+} json_path_selector;
+
+typedef struct {
+    int descendant;
+    size_t size;
+    json_path_selector *selectors;
+} json_path_step;
+
+struct json_path {
+    size_t size;
+    json_path_step *steps;
+    /* the steps with a negative index or bound, they need the size of the array */
+    uint64_t sized;
+};
+
+typedef struct {
+    const json_path *path;
+    json_path_callback callback;
+    void *data;
+    size_t count;
+    int stop;
+    /* the matches are the callback's to take */
+    int owned;
+} json_path_query;
+
+static void json_path_expr_free(json_path_expr *e)
+{
+    if (e) {
+        json_path_expr_free(e->left);
+        json_path_expr_free(e->right);
+        json_pointer_free(e->operand);
+        json_free(&e->literal);
+        free(e);
+    }
+}
+
+static json_path_expr *json_path_expr_new(int op, json_path_expr *left, json_path_expr *right)
+{
+    json_path_expr *e;
+
+    if (!left || (op <= JSON_PATH_AND && !right)) {
+        json_path_expr_free(left);
+        json_path_expr_free(right);
+        return NULL;
+    }
+    e = (json_path_expr *) malloc(sizeof(json_path_expr));
+    e->op = op;
+    e->left = left;
+    e->right = right;
+    e->operand = NULL;
+    json_init(&e->literal);
+    return e;
+}
+
+static void json_path_step_free(json_path_step *s)
+{
+    size_t i;
+
+    for (i = 0; i < s->size; i++) {
+        free(s->selectors[i].key);
+        json_path_expr_free(s->selectors[i].filter);
+    }
+    free(s->selectors);
+}
+
+/* Push the chars of a quoted name to the stack */
+static int json_path_parse_quoted(json_context *c, size_t *len)
+{
+    size_t head = c->top;
+
+    if (*c->json == '\"')
+        return json_decode_string(c, len);
+    if (*c->json != '\'')
+        return JSON_PARSE_ERROR;
+    for (c->json++; *c->json != '\''; c->json++) {
+        if (*c->json == '\\' && c->json[1] != '\0')
+            c->json++;
+        if (*c->json == '\0') {
+            c->top = head;
+            return JSON_PARSE_ERROR;
+        }
+        PUTC(c, *c->json);
+    }
+    c->json++;
+    *len = c->top - head;
+    return JSON_PARSE_OK;
+}
+
+static int json_path_parse_int(json_context *c, long *n)
+{
+    const char *p = c->json;
+    int negative = *p == '-';
+    long i = 0;
+
+    if (negative)
+        p++;
+    if (!ISDIGIT(*p))
+        return 0;
+    for (; ISDIGIT(*p); p++) {
+        if (i > (LONG_MAX - 9) / 10)
+            return 0;
+        i = i * 10 + (*p - '0');
+    }
+    *n = negative ? -i : i;
+    c->json = p;
+    return 1;
+}
+
+/* Escape the name pushed at 'head' into a token of a JSON Pointer */
+static void json_path_push_token(json_context *c, size_t head)
+{
+    size_t len = c->top - head, i;
+    char *name = (char *) malloc(len + 1);
+
+    memcpy(name, json_context_pop(c, len), len);
+    PUTC(c, '/');
+    for (i = 0; i < len; i++)
+        if (name[i] == '~')
+            json_context_push(c, "~0", 2);
+        else if (name[i] == '/')
+            json_context_push(c, "~1", 2);
+        else
+            PUTC(c, name[i]);
+    free(name);
+}
+
+/* The path after '@' as a JSON Pointer, names and indexes only */
+static json_pointer *json_path_parse_operand(json_context *c)
+{
+    json_pointer *p = NULL;
+    size_t head = c->top, token, len;
+    const char *start;
+
+    for (;;) {
+        token = c->top;
+        if (*c->json == '.') {
+            for (start = ++c->json; ISNAME(*c->json); c->json++)
+                ;
+            if (c->json == start)
+                break;
+            json_context_push(c, start, c->json - start);
+        } else if (*c->json == '[') {
+            c->json++;
+            json_parse_whitespace(c);
+            if (ISDIGIT(*c->json)) {
+                for (start = c->json; ISDIGIT(*c->json); c->json++)
+                    ;
+                json_context_push(c, start, c->json - start);
+            } else if (json_path_parse_quoted(c, &len) == JSON_PARSE_ERROR)
+                break;
+            json_parse_whitespace(c);
+            if (*c->json != ']')
+                break;
+            c->json++;
+        } else {
+            p = json_pointer_compile_n(c->stack + head, c->top - head);
+            break;
+        }
+        json_path_push_token(c, token);
+    }
+    c->top = head;
+    return p;
+}
+
+static json_path_expr *json_path_parse_or(json_context *c);
+
+/* '@path', optionally compared with a literal */
+static json_path_expr *json_path_parse_comparison(json_context *c)
+{
+    static const struct {
+        const char *name;
+        int op;
+    } ops[] = {{"==", JSON_PATH_EQ}, {"!=", JSON_PATH_NE}, {"<=", JSON_PATH_LE}, {">=", JSON_PATH_GE}, {"<", JSON_PATH_LT}, {">", JSON_PATH_GT}};
+    json_path_expr *e;
+    json_pointer *operand;
+    size_t i, len;
+
+    if (*c->json != '@')
+        return NULL;
+    c->json++;
+    if (!(operand = json_path_parse_operand(c)))
+        return NULL;
+    e = (json_path_expr *) malloc(sizeof(json_path_expr));
+    e->op = JSON_PATH_EXISTS;
+    e->left = e->right = NULL;
+    e->operand = operand;
+    json_init(&e->literal);
+    json_parse_whitespace(c);
+    for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
+        if (!strncmp(c->json, ops[i].name, strlen(ops[i].name)))
+            break;
+    if (i == sizeof(ops) / sizeof(ops[0]))
+        return e;
+    e->op = ops[i].op;
+    c->json += strlen(ops[i].name);
+    json_parse_whitespace(c);
+    if (*c->json == '\'') {
+        if (json_path_parse_quoted(c, &len) == JSON_PARSE_OK) {
+            json_set_string(&e->literal, c->stack + c->top - len, len);
+            c->top -= len;
+            return e;
+        }
+    } else if (*c->json != '{' && *c->json != '[' && json_parse_value(c, &e->literal) == JSON_PARSE_OK)
+        return e;
+    json_path_expr_free(e);
+    return NULL;
+}
+
+static json_path_expr *json_path_parse_unary(json_context *c)
+{
+    json_path_expr *e;
+
+    json_parse_whitespace(c);
+    if (*c->json == '!') {
+        c->json++;
+        return json_path_expr_new(JSON_PATH_NOT, json_path_parse_unary(c), NULL);
+    }
+    if (*c->json != '(')
+        return json_path_parse_comparison(c);
+    c->json++;
+    e = json_path_parse_or(c);
+    json_parse_whitespace(c);
+    if (e && *c->json == ')') {
+        c->json++;
+        return e;
+    }
+    json_path_expr_free(e);
+    return NULL;
+}
+
+static json_path_expr *json_path_parse_and(json_context *c)
+{
+    json_path_expr *e = json_path_parse_unary(c);
+
+    for (json_parse_whitespace(c); e && c->json[0] == '&' && c->json[1] == '&'; json_parse_whitespace(c)) {
+        c->json += 2;
+        e = json_path_expr_new(JSON_PATH_AND, e, json_path_parse_unary(c));
+    }
+    return e;
+}
+
+static json_path_expr *json_path_parse_or(json_context *c)
+{
+    json_path_expr *e = json_path_parse_and(c);
+
+    while (e && c->json[0] == '|' && c->json[1] == '|') {
+        c->json += 2;
+        e = json_path_expr_new(JSON_PATH_OR, e, json_path_parse_and(c));
+    }
+    return e;
+}
+
+/* One of the selectors between '[' and ']', a name, an index or a slice */
+static int json_path_parse_selector(json_context *c, json_path_selector *s)
+{
+    int start;
+
+    if (*c->json == '\"' || *c->json == '\'') {
+        if (json_path_parse_quoted(c, &s->len) == JSON_PARSE_ERROR)
+            return JSON_PARSE_ERROR;
+        s->type = JSON_PATH_KEY;
+        s->key = (char *) malloc(s->len + 1);
+        memcpy(s->key, json_context_pop(c, s->len), s->len);
+        s->key[s->len] = '\0';
+        return JSON_PARSE_OK;
+    }
+    start = json_path_parse_int(c, &s->start);
+    json_parse_whitespace(c);
+    if (*c->json != ':') {
+        s->type = JSON_PATH_INDEX;
+        return start ? JSON_PARSE_OK : JSON_PARSE_ERROR;
+    }
+    s->type = JSON_PATH_SLICE;
+    if (!start)
+        s->start = 0;
+    c->json++;
+    json_parse_whitespace(c);
+    if (!json_path_parse_int(c, &s->end))
+        s->end = JSON_PATH_END;
+    json_parse_whitespace(c);
+    s->step = 1;
+    if (*c->json == ':') {
+        c->json++;
+        json_parse_whitespace(c);
+        if (json_path_parse_int(c, &s->step) && s->step <= 0)
+            return JSON_PARSE_ERROR;
+    }
+    return JSON_PARSE_OK;
+}
+
+/* The selectors of a step pushed to the stack, a '.name', '.*', or a '[...]' */
+static int json_path_parse_selectors(json_context *c, int bracket)
+{
+    json_path_selector s;
+    const char *start;
+
+    s.key = NULL;
+    s.len = 0;
+    s.start = s.end = 0;
+    s.step = 1;
+    s.filter = NULL;
+    if (!bracket) {
+        if (*c->json == '*') {
+            c->json++;
+            s.type = JSON_PATH_WILDCARD;
+        } else {
+            for (start = c->json; ISNAME(*c->json); c->json++)
+                ;
+            if (c->json == start)
+                return JSON_PARSE_ERROR;
+            s.type = JSON_PATH_KEY;
+            s.len = c->json - start;
+            s.key = (char *) malloc(s.len + 1);
+            memcpy(s.key, start, s.len);
+            s.key[s.len] = '\0';
+        }
+        json_context_push(c, &s, sizeof(s));
+        return JSON_PARSE_OK;
+    }
+    c->json++;
+    json_parse_whitespace(c);
+    if (*c->json == '*') {
+        c->json++;
+        s.type = JSON_PATH_WILDCARD;
+        json_context_push(c, &s, sizeof(s));
+    } else if (*c->json == '?') {
+        c->json++;
+        json_parse_whitespace(c);
+        if (*c->json != '(' || !(s.filter = json_path_parse_unary(c)))
+            return JSON_PARSE_ERROR;
+        s.type = JSON_PATH_FILTER;
+        json_context_push(c, &s, sizeof(s));
+    } else
+        for (;;) {
+            if (json_path_parse_selector(c, &s) == JSON_PARSE_ERROR)
+                return JSON_PARSE_ERROR;
+            json_context_push(c, &s, sizeof(s));
+            s.key = NULL;
+            s.end = 0;
+            s.step = 1;
+            json_parse_whitespace(c);
+            if (*c->json != ',')
+                break;
+            c->json++;
+            json_parse_whitespace(c);
+        }
+    json_parse_whitespace(c);
+    if (*c->json != ']')
+        return JSON_PARSE_ERROR;
+    c->json++;
+    return JSON_PARSE_OK;
+}
+
+static int json_path_parse_step(json_context *c, json_context *steps)
+{
+    json_path_step step;
+    size_t head = c->top, size;
+    int ret;
+
+    step.descendant = 0;
+    if (*c->json == '[')
+        ret = json_path_parse_selectors(c, 1);
+    else if (*c->json == '.') {
+        if (*++c->json == '.') {
+            c->json++;
+            step.descendant = 1;
+        }
+        ret = json_path_parse_selectors(c, step.descendant && *c->json == '[');
+    } else
+        ret = JSON_PARSE_ERROR;
+    step.size = (c->top - head) / sizeof(json_path_selector);
+    size = step.size * sizeof(json_path_selector);
+    step.selectors = NULL;
+    if (size) {
+        step.selectors = (json_path_selector *) malloc(size);
+        memcpy(step.selectors, json_context_pop(c, size), size);
+    }
+    if (ret == JSON_PARSE_ERROR) {
+        json_path_step_free(&step);
+        return JSON_PARSE_ERROR;
+    }
+    json_context_push(steps, &step, sizeof(step));
+    return JSON_PARSE_OK;
+}
+
+/* NULL if 'expr' is not a JSONPath this parser knows */
+json_path *json_path_compile(const char *expr)
+{
+    json_context c, steps;
+    json_path *path = NULL;
+    json_path_step *s;
+    size_t size, i, k;
+    int ret = JSON_PARSE_ERROR;
+
+    assert(expr);
+    json_context_init(&c, expr);
+    json_context_init(&steps, NULL);
+    if (*c.json == '$')
+        for (c.json++, ret = JSON_PARSE_OK; ret == JSON_PARSE_OK && *c.json;)
+            ret = steps.top < JSON_PATH_STEPS_MAX * sizeof(json_path_step) ? json_path_parse_step(&c, &steps) : JSON_PARSE_ERROR;
+    size = steps.top / sizeof(json_path_step);
+    s = (json_path_step *) steps.stack;
+    if (ret == JSON_PARSE_OK) {
+        path = (json_path *) malloc(sizeof(json_path) + steps.top);
+        path->size = size;
+        path->steps = (json_path_step *) (path + 1);
+        path->sized = 0;
+        if (size)
+            memcpy(path->steps, s, steps.top);
+        for (i = 0; i < size; i++)
+            for (k = 0; k < s[i].size; k++)
+                if ((s[i].selectors[k].type == JSON_PATH_INDEX || s[i].selectors[k].type == JSON_PATH_SLICE) && (s[i].selectors[k].start < 0 || s[i].selectors[k].end < 0))
+                    path->sized |= JSON_PATH_BIT(i);
+    } else
+        for (i = 0; i < size; i++)
+            json_path_step_free(&s[i]);
+    json_context_free(&c);
+    json_context_free(&steps);
+    return path;
+}
+
+void json_path_free(json_path *path)
+{
+    size_t i;
+
+    if (path) {
+        for (i = 0; i < path->size; i++)
+            json_path_step_free(&path->steps[i]);
+        free(path);
+    }
+}
+
+static int json_path_compare(int op, const json_value *a, const json_value *b)
+{
+    int cmp;
+
+    if (a->type != b->type)
+        return op == JSON_PATH_NE;
+    JSON_DECODE(a);
+    JSON_DECODE(b);
+    if (a->type == JSON_NUMBER)
+        cmp = a->number < b->number ? -1 : a->number > b->number;
+    else if (a->type == JSON_STRING) {
+        cmp = memcmp(a->string, b->string, a->string_len < b->string_len ? a->string_len : b->string_len);
+        if (cmp == 0)
+            cmp = a->string_len < b->string_len ? -1 : a->string_len > b->string_len;
+    } else if (op == JSON_PATH_EQ || op == JSON_PATH_NE)
+        cmp = 0;
+    else
+        return 0;
+    switch (op) {
+    case JSON_PATH_EQ:
+        return cmp == 0;
+    case JSON_PATH_NE:
+        return cmp != 0;
+    case JSON_PATH_LT:
+        return cmp < 0;
+    case JSON_PATH_LE:
+        return cmp <= 0;
+    case JSON_PATH_GT:
+        return cmp > 0;
+    default:
+        return cmp >= 0;
+    }
+}
+
+static int json_path_test(const json_path_expr *e, const json_value *v)
+{
+    const json_value *x;
+    json_value n;
+
+    switch (e->op) {
+    case JSON_PATH_OR:
+        return json_path_test(e->left, v) || json_path_test(e->right, v);
+    case JSON_PATH_AND:
+        return json_path_test(e->left, v) && json_path_test(e->right, v);
+    case JSON_PATH_NOT:
+        return !json_path_test(e->left, v);
+    default:
+        x = json_pointer_resolve(v, e->operand, e->operand->size, &n);
+        if (e->op == JSON_PATH_EXISTS)
+            return x != NULL;
+        return x && json_path_compare(e->op, JSON_RESOLVE(x), &e->literal);
+    }
+}
+
+static int json_path_select_index(const json_path_selector *s, size_t index, size_t size)
+{
+    long i = (long) index, start = s->start, end = s->end;
+
+    switch (s->type) {
+    case JSON_PATH_INDEX:
+        return i == (start < 0 ? start + (long) size : start);
+    case JSON_PATH_SLICE:
+        if (start < 0 && (start += (long) size) < 0)
+            start = 0;
+        if (end < 0)
+            end += (long) size;
+        return i >= start && i < end && (i - start) % s->step == 0;
+    default:
+        return s->type == JSON_PATH_WILDCARD;
+    }
+}
+
+static int json_path_select_key(const json_path_selector *s, const char *key, size_t len)
+{
+    if (s->type == JSON_PATH_KEY)
+        return len == s->len && !memcmp(key, s->key, len);
+    return s->type == JSON_PATH_WILDCARD;
+}
+
+/*
+ * The steps reaching a child from the steps 'mask' reaching its parent, 'key' is NULL for an
+ * element of an array of 'size'. The filters to test on the child go to 'filters'.
+ */
+static uint64_t json_path_child(const json_path *path, uint64_t mask, const char *key, size_t len, size_t index, size_t size, uint64_t *filters)
+{
+    const json_path_step *s;
+    uint64_t child = 0;
+    size_t i, k;
+
+    for (i = 0, s = path->steps; i < path->size; i++, s++) {
+        if (!(mask & JSON_PATH_BIT(i)))
+            continue;
+        if (s->descendant)
+            child |= JSON_PATH_BIT(i);
+        if (s->selectors[0].type == JSON_PATH_FILTER) {
+            *filters |= JSON_PATH_BIT(i);
+            continue;
+        }
+        for (k = 0; k < s->size; k++)
+            if (key ? json_path_select_key(&s->selectors[k], key, len) : json_path_select_index(&s->selectors[k], index, size)) {
+                child |= JSON_PATH_BIT(i + 1);
+                break;
+            }
+    }
+    return child;
+}
+
+static void json_path_walk(json_path_query *q, const json_value *v, uint64_t mask, uint64_t filters)
+{
+    const json_path *path = q->path;
+    json_object *o;
+    uint64_t f;
+    size_t i, m;
+
+    v = JSON_RESOLVE(v);
+    for (i = 0; filters >> i; i++)
+        if ((filters & JSON_PATH_BIT(i)) && json_path_test(path->steps[i].selectors[0].filter, v))
+            mask |= JSON_PATH_BIT(i + 1);
+    if (mask & JSON_PATH_BIT(path->size)) {
+        json_value *match = (json_value *) v, handle;
+
+        mask &= ~JSON_PATH_BIT(path->size);
+        /* the callback may take a match whose descendants are still to walk, give it a reference */
+        if (q->owned && mask) {
+            json_share(&handle, match);
+            v = JSON_RESOLVE(match);
+            match = &handle;
+        }
+        q->count++;
+        q->stop = q->callback(q->data, match) != 0;
+        if (match == &handle)
+            json_free(&handle);
+        if (q->stop)
+            return;
+    }
+    if (!mask)
+        return;
+    if (v->type == JSON_OBJECT)
+        for (o = v->object; o && !q->stop; o = o->next) {
+            f = 0;
+            if ((m = json_path_child(path, mask, o->key, o->key_len, 0, 0, &f)) | f)
+                json_path_walk(q, &o->value, m, f);
+        }
+    else if (v->type == JSON_ARRAY) {
+        json_value e;
+
+        /* the elements of a packed array are matched as copies */
+        for (i = 0; i < v->array_size && !q->stop; i++) {
+            f = 0;
+            if ((m = json_path_child(path, mask, NULL, 0, i, v->array_size, &f)) | f)
+                json_path_walk(q, json_array_at(v, i, &e), m, f);
+        }
+    }
+}
+
+size_t json_path_eval(const json_path *path, const json_value *v, json_path_callback callback, void *data)
+{
+    json_path_query q;
+
+    assert(path && v && callback);
+    q.path = path;
+    q.callback = callback;
+    q.data = data;
+    q.count = 0;
+    q.stop = 0;
+    q.owned = 0;
+    json_path_walk(&q, v, JSON_PATH_BIT(0), 0);
+    return q.count;
+}
+
+static int json_path_stream_value(json_context *c, json_path_query *q, uint64_t mask, uint64_t filters);
+
+static int json_path_stream_object(json_context *c, json_path_query *q, uint64_t mask)
+{
+    uint64_t child, filters;
+    size_t len;
+
+    assert(*c->json == '{');
+    c->json++;
+    json_parse_whitespace(c);
+    if (*c->json == '}') {
+        c->json++;
+        return JSON_PARSE_OK;
+    }
+    for (;;) {
+        if (*c->json != '\"' || json_decode_string(c, &len) == JSON_PARSE_ERROR)
+            return JSON_PARSE_ERROR;
+        filters = 0;
+        child = json_path_child(q->path, mask, c->stack + c->top - len, len, 0, 0, &filters);
+        c->top -= len;
+        json_parse_whitespace(c);
+        if (*c->json != ':')
+            return JSON_PARSE_ERROR;
+        c->json++;
+        json_parse_whitespace(c);
+        if (json_path_stream_value(c, q, child, filters) == JSON_PARSE_ERROR)
+            return JSON_PARSE_ERROR;
+        if (q->stop)
+            return JSON_PARSE_OK;
+        json_parse_whitespace(c);
+        if (*c->json == '}') {
+            c->json++;
+            return JSON_PARSE_OK;
+        }
+        if (*c->json != ',')
+            return JSON_PARSE_ERROR;
+        c->json++;
+        json_parse_whitespace(c);
+    }
+}
+
+static int json_path_stream_array(json_context *c, json_path_query *q, uint64_t mask)
+{
+    uint64_t child, filters;
+    size_t i;
+
+    assert(*c->json == '[');
+    c->json++;
+    json_parse_whitespace(c);
+    if (*c->json == ']') {
+        c->json++;
+        return JSON_PARSE_OK;
+    }
+    for (i = 0;; i++) {
+        filters = 0;
+        child = json_path_child(q->path, mask, NULL, 0, i, 0, &filters);
+        if (json_path_stream_value(c, q, child, filters) == JSON_PARSE_ERROR)
+            return JSON_PARSE_ERROR;
+        if (q->stop)
+            return JSON_PARSE_OK;
+        json_parse_whitespace(c);
+        if (*c->json == ']') {
+            c->json++;
+            return JSON_PARSE_OK;
+        }
+        if (*c->json != ',')
+            return JSON_PARSE_ERROR;
+        c->json++;
+        json_parse_whitespace(c);
+    }
+}
+
+static int json_path_stream_value(json_context *c, json_path_query *q, uint64_t mask, uint64_t filters)
+{
+    json_value v;
+    int ret;
+
+    if (!(mask | filters))
+        return json_skip_value(c);
+    if (filters || (mask & JSON_PATH_BIT(q->path->size)) || (*c->json == '[' && (mask & q->path->sized))) {
+        json_init(&v);
+        if ((ret = json_parse_value(c, &v)) == JSON_PARSE_OK)
+            json_path_walk(q, &v, mask, filters);
+        json_free(&v);
+        return ret;
+    }
+    if (*c->json == '{')
+        return json_path_stream_object(c, q, mask);
+    if (*c->json == '[')
+        return json_path_stream_array(c, q, mask);
+    return json_skip_value(c);
+}
+
+/*
+ * Evaluate 'path' over the text 'json' without building the document. Matches found before an
+ * error have been passed to 'callback', and the text after a stop is not read.
+ */
+int json_path_stream(const json_path *path, const char *json, json_path_callback callback, void *data)
+{
+    json_context c;
+    json_path_query q;
+    int ret;
+
+    assert(path && json && callback);
+    json_context_init(&c, json);
+    q.path = path;
+    q.callback = callback;
+    q.data = data;
+    q.count = 0;
+    q.stop = 0;
+    q.owned = 1;
+    json_parse_whitespace(&c);
+    if ((ret = json_path_stream_value(&c, &q, JSON_PATH_BIT(0), 0)) == JSON_PARSE_OK && !q.stop) {
+        json_parse_whitespace(&c);
+        if (*c.json != '\0')
+            ret = JSON_PARSE_ERROR;
+    }
+    json_context_free(&c);
+    return ret;
+}
+
+/* *********************************Struct****************************************** *
+ * json_parse_struct parses into a C struct described by a table of 'json_field', with no tree:
+ * 1). A key is matched in place, first against the field after the last one matched, since the
+ *     members of a message mostly come in one order, then by the table of the compiled schema.
+ * 2). The numbers of integer fields are read digit by digit, without strtod.
+ * 3). Strings are decoded one after another into the stack of the context, which is handed to the
+ *     caller as the one 'strings' buffer once it stops moving, then the string fields are set.
+ * 4). Unknown keys are skipped by json_skip_value, or fail with JSON_SCHEMA_STRICT.
+ */
+typedef struct {
+    const char *name;
+    size_t len;
+    int type;
+    size_t offset;
+    json_schema *schema;
+    /* the escaped key as jsonified, with the '{' or ", " before it */
+    char *prefix;
+    size_t prefix_len;
+} json_schema_field;
+
+struct json_schema {
+    size_t size;
+    json_schema_field *fields;
+    /* open addressing by the hash of the names, index + 1 of the field, 0 for none */
+    size_t *table;
+    size_t mask;
+    int flags;
+};
+
+typedef struct {
+    char **field;
+    /* the offset of the string in the stack */
+    size_t string;
+} json_struct_string;
+
+static const json_schema_field *json_schema_find(const json_schema *s, const char *key, size_t len)
+{
+    size_t h, i;
+
+    for (h = json_hash_string(key, len) & s->mask; (i = s->table[h]) != 0; h = (h + 1) & s->mask)
+        if (s->fields[i - 1].len == len && !memcmp(s->fields[i - 1].name, key, len))
+            return &s->fields[i - 1];
+    return NULL;
+}
+
+static char *json_schema_prefix(const char *name, size_t len, int first, size_t *prefix_len)
+{
+    json_context c;
+    json_value key;
+    char *prefix;
+
+    json_context_init(&c, NULL);
+    json_context_push(&c, first ? "{" : ", ", first ? 1 : 2);
+    key.type = JSON_STRING;
+    key.flags = 0;
+    key.string = (char *) name;
+    key.string_len = len;
+    /* names are UTF-8 */
+    if (json_jsonify_string(&c, &key) == JSON_JSONIFY_ERROR)
+        assert(0);
+    json_context_push(&c, ": ", 2);
+    *prefix_len = c.top;
+    prefix = (char *) malloc(c.top);
+    memcpy(prefix, c.stack, c.top);
+    json_context_free(&c);
+    return prefix;
+}
+
+/* The names in 'fields' are not copied */
+json_schema *json_schema_compile(const json_field *fields, int flags)
+{
+    json_schema *s;
+    json_schema_field *f;
+    size_t size, i, h;
+
+    assert(fields);
+    for (size = 0; fields[size].name; size++)
+        ;
+    s = (json_schema *) malloc(sizeof(json_schema));
+    s->size = size;
+    s->flags = flags;
+    s->fields = (json_schema_field *) malloc(sizeof(json_schema_field) * (size ? size : 1));
+    for (s->mask = 1; s->mask < size * 2; s->mask <<= 1)
+        ;
+    s->table = (size_t *) calloc(s->mask--, sizeof(size_t));
+    for (i = 0, f = s->fields; i < size; i++, f++) {
+        f->name = fields[i].name;
+        f->len = strlen(f->name);
+        f->type = fields[i].type;
+        f->offset = fields[i].offset;
+        f->schema = f->type == JSON_FIELD_OBJECT ? json_schema_compile(fields[i].fields, flags) : NULL;
+        f->prefix = json_schema_prefix(f->name, f->len, i == 0, &f->prefix_len);
+        /* each name once */
+        assert(!json_schema_find(s, f->name, f->len));
+        for (h = json_hash_string(f->name, f->len) & s->mask; s->table[h]; h = (h + 1) & s->mask)
+            ;
+        s->table[h] = i + 1;
+    }
+    return s;
+}
+
+void json_schema_free(json_schema *schema)
+{
+    size_t i;
+
+    if (schema) {
+        for (i = 0; i < schema->size; i++) {
+            json_schema_free(schema->fields[i].schema);
+            free(schema->fields[i].prefix);
+        }
+        free(schema->fields);
+        free(schema->table);
+        free(schema);
+    }
+}
+
+/* An integer, JSON_PARSE_ERROR if the number has a fraction or does not fit */
+/*
+ * An int64_t field takes a number only if it is an integer of int64_t, exactly: the significant
+ * digits times a power of ten are computed without a double, so 1.5e1 is taken and a fraction or
+ * a value past the limits is an error, however many digits it has.
+ */
+static int json_parse_integer(json_context *c, int64_t *i)
+{
+    const char *p, *end, *mantissa, *last = NULL;
+    int negative = *c->json == '-', fraction = 0;
+    uint64_t u = 0;
+    long exp = 0;
+
+    if (!(ISDIGIT(*c->json) || negative) || !(end = json_scan_number(c->json)))
+        return JSON_PARSE_ERROR;
+    for (p = c->json + negative; p < end && *p != 'e' && *p != 'E'; p++)
+        if (ISDIGIT(*p) && *p != '0')
+            last = p;
+    mantissa = p;
+    if (p < end) {
+        int sign = *++p == '-' ? -1 : 1;
+        for (p += *p == '-' || *p == '+'; p < end; p++)
+            if (exp < 100000)
+                exp = exp * 10 + (*p - '0');
+        exp *= sign;
+    }
+    /* u * 10^exp, u ends with the last nonzero digit */
+    for (p = c->json + negative; last && p < mantissa; p++) {
+        if (*p == '.')
+            fraction = 1;
+        else if (p <= last) {
+            if (u > (UINT64_MAX - (*p - '0')) / 10)
+                return JSON_PARSE_ERROR;
+            u = u * 10 + (*p - '0');
+            exp -= fraction;
+        } else
+            exp += !fraction;
+    }
+    if (last && exp < 0)
+        return JSON_PARSE_ERROR;
+    for (; last && exp > 0; exp--) {
+        if (u > UINT64_MAX / 10)
+            return JSON_PARSE_ERROR;
+        u *= 10;
+    }
+    if (u > (uint64_t) INT64_MAX + negative)
+        return JSON_PARSE_ERROR;
+    *i = !negative ? (int64_t) u : u == (uint64_t) INT64_MAX + 1 ? INT64_MIN : -(int64_t) u;
+    c->json = end;
+    return JSON_PARSE_OK;
+}
+
+static int json_parse_struct_object(json_context *c, json_context *strings, const json_schema *s, char *dst);
+
+/* A null leaves the field as it is */
+static int json_parse_field(json_context *c, json_context *strings, const json_schema_field *f, char *dst)
+{
+    json_struct_string string;
+    json_context value;
+    json_value n;
+    int64_t i;
+    size_t len;
+    int ret;
+
+    if (*c->json == 'n' && f->type != JSON_FIELD_VALUE)
+        return json_parse_null(c, &n);
+    switch (f->type) {
+    case JSON_FIELD_BOOL:
+        if (*c->json == 't' && json_parse_true(c, &n) == JSON_PARSE_OK)
+            *(int *) dst = 1;
+        else if (*c->json == 'f' && json_parse_false(c, &n) == JSON_PARSE_OK)
+            *(int *) dst = 0;
+        else
+            return JSON_PARSE_ERROR;
+        return JSON_PARSE_OK;
+    case JSON_FIELD_INT:
+        if (json_parse_integer(c, &i) == JSON_PARSE_ERROR || i < INT_MIN || i > INT_MAX)
+            return JSON_PARSE_ERROR;
+        *(int *) dst = (int) i;
+        return JSON_PARSE_OK;
+    case JSON_FIELD_INT64:
+        return json_parse_integer(c, (int64_t *) dst);
+    case JSON_FIELD_DOUBLE:
+        if (!(ISDIGIT(*c->json) || *c->json == '-') || json_parse_number(c, &n) == JSON_PARSE_ERROR)
+            return JSON_PARSE_ERROR;
+        *(double *) dst = n.number;
+        return JSON_PARSE_OK;
+    case JSON_FIELD_STRING:
+        string.string = c->top;
+        if (*c->json != '\"' || json_decode_string(c, &len) == JSON_PARSE_ERROR)
+            return JSON_PARSE_ERROR;
+        PUTC(c, '\0');
+        string.field = (char **) dst;
+        json_context_push(strings, &string, sizeof(string));
+        return JSON_PARSE_OK;
+    case JSON_FIELD_OBJECT:
+        return json_parse_struct_object(c, strings, f->schema, dst);
+    default:
+        /* the strings are not aligned for the values the parser stacks */
+        json_context_init(&value, c->json);
+        json_free((json_value *) dst);
+        json_init((json_value *) dst);
+        ret = json_parse_value(&value, (json_value *) dst);
+        c->json = value.json;
+        json_context_free(&value);
+        return ret;
+    }
+}
+
+static int json_parse_struct_object(json_context *c, json_context *strings, const json_schema *s, char *dst)
+{
+    const json_schema_field *f, *next = s->fields;
+    const char *key;
+    size_t len;
+    int ret;
+
+    if (*c->json != '{')
+        return JSON_PARSE_ERROR;
+    c->json++;
+    json_parse_whitespace(c);
+    if (*c->json == '}') {
+        c->json++;
+        return JSON_PARSE_OK;
+    }
+    for (;;) {
+        key = c->json;
+        if (*key != '\"' || json_skip_value(c) == JSON_PARSE_ERROR)
+            return JSON_PARSE_ERROR;
+        len = c->json - key - 2;
+        if (memchr(key + 1, '\\', len)) {
+            c->json = key;
+            if (json_decode_string(c, &len) == JSON_PARSE_ERROR)
+                return JSON_PARSE_ERROR;
+            f = json_schema_find(s, json_context_pop(c, len), len);
+        } else if (next < s->fields + s->size && next->len == len && !memcmp(next->name, key + 1, len))
+            f = next;
+        else
+            f = json_schema_find(s, key + 1, len);
+        json_parse_whitespace(c);
+        if (*c->json != ':')
+            return JSON_PARSE_ERROR;
+        c->json++;
+        json_parse_whitespace(c);
+        if (f) {
+            ret = json_parse_field(c, strings, f, dst + f->offset);
+            next = f + 1;
+        } else
+            ret = s->flags & JSON_SCHEMA_STRICT ? JSON_PARSE_ERROR : json_skip_value(c);
+        if (ret == JSON_PARSE_ERROR)
+            return JSON_PARSE_ERROR;
+        json_parse_whitespace(c);
+        if (*c->json == '}') {
+            c->json++;
+            return JSON_PARSE_OK;
+        }
+        if (*c->json != ',')
+            return JSON_PARSE_ERROR;
+        c->json++;
+        json_parse_whitespace(c);
+    }
+}
+
+/*
+ * Parse the object 'json' into the struct 'dst' described by 'schema'. Fields without a member
+ * are left as they are. The string fields point into '*strings', one buffer to free() when they
+ * are no longer used, and are only set on success; other fields may be set on failure.
+ */
+int json_parse_struct(void *dst, const char *json, const json_schema *schema, char **strings)
+{
+    json_context c, fixups;
+    json_struct_string *s;
+    int ret;
+
+    assert(dst && json && schema && strings);
+    json_context_init(&c, json);
+    json_context_init(&fixups, NULL);
+    json_parse_whitespace(&c);
+    if ((ret = json_parse_struct_object(&c, &fixups, schema, (char *) dst)) == JSON_PARSE_OK) {
+        json_parse_whitespace(&c);
+        if (*c.json != '\0')
+            ret = JSON_PARSE_ERROR;
+    }
+    if (ret == JSON_PARSE_OK) {
+        for (s = (json_struct_string *) fixups.stack; s < (json_struct_string *) (fixups.stack + fixups.top); s++)
+            *s->field = c.stack + s->string;
+        *strings = c.stack;
+        c.stack = NULL;
+    }
+    json_context_free(&c);
+    json_context_free(&fixups);
+    return ret;
+}
+
+static int json_jsonify_struct_object(json_context *c, const json_schema *s, const char *src, json_sink sink, void *data);
+
+static int json_jsonify_field(json_context *c, const json_schema_field *f, const char *src, json_sink sink, void *data)
+{
+    json_value v;
+
+    switch (f->type) {
+    case JSON_FIELD_BOOL:
+        if (*(const int *) src)
+            json_context_push(c, "true", 4);
+        else
+            json_context_push(c, "false", 5);
+        return JSON_JSONIFY_OK;
+    case JSON_FIELD_INT:
+        json_jsonify_integer(c, *(const int *) src);
+        return JSON_JSONIFY_OK;
+    case JSON_FIELD_INT64:
+        json_jsonify_integer(c, *(const int64_t *) src);
+        return JSON_JSONIFY_OK;
+    case JSON_FIELD_DOUBLE:
+        v.type = JSON_NUMBER;
+        v.flags = 0;
+        v.number = *(const double *) src;
+        return json_jsonify_number(c, &v);
+    case JSON_FIELD_STRING:
+        if (!*(char *const *) src) {
+            json_context_push(c, "null", 4);
+            return JSON_JSONIFY_OK;
+        }
+        v.type = JSON_STRING;
+        v.string = *(char *const *) src;
+        v.string_len = strlen(v.string);
+        return json_jsonify_string(c, &v);
+    case JSON_FIELD_OBJECT:
+        return json_jsonify_struct_object(c, f->schema, src, sink, data);
+    default:
+        return json_jsonify_value(c, (const json_value *) src);
+    }
+}
+
+/* With a 'sink', what is jsonified goes to it in chunks of about JSON_SINK_CHUNK between fields */
+#define JSON_SINK_CHUNK 4096
+
+static int json_jsonify_struct_object(json_context *c, const json_schema *s, const char *src, json_sink sink, void *data)
+{
+    const json_schema_field *f;
+
+    if (s->size == 0)
+        json_context_push(c, "{", 1);
+    for (f = s->fields; f < s->fields + s->size; f++) {
+        json_context_push(c, f->prefix, f->prefix_len);
+        if (json_jsonify_field(c, f, src + f->offset, sink, data) == JSON_JSONIFY_ERROR)
+            return JSON_JSONIFY_ERROR;
+        if (sink && c->top >= JSON_SINK_CHUNK) {
+            if (sink(data, c->stack, c->top))
+                return JSON_JSONIFY_ERROR;
+            c->top = 0;
+        }
+    }
+    PUTC(c, '}');
+    return JSON_JSONIFY_OK;
+}
+
+/* The struct 'src' described by 'schema' as a JSON object, like json_jsonify */
+char *json_jsonify_struct(const void *src, const json_schema *schema, size_t *len)
+{
+    json_context c;
+    char *json = NULL;
+
+    assert(src && schema);
+    json_context_init(&c, NULL);
+    if (json_jsonify_struct_object(&c, schema, (const char *) src, NULL, NULL) == JSON_JSONIFY_OK) {
+        PUTC(&c, '\0');
+        json = c.stack;
+        c.stack = NULL;
+    }
+    if (len)
+        *len = json ? c.top - 1 : 0;
+    json_context_free(&c);
+    return json;
+}
+
+/*
+ * Like json_jsonify_struct, passing the text to 'sink' in chunks, so the buffer stays small
+ * whatever the size of the struct. A non-zero return of 'sink' stops with JSON_JSONIFY_ERROR,
+ * as does an invalid string, after the text before it has been passed.
+ */
+int json_jsonify_struct_sink(const void *src, const json_schema *schema, json_sink sink, void *data)
+{
+    json_context c;
+    int ret;
+
+    assert(src && schema && sink);
+    json_context_init(&c, NULL);
+    if ((ret = json_jsonify_struct_object(&c, schema, (const char *) src, sink, data)) == JSON_JSONIFY_OK && sink(data, c.stack, c.top))
+        ret = JSON_JSONIFY_ERROR;
+    json_context_free(&c);
+    return ret;
+}
+
+/* *********************************Writer****************************************** *
+ * A 'json_writer' produces text call by call, without a tree: the values are written with the
+ * jsonify functions into 'out', which goes to the sink in chunks of about JSON_SINK_CHUNK if
+ * there is one. 'levels' has a byte of JSON_WRITER_* flags for each open container, checked by
+ * every call; the first misuse or invalid string puts the writer in error until it is reset.
+ */
+#define JSON_WRITER_OBJECT (1 << 0)
+#define JSON_WRITER_ARRAY (1 << 1)
+/* a value has been written in the container */
+#define JSON_WRITER_ITEMS (1 << 2)
+/* a key has been written, its value is next */
+#define JSON_WRITER_KEY (1 << 3)
+
+struct json_writer {
+    json_context out;
+    json_context levels;
+    json_sink sink;
+    void *data;
+    /* the value at the top has been started */
+    int started;
+    int error;
+};
+
+/* With a NULL 'sink' the text stays in the writer, see json_writer_get_text */
+json_writer *json_writer_new(json_sink sink, void *data)
+{
+    json_writer *w = (json_writer *) malloc(sizeof(json_writer));
+
+    json_context_init(&w->out, NULL);
+    json_context_init(&w->levels, NULL);
+    w->sink = sink;
+    w->data = data;
+    w->started = w->error = 0;
+    return w;
+}
+
+void json_writer_free(json_writer *w)
+{
+    if (w) {
+        json_context_free(&w->out);
+        json_context_free(&w->levels);
+        free(w);
+    }
+}
+
+/* Start a new document, keeping the buffers */
+void json_writer_reset(json_writer *w)
+{
+    assert(w);
+    w->out.top = w->levels.top = 0;
+    w->started = w->error = 0;
+}
+
+void json_writer_set_options(json_writer *w, const json_jsonify_options *options)
+{
+    assert(w);
+    w->out.flags = options ? options->flags : 0;
+}
+
+static int json_writer_fail(json_writer *w)
+{
+    w->error = 1;
+    return JSON_JSONIFY_ERROR;
+}
+
+static int json_writer_flush(json_writer *w, size_t chunk)
+{
+    if (w->sink && w->out.top >= chunk && w->out.top) {
+        if (w->sink(w->data, w->out.stack, w->out.top))
+            return json_writer_fail(w);
+        w->out.top = 0;
+    }
+    return JSON_JSONIFY_OK;
+}
+
+/* Check a value may come, and write the separator before it */
+static int json_writer_value_begin(json_writer *w)
+{
+    char *level;
+
+    if (w->error)
+        return JSON_JSONIFY_ERROR;
+    if (w->levels.top == 0) {
+        if (w->started)
+            return json_writer_fail(w);
+        w->started = 1;
+        return JSON_JSONIFY_OK;
+    }
+    level = &w->levels.stack[w->levels.top - 1];
+    if (*level & JSON_WRITER_OBJECT) {
+        if (!(*level & JSON_WRITER_KEY))
+            return json_writer_fail(w);
+        *level &= ~JSON_WRITER_KEY;
+    } else {
+        if (*level & JSON_WRITER_ITEMS)
+            json_context_push(&w->out, ", ", 2);
+        *level |= JSON_WRITER_ITEMS;
+    }
+    return JSON_JSONIFY_OK;
+}
+
+static int json_writer_value_end(json_writer *w, int ret)
+{
+    if (ret == JSON_JSONIFY_ERROR)
+        return json_writer_fail(w);
+    return json_writer_flush(w, JSON_SINK_CHUNK);
+}
+
+static int json_writer_begin(json_writer *w, int kind)
+{
+    char level = (char) kind;
+
+    if (json_writer_value_begin(w) == JSON_JSONIFY_ERROR)
+        return JSON_JSONIFY_ERROR;
+    PUTC(&w->out, kind == JSON_WRITER_OBJECT ? '{' : '[');
+    json_context_push(&w->levels, &level, 1);
+    return JSON_JSONIFY_OK;
+}
+
+static int json_writer_end(json_writer *w, int kind)
+{
+    char level;
+
+    if (w->error)
+        return JSON_JSONIFY_ERROR;
+    if (w->levels.top == 0 || ((level = w->levels.stack[w->levels.top - 1]) & (kind | JSON_WRITER_KEY)) != kind)
+        return json_writer_fail(w);
+    w->levels.top--;
+    PUTC(&w->out, kind == JSON_WRITER_OBJECT ? '}' : ']');
+    return json_writer_value_end(w, JSON_JSONIFY_OK);
+}
+
+int json_writer_begin_object(json_writer *w)
+{
+    assert(w);
+    return json_writer_begin(w, JSON_WRITER_OBJECT);
+}
+
+int json_writer_end_object(json_writer *w)
+{
+    assert(w);
+    return json_writer_end(w, JSON_WRITER_OBJECT);
+}
+
+int json_writer_begin_array(json_writer *w)
+{
+    assert(w);
+    return json_writer_begin(w, JSON_WRITER_ARRAY);
+}
+
+int json_writer_end_array(json_writer *w)
+{
+    assert(w);
+    return json_writer_end(w, JSON_WRITER_ARRAY);
+}
+
+int json_writer_key(json_writer *w, const char *key, size_t len)
+{
+    json_value v;
+    char *level;
+
+    assert(w && (key || len == 0));
+    if (w->error)
+        return JSON_JSONIFY_ERROR;
+    if (w->levels.top == 0 || (*(level = &w->levels.stack[w->levels.top - 1]) & (JSON_WRITER_OBJECT | JSON_WRITER_KEY)) != JSON_WRITER_OBJECT)
+        return json_writer_fail(w);
+    if (*level & JSON_WRITER_ITEMS)
+        json_context_push(&w->out, ", ", 2);
+    *level |= JSON_WRITER_ITEMS | JSON_WRITER_KEY;
+    v.type = JSON_STRING;
+    v.string = (char *) key;
+    v.string_len = len;
+    if (json_jsonify_string(&w->out, &v) == JSON_JSONIFY_ERROR)
+        return json_writer_fail(w);
+    json_context_push(&w->out, ": ", 2);
+    return JSON_JSONIFY_OK;
+}
+
+int json_writer_string(json_writer *w, const char *string, size_t len)
+{
+    json_value v;
+
+    assert(w && (string || len == 0));
+    if (json_writer_value_begin(w) == JSON_JSONIFY_ERROR)
+        return JSON_JSONIFY_ERROR;
+    v.type = JSON_STRING;
+    v.string = (char *) string;
+    v.string_len = len;
+    return json_writer_value_end(w, json_jsonify_string(&w->out, &v));
+}
+
+int json_writer_number(json_writer *w, double number)
+{
+    json_value v;
+
+    assert(w);
+    if (json_writer_value_begin(w) == JSON_JSONIFY_ERROR)
+        return JSON_JSONIFY_ERROR;
+    v.type = JSON_NUMBER;
+    v.flags = 0;
+    v.number = number;
+    return json_writer_value_end(w, json_jsonify_number(&w->out, &v));
+}
+
+int json_writer_bool(json_writer *w, int b)
+{
+    assert(w);
+    if (json_writer_value_begin(w) == JSON_JSONIFY_ERROR)
+        return JSON_JSONIFY_ERROR;
+    if (b)
+        json_context_push(&w->out, "true", 4);
+    else
+        json_context_push(&w->out, "false", 5);
+    return json_writer_value_end(w, JSON_JSONIFY_OK);
+}
+
+int json_writer_null(json_writer *w)
+{
+    assert(w);
+    if (json_writer_value_begin(w) == JSON_JSONIFY_ERROR)
+        return JSON_JSONIFY_ERROR;
+    json_context_push(&w->out, "null", 4);
+    return json_writer_value_end(w, JSON_JSONIFY_OK);
+}
+
+/* A tree as one value */
+int json_writer_value(json_writer *w, const json_value *v)
+{
+    assert(w && v);
+    if (json_writer_value_begin(w) == JSON_JSONIFY_ERROR)
+        return JSON_JSONIFY_ERROR;
+    return json_writer_value_end(w, json_jsonify_value(&w->out, v));
+}
+
+/* Check the text is one complete value, and pass the rest of it to the sink */
+int json_writer_finish(json_writer *w)
+{
+    assert(w);
+    if (w->error)
+        return JSON_JSONIFY_ERROR;
+    if (!w->started || w->levels.top)
+        return json_writer_fail(w);
+    return json_writer_flush(w, 0);
+}
+
+/* The text written without a sink, valid until the next call on 'w', NULL after an error */
+const char *json_writer_get_text(json_writer *w, size_t *len)
+{
+    assert(w && !w->sink);
+    if (w->error) {
+        if (len)
+            *len = 0;
+        return NULL;
+    }
+    PUTC(&w->out, '\0');
+    w->out.top--;
+    if (len)
+        *len = w->out.top;
+    return w->out.stack;
+}
+
+/* *********************************Format****************************************** *
+ * json_minify and json_prettify rewrite the whitespace of a text token by token, never building
+ * a tree: strings and numbers are checked with the grammar of json_parse and copied byte for
+ * byte, so escapes and the spelling of numbers are kept. 'levels' has the opening bracket of
+ * each open container; with a sink the output goes out every JSON_SINK_CHUNK, so the memory
+ * used is a chunk plus a byte per level of nesting, whatever the size of the text.
+ */
+typedef struct {
+    /* 'json' is the text to format, 'stack' the output */
+    json_context out;
+    json_context levels;
+    json_sink sink;
+    void *data;
+    /* spaces per level, -1 to minify */
+    long indent;
+} json_format;
+
+static void json_format_newline(json_format *f)
+{
+    static const char spaces[] = "                                ";
+    size_t n;
+
+    if (f->indent < 0)
+        return;
+    PUTC(&f->out, '\n');
+    for (n = f->levels.top * f->indent; n > sizeof(spaces) - 1; n -= sizeof(spaces) - 1)
+        json_context_push(&f->out, spaces, sizeof(spaces) - 1);
+    json_context_push(&f->out, spaces, n);
+}
+
+/* A scalar, or the opening bracket of a container, at 'p' */
+static const char *json_format_value(json_format *f, const char *p)
+{
+    const char *end;
+    char open;
+
+    switch (*p) {
+    case '{':
+    case '[':
+        open = *p;
+        for (p++; ISWHITESPACE(*p); p++)
+            ;
+        PUTC(&f->out, open);
+        /* '}' and ']' follow '{' and '[' by 2 in ASCII */
+        if (*p == open + 2) {
+            PUTC(&f->out, *p);
+            return p + 1;
+        }
+        json_context_push(&f->levels, &open, 1);
+        json_format_newline(f);
+        return p;
+    case '\"':
+        end = json_scan_string(p);
+        break;
+    case 't':
+        end = strncmp(p, "true", 4) ? NULL : p + 4;
+        break;
+    case 'f':
+        end = strncmp(p, "false", 5) ? NULL : p + 5;
+        break;
+    case 'n':
+        end = strncmp(p, "null", 4) ? NULL : p + 4;
+        break;
+    default:
+        end = ISDIGIT(*p) || *p == '-' ? json_scan_number(p) : NULL;
+    }
+    if (end)
+        json_context_push(&f->out, p, end - p);
+    return end;
+}
+
+static int json_format_text(json_format *f)
+{
+    const char *p = f->out.json;
+    char open;
+    size_t levels;
+
+    for (;;) {
+        while (ISWHITESPACE(*p))
+            p++;
+        levels = f->levels.top;
+        /* a key comes first in an object that has just been opened or continued */
+        if (levels && f->levels.stack[levels - 1] == '{') {
+            const char *key = p;
+            if (*p != '\"' || !(p = json_scan_string(p)))
+                return JSON_PARSE_ERROR;
+            json_context_push(&f->out, key, p - key);
+            while (ISWHITESPACE(*p))
+                p++;
+            if (*p++ != ':')
+                return JSON_PARSE_ERROR;
+            json_context_push(&f->out, ": ", f->indent < 0 ? 1 : 2);
+            while (ISWHITESPACE(*p))
+                p++;
+        }
+        if (!(p = json_format_value(f, p)))
+            return JSON_PARSE_ERROR;
+        if (f->levels.top > levels)
+            continue;
+        /* after a value: close the containers it ends, then a ',' or the end of the text */
+        for (;;) {
+            while (ISWHITESPACE(*p))
+                p++;
+            if (!f->levels.top)
+                return *p ? JSON_PARSE_ERROR : JSON_PARSE_OK;
+            open = f->levels.stack[f->levels.top - 1];
+            if (*p == ',') {
+                p++;
+                PUTC(&f->out, ',');
+                json_format_newline(f);
+                break;
+            }
+            if (*p != open + 2)
+                return JSON_PARSE_ERROR;
+            f->levels.top--;
+            json_format_newline(f);
+            PUTC(&f->out, *p++);
+        }
+        if (f->sink && f->out.top >= JSON_SINK_CHUNK) {
+            if (f->sink(f->data, f->out.stack, f->out.top))
+                return JSON_PARSE_ERROR;
+            f->out.top = 0;
+        }
+    }
+}
+
+static int json_format_sink(const char *json, long indent, json_sink sink, void *data)
+{
+    json_format f;
+    int ret;
+
+    assert(json && sink);
+    json_context_init(&f.out, json);
+    json_context_init(&f.levels, NULL);
+    f.sink = sink;
+    f.data = data;
+    f.indent = indent;
+    ret = json_format_text(&f);
+    if (ret == JSON_PARSE_OK && f.out.top && sink(data, f.out.stack, f.out.top))
+        ret = JSON_PARSE_ERROR;
+    json_context_free(&f.out);
+    json_context_free(&f.levels);
+    return ret;
+}
+
+static char *json_format_string(const char *json, long indent, size_t *len)
+{
+    json_format f;
+    char *text = NULL;
+
+    assert(json);
+    json_context_init(&f.out, json);
+    json_context_init(&f.levels, NULL);
+    f.sink = NULL;
+    f.indent = indent;
+    if (len)
+        *len = 0;
+    if (json_format_text(&f) == JSON_PARSE_OK) {
+        PUTC(&f.out, '\0');
+        if (len)
+            *len = f.out.top - 1;
+        text = f.out.stack;
+        f.out.stack = NULL;
+    }
+    json_context_free(&f.out);
+    json_context_free(&f.levels);
+    return text;
+}
+
+char *json_minify(const char *json, size_t *len)
+{
+    return json_format_string(json, -1, len);
+}
+
+char *json_prettify(const char *json, size_t indent, size_t *len)
+{
+    return json_format_string(json, (long) indent, len);
+}
+
+int json_minify_sink(const char *json, json_sink sink, void *data)
+{
+    return json_format_sink(json, -1, sink, data);
+}
+
+int json_prettify_sink(const char *json, size_t indent, json_sink sink, void *data)
+{
+    return json_format_sink(json, (long) indent, sink, data);
+}
+
+/* *********************************Binary****************************************** *
+ * CBOR (RFC 8949) and MessagePack convert to and from the tree with the same scaffolding:
+ * 1). Encoding writes into a context that goes to the sink in chunks of about JSON_SINK_CHUNK.
+ *     Exact integers and integral numbers below 2^63 are written as integers, the others as
+ *     the shortest float that keeps the value.
+ * 2). Decoding is bounded by the length of the input. Every string and container is prefixed
+ *     with its length, so strings are copied once and arrays are allocated at their final size,
+ *     with nothing buffered. Map keys must be strings, numbers must be finite, and the input
+ *     must hold exactly one value.
+ */
+typedef struct json_encoder json_encoder;
+typedef int (*json_encode_func)(json_encoder *e, const json_value *v);
+
+struct json_encoder {
+    json_context out;
+    json_sink sink;
+    void *data;
+};
+
+typedef struct {
+    const unsigned char *p, *end;
+} json_decoder;
+
+typedef int (*json_decode_func)(json_decoder *d, json_value *v);
+
+/* 'lead' followed by the low 'bytes' bytes of 'n' in big-endian */
+static void json_encoder_put(json_encoder *e, unsigned char lead, uint64_t n, size_t bytes)
+{
+    unsigned char s[9];
+    size_t i;
+
+    s[0] = lead;
+    for (i = bytes; i > 0; i--, n >>= 8)
+        s[i] = (unsigned char) n;
+    json_context_push(&e->out, s, bytes + 1);
+}
+
+static int json_encoder_flush(json_encoder *e)
+{
+    if (e->sink && e->out.top >= JSON_SINK_CHUNK) {
+        if (e->sink(e->data, e->out.stack, e->out.top))
+            return JSON_JSONIFY_ERROR;
+        e->out.top = 0;
+    }
+    return JSON_JSONIFY_OK;
+}
+
+/* 1 if the number goes out as the integer 'i', those above INT64_MAX are left to the caller */
+static int json_encoder_integer(const json_value *v, int64_t *i)
+{
+    if (v->flags & JSON_FLAG_INT64) {
+        *i = v->number_int64;
+        return 1;
+    }
+    if (v->number > -9223372036854775808.0 && v->number < 9223372036854775808.0 && v->number == (double) (int64_t) v->number &&
+        (v->number != 0 || !signbit(v->number))) {
+        *i = (int64_t) v->number;
+        return 1;
+    }
+    return 0;
+}
+
+static int json_encoder_float(json_encoder *e, double number, unsigned char lead32, unsigned char lead64)
+{
+    float f = (float) number;
+    uint32_t u32;
+    uint64_t u64;
+
+    if ((double) f == number) {
+        memcpy(&u32, &f, 4);
+        json_encoder_put(e, lead32, u32, 4);
+    } else {
+        memcpy(&u64, &number, 8);
+        json_encoder_put(e, lead64, u64, 8);
+    }
+    return JSON_JSONIFY_OK;
+}
+
+static char *json_encode(const json_value *v, size_t *len, json_encode_func encode)
+{
+    json_encoder e;
+
+    assert(v);
+    json_context_init(&e.out, NULL);
+    e.sink = NULL;
+    if (encode(&e, v) == JSON_JSONIFY_ERROR) {
+        free(e.out.stack);
+        return NULL;
+    }
+    if (len)
+        *len = e.out.top;
+    /* never NULL, even for nothing to hold */
+    PUTC(&e.out, '\0');
+    return e.out.stack;
+}
+
+static int json_encode_sink(const json_value *v, json_sink sink, void *data, json_encode_func encode)
+{
+    json_encoder e;
+    int ret;
+
+    assert(v && sink);
+    json_context_init(&e.out, NULL);
+    e.sink = sink;
+    e.data = data;
+    ret = encode(&e, v);
+    if (ret == JSON_JSONIFY_OK && e.out.top && sink(data, e.out.stack, e.out.top))
+        ret = JSON_JSONIFY_ERROR;
+    json_context_free(&e.out);
+    return ret;
+}
+
+/* The big-endian unsigned integer of 'bytes' bytes */
+static int json_decoder_uint(json_decoder *d, size_t bytes, uint64_t *n)
+{
+    if ((size_t) (d->end - d->p) < bytes)
+        return JSON_PARSE_ERROR;
+    for (*n = 0; bytes > 0; bytes--)
+        *n = (*n << 8) | *d->p++;
+    return JSON_PARSE_OK;
+}
+
+/* An IEEE 754 float of 2, 4 or 8 bytes */
+static int json_decoder_float(json_decoder *d, size_t bytes, json_value *v)
+{
+    uint64_t n;
+    float f;
+    uint32_t u32;
+
+    if (json_decoder_uint(d, bytes, &n) == JSON_PARSE_ERROR)
+        return JSON_PARSE_ERROR;
+    if (bytes == 2) {
+        unsigned exp = (n >> 10) & 0x1F, mant = n & 0x3FF;
+        v->number = exp == 0 ? ldexp(mant, -24) : exp == 31 ? HUGE_VAL : ldexp(mant + 1024, (int) exp - 25);
+        if (n & 0x8000)
+            v->number = -v->number;
+    } else if (bytes == 4) {
+        u32 = (uint32_t) n;
+        memcpy(&f, &u32, 4);
+        v->number = f;
+    } else
+        memcpy(&v->number, &n, 8);
+    if (!isfinite(v->number))
+        return JSON_PARSE_ERROR;
+    v->type = JSON_NUMBER;
+    return JSON_PARSE_OK;
+}
+
+static int json_decoder_string(json_decoder *d, json_value *v, uint64_t len)
+{
+    if ((uint64_t) (d->end - d->p) < len)
+        return JSON_PARSE_ERROR;
+    json_set_string(v, (const char *) d->p, (size_t) len);
+    d->p += len;
+    return JSON_PARSE_OK;
+}
+
+static int json_decoder_array(json_decoder *d, json_value *v, uint64_t size, json_decode_func decode)
+{
+    size_t i;
+
+    /* every element takes a byte at least */
+    if ((uint64_t) (d->end - d->p) < size)
+        return JSON_PARSE_ERROR;
+    v->type = JSON_ARRAY;
+    v->flags = 0;
+    v->array_size = 0;
+    v->array_capacity = (size_t) size;
+    v->array = size ? (json_value *) malloc(sizeof(json_value) * v->array_capacity) : NULL;
+    for (i = 0; i < size; i++) {
+        json_init(&v->array[i]);
+        if (decode(d, &v->array[i]) == JSON_PARSE_ERROR) {
+            json_free(v);
+            return JSON_PARSE_ERROR;
+        }
+        v->array_size++;
+    }
+    return JSON_PARSE_OK;
+}
+
+static int json_decoder_object(json_decoder *d, json_value *v, uint64_t size, json_decode_func decode)
+{
+    json_object **tail = &v->object, *o;
+    json_value key;
+    size_t i;
+
+    if ((uint64_t) (d->end - d->p) / 2 < size)
+        return JSON_PARSE_ERROR;
+    v->type = JSON_OBJECT;
+    v->flags = 0;
+    v->object_size = 0;
+    v->object = NULL;
+    v->object_index = NULL;
+    for (i = 0; i < size; i++) {
+        json_init(&key);
+        if (decode(d, &key) == JSON_PARSE_ERROR || key.type != JSON_STRING) {
+            json_free(&key);
+            json_free(v);
+            return JSON_PARSE_ERROR;
+        }
+        o = (json_object *) malloc(sizeof(json_object));
+        o->key = key.string;
+        o->key_len = key.string_len;
+        json_init(&o->value);
+        o->next = NULL;
+        *tail = o;
+        tail = &o->next;
+        v->object_size++;
+        if (decode(d, &o->value) == JSON_PARSE_ERROR) {
+            json_free(v);
+            return JSON_PARSE_ERROR;
+        }
+    }
+    return JSON_PARSE_OK;
+}
+
+static int json_decode(json_value *v, const void *data, size_t len, json_decode_func decode)
+{
+    json_decoder d;
+
+    assert(v && (data || !len));
+    d.p = (const unsigned char *) data;
+    d.end = d.p + len;
+    json_init(v);
+    if (decode(&d, v) == JSON_PARSE_ERROR)
+        return JSON_PARSE_ERROR;
+    if (d.p != d.end) {
+        json_free(v);
+        return JSON_PARSE_ERROR;
+    }
+    return JSON_PARSE_OK;
+}
+
+/* CBOR: a head is the major type in the high 3 bits, and the argument in the low 5 bits or after */
+#define JSON_CBOR_UINT 0
+#define JSON_CBOR_NEGINT 1
+#define JSON_CBOR_TEXT 3
+#define JSON_CBOR_ARRAY 4
+#define JSON_CBOR_MAP 5
+#define JSON_CBOR_TAG 6
+#define JSON_CBOR_SIMPLE 7
+
+static void json_cbor_head(json_encoder *e, unsigned major, uint64_t n)
+{
+    major <<= 5;
+    if (n < 24)
+        PUTC(&e->out, (char) (major | n));
+    else if (n <= 0xFF)
+        json_encoder_put(e, (unsigned char) (major | 24), n, 1);
+    else if (n <= 0xFFFF)
+        json_encoder_put(e, (unsigned char) (major | 25), n, 2);
+    else if (n <= 0xFFFFFFFF)
+        json_encoder_put(e, (unsigned char) (major | 26), n, 4);
+    else
+        json_encoder_put(e, (unsigned char) (major | 27), n, 8);
+}
+
+static int json_cbor_encode(json_encoder *e, const json_value *v)
+{
+    const json_object *o;
+    json_value n;
+    int64_t i;
+    size_t k;
+
+    v = JSON_RESOLVE(v);
+    JSON_DECODE(v);
+    switch (v->type) {
+    case JSON_NULL:
+        PUTC(&e->out, (char) 0xF6);
+        break;
+    case JSON_FALSE:
+        PUTC(&e->out, (char) 0xF4);
+        break;
+    case JSON_TRUE:
+        PUTC(&e->out, (char) 0xF5);
+        break;
+    case JSON_NUMBER:
+        if (v->flags & JSON_FLAG_UINT64)
+            json_cbor_head(e, JSON_CBOR_UINT, v->number_uint64);
+        else if (!json_encoder_integer(v, &i))
+            return json_encoder_float(e, v->number, 0xFA, 0xFB);
+        else if (i >= 0)
+            json_cbor_head(e, JSON_CBOR_UINT, (uint64_t) i);
+        else
+            json_cbor_head(e, JSON_CBOR_NEGINT, (uint64_t) (-1 - i));
+        break;
+    case JSON_STRING:
+        json_cbor_head(e, JSON_CBOR_TEXT, v->string_len);
+        json_context_push(&e->out, v->string, v->string_len);
+        break;
+    case JSON_ARRAY:
+        json_cbor_head(e, JSON_CBOR_ARRAY, v->array_size);
+        for (k = 0; k < v->array_size; k++)
+            if (json_cbor_encode(e, json_array_at(v, k, &n)) == JSON_JSONIFY_ERROR)
+                return JSON_JSONIFY_ERROR;
+        break;
+    case JSON_OBJECT:
+        json_cbor_head(e, JSON_CBOR_MAP, v->object_size);
+        for (o = v->object; o; o = o->next) {
+            json_cbor_head(e, JSON_CBOR_TEXT, o->key_len);
+            json_context_push(&e->out, o->key, o->key_len);
+            if (json_cbor_encode(e, &o->value) == JSON_JSONIFY_ERROR)
+                return JSON_JSONIFY_ERROR;
+        }
+        break;
+    }
+    return json_encoder_flush(e);
+}
+
+static int json_cbor_decode(json_decoder *d, json_value *v)
+{
+    unsigned major, info;
+    uint64_t n;
+
+    /* a tagged value stands for itself, the tags before it are skipped without recursion */
+    do {
+        if (d->p == d->end)
+            return JSON_PARSE_ERROR;
+        major = *d->p >> 5;
+        info = *d->p++ & 0x1F;
+        if (major == JSON_CBOR_SIMPLE) {
+            switch (info) {
+            case 20:
+                v->type = JSON_FALSE;
+                return JSON_PARSE_OK;
+            case 21:
+                v->type = JSON_TRUE;
+                return JSON_PARSE_OK;
+            case 22:
+                v->type = JSON_NULL;
+                return JSON_PARSE_OK;
+            case 25:
+            case 26:
+            case 27:
+                return json_decoder_float(d, (size_t) 1 << (info - 24), v);
+            default:
+                return JSON_PARSE_ERROR;
+            }
+        }
+        /* indefinite lengths (31) are not supported */
+        if (info < 24)
+            n = info;
+        else if (info > 27 || json_decoder_uint(d, (size_t) 1 << (info - 24), &n) == JSON_PARSE_ERROR)
+            return JSON_PARSE_ERROR;
+    } while (major == JSON_CBOR_TAG);
+    switch (major) {
+    case JSON_CBOR_UINT:
+        json_set_uint64(v, n);
+        return JSON_PARSE_OK;
+    case JSON_CBOR_NEGINT:
+        if (n <= INT64_MAX)
+            json_set_int64(v, -1 - (int64_t) n);
+        else
+            json_set_number(v, -1 - (double) n);
+        return JSON_PARSE_OK;
+    case JSON_CBOR_TEXT:
+        return json_decoder_string(d, v, n);
+    case JSON_CBOR_ARRAY:
+        return json_decoder_array(d, v, n, json_cbor_decode);
+    case JSON_CBOR_MAP:
+        return json_decoder_object(d, v, n, json_cbor_decode);
+    default:
+        /* byte strings */
+        return JSON_PARSE_ERROR;
+    }
+}
+
+char *json_to_cbor(const json_value *v, size_t *len)
+{
+    return json_encode(v, len, json_cbor_encode);
+}
+
+int json_to_cbor_sink(const json_value *v, json_sink sink, void *data)
+{
+    return json_encode_sink(v, sink, data, json_cbor_encode);
+}
+
+int json_from_cbor(json_value *v, const void *cbor, size_t len)
+{
+    return json_decode(v, cbor, len, json_cbor_decode);
+}
+
+/* MessagePack: the smallest of the fix and sized forms of each type, lengths stop at 32 bits */
+static int json_msgpack_head(json_encoder *e, unsigned fix, unsigned fix_max, unsigned char lead, uint64_t n)
+{
+    if (n > 0xFFFFFFFF)
+        return JSON_JSONIFY_ERROR;
+    if (n <= fix_max)
+        PUTC(&e->out, (char) (fix | n));
+    else if (lead == 0xD9 && n <= 0xFF)
+        json_encoder_put(e, lead, n, 1);
+    else if (n <= 0xFFFF)
+        json_encoder_put(e, (unsigned char) (lead + (lead == 0xD9)), n, 2);
+    else
+        json_encoder_put(e, (unsigned char) (lead + (lead == 0xD9) + 1), n, 4);
+    return JSON_JSONIFY_OK;
+}
+
+static int json_msgpack_encode(json_encoder *e, const json_value *v)
+{
+    const json_object *o;
+    json_value n;
+    int64_t i;
+    size_t k;
+
+    v = JSON_RESOLVE(v);
+    JSON_DECODE(v);
+    switch (v->type) {
+    case JSON_NULL:
+        PUTC(&e->out, (char) 0xC0);
+        break;
+    case JSON_FALSE:
+        PUTC(&e->out, (char) 0xC2);
+        break;
+    case JSON_TRUE:
+        PUTC(&e->out, (char) 0xC3);
+        break;
+    case JSON_NUMBER:
+        if (v->flags & JSON_FLAG_UINT64)
+            json_encoder_put(e, 0xCF, v->number_uint64, 8);
+        else if (!json_encoder_integer(v, &i))
+            return json_encoder_float(e, v->number, 0xCA, 0xCB);
+        else if (i >= -32 && i <= 0x7F)
+            PUTC(&e->out, (char) i);
+        else if (i > 0)
+            json_encoder_put(e, i <= 0xFF ? 0xCC : i <= 0xFFFF ? 0xCD : i <= 0xFFFFFFFF ? 0xCE : 0xCF, (uint64_t) i,
+                             i <= 0xFF ? 1 : i <= 0xFFFF ? 2 : i <= 0xFFFFFFFF ? 4 : 8);
+        else
+            json_encoder_put(e, i >= -0x80 ? 0xD0 : i >= -0x8000 ? 0xD1 : i >= -0x80000000LL ? 0xD2 : 0xD3, (uint64_t) i,
+                             i >= -0x80 ? 1 : i >= -0x8000 ? 2 : i >= -0x80000000LL ? 4 : 8);
+        break;
+    case JSON_STRING:
+        /* str8 0xD9, str16 0xDA, str32 0xDB */
+        if (json_msgpack_head(e, 0xA0, 31, 0xD9, v->string_len) == JSON_JSONIFY_ERROR)
+            return JSON_JSONIFY_ERROR;
+        json_context_push(&e->out, v->string, v->string_len);
+        break;
+    case JSON_ARRAY:
+        /* array16 0xDC, array32 0xDD */
+        if (json_msgpack_head(e, 0x90, 15, 0xDC, v->array_size) == JSON_JSONIFY_ERROR)
+            return JSON_JSONIFY_ERROR;
+        for (k = 0; k < v->array_size; k++)
+            if (json_msgpack_encode(e, json_array_at(v, k, &n)) == JSON_JSONIFY_ERROR)
+                return JSON_JSONIFY_ERROR;
+        break;
+    case JSON_OBJECT:
+        /* map16 0xDE, map32 0xDF */
+        if (json_msgpack_head(e, 0x80, 15, 0xDE, v->object_size) == JSON_JSONIFY_ERROR)
+            return JSON_JSONIFY_ERROR;
+        for (o = v->object; o; o = o->next) {
+            if (json_msgpack_head(e, 0xA0, 31, 0xD9, o->key_len) == JSON_JSONIFY_ERROR)
+                return JSON_JSONIFY_ERROR;
+            json_context_push(&e->out, o->key, o->key_len);
+            if (json_msgpack_encode(e, &o->value) == JSON_JSONIFY_ERROR)
+                return JSON_JSONIFY_ERROR;
+        }
+        break;
+    }
+    return json_encoder_flush(e);
+}
+
+static int json_msgpack_decode(json_decoder *d, json_value *v)
+{
+    unsigned char lead;
+    uint64_t n;
+
+    if (d->p == d->end)
+        return JSON_PARSE_ERROR;
+    lead = *d->p++;
+    if (lead <= 0x7F || lead >= 0xE0) {
+        json_set_int64(v, (signed char) lead);
+        return JSON_PARSE_OK;
+    }
+    if (lead <= 0x8F)
+        return json_decoder_object(d, v, lead & 0x0F, json_msgpack_decode);
+    if (lead <= 0x9F)
+        return json_decoder_array(d, v, lead & 0x0F, json_msgpack_decode);
+    if (lead <= 0xBF)
+        return json_decoder_string(d, v, lead & 0x1F);
+    switch (lead) {
+    case 0xC0:
+        v->type = JSON_NULL;
+        return JSON_PARSE_OK;
+    case 0xC2:
+        v->type = JSON_FALSE;
+        return JSON_PARSE_OK;
+    case 0xC3:
+        v->type = JSON_TRUE;
+        return JSON_PARSE_OK;
+    case 0xCA:
+        return json_decoder_float(d, 4, v);
+    case 0xCB:
+        return json_decoder_float(d, 8, v);
+    case 0xCC:
+    case 0xCD:
+    case 0xCE:
+    case 0xCF:
+        if (json_decoder_uint(d, (size_t) 1 << (lead - 0xCC), &n) == JSON_PARSE_ERROR)
+            return JSON_PARSE_ERROR;
+        json_set_uint64(v, n);
+        return JSON_PARSE_OK;
+    case 0xD0:
+    case 0xD1:
+    case 0xD2:
+    case 0xD3:
+        if (json_decoder_uint(d, (size_t) 1 << (lead - 0xD0), &n) == JSON_PARSE_ERROR)
+            return JSON_PARSE_ERROR;
+        /* sign-extend from the top bit read */
+        if (lead != 0xD3 && (n >> ((8 << (lead - 0xD0)) - 1)))
+            n |= ~(uint64_t) 0 << (8 << (lead - 0xD0));
+        json_set_int64(v, (int64_t) n);
+        return JSON_PARSE_OK;
+    case 0xD9:
+    case 0xDA:
+    case 0xDB:
+        if (json_decoder_uint(d, (size_t) 1 << (lead - 0xD9), &n) == JSON_PARSE_ERROR)
+            return JSON_PARSE_ERROR;
+        return json_decoder_string(d, v, n);
+    case 0xDC:
+    case 0xDD:
+        if (json_decoder_uint(d, (size_t) 2 << (lead - 0xDC), &n) == JSON_PARSE_ERROR)
+            return JSON_PARSE_ERROR;
+        return json_decoder_array(d, v, n, json_msgpack_decode);
+    case 0xDE:
+    case 0xDF:
+        if (json_decoder_uint(d, (size_t) 2 << (lead - 0xDE), &n) == JSON_PARSE_ERROR)
+            return JSON_PARSE_ERROR;
+        return json_decoder_object(d, v, n, json_msgpack_decode);
+    default:
+        /* bin, ext and the unused 0xC1 */
+        return JSON_PARSE_ERROR;
+    }
+}
+
+char *json_to_msgpack(const json_value *v, size_t *len)
+{
+    return json_encode(v, len, json_msgpack_encode);
+}
+
+int json_to_msgpack_sink(const json_value *v, json_sink sink, void *data)
+{
+    return json_encode_sink(v, sink, data, json_msgpack_encode);
+}
+
+int json_from_msgpack(json_value *v, const void *msgpack, size_t len)
+{
+    return json_decode(v, msgpack, len, json_msgpack_decode);
+}
+
+/* *********************************Compact***************************************** *
+ * json_compact relocates a tree into one block laid out in depth first order: the root, then the
+ * elements of each array and the members of each object, each block before the blocks of its
+ * children, and at the end all strings and keys. Every value in the block is flagged
+ * JSON_FLAG_COMPACT, so json_free leaves it alone and the whole tree is freed by free(root).
+ */
+static void json_compact_measure(const json_value *v, size_t *values, size_t *chars)
+{
+    size_t i;
+    json_object *o;
+
+    v = JSON_RESOLVE(v);
+    JSON_DECODE(v);
+    switch (v->type) {
+    case JSON_STRING:
+        *chars += v->string_len + 1;
+        break;
+    case JSON_ARRAY:
+        *values += sizeof(json_value) * v->array_size;
+        if (!(v->flags & JSON_FLAG_PACKED))
+            for (i = 0; i < v->array_size; i++)
+                json_compact_measure(&v->array[i], values, chars);
+        break;
+    case JSON_OBJECT:
+        *values += sizeof(json_object) * v->object_size;
+        for (o = v->object; o; o = o->next) {
+            *chars += o->key_len + 1;
+            json_compact_measure(&o->value, values, chars);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static void json_compact_copy(json_value *dst, const json_value *src, char **values, char **chars)
+{
+    size_t i;
+    json_object *o;
+    json_value n;
+
+    src = JSON_RESOLVE(src);
+    JSON_DECODE(src);
+    dst->type = src->type;
+    dst->flags = JSON_FLAG_COMPACT;
+    switch (src->type) {
+    case JSON_STRING:
+        dst->string = *chars;
+        dst->string_len = src->string_len;
+        memcpy(dst->string, src->string, src->string_len + 1);
+        *chars += src->string_len + 1;
+        break;
+    case JSON_NUMBER:
+        dst->flags |= src->flags & JSON_FLAG_INTEGER;
+        dst->number = src->number;
+        if (src->flags & JSON_FLAG_INTEGER)
+            dst->number_uint64 = src->number_uint64;
+        break;
+    case JSON_ARRAY:
+        dst->array = src->array_size ? (json_value *) *values : NULL;
+        dst->array_size = dst->array_capacity = src->array_size;
+        *values += sizeof(json_value) * src->array_size;
+        /* unpacked, the elements of a compacted tree cannot be allocated later */
+        for (i = 0; i < src->array_size; i++)
+            json_compact_copy(&dst->array[i], json_array_at(src, i, &n), values, chars);
+        break;
+    case JSON_OBJECT:
+        /* jsonify walks the members until NULL */
+        dst->object = src->object_size ? (json_object *) *values : NULL;
+        dst->object_size = src->object_size;
+        dst->object_index = NULL;
+        *values += sizeof(json_object) * src->object_size;
+        for (i = 0, o = src->object; o; i++, o = o->next) {
+            json_object *m = &dst->object[i];
+            m->key = *chars;
+            m->key_len = o->key_len;
+            memcpy(m->key, o->key, o->key_len + 1);
+            *chars += o->key_len + 1;
+            m->next = o->next ? m + 1 : NULL;
+            json_compact_copy(&m->value, &o->value, values, chars);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+json_value *json_compact(json_value *v)
+{
+    size_t values = sizeof(json_value), chars = 0;
+    char *block, *pv, *pc;
+
+    assert(v);
+    json_compact_measure(v, &values, &chars);
+    block = (char *) malloc(values + chars);
+    pv = block + sizeof(json_value);
+    pc = block + values;
+    json_compact_copy((json_value *) block, v, &pv, &pc);
+    assert(pv == block + values && pc == block + values + chars);
+    json_free(v);
+    return (json_value *) block;
+}
+
+/* *********************************Columns***************************************** *
+ * json_shred turns an array of records into one json_column per path, a JSON pointer applied to
+ * each row. A column takes the type of the first value found and has a slot for every row: the
+ * numbers in one double[], the strings one after another in 'strings' delimited by 'offsets', the
+ * booleans in a bitmap. Missing fields, nulls and values of another type leave the slot zeroed,
+ * or an empty string, with the 'valid' bit clear, so a scan is a loop over plain arrays.
+ */
+#define JSON_COLUMN_WORDS(size) (((size) + 63) >> 6)
+
+/* The JSON_COLUMN_* a value belongs to, -1 for arrays and objects */
+static int json_column_type(const json_value *v)
+{
+    switch (v->type) {
+    case JSON_NUMBER:
+        return JSON_COLUMN_NUMBER;
+    case JSON_STRING:
+        return JSON_COLUMN_STRING;
+    case JSON_TRUE:
+    case JSON_FALSE:
+        return JSON_COLUMN_BOOL;
+    case JSON_NULL:
+        return JSON_COLUMN_NULL;
+    default:
+        return -1;
+    }
+}
+
+static void json_column_set_type(json_column *column, int type)
+{
+    column->type = type;
+    if (type == JSON_COLUMN_NUMBER)
+        column->numbers = (double *) calloc(column->size + 1, sizeof(double));
+    else if (type == JSON_COLUMN_STRING)
+        column->offsets = (size_t *) calloc(column->size + 1, sizeof(size_t));
+    else
+        column->bools = (uint64_t *) calloc(JSON_COLUMN_WORDS(column->size) + 1, sizeof(uint64_t));
+}
+
+/* Store row i of 'column', 'strings' collects the string column */
+static void json_column_put(json_column *column, json_context *strings, size_t i, const json_value *v)
+{
+    int type = JSON_COLUMN_NULL;
+
+    if (v) {
+        v = JSON_RESOLVE(v);
+        JSON_DECODE(v);
+        type = json_column_type(v);
+    }
+    if (type != JSON_COLUMN_NULL) {
+        if (column->type == JSON_COLUMN_NULL && type > 0)
+            json_column_set_type(column, type);
+        if (type != column->type)
+            column->mismatched++;
+        else {
+            column->valid[i >> 6] |= (uint64_t) 1 << (i & 63);
+            if (type == JSON_COLUMN_NUMBER)
+                column->numbers[i] = v->number;
+            else if (type == JSON_COLUMN_STRING)
+                json_context_push(strings, v->string, v->string_len);
+            else if (v->type == JSON_TRUE)
+                column->bools[i >> 6] |= (uint64_t) 1 << (i & 63);
+        }
+    }
+    if (column->type == JSON_COLUMN_STRING)
+        column->offsets[i + 1] = strings->top;
+}
+
+int json_shred(json_column *columns, const json_value *v, const char *const *paths, size_t n)
+{
+    json_pointer **pointers;
+    json_context *strings;
+    json_value e, field;
+    const json_value *row;
+    size_t i, k;
+
+    assert(columns && v && (paths || !n));
+    v = JSON_RESOLVE(v);
+    if (v->type != JSON_ARRAY)
+        return JSON_SHRED_ERROR;
+    pointers = (json_pointer **) malloc(sizeof(json_pointer *) * (n + 1));
+    for (k = 0; k < n; k++)
+        if (!(pointers[k] = json_pointer_compile(paths[k]))) {
+            while (k--)
+                json_pointer_free(pointers[k]);
+            free(pointers);
+            return JSON_SHRED_ERROR;
+        }
+    strings = (json_context *) malloc(sizeof(json_context) * (n + 1));
+    for (k = 0; k < n; k++) {
+        memset(&columns[k], 0, sizeof(json_column));
+        columns[k].size = v->array_size;
+        columns[k].valid = (uint64_t *) calloc(JSON_COLUMN_WORDS(v->array_size) + 1, sizeof(uint64_t));
+        json_context_init(&strings[k], NULL);
+    }
+    /* row by row, the members of a record are read while they are in cache */
+    for (i = 0; i < v->array_size; i++) {
+        row = json_array_at(v, i, &e);
+        for (k = 0; k < n; k++)
+            json_column_put(&columns[k], &strings[k], i, json_pointer_get(row, pointers[k], &field));
+    }
+    for (k = 0; k < n; k++) {
+        json_pointer_free(pointers[k]);
+        if (columns[k].type == JSON_COLUMN_STRING)
+            columns[k].strings = strings[k].stack ? strings[k].stack : (char *) calloc(1, 1);
+        else
+            json_context_free(&strings[k]);
+    }
+    free(pointers);
+    free(strings);
+    return JSON_SHRED_OK;
+}
+
+void json_column_free(json_column *column)
+{
+    assert(column);
+    free(column->valid);
+    free(column->numbers);
+    free(column->offsets);
+    free(column->strings);
+    free(column->bools);
+    memset(column, 0, sizeof(json_column));
+}
+
+/* **********************************Tape******************************************* *
+ * A 'json_tape' is a read-only document stored in two buffers: 'tape', 64-bit words in document
+ * order, and 'strings', the decoded strings each followed by '\0'. The high 8 bits of a word are
+ * the type and the low 56 bits the payload:
+ *   1). null, true, false: one word.
+ *   2). number: one word, then the bits of the double, or of the integer if the payload is
+ *       JSON_FLAG_INT64 or JSON_FLAG_UINT64, so that integers past 2^53 stay exact.
+ *   3). string: the offset in 'strings', then the length.
+ *   4). array, object: the index after the last word of the container, so that it can be skipped
+ *       at once, then the count. A member of an object is a key string followed by the value.
+ * The root is at index 0, so 0 never refers to an element and stands for "not found".
+ */
+#define JSON_TAPE_WORD(type, payload) (((uint64_t) (type) << 56) | (uint64_t) (payload))
+#define JSON_TAPE_TYPE(w) ((int) ((w) >> 56))
+#define JSON_TAPE_PAYLOAD(w) ((size_t) ((w) & 0x00FFFFFFFFFFFFFFULL))
+#define JSON_TAPE_AT(t, i) (((uint64_t *) (t)->stack)[i])
+
+/* how json_tape_free releases the 'snapshot' of a tape */
+#define JSON_TAPE_RELEASE_NONE 0
+#define JSON_TAPE_RELEASE_FREE 1
+#define JSON_TAPE_RELEASE_UNMAP 2
+
+static void json_tape_push(json_context *t, uint64_t w)
+{
+    json_context_push(t, &w, sizeof(uint64_t));
+}
+
+/* The strings are decoded straight onto the stack of 'c', which becomes the string buffer */
+static int json_tape_parse_string(json_context *c, json_context *t)
+{
+    size_t offset = c->top, len;
+
+    if (json_decode_string(c, &len) == JSON_PARSE_ERROR)
+        return JSON_PARSE_ERROR;
+    PUTC(c, '\0');
+    json_tape_push(t, JSON_TAPE_WORD(JSON_STRING, offset));
+    json_tape_push(t, len);
+    return JSON_PARSE_OK;
+}
+
+static int json_tape_parse_value(json_context *c, json_context *t);
+
+static int json_tape_parse_container(json_context *c, json_context *t)
+{
+    size_t head = t->top / sizeof(uint64_t), size = 0;
+    int type = *c->json == '[' ? JSON_ARRAY : JSON_OBJECT;
+    char close = type == JSON_ARRAY ? ']' : '}';
+
+    json_tape_push(t, 0);
+    json_tape_push(t, 0);
+    c->json++;
+    json_parse_whitespace(c);
+    if (*c->json != close)
+        for (;;) {
+            if (type == JSON_OBJECT) {
+                if (*c->json != '\"' || json_tape_parse_string(c, t) == JSON_PARSE_ERROR)
+                    return JSON_PARSE_ERROR;
+                json_parse_whitespace(c);
+                if (*c->json++ != ':')
+                    return JSON_PARSE_ERROR;
+                json_parse_whitespace(c);
+            }
+            if (json_tape_parse_value(c, t) == JSON_PARSE_ERROR)
+                return JSON_PARSE_ERROR;
+            size++;
+            json_parse_whitespace(c);
+            if (*c->json == close)
+                break;
+            if (*c->json != ',')
+                return JSON_PARSE_ERROR;
+            c->json++;
+            json_parse_whitespace(c);
+        }
+    c->json++;
+    JSON_TAPE_AT(t, head) = JSON_TAPE_WORD(type, t->top / sizeof(uint64_t));
+    JSON_TAPE_AT(t, head + 1) = size;
+    return JSON_PARSE_OK;
+}
+
+static int json_tape_parse_value(json_context *c, json_context *t)
+{
+    json_value v;
+    uint64_t bits;
+
+    switch (*c->json) {
+    case '{':
+    case '[':
+        return json_tape_parse_container(c, t);
+    case '\"':
+        return json_tape_parse_string(c, t);
+    default:
+        /* literals and numbers allocate nothing */
+        if (json_parse_value(c, &v) == JSON_PARSE_ERROR)
+            return JSON_PARSE_ERROR;
+        json_tape_push(t, JSON_TAPE_WORD(v.type, v.type == JSON_NUMBER ? v.flags & JSON_FLAG_INTEGER : 0));
+        if (v.type == JSON_NUMBER) {
+            if (v.flags & JSON_FLAG_INTEGER)
+                bits = v.flags & JSON_FLAG_INT64 ? (uint64_t) v.number_int64 : v.number_uint64;
+            else
+                memcpy(&bits, &v.number, sizeof(double));
+            json_tape_push(t, bits);
+        }
+        return JSON_PARSE_OK;
+    }
+}
+
+static void json_tape_clear(json_tape *tape)
+{
+    tape->tape = NULL;
+    tape->strings = NULL;
+    tape->size = tape->strings_size = 0;
+    tape->snapshot = NULL;
+}
+
+int json_tape_parse(json_tape *tape, const char *json)
+{
+    int ret;
+    json_context c, t;
+
+    assert(tape && json);
+    json_context_init(&c, json);
+    json_context_init(&t, NULL);
+    json_parse_whitespace(&c);
+    if ((ret = json_tape_parse_value(&c, &t)) == JSON_PARSE_OK) {
+        json_parse_whitespace(&c);
+        if (*c.json != '\0')
+            ret = JSON_PARSE_ERROR;
+    }
+    if (ret == JSON_PARSE_OK) {
+        tape->tape = (uint64_t *) realloc(t.stack, t.top);
+        tape->size = t.top / sizeof(uint64_t);
+        tape->strings = c.top ? (char *) realloc(c.stack, c.top) : c.stack;
+        tape->strings_size = c.top;
+        tape->snapshot = NULL;
+    } else {
+        json_context_free(&c);
+        json_context_free(&t);
+        json_tape_clear(tape);
+    }
+    return ret;
+}
+
+void json_tape_free(json_tape *tape)
+{
+    assert(tape);
+    if (!tape->snapshot) {
+        free(tape->tape);
+        free(tape->strings);
+    } else if (tape->snapshot_release == JSON_TAPE_RELEASE_FREE)
+        free(tape->snapshot);
+#ifdef JSON_MMAP
+    else if (tape->snapshot_release == JSON_TAPE_RELEASE_UNMAP)
+        munmap(tape->snapshot, tape->snapshot_size);
+#endif
+    json_tape_clear(tape);
+}
+
+int json_tape_get_type(const json_tape *tape, size_t i)
+{
+    assert(tape && i < tape->size);
+    return JSON_TAPE_TYPE(tape->tape[i]);
+}
+
+size_t json_tape_next(const json_tape *tape, size_t i)
+{
+    assert(tape && i < tape->size);
+    switch (JSON_TAPE_TYPE(tape->tape[i])) {
+    case JSON_ARRAY:
+    case JSON_OBJECT:
+        return JSON_TAPE_PAYLOAD(tape->tape[i]);
+    case JSON_STRING:
+    case JSON_NUMBER:
+        return i + 2;
+    default:
+        return i + 1;
+    }
+}
+
+size_t json_tape_first(const json_tape *tape, size_t i)
+{
+    assert(tape && i < tape->size && (JSON_TAPE_TYPE(tape->tape[i]) == JSON_ARRAY || JSON_TAPE_TYPE(tape->tape[i]) == JSON_OBJECT));
+    return i + 2;
+}
+
+/* The number at 'i' as json_parse stores it */
+static void json_tape_number(const json_tape *tape, size_t i, json_value *v)
+{
+    assert(tape && i < tape->size && JSON_TAPE_TYPE(tape->tape[i]) == JSON_NUMBER);
+    switch (JSON_TAPE_PAYLOAD(tape->tape[i])) {
+    case JSON_FLAG_INT64:
+        json_set_int64(v, (int64_t) tape->tape[i + 1]);
+        break;
+    case JSON_FLAG_UINT64:
+        json_set_uint64(v, tape->tape[i + 1]);
+        break;
+    default:
+        v->type = JSON_NUMBER;
+        v->flags = 0;
+        memcpy(&v->number, &tape->tape[i + 1], sizeof(double));
+        break;
+    }
+}
+
+double json_tape_get_number(const json_tape *tape, size_t i)
+{
+    json_value v;
+
+    json_tape_number(tape, i, &v);
+    return v.number;
+}
+
+int64_t json_tape_get_int64(const json_tape *tape, size_t i)
+{
+    json_value v;
+
+    json_tape_number(tape, i, &v);
+    return json_get_int64(&v);
+}
+
+uint64_t json_tape_get_uint64(const json_tape *tape, size_t i)
+{
+    json_value v;
+
+    json_tape_number(tape, i, &v);
+    return json_get_uint64(&v);
+}
+
+const char *json_tape_get_string(const json_tape *tape, size_t i)
+{
+    assert(tape && i < tape->size && JSON_TAPE_TYPE(tape->tape[i]) == JSON_STRING);
+    return tape->strings + JSON_TAPE_PAYLOAD(tape->tape[i]);
+}
+
+size_t json_tape_get_string_length(const json_tape *tape, size_t i)
+{
+    assert(tape && i < tape->size && JSON_TAPE_TYPE(tape->tape[i]) == JSON_STRING);
+    return (size_t) tape->tape[i + 1];
+}
+
+size_t json_tape_get_array_size(const json_tape *tape, size_t i)
+{
+    assert(tape && i < tape->size && JSON_TAPE_TYPE(tape->tape[i]) == JSON_ARRAY);
+    return (size_t) tape->tape[i + 1];
+}
+
+size_t json_tape_get_array_element(const json_tape *tape, size_t i, size_t index)
+{
+    size_t e;
+
+    assert(tape && i < tape->size && JSON_TAPE_TYPE(tape->tape[i]) == JSON_ARRAY && index < tape->tape[i + 1]);
+    for (e = i + 2; index > 0; index--)
+        e = json_tape_next(tape, e);
+    return e;
+}
+
+size_t json_tape_get_object_size(const json_tape *tape, size_t i)
+{
+    assert(tape && i < tape->size && JSON_TAPE_TYPE(tape->tape[i]) == JSON_OBJECT);
+    return (size_t) tape->tape[i + 1];
+}
+
+/* index of the key of the member 'index' */
+static size_t json_tape_nth_member(const json_tape *tape, size_t i, size_t index)
+{
+    size_t k;
+
+    assert(tape && i < tape->size && JSON_TAPE_TYPE(tape->tape[i]) == JSON_OBJECT && index < tape->tape[i + 1]);
+    for (k = i + 2; index > 0; index--)
+        k = json_tape_next(tape, k + 2);
+    return k;
+}
+
+const char *json_tape_get_object_key(const json_tape *tape, size_t i, size_t index)
+{
+    return json_tape_get_string(tape, json_tape_nth_member(tape, i, index));
+}
+
+size_t json_tape_get_object_key_length(const json_tape *tape, size_t i, size_t index)
+{
+    return json_tape_get_string_length(tape, json_tape_nth_member(tape, i, index));
+}
+
+size_t json_tape_get_object_value_index(const json_tape *tape, size_t i, size_t index)
+{
+    return json_tape_nth_member(tape, i, index) + 2;
+}
+
+size_t json_tape_get_object_value_n(const json_tape *tape, size_t i, const char *key, size_t len)
+{
+    size_t k, end;
+
+    assert(tape && i < tape->size && JSON_TAPE_TYPE(tape->tape[i]) == JSON_OBJECT && key);
+    for (k = i + 2, end = JSON_TAPE_PAYLOAD(tape->tape[i]); k < end; k = json_tape_next(tape, k + 2))
+        if (tape->tape[k + 1] == len && !memcmp(tape->strings + JSON_TAPE_PAYLOAD(tape->tape[k]), key, len))
+            return k + 2;
+    return 0;
+}
+
+/* The node at 'p' from node 'i', 0 if there is none */
+size_t json_tape_pointer_get(const json_tape *tape, size_t i, const json_pointer *p)
+{
+    const json_pointer_token *t;
+
+    assert(tape && i < tape->size && p);
+    for (t = p->tokens; t < p->tokens + p->size; t++) {
+        if (JSON_TAPE_TYPE(tape->tape[i]) == JSON_OBJECT)
+            i = json_tape_get_object_value_n(tape, i, t->key, t->len);
+        else if (JSON_TAPE_TYPE(tape->tape[i]) == JSON_ARRAY && t->index < tape->tape[i + 1])
+            i = json_tape_get_array_element(tape, i, t->index);
+        else
+            return 0;
+        /* the root is the only node at 0 */
+        if (i == 0)
+            return 0;
+    }
+    return i;
+}
+
+void json_tape_to_value(const json_tape *tape, size_t i, json_value *v)
+{
+    size_t n, e;
+
+    assert(tape && i < tape->size && v);
+    v->flags = 0;
+    switch (JSON_TAPE_TYPE(tape->tape[i])) {
+    case JSON_NUMBER:
+        json_tape_number(tape, i, v);
+        break;
+    case JSON_STRING:
+        json_set_string(v, json_tape_get_string(tape, i), json_tape_get_string_length(tape, i));
+        break;
+    case JSON_ARRAY:
+        v->type = JSON_ARRAY;
+        v->array_size = v->array_capacity = (size_t) tape->tape[i + 1];
+        v->array = v->array_size ? (json_value *) malloc(sizeof(json_value) * v->array_size) : NULL;
+        for (n = 0, e = i + 2; n < v->array_size; n++, e = json_tape_next(tape, e))
+            json_tape_to_value(tape, e, &v->array[n]);
+        break;
+    case JSON_OBJECT:
+    {
+        json_object **p = &v->object;
+
+        v->type = JSON_OBJECT;
+        v->object_size = (size_t) tape->tape[i + 1];
+        v->object_index = NULL;
+        for (n = 0, e = i + 2; n < v->object_size; n++, e = json_tape_next(tape, e + 2)) {
+            *p = (json_object *) malloc(sizeof(json_object));
+            (*p)->key_len = json_tape_get_string_length(tape, e);
+            (*p)->key = (char *) malloc((*p)->key_len + 1);
+            memcpy((*p)->key, json_tape_get_string(tape, e), (*p)->key_len + 1);
+            json_tape_to_value(tape, e + 2, &(*p)->value);
+            p = &(*p)->next;
+        }
+        *p = NULL;
+        break;
+    }
+    default:
+        v->type = JSON_TAPE_TYPE(tape->tape[i]);
+        break;
+    }
+}
+
+/*
+ * A snapshot is a tape as it is in memory, behind a header, so that a mapped file is a tape
+ * without parsing or allocating. The words are in the byte order of the machine, which the
+ * header records; 'checksum' covers the tape and the strings. The checksum only catches
+ * corruption, anyone can recompute it: a snapshot that is not JSON_TAPE_TRUSTED also has every
+ * word checked by json_tape_check, so that the accessors stay within the buffers. A trusted one
+ * only has the root and the strings checked.
+ */
+#define JSON_TAPE_MAGIC "JSONTAPE"
+#define JSON_TAPE_VERSION 2
+#define JSON_TAPE_BYTE_ORDER 0x01020304
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t size;
+    uint64_t strings_size;
+    uint64_t checksum;
+} json_tape_header;
+
+/* Four lanes of multiply and shift over the words, mixed at the end */
+static uint64_t json_tape_checksum(const char *p, size_t len)
+{
+    uint64_t h[4] = {0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL, 0x27D4EB2F165667C5ULL}, w;
+    size_t n = len, i;
+
+    for (i = 0; len >= 8; i = (i + 1) % 4, p += 8, len -= 8) {
+        memcpy(&w, p, 8);
+        h[i] = (h[i] ^ w) * 0xff51afd7ed558ccdULL;
+        h[i] ^= h[i] >> 32;
+    }
+    for (w = 0, i = 0; i < len; i++)
+        w |= (uint64_t) (unsigned char) p[i] << (i * 8);
+    return json_hash_mix(h[0] ^ json_hash_mix(h[1] ^ json_hash_mix(h[2] ^ (json_hash_mix(h[3] ^ w) + n))));
+}
+
+typedef struct {
+    /* the index after the container, the elements and keys still to come */
+    size_t end, remaining;
+    int object;
+} json_tape_frame;
+
+/* Walk the words of 'tape' in order, with the containers open so far on a stack */
+static int json_tape_check(const json_tape *tape)
+{
+    json_tape_frame frame, *top = NULL;
+    json_context c;
+    size_t i = 0, limit, offset, len;
+    int type, ret = JSON_PARSE_ERROR;
+
+    json_context_init(&c, NULL);
+    for (;;) {
+        while (top && i == top->end) {
+            if (top->remaining)
+                goto error;
+            json_context_pop(&c, sizeof(json_tape_frame));
+            top = c.top ? (json_tape_frame *) (c.stack + c.top) - 1 : NULL;
+        }
+        if (!top && i)
+            break;
+        limit = top ? top->end : tape->size;
+        type = JSON_TAPE_TYPE(tape->tape[i]);
+        if (top) {
+            if (!top->remaining || (top->object && top->remaining % 2 == 0 && type != JSON_STRING))
+                goto error;
+            top->remaining--;
+        }
+        switch (type) {
+        case JSON_NULL:
+        case JSON_TRUE:
+        case JSON_FALSE:
+            i++;
+            break;
+        case JSON_NUMBER:
+        case JSON_STRING:
+            if (limit - i < 2)
+                goto error;
+            offset = JSON_TAPE_PAYLOAD(tape->tape[i]);
+            len = (size_t) tape->tape[i + 1];
+            if (type == JSON_STRING && (offset >= tape->strings_size || len >= tape->strings_size - offset || tape->strings[offset + len]))
+                goto error;
+            if (type == JSON_NUMBER && offset && offset != JSON_FLAG_INT64 && offset != JSON_FLAG_UINT64)
+                goto error;
+            i += 2;
+            break;
+        case JSON_ARRAY:
+        case JSON_OBJECT:
+            if (limit - i < 2)
+                goto error;
+            frame.end = JSON_TAPE_PAYLOAD(tape->tape[i]);
+            frame.remaining = (size_t) tape->tape[i + 1];
+            frame.object = type == JSON_OBJECT;
+            /* every element takes a word at least, a member two */
+            if (frame.end < i + 2 || frame.end > limit || frame.remaining > (frame.end - i - 2) >> frame.object)
+                goto error;
+            frame.remaining <<= frame.object;
+            json_context_push(&c, &frame, sizeof(json_tape_frame));
+            top = (json_tape_frame *) (c.stack + c.top) - 1;
+            i += 2;
+            break;
+        default:
+            goto error;
+        }
+    }
+    ret = i == tape->size ? JSON_PARSE_OK : JSON_PARSE_ERROR;
+error:
+    json_context_free(&c);
+    return ret;
+}
+
+int json_tape_save(const json_tape *tape, const char *path)
+{
+    json_tape_header header;
+    uint64_t tape_sum, strings_sum;
+    FILE *f;
+    int ok;
+
+    assert(tape && path);
+    memcpy(header.magic, JSON_TAPE_MAGIC, 8);
+    header.version = JSON_TAPE_VERSION;
+    header.byte_order = JSON_TAPE_BYTE_ORDER;
+    header.size = tape->size;
+    header.strings_size = tape->strings_size;
+    tape_sum = json_tape_checksum((const char *) tape->tape, tape->size * sizeof(uint64_t));
+    strings_sum = json_tape_checksum(tape->strings, tape->strings_size);
+    header.checksum = json_hash_mix(tape_sum ^ json_hash_mix(strings_sum));
+    if (!(f = fopen(path, "wb")))
+        return JSON_JSONIFY_ERROR;
+    ok = fwrite(&header, sizeof(header), 1, f) == 1 && fwrite(tape->tape, sizeof(uint64_t), tape->size, f) == tape->size &&
+         fwrite(tape->strings, 1, tape->strings_size, f) == tape->strings_size;
+    if (fclose(f))
+        ok = 0;
+    return ok ? JSON_JSONIFY_OK : JSON_JSONIFY_ERROR;
+}
+
+int json_tape_attach(json_tape *tape, const void *snapshot, size_t len, int flags)
+{
+    json_tape_header header;
+    const char *p = (const char *) snapshot;
+    uint64_t tape_sum, strings_sum;
+
+    assert(tape && (snapshot || !len));
+    json_tape_clear(tape);
+    if (len < sizeof(header) || (uintptr_t) p % sizeof(uint64_t))
+        return JSON_PARSE_ERROR;
+    memcpy(&header, p, sizeof(header));
+    if (memcmp(header.magic, JSON_TAPE_MAGIC, 8) || header.version != JSON_TAPE_VERSION || header.byte_order != JSON_TAPE_BYTE_ORDER ||
+        !header.size || header.size > (len - sizeof(header)) / sizeof(uint64_t) ||
+        header.strings_size != len - sizeof(header) - header.size * sizeof(uint64_t))
+        return JSON_PARSE_ERROR;
+    if (!(flags & JSON_TAPE_TRUSTED)) {
+        tape_sum = json_tape_checksum(p + sizeof(header), (size_t) header.size * sizeof(uint64_t));
+        strings_sum = json_tape_checksum(p + sizeof(header) + header.size * sizeof(uint64_t), (size_t) header.strings_size);
+        if (header.checksum != json_hash_mix(tape_sum ^ json_hash_mix(strings_sum)))
+            return JSON_PARSE_ERROR;
+    }
+    tape->tape = (uint64_t *) (p + sizeof(header));
+    tape->size = (size_t) header.size;
+    tape->strings = (char *) (p + sizeof(header) + header.size * sizeof(uint64_t));
+    tape->strings_size = (size_t) header.strings_size;
+    /* the root spans the tape, the last string is terminated */
+    if (json_tape_next(tape, 0) != tape->size ||
+        (tape->strings_size && tape->strings[tape->strings_size - 1]) || (!(flags & JSON_TAPE_TRUSTED) && json_tape_check(tape) == JSON_PARSE_ERROR)) {
+        json_tape_clear(tape);
+        return JSON_PARSE_ERROR;
+    }
+    tape->snapshot = (void *) p;
+    tape->snapshot_size = len;
+    tape->snapshot_release = JSON_TAPE_RELEASE_NONE;
+    return JSON_PARSE_OK;
+}
+
+/* Mapped where mmap is available, else read into memory */
+int json_tape_load(json_tape *tape, const char *path, int flags)
+{
+    void *snapshot;
+    size_t len;
+#ifdef JSON_MMAP
+    struct stat st;
+    int fd;
+
+    assert(tape && path);
+    json_tape_clear(tape);
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return JSON_PARSE_ERROR;
+    if (fstat(fd, &st) || st.st_size <= 0 ||
+        (snapshot = mmap(NULL, len = (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return JSON_PARSE_ERROR;
+    }
+    close(fd);
+    if (json_tape_attach(tape, snapshot, len, flags) == JSON_PARSE_ERROR) {
+        munmap(snapshot, len);
+        return JSON_PARSE_ERROR;
+    }
+    tape->snapshot_release = JSON_TAPE_RELEASE_UNMAP;
+#else
+    FILE *f;
+    long size;
+
+    assert(tape && path);
+    json_tape_clear(tape);
+    if (!(f = fopen(path, "rb")) || fseek(f, 0, SEEK_END) || (size = ftell(f)) <= 0 || fseek(f, 0, SEEK_SET)) {
+        if (f)
+            fclose(f);
+        return JSON_PARSE_ERROR;
+    }
+    /* malloc aligns for any word */
+    snapshot = malloc(len = (size_t) size);
+    if (fread(snapshot, 1, len, f) != len || json_tape_attach(tape, snapshot, len, flags) == JSON_PARSE_ERROR) {
+        fclose(f);
+        free(snapshot);
+        return JSON_PARSE_ERROR;
+    }
+    fclose(f);
+    tape->snapshot_release = JSON_TAPE_RELEASE_FREE;
+#endif
+    return JSON_PARSE_OK;
+}
@@ -2,6 +2,7 @@
 #define JSON_H__
 
 #include <stddef.h> /* size_t */
+#include <stdint.h> /* uint64_t */
 #include <assert.h> /* assert */
 
 typedef enum json_type {
@@ -16,6 +17,15 @@ typedef enum json_type {
 
 typedef struct json_value json_value;
 typedef struct json_object json_object;
+typedef struct json_shape json_shape;
+typedef struct json_shape_cache json_shape_cache;
+typedef struct json_object_index json_object_index;
+typedef struct json_shared json_shared;
+typedef struct json_dedup json_dedup;
+typedef struct json_pointer json_pointer;
+typedef struct json_path json_path;
+typedef struct json_schema json_schema;
+typedef struct json_writer json_writer;
 
 struct json_value {
     union {
@@ -23,11 +33,22 @@ struct json_value {
         struct {
             json_object *object;
             size_t object_size;
+            union {
+                /* JSON_FLAG_SHAPED: key layout shared by parsed objects */
+                json_shape *object_shape;
+                /* otherwise: lookup index and tail of modified objects, may be NULL */
+                json_object_index *object_index;
+            };
         };
         /* array */
         struct {
-            json_value *array;
+            union {
+                json_value *array;
+                /* JSON_FLAG_PACKED: the numbers of the elements */
+                double *array_doubles;
+            };
             size_t array_size;
+            size_t array_capacity;
         };
         /* string */
         struct {
@@ -35,9 +56,26 @@ struct json_value {
             size_t string_len;
         };
         /* number */
-        double number;
+        struct {
+            /* the nearest double when the number is one of the integers below */
+            double number;
+            union {
+                /* JSON_FLAG_INT64: the exact value */
+                int64_t number_int64;
+                /* JSON_FLAG_UINT64: the exact value, above INT64_MAX */
+                uint64_t number_uint64;
+            };
+        };
+        /* JSON_FLAG_RAW: the text of the string or number, quotes included, in the parsed json */
+        struct {
+            const char *raw;
+            size_t raw_len;
+        };
+        /* JSON_FLAG_SHARED: the reference counted value */
+        json_shared *shared;
     };
     json_type type;
+    int flags;
 };
 
 struct json_object {
@@ -47,13 +85,122 @@ struct json_object {
     json_object *next;
 };
 
+/* json_value flags */
+enum {
+    /* the storage belongs to the block of json_compact */
+    JSON_FLAG_COMPACT = 1 << 0,
+    /* the object shares the keys of 'object_shape' */
+    JSON_FLAG_SHAPED = 1 << 1,
+    /* a reference to 'shared', the type is the type of the shared value */
+    JSON_FLAG_SHARED = 1 << 2,
+    /* the number is the integer 'number_int64' */
+    JSON_FLAG_INT64 = 1 << 3,
+    /* the number is the integer 'number_uint64' */
+    JSON_FLAG_UINT64 = 1 << 4,
+    /* the string or number is not decoded yet, see 'raw' */
+    JSON_FLAG_RAW = 1 << 5,
+    /* the array is numbers only, stored in 'array_doubles' */
+    JSON_FLAG_PACKED = 1 << 6
+};
+
+/* deepcopy argument of the set functions: attach a reference instead of a copy */
+#define JSON_SHARE 2
+
+/* read-only document, see "Tape" in json.c for the layout */
+typedef struct json_tape {
+    uint64_t *tape;
+    size_t size;
+    char *strings;
+    size_t strings_size;
+    /* json_tape_load, json_tape_attach: the snapshot 'tape' and 'strings' point into, else NULL */
+    void *snapshot;
+    size_t snapshot_size;
+    int snapshot_release;
+} json_tape;
+
+/* json_tape_load and json_tape_attach flags: skip the checksum and the offset checks, for files of your own only */
+#define JSON_TAPE_TRUSTED 1
+
+/* the type of a json_column */
+enum {
+    /* no row has a value */
+    JSON_COLUMN_NULL,
+    JSON_COLUMN_NUMBER,
+    JSON_COLUMN_STRING,
+    JSON_COLUMN_BOOL
+};
+
+/* one field of every record of json_shred, the buffers hold a slot for every row */
+typedef struct json_column {
+    /* JSON_COLUMN_*, by the first value found */
+    int type;
+    size_t size;
+    /* bit i of 'valid' is set if row i has a value of 'type', the others are null */
+    uint64_t *valid;
+    /* rows whose value had another type, counted as null */
+    size_t mismatched;
+    /* JSON_COLUMN_NUMBER */
+    double *numbers;
+    /* JSON_COLUMN_STRING: row i is [offsets[i], offsets[i + 1]) of 'strings' */
+    size_t *offsets;
+    char *strings;
+    /* JSON_COLUMN_BOOL: bit i is the value of row i */
+    uint64_t *bools;
+} json_column;
+
+/* bit i of a bitmap of json_column */
+#define JSON_COLUMN_BIT(bitmap, i) ((int) ((bitmap)[(i) >> 6] >> ((i) & 63) & 1))
+
 enum {
     JSON_PARSE_OK,
     JSON_PARSE_ERROR,
     JSON_JSONIFY_OK,
-    JSON_JSONIFY_ERROR
+    JSON_JSONIFY_ERROR,
+    JSON_PATCH_OK,
+    JSON_PATCH_ERROR,
+    JSON_EXTRACT_OK,
+    /* the path is not in the document */
+    JSON_EXTRACT_MISSING,
+    JSON_EXTRACT_ERROR,
+    JSON_SHRED_OK,
+    JSON_SHRED_ERROR
 };
 
+/* keep strings and numbers as slices of the text, decoded when first read */
+#define JSON_PARSE_LAZY 1
+/* store arrays of numbers as contiguous doubles, see json_get_array_doubles */
+#define JSON_PARSE_PACK 2
+
+typedef struct json_parse_options {
+    /* share keys between objects of the same key sequence, NULL to disable */
+    json_shape_cache *shape_cache;
+    /* JSON_PARSE_* */
+    int flags;
+    /* share identical strings and small subtrees between values, NULL to disable */
+    json_dedup *dedup;
+} json_parse_options;
+
+typedef struct json_dedup_stats {
+    /* values looked up while parsing */
+    size_t lookups;
+    /* lookups that found an identical value */
+    size_t hits;
+    /* distinct values in the table */
+    size_t entries;
+    /* bytes of strings and containers the hits did not keep */
+    size_t bytes_saved;
+} json_dedup_stats;
+
+/* copy valid UTF-8 into strings instead of "\uXXXX" escapes */
+#define JSON_JSONIFY_RAW_UTF8 1
+/* write '/' instead of "\/" */
+#define JSON_JSONIFY_UNESCAPED_SLASH 2
+
+typedef struct json_jsonify_options {
+    /* JSON_JSONIFY_* */
+    int flags;
+} json_jsonify_options;
+
 void json_init(json_value *v);
 
 void json_free(json_value *v);
@@ -61,15 +208,40 @@ void json_free(json_value *v);
 /* parse */
 int json_parse(json_value *v, const char *json);
 
+int json_parse_ex(json_value *v, const char *json, const json_parse_options *options);
+
+/* shape cache */
+json_shape_cache *json_shape_cache_new(void);
+
+void json_shape_cache_free(json_shape_cache *cache);
+
+/* dedup */
+json_dedup *json_dedup_new(size_t max_subtree);
+
+void json_dedup_free(json_dedup *dedup);
+
+size_t json_dedup_prune(json_dedup *dedup);
+
+void json_dedup_get_stats(const json_dedup *dedup, json_dedup_stats *stats);
+
 /* jsonify */
+/* receives jsonified text in pieces, non-zero to stop */
+typedef int (*json_sink)(void *data, const char *json, size_t len);
+
 char *json_jsonify(const json_value *v, size_t *len);
 
+char *json_jsonify_ex(const json_value *v, size_t *len, const json_jsonify_options *options);
+
 /* access functions */
 /* get */
 int json_get_type(const json_value *v);
 
 double json_get_number(const json_value *v);
 
+int64_t json_get_int64(const json_value *v);
+
+uint64_t json_get_uint64(const json_value *v);
+
 char *json_get_string(const json_value *v);
 
 size_t json_get_string_length(const json_value *v);
@@ -78,6 +250,10 @@ json_value *json_get_array_element(const json_value *v, size_t index);
 
 size_t json_get_array_size(const json_value *v);
 
+const json_value *json_array_at(const json_value *v, size_t index, json_value *e);
+
+const double *json_get_array_doubles(const json_value *v, size_t *n);
+
 size_t json_get_object_size(const json_value *v);
 
 char *json_get_object_key(const json_value *v, size_t index);
@@ -101,8 +277,226 @@ void json_set_string(json_value *v, const char *string, size_t len);
 
 void json_set_number(json_value *v, double number);
 
+void json_set_int64(json_value *v, int64_t number);
+
+void json_set_uint64(json_value *v, uint64_t number);
+
 void json_set_array(json_value *v, int deepcopy, ...);
 
 void json_object_append(json_value *v, int deepcopy, ...);
 
+void json_object_set(json_value *v, const char *key, size_t len, int deepcopy, json_value *value);
+
+int json_object_remove(json_value *v, const char *key, size_t len);
+
+void json_copy(json_value *dst, const json_value *src);
+
+void json_move(json_value *dst, json_value *src);
+
+void json_swap(json_value *a, json_value *b);
+
+void json_share(json_value *dst, json_value *src);
+
+json_value *json_unshare(json_value *v);
+
+int json_equal(const json_value *a, const json_value *b);
+
+uint64_t json_hash(const json_value *v);
+
+void json_diff(json_value *patch, const json_value *a, const json_value *b);
+
+int json_patch_apply(json_value *v, const json_value *patch);
+
+void json_merge_patch_apply(json_value *v, const json_value *patch);
+
+void json_array_reserve(json_value *v, size_t capacity);
+
+void json_array_push(json_value *v, int deepcopy, json_value *e);
+
+void json_array_insert(json_value *v, size_t index, int deepcopy, json_value *e);
+
+void json_array_remove(json_value *v, size_t index);
+
+void json_array_pack(json_value *v);
+
+void json_array_unpack(json_value *v);
+
+/* pointer */
+json_pointer *json_pointer_compile(const char *path);
+
+json_pointer *json_pointer_compile_n(const char *path, size_t len);
+
+void json_pointer_free(json_pointer *p);
+
+json_value *json_pointer_get(const json_value *v, const json_pointer *p, json_value *e);
+
+int json_extract(json_value *v, const char *json, const json_pointer *p);
+
+/* path */
+/* called with each match of a JSONPath, non-zero to stop */
+typedef int (*json_path_callback)(void *data, json_value *match);
+
+json_path *json_path_compile(const char *expr);
+
+void json_path_free(json_path *path);
+
+size_t json_path_eval(const json_path *path, const json_value *v, json_path_callback callback, void *data);
+
+int json_path_stream(const json_path *path, const char *json, json_path_callback callback, void *data);
+
+/* struct */
+/* the C type of a field */
+enum {
+    /* int, 0 or 1 */
+    JSON_FIELD_BOOL,
+    /* int */
+    JSON_FIELD_INT,
+    /* int64_t */
+    JSON_FIELD_INT64,
+    /* double */
+    JSON_FIELD_DOUBLE,
+    /* char *, into the strings buffer of json_parse_struct */
+    JSON_FIELD_STRING,
+    /* a struct described by 'fields' */
+    JSON_FIELD_OBJECT,
+    /* json_value, initialized before parsing */
+    JSON_FIELD_VALUE
+};
+
+/* json_schema_compile flags: fail on keys without a field */
+#define JSON_SCHEMA_STRICT 1
+
+typedef struct json_field {
+    const char *name;
+    int type;
+    size_t offset;
+    /* JSON_FIELD_OBJECT: the fields of the member struct */
+    const struct json_field *fields;
+} json_field;
+
+/* a field named as the member 'member' of the struct 'type', tables end with JSON_FIELD_END */
+#define JSON_FIELD(field_type, type, member) { #member, field_type, offsetof(type, member), NULL }
+#define JSON_FIELD_STRUCT(type, member, fields) { #member, JSON_FIELD_OBJECT, offsetof(type, member), fields }
+#define JSON_FIELD_END { NULL, 0, 0, NULL }
+
+json_schema *json_schema_compile(const json_field *fields, int flags);
+
+void json_schema_free(json_schema *schema);
+
+int json_parse_struct(void *dst, const char *json, const json_schema *schema, char **strings);
+
+char *json_jsonify_struct(const void *src, const json_schema *schema, size_t *len);
+
+int json_jsonify_struct_sink(const void *src, const json_schema *schema, json_sink sink, void *data);
+
+/* writer */
+json_writer *json_writer_new(json_sink sink, void *data);
+
+void json_writer_free(json_writer *w);
+
+void json_writer_reset(json_writer *w);
+
+void json_writer_set_options(json_writer *w, const json_jsonify_options *options);
+
+int json_writer_begin_object(json_writer *w);
+
+int json_writer_end_object(json_writer *w);
+
+int json_writer_begin_array(json_writer *w);
+
+int json_writer_end_array(json_writer *w);
+
+int json_writer_key(json_writer *w, const char *key, size_t len);
+
+int json_writer_string(json_writer *w, const char *string, size_t len);
+
+int json_writer_number(json_writer *w, double number);
+
+int json_writer_bool(json_writer *w, int b);
+
+int json_writer_null(json_writer *w);
+
+int json_writer_value(json_writer *w, const json_value *v);
+
+int json_writer_finish(json_writer *w);
+
+const char *json_writer_get_text(json_writer *w, size_t *len);
+
+/* format */
+char *json_minify(const char *json, size_t *len);
+
+char *json_prettify(const char *json, size_t indent, size_t *len);
+
+int json_minify_sink(const char *json, json_sink sink, void *data);
+
+int json_prettify_sink(const char *json, size_t indent, json_sink sink, void *data);
+
+/* binary */
+char *json_to_cbor(const json_value *v, size_t *len);
+
+int json_to_cbor_sink(const json_value *v, json_sink sink, void *data);
+
+int json_from_cbor(json_value *v, const void *cbor, size_t len);
+
+char *json_to_msgpack(const json_value *v, size_t *len);
+
+int json_to_msgpack_sink(const json_value *v, json_sink sink, void *data);
+
+int json_from_msgpack(json_value *v, const void *msgpack, size_t len);
+
+/* compact */
+json_value *json_compact(json_value *v);
+
+/* columns */
+int json_shred(json_column *columns, const json_value *v, const char *const *paths, size_t n);
+
+void json_column_free(json_column *column);
+
+/* tape */
+int json_tape_parse(json_tape *tape, const char *json);
+
+void json_tape_free(json_tape *tape);
+
+int json_tape_save(const json_tape *tape, const char *path);
+
+int json_tape_load(json_tape *tape, const char *path, int flags);
+
+int json_tape_attach(json_tape *tape, const void *snapshot, size_t len, int flags);
+
+int json_tape_get_type(const json_tape *tape, size_t i);
+
+size_t json_tape_next(const json_tape *tape, size_t i);
+
+size_t json_tape_first(const json_tape *tape, size_t i);
+
+double json_tape_get_number(const json_tape *tape, size_t i);
+
+int64_t json_tape_get_int64(const json_tape *tape, size_t i);
+
+uint64_t json_tape_get_uint64(const json_tape *tape, size_t i);
+
+const char *json_tape_get_string(const json_tape *tape, size_t i);
+
+size_t json_tape_get_string_length(const json_tape *tape, size_t i);
+
+size_t json_tape_get_array_size(const json_tape *tape, size_t i);
+
+size_t json_tape_get_array_element(const json_tape *tape, size_t i, size_t index);
+
+size_t json_tape_get_object_size(const json_tape *tape, size_t i);
+
+const char *json_tape_get_object_key(const json_tape *tape, size_t i, size_t index);
+
+size_t json_tape_get_object_key_length(const json_tape *tape, size_t i, size_t index);
+
+size_t json_tape_get_object_value_index(const json_tape *tape, size_t i, size_t index);
+
+#define json_tape_get_object_value(tape, i, key) json_tape_get_object_value_n(tape, i, key, sizeof(key) - 1)
+
+size_t json_tape_get_object_value_n(const json_tape *tape, size_t i, const char *key, size_t len);
+
+size_t json_tape_pointer_get(const json_tape *tape, size_t i, const json_pointer *p);
+
+void json_tape_to_value(const json_tape *tape, size_t i, json_value *v);
+
 #endif /* JSON_H__ */
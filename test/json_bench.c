@@ -0,0 +1,1166 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+#include <malloc.h>
+#define BENCH_HEAP() ((size_t) (mallinfo2().uordblks + mallinfo2().hblkhd))
+#else
+#define BENCH_HEAP() ((size_t) 0)
+#endif
+#include "../src/json.h"
+
+#define BENCH_LINES 200000
+
+static double bench_seconds(clock_t start)
+{
+    return (double) (clock() - start) / CLOCKS_PER_SEC;
+}
+
+static void bench_report(const char *name, double seconds, size_t bytes)
+{
+    printf("%-40s %8.3f s %10.2f MB/s\n", name, seconds, bytes / seconds / (1024 * 1024));
+}
+
+/* NDJSON with one schema, the lines are separated by '\0' */
+static char *bench_ndjson(size_t lines, size_t *len)
+{
+    char *buf, *p;
+    size_t i;
+
+    buf = p = (char *) malloc(lines * 256);
+    for (i = 0; i < lines; i++)
+        p += sprintf(p, "{\"timestamp\": %lu, \"host\": \"web-%02lu\", \"method\": \"GET\", \"status\": %d, "
+                        "\"latency\": %.3f, \"bytes\": %lu, \"cached\": %s}",
+                     (unsigned long) (1500000000 + i), (unsigned long) (i % 32), i % 7 ? 200 : 404,
+                     (i % 1000) / 7.0, (unsigned long) (i * 37 % 65536), i % 3 ? "true" : "false") + 1;
+    *len = p - buf;
+    return buf;
+}
+
+static void bench_shape(void)
+{
+    json_parse_options options;
+    json_value v;
+    char *buf, *p;
+    size_t len, i;
+    clock_t start;
+
+    buf = bench_ndjson(BENCH_LINES, &len);
+
+    start = clock();
+    for (i = 0, p = buf; i < BENCH_LINES; i++, p += strlen(p) + 1) {
+        json_init(&v);
+        json_parse(&v, p);
+        json_free(&v);
+    }
+    bench_report("ndjson json_parse", bench_seconds(start), len);
+
+    options.shape_cache = json_shape_cache_new();
+    options.dedup = NULL;
+    options.flags = 0;
+    start = clock();
+    for (i = 0, p = buf; i < BENCH_LINES; i++, p += strlen(p) + 1) {
+        json_init(&v);
+        json_parse_ex(&v, p, &options);
+        json_free(&v);
+    }
+    bench_report("ndjson json_parse_ex shape cache", bench_seconds(start), len);
+    json_shape_cache_free(options.shape_cache);
+    free(buf);
+}
+
+/* a proxy passing NDJSON through after reading one field of each line */
+static void bench_lazy(void)
+{
+    json_parse_options options;
+    json_value v;
+    char *buf, *p;
+    size_t len, i;
+    clock_t start;
+    int lazy;
+
+    buf = bench_ndjson(BENCH_LINES, &len);
+    options.shape_cache = NULL;
+    options.dedup = NULL;
+    for (lazy = 0; lazy < 2; lazy++) {
+        options.flags = lazy ? JSON_PARSE_LAZY : 0;
+        start = clock();
+        for (i = 0, p = buf; i < BENCH_LINES; i++, p += strlen(p) + 1) {
+            json_init(&v);
+            json_parse_ex(&v, p, &options);
+            if (json_get_number(json_get_object_value(&v, "status")) != 404)
+                free(json_jsonify(&v, NULL));
+            json_free(&v);
+        }
+        bench_report(lazy ? "ndjson pass-through lazy" : "ndjson pass-through", bench_seconds(start), len);
+    }
+    free(buf);
+}
+
+/* an array of records with nested arrays and objects */
+static char *bench_corpus(size_t records, size_t *len)
+{
+    char *buf, *p;
+    size_t i;
+
+    buf = p = (char *) malloc(records * 256 + 3);
+    *p++ = '[';
+    for (i = 0; i < records; i++)
+        p += sprintf(p, "%s{\"id\": %lu, \"name\": \"user-%lu\", \"score\": %.2f, \"tags\": [\"a\", \"b\", %lu], "
+                        "\"geo\": {\"lat\": %.4f, \"lon\": %.4f}, \"active\": %s}",
+                     i ? ", " : "", (unsigned long) i, (unsigned long) i, i * 0.37, (unsigned long) (i % 10),
+                     (i % 180) - 90.0 + 0.1234, (i % 360) - 180.0 + 0.5678, i % 2 ? "true" : "false");
+    *p++ = ']';
+    *p = '\0';
+    *len = p - buf;
+    return buf;
+}
+
+/* payload bytes of the tree, not counting the allocator overhead */
+static size_t bench_dom_bytes(const json_value *v)
+{
+    size_t i, bytes = 0;
+
+    switch (json_get_type(v)) {
+    case JSON_STRING:
+        return json_get_string_length(v) + 1;
+    case JSON_ARRAY:
+        for (i = 0; i < json_get_array_size(v); i++)
+            bytes += sizeof(json_value) + bench_dom_bytes(json_get_array_element(v, i));
+        return bytes;
+    case JSON_OBJECT:
+    {
+        json_object *o;
+        for (o = v->object; o; o = o->next)
+            bytes += sizeof(json_object) + o->key_len + 1 + bench_dom_bytes(&o->value);
+        return bytes;
+    }
+    default:
+        return 0;
+    }
+}
+
+static double bench_dom_walk(const json_value *v)
+{
+    double sum = 0.0;
+    size_t i;
+
+    switch (json_get_type(v)) {
+    case JSON_NUMBER:
+        return json_get_number(v);
+    case JSON_STRING:
+        return (double) json_get_string_length(v);
+    case JSON_ARRAY:
+        for (i = 0; i < json_get_array_size(v); i++)
+            sum += bench_dom_walk(json_get_array_element(v, i));
+        return sum;
+    case JSON_OBJECT:
+    {
+        json_object *o;
+        for (o = v->object; o; o = o->next)
+            sum += (double) o->key_len + bench_dom_walk(&o->value);
+        return sum;
+    }
+    default:
+        return 0.0;
+    }
+}
+
+/* the tape is in document order, a full walk is a linear scan */
+static double bench_tape_walk(const json_tape *t)
+{
+    double sum = 0.0;
+    size_t i;
+
+    for (i = 0; i < t->size; )
+        switch (json_tape_get_type(t, i)) {
+        case JSON_NUMBER:
+            sum += json_tape_get_number(t, i);
+            i += 2;
+            break;
+        case JSON_STRING:
+            /* keys are counted too */
+            sum += (double) json_tape_get_string_length(t, i);
+            i += 2;
+            break;
+        case JSON_ARRAY:
+        case JSON_OBJECT:
+            i = json_tape_first(t, i);
+            break;
+        default:
+            i++;
+            break;
+        }
+    return sum;
+}
+
+static void bench_tape(void)
+{
+    json_value v;
+    json_tape t;
+    char *json;
+    size_t len, i;
+    double dom = 0.0, tape = 0.0;
+    clock_t start;
+
+    json = bench_corpus(BENCH_LINES, &len);
+
+    start = clock();
+    json_init(&v);
+    json_parse(&v, json);
+    bench_report("corpus json_parse", bench_seconds(start), len);
+    start = clock();
+    for (i = 0; i < 10; i++)
+        dom += bench_dom_walk(&v);
+    bench_report("corpus DOM walk x10", bench_seconds(start), len * 10);
+    printf("%-40s %8.2f MB\n", "corpus DOM size", bench_dom_bytes(&v) / (1024.0 * 1024));
+    json_free(&v);
+
+    start = clock();
+    json_tape_parse(&t, json);
+    bench_report("corpus json_tape_parse", bench_seconds(start), len);
+    start = clock();
+    for (i = 0; i < 10; i++)
+        tape += bench_tape_walk(&t);
+    bench_report("corpus tape walk x10", bench_seconds(start), len * 10);
+    printf("%-40s %8.2f MB\n", "corpus tape size", (t.size * sizeof(uint64_t) + t.strings_size) / (1024.0 * 1024));
+    json_tape_free(&t);
+    if (dom - tape > dom * 1e-9 || tape - dom > dom * 1e-9)
+        printf("walks disagree\n");
+    free(json);
+}
+
+static void bench_compact(void)
+{
+    json_value v, *c;
+    char *json;
+    size_t len, i, heap;
+    double sum = 0.0;
+    clock_t start;
+
+    json = bench_corpus(BENCH_LINES, &len);
+    heap = BENCH_HEAP();
+    json_init(&v);
+    json_parse(&v, json);
+    printf("%-40s %8.2f MB\n", "corpus DOM heap", (BENCH_HEAP() - heap) / (1024.0 * 1024));
+    start = clock();
+    for (i = 0; i < 10; i++)
+        sum += bench_dom_walk(&v);
+    bench_report("corpus DOM walk x10", bench_seconds(start), len * 10);
+
+    start = clock();
+    c = json_compact(&v);
+    bench_report("corpus json_compact", bench_seconds(start), len);
+    printf("%-40s %8.2f MB\n", "corpus compacted heap", (BENCH_HEAP() - heap) / (1024.0 * 1024));
+    start = clock();
+    for (i = 0; i < 10; i++)
+        sum -= bench_dom_walk(c);
+    bench_report("corpus compacted walk x10", bench_seconds(start), len * 10);
+    free(c);
+    if (sum > 1e-3 * len || sum < -1e-3 * len)
+        printf("walks disagree\n");
+    free(json);
+}
+
+static void bench_copy(void)
+{
+    json_value v, copy;
+    char *json;
+    size_t len, i;
+    clock_t start;
+
+    json = bench_corpus(BENCH_LINES, &len);
+    json_init(&v);
+    json_parse(&v, json);
+    start = clock();
+    for (i = 0; i < 5; i++) {
+        json_init(&copy);
+        json_copy(&copy, &v);
+        json_free(&copy);
+    }
+    bench_report("corpus json_copy + json_free x5", bench_seconds(start), len * 5);
+    json_free(&v);
+    free(json);
+}
+
+#define BENCH_KEYS 100000
+
+static void bench_object(void)
+{
+    json_value o, e;
+    char key[16];
+    size_t i;
+    clock_t start;
+
+    json_init(&o);
+    json_init(&e);
+    start = clock();
+    for (i = 0; i < BENCH_KEYS; i++) {
+        json_set_number(&e, (double) i);
+        json_object_append(&o, 0, key, (size_t) sprintf(key, "key-%lu", (unsigned long) i), &e, NULL);
+    }
+    printf("%-40s %8.3f s\n", "object append 100k keys", bench_seconds(start));
+
+    start = clock();
+    for (i = 0; i < BENCH_KEYS; i++) {
+        json_set_number(&e, (double) i);
+        json_object_set(&o, key, (size_t) sprintf(key, "key-%lu", (unsigned long) (i * 7919 % BENCH_KEYS)), 0, &e);
+    }
+    printf("%-40s %8.3f s\n", "object set 100k existing keys", bench_seconds(start));
+
+    start = clock();
+    for (i = 0; i < BENCH_KEYS; i++) {
+        size_t len = (size_t) sprintf(key, "key-%lu", (unsigned long) (i * 7919 % BENCH_KEYS));
+        json_object_remove(&o, key, len);
+        json_set_number(&e, (double) i);
+        json_object_set(&o, key, len, 0, &e);
+    }
+    printf("%-40s %8.3f s\n", "object remove + set 100k keys", bench_seconds(start));
+    json_free(&o);
+}
+
+#define BENCH_RESPONSES 20000
+
+/* Responses embedding one config subtree, copied vs shared */
+static void bench_share(void)
+{
+    json_value config, id, *responses;
+    char *json;
+    size_t len, i, heap;
+    int mode;
+    clock_t start;
+
+    json = bench_corpus(20, &len);
+    json_init(&config);
+    json_parse(&config, json);
+    responses = (json_value *) malloc(sizeof(json_value) * BENCH_RESPONSES);
+    for (mode = 1; mode <= JSON_SHARE; mode++) {
+        heap = BENCH_HEAP();
+        start = clock();
+        for (i = 0; i < BENCH_RESPONSES; i++) {
+            json_init(&id);
+            json_set_number(&id, (double) i);
+            json_init(&responses[i]);
+            json_object_append(&responses[i], 0, "id", (size_t) 2, &id, NULL);
+            json_object_append(&responses[i], mode, "config", (size_t) 6, &config, NULL);
+        }
+        bench_report(mode == JSON_SHARE ? "responses JSON_SHARE" : "responses deepcopy", bench_seconds(start), len * BENCH_RESPONSES);
+        printf("%-40s %8.2f MB\n", "responses heap", (BENCH_HEAP() - heap) / (1024.0 * 1024));
+        for (i = 0; i < BENCH_RESPONSES; i++)
+            json_free(&responses[i]);
+    }
+    free(responses);
+    json_free(&config);
+    free(json);
+}
+
+/* Comparing and hashing trees vs comparing their serializations */
+static void bench_equal(void)
+{
+    json_value a, b;
+    char *json, *ja, *jb;
+    size_t len, la, lb;
+    int equal;
+    clock_t start;
+
+    json = bench_corpus(BENCH_LINES, &len);
+    json_init(&a);
+    json_parse(&a, json);
+    json_init(&b);
+    json_parse(&b, json);
+    start = clock();
+    ja = json_jsonify(&a, &la);
+    jb = json_jsonify(&b, &lb);
+    equal = la == lb && !memcmp(ja, jb, la);
+    bench_report("corpus jsonify + memcmp", bench_seconds(start), len);
+    free(ja);
+    free(jb);
+    start = clock();
+    equal -= json_equal(&a, &b);
+    bench_report("corpus json_equal", bench_seconds(start), len);
+    start = clock();
+    equal += json_hash(&a) == json_hash(&b);
+    bench_report("corpus json_hash x2", bench_seconds(start), len * 2);
+    if (equal != 1)
+        printf("comparisons disagree\n");
+    json_free(&a);
+    json_free(&b);
+    free(json);
+}
+
+/* A few records changed in the corpus, in plain trees and in trees sharing the records */
+static void bench_diff_version(json_value *b)
+{
+    json_value e;
+    size_t i;
+
+    for (i = 0; i < 10; i++) {
+        json_init(&e);
+        json_set_number(&e, -1.0);
+        json_object_set(json_get_array_element(b, i * 997), "score", 5, 0, &e);
+    }
+    json_array_remove(b, 5);
+    json_init(&e);
+    json_set_string(&e, "new", 3);
+    json_array_insert(b, 100, 0, &e);
+}
+
+static void bench_diff(void)
+{
+    json_value a, b, patch, ref;
+    char *json, *p;
+    size_t len, plen, i;
+    clock_t start;
+
+    json = bench_corpus(BENCH_LINES, &len);
+    json_init(&a);
+    json_parse(&a, json);
+    json_init(&b);
+    json_copy(&b, &a);
+    bench_diff_version(&b);
+    start = clock();
+    json_init(&patch);
+    json_diff(&patch, &a, &b);
+    bench_report("corpus json_diff", bench_seconds(start), len);
+    p = json_jsonify(&patch, &plen);
+    printf("%-40s %8lu ops %10lu B\n", "corpus patch", (unsigned long) json_get_array_size(&patch), (unsigned long) plen);
+    free(p);
+    start = clock();
+    if (json_patch_apply(&a, &patch) != JSON_PATCH_OK)
+        printf("patch failed\n");
+    bench_report("corpus json_patch_apply", bench_seconds(start), plen);
+    if (!json_equal(&a, &b))
+        printf("patched corpus differs\n");
+    json_free(&patch);
+    json_free(&b);
+
+    for (i = 0; i < json_get_array_size(&a); i++) {
+        json_share(&ref, json_get_array_element(&a, i));
+        json_free(&ref);
+    }
+    json_init(&b);
+    json_copy(&b, &a);
+    bench_diff_version(&b);
+    start = clock();
+    json_init(&patch);
+    json_diff(&patch, &a, &b);
+    bench_report("shared records json_diff", bench_seconds(start), len);
+    json_free(&patch);
+    json_free(&a);
+    json_free(&b);
+    free(json);
+}
+
+/* Extracting one field of every record: compiled once, compiled each time, and by hand */
+static void bench_pointer(void)
+{
+    json_value v, s, *r;
+    json_tape t;
+    json_pointer *p;
+    char *json;
+    size_t len, i, n, e;
+    double sum = 0.0;
+    clock_t start;
+
+    json = bench_corpus(BENCH_LINES, &len);
+    json_init(&v);
+    json_parse(&v, json);
+    json_tape_parse(&t, json);
+    n = json_get_array_size(&v);
+    start = clock();
+    for (i = 0; i < n; i++) {
+        r = json_get_array_element(&v, i);
+        sum += json_get_number(json_get_object_value(json_get_object_value(r, "geo"), "lat"));
+    }
+    bench_report("corpus field by hand", bench_seconds(start), len);
+    start = clock();
+    for (i = 0; i < n; i++) {
+        p = json_pointer_compile("/geo/lat");
+        sum -= json_get_number(json_pointer_get(json_get_array_element(&v, i), p, &s));
+        json_pointer_free(p);
+    }
+    bench_report("corpus field json_pointer_compile each", bench_seconds(start), len);
+    p = json_pointer_compile("/geo/lat");
+    start = clock();
+    for (i = 0; i < n; i++)
+        sum += json_get_number(json_pointer_get(json_get_array_element(&v, i), p, &s));
+    bench_report("corpus field json_pointer_get", bench_seconds(start), len);
+    start = clock();
+    for (i = 0, e = json_tape_first(&t, 0); i < n; i++, e = json_tape_next(&t, e))
+        sum -= json_tape_get_number(&t, json_tape_pointer_get(&t, e, p));
+    bench_report("corpus field json_tape_pointer_get", bench_seconds(start), len);
+    json_pointer_free(p);
+    if (sum > 1e-3 * len || sum < -1e-3 * len)
+        printf("fields disagree\n");
+    json_tape_free(&t);
+    json_free(&v);
+    free(json);
+}
+
+typedef struct {
+    double sum;
+    size_t count;
+    size_t heap;
+} bench_path_result;
+
+static int bench_path_sum(void *data, json_value *match)
+{
+    bench_path_result *r = (bench_path_result *) data;
+    size_t heap = BENCH_HEAP();
+
+    r->sum += json_get_number(match);
+    r->count++;
+    if (heap > r->heap)
+        r->heap = heap;
+    return 0;
+}
+
+static void bench_path_query(const char *json, size_t len, const char *expr)
+{
+    bench_path_result dom = {0.0, 0, 0}, stream = {0.0, 0, 0};
+    json_path *path = json_path_compile(expr);
+    json_value v;
+    size_t heap = BENCH_HEAP();
+    char name[64];
+    clock_t start;
+
+    start = clock();
+    json_init(&v);
+    json_parse(&v, json);
+    dom.heap = BENCH_HEAP() - heap;
+    json_path_eval(path, &v, bench_path_sum, &dom);
+    json_free(&v);
+    sprintf(name, "%s parse+eval", expr);
+    bench_report(name, bench_seconds(start), len);
+    stream.heap = heap = BENCH_HEAP();
+    start = clock();
+    json_path_stream(path, json, bench_path_sum, &stream);
+    sprintf(name, "%s stream", expr);
+    bench_report(name, bench_seconds(start), len);
+    printf("%-40s %8.2f MB %8.2f MB\n", "  peak heap parse+eval, stream", dom.heap / (1024.0 * 1024),
+           (stream.heap - heap) / (1024.0 * 1024));
+    if (dom.count != stream.count || dom.sum != stream.sum)
+        printf("matches disagree\n");
+    json_path_free(path);
+}
+
+static void bench_path(void)
+{
+    char *json;
+    size_t len;
+
+    json = bench_corpus(BENCH_LINES, &len);
+    bench_path_query(json, len, "$[?(@.score > 50000)].id");
+    bench_path_query(json, len, "$[*].geo.lat");
+    bench_path_query(json, len, "$..lon");
+    free(json);
+}
+
+/* routing on "type": the body grows, the field stays at the front */
+static void bench_extract(void)
+{
+    static const size_t records[] = {10, 1000, 100000};
+    json_pointer *type = json_pointer_compile("/type"), *last = json_pointer_compile("/last");
+    json_value v;
+    char *corpus, *body, name[64];
+    size_t len, i, k, rounds;
+    clock_t start;
+
+    for (k = 0; k < sizeof(records) / sizeof(records[0]); k++) {
+        corpus = bench_corpus(records[k], &len);
+        body = (char *) malloc(len + 64);
+        len = sprintf(body, "{\"type\": \"order\", \"payload\": %s, \"last\": 1}", corpus);
+        rounds = 100000000 / len + 1;
+        start = clock();
+        for (i = 0; i < rounds; i++) {
+            json_init(&v);
+            json_parse(&v, body);
+            json_free(&v);
+        }
+        sprintf(name, "%lu B body json_parse", (unsigned long) len);
+        bench_report(name, bench_seconds(start), len * rounds);
+        start = clock();
+        for (i = 0; i < 1000000; i++) {
+            json_init(&v);
+            json_extract(&v, body, type);
+            json_free(&v);
+        }
+        printf("%-40s %8.3f us\n", "  json_extract /type each", bench_seconds(start));
+        start = clock();
+        for (i = 0; i < rounds; i++) {
+            json_init(&v);
+            json_extract(&v, body, last);
+            json_free(&v);
+        }
+        bench_report("  json_extract /last", bench_seconds(start), len * rounds);
+        free(body);
+        free(corpus);
+    }
+    json_pointer_free(type);
+    json_pointer_free(last);
+}
+
+typedef struct {
+    int64_t timestamp;
+    char *host;
+    char *method;
+    int status;
+    double latency;
+    int64_t bytes;
+    int cached;
+} bench_log;
+
+static const json_field bench_log_fields[] = {
+    JSON_FIELD(JSON_FIELD_INT64, bench_log, timestamp),
+    JSON_FIELD(JSON_FIELD_STRING, bench_log, host),
+    JSON_FIELD(JSON_FIELD_STRING, bench_log, method),
+    JSON_FIELD(JSON_FIELD_INT, bench_log, status),
+    JSON_FIELD(JSON_FIELD_DOUBLE, bench_log, latency),
+    JSON_FIELD(JSON_FIELD_INT64, bench_log, bytes),
+    JSON_FIELD(JSON_FIELD_BOOL, bench_log, cached),
+    JSON_FIELD_END
+};
+
+static void bench_struct_from_dom(const json_value *v, bench_log *log)
+{
+    log->timestamp = (int64_t) json_get_number(json_get_object_value(v, "timestamp"));
+    log->host = json_get_string(json_get_object_value(v, "host"));
+    log->method = json_get_string(json_get_object_value(v, "method"));
+    log->status = (int) json_get_number(json_get_object_value(v, "status"));
+    log->latency = json_get_number(json_get_object_value(v, "latency"));
+    log->bytes = (int64_t) json_get_number(json_get_object_value(v, "bytes"));
+    log->cached = json_get_type(json_get_object_value(v, "cached")) == JSON_TRUE;
+}
+
+static void bench_struct(void)
+{
+    json_schema *schema = json_schema_compile(bench_log_fields, 0);
+    json_parse_options options;
+    json_value v;
+    bench_log log;
+    char *buf, *p, *strings;
+    size_t len, i;
+    int64_t dom = 0, shaped = 0, bound = 0;
+    clock_t start;
+
+    buf = bench_ndjson(BENCH_LINES, &len);
+
+    start = clock();
+    for (i = 0, p = buf; i < BENCH_LINES; i++, p += strlen(p) + 1) {
+        json_init(&v);
+        json_parse(&v, p);
+        bench_struct_from_dom(&v, &log);
+        dom += log.bytes + log.host[4];
+        json_free(&v);
+    }
+    bench_report("ndjson json_parse to struct", bench_seconds(start), len);
+
+    options.shape_cache = json_shape_cache_new();
+    options.dedup = NULL;
+    options.flags = 0;
+    start = clock();
+    for (i = 0, p = buf; i < BENCH_LINES; i++, p += strlen(p) + 1) {
+        json_init(&v);
+        json_parse_ex(&v, p, &options);
+        bench_struct_from_dom(&v, &log);
+        shaped += log.bytes + log.host[4];
+        json_free(&v);
+    }
+    bench_report("ndjson shaped json_parse to struct", bench_seconds(start), len);
+    json_shape_cache_free(options.shape_cache);
+
+    start = clock();
+    for (i = 0, p = buf; i < BENCH_LINES; i++, p += strlen(p) + 1) {
+        json_parse_struct(&log, p, schema, &strings);
+        bound += log.bytes + log.host[4];
+        free(strings);
+    }
+    bench_report("ndjson json_parse_struct", bench_seconds(start), len);
+    if (dom != shaped || dom != bound)
+        printf("structs disagree\n");
+    json_schema_free(schema);
+    free(buf);
+}
+
+static int bench_sink_count(void *data, const char *json, size_t len)
+{
+    (void) json;
+    *(size_t *) data += len;
+    return 0;
+}
+
+static void bench_jsonify_struct(void)
+{
+    json_schema *schema = json_schema_compile(bench_log_fields, 0);
+    json_value v, host, method, number[5];
+    bench_log log = {1500000000, "web-07", "GET", 200, 12.345, 4096, 1};
+    char *json;
+    size_t len, total = 0, i, k;
+    clock_t start;
+
+    start = clock();
+    for (i = 0; i < BENCH_LINES; i++) {
+        log.timestamp++;
+        json_init(&v);
+        json_init(&host);
+        json_init(&method);
+        json_set_string(&host, log.host, strlen(log.host));
+        json_set_string(&method, log.method, strlen(log.method));
+        for (k = 0; k < 5; k++)
+            json_init(&number[k]);
+        json_set_number(&number[0], (double) log.timestamp);
+        json_set_number(&number[1], log.status);
+        json_set_number(&number[2], log.latency);
+        json_set_number(&number[3], (double) log.bytes);
+        if (log.cached)
+            json_set_true(&number[4]);
+        else
+            json_set_false(&number[4]);
+        json_object_append(&v, 0, "timestamp", (size_t) 9, &number[0], "host", (size_t) 4, &host, "method", (size_t) 6, &method,
+                           "status", (size_t) 6, &number[1], "latency", (size_t) 7, &number[2], "bytes", (size_t) 5, &number[3],
+                           "cached", (size_t) 6, &number[4], NULL);
+        json = json_jsonify(&v, &len);
+        total += len;
+        free(json);
+        json_free(&v);
+    }
+    bench_report("log tree + json_jsonify", bench_seconds(start), total);
+
+    total = 0;
+    start = clock();
+    for (i = 0; i < BENCH_LINES; i++) {
+        log.timestamp++;
+        json = json_jsonify_struct(&log, schema, &len);
+        total += len;
+        free(json);
+    }
+    bench_report("log json_jsonify_struct", bench_seconds(start), total);
+
+    total = 0;
+    start = clock();
+    for (i = 0; i < BENCH_LINES; i++) {
+        log.timestamp++;
+        json_jsonify_struct_sink(&log, schema, bench_sink_count, &total);
+    }
+    bench_report("log json_jsonify_struct_sink", bench_seconds(start), total);
+    json_schema_free(schema);
+}
+
+static void bench_writer(void)
+{
+    bench_log log = {1500000000, "web-07", "GET", 200, 12.345, 4096, 1};
+    json_writer *w = json_writer_new(NULL, NULL);
+    size_t len, total = 0, i;
+    clock_t start;
+
+    start = clock();
+    for (i = 0; i < BENCH_LINES; i++) {
+        log.timestamp++;
+        json_writer_reset(w);
+        json_writer_begin_object(w);
+        json_writer_key(w, "timestamp", 9);
+        json_writer_number(w, (double) log.timestamp);
+        json_writer_key(w, "host", 4);
+        json_writer_string(w, log.host, strlen(log.host));
+        json_writer_key(w, "method", 6);
+        json_writer_string(w, log.method, strlen(log.method));
+        json_writer_key(w, "status", 6);
+        json_writer_number(w, log.status);
+        json_writer_key(w, "latency", 7);
+        json_writer_number(w, log.latency);
+        json_writer_key(w, "bytes", 5);
+        json_writer_number(w, (double) log.bytes);
+        json_writer_key(w, "cached", 6);
+        json_writer_bool(w, log.cached);
+        json_writer_end_object(w);
+        json_writer_finish(w);
+        json_writer_get_text(w, &len);
+        total += len;
+    }
+    bench_report("log json_writer", bench_seconds(start), total);
+    json_writer_free(w);
+}
+
+/* arrays of strings that are plain ASCII, CJK text, and full of '"', '\', '/' and '\n' */
+static void bench_jsonify_string(void)
+{
+    static const char *const units[] = {"The quick brown fox jumps over the lazy dog. ",
+                                        "\xE4\xBD\xA0\xE5\xA5\xBD\xE4\xB8\x96\xE7\x95\x8C\xEF\xBC\x8C",
+                                        "path/to/file \"q\" \\ \n"};
+    static const char *const names[] = {"ascii", "cjk", "escapes"};
+    json_jsonify_options options;
+    json_value a, e;
+    char name[64], *s, *json;
+    size_t len, size, total, i, k, r;
+    clock_t start;
+
+    for (k = 0; k < 3; k++) {
+        len = strlen(units[k]);
+        s = (char *) malloc(len * 20);
+        for (i = 0; i < 20; i++)
+            memcpy(s + i * len, units[k], len);
+        json_init(&a);
+        json_set_array(&a, 0, NULL);
+        for (i = 0; i < 20000; i++) {
+            json_init(&e);
+            json_set_string(&e, s, len * 20);
+            json_array_push(&a, 0, &e);
+        }
+        free(s);
+        for (options.flags = 0; options.flags <= JSON_JSONIFY_RAW_UTF8; options.flags += JSON_JSONIFY_RAW_UTF8) {
+            total = 0;
+            start = clock();
+            for (r = 0; r < 20; r++) {
+                json = json_jsonify_ex(&a, &size, &options);
+                total += len * 20 * 20000;
+                free(json);
+            }
+            sprintf(name, "%s jsonify%s (%lu bytes)", names[k], options.flags ? " raw utf-8" : "", (unsigned long) size);
+            bench_report(name, bench_seconds(start), total);
+        }
+        json_free(&a);
+    }
+}
+
+static int bench_sink_discard(void *data, const char *json, size_t len)
+{
+    (void) json;
+    *(size_t *) data += len;
+    return 0;
+}
+
+/* the NDJSON lines as one pretty array, reformatted token by token and through a tree */
+static void bench_format(void)
+{
+    char *lines, *json, *p, *text;
+    size_t len, size, i;
+    json_value v;
+    clock_t start;
+
+    lines = bench_ndjson(BENCH_LINES, &len);
+    json = p = (char *) malloc(len * 2);
+    for (*p++ = '[', i = 0; i < len; i += strlen(lines + i) + 1)
+        p += sprintf(p, "%s\n    %s", i ? "," : "", lines + i);
+    strcpy(p, "\n]");
+    len = p + 2 - json;
+    free(lines);
+
+    start = clock();
+    json_init(&v);
+    json_parse(&v, json);
+    text = json_jsonify(&v, NULL);
+    bench_report("format parse + jsonify", bench_seconds(start), len);
+    json_free(&v);
+    free(text);
+
+    start = clock();
+    text = json_minify(json, &size);
+    bench_report("format json_minify", bench_seconds(start), len);
+    free(text);
+
+    start = clock();
+    text = json_prettify(json, 2, &size);
+    bench_report("format json_prettify", bench_seconds(start), len);
+    free(text);
+
+    size = 0;
+    start = clock();
+    json_minify_sink(json, bench_sink_discard, &size);
+    bench_report("format json_minify_sink", bench_seconds(start), len);
+    free(json);
+}
+
+/* the NDJSON lines as one array, through text, CBOR and MessagePack */
+static void bench_binary(void)
+{
+    static const struct {
+        const char *name;
+        char *(*to)(const json_value *v, size_t *len);
+        int (*from)(json_value *v, const void *data, size_t len);
+    } formats[] = {{"cbor", json_to_cbor, json_from_cbor}, {"msgpack", json_to_msgpack, json_from_msgpack}};
+    char *lines, *json, *p, name[64];
+    size_t len, size, i, k;
+    json_value v, back;
+    clock_t start;
+
+    lines = bench_ndjson(BENCH_LINES, &len);
+    json = p = (char *) malloc(len + 2);
+    for (*p++ = '[', i = 0; i < len; i += strlen(lines + i) + 1)
+        p += sprintf(p, "%s%s", i ? "," : "", lines + i);
+    strcpy(p, "]");
+    len = p + 1 - json;
+    free(lines);
+    json_init(&v);
+
+    start = clock();
+    json_parse(&v, json);
+    sprintf(name, "binary json_parse (%lu bytes)", (unsigned long) len);
+    bench_report(name, bench_seconds(start), len);
+    start = clock();
+    p = json_jsonify(&v, &size);
+    bench_report("binary json_jsonify", bench_seconds(start), size);
+    free(p);
+
+    for (k = 0; k < sizeof(formats) / sizeof(formats[0]); k++) {
+        start = clock();
+        p = formats[k].to(&v, &size);
+        sprintf(name, "binary to %s (%lu bytes)", formats[k].name, (unsigned long) size);
+        bench_report(name, bench_seconds(start), size);
+        start = clock();
+        formats[k].from(&back, p, size);
+        sprintf(name, "binary from %s", formats[k].name);
+        bench_report(name, bench_seconds(start), size);
+        json_free(&back);
+        free(p);
+    }
+    json_free(&v);
+    free(json);
+}
+
+/* startup from text against startup from a saved snapshot of the same corpus */
+static void bench_tape_snapshot(void)
+{
+    static const char *path = "json_bench.tape";
+    json_tape t;
+    char *json;
+    size_t len;
+    double sum = 0.0;
+    clock_t start;
+
+    json = bench_corpus(BENCH_LINES, &len);
+    start = clock();
+    json_tape_parse(&t, json);
+    bench_report("snapshot json_tape_parse", bench_seconds(start), len);
+    free(json);
+    len = t.size * sizeof(uint64_t) + t.strings_size;
+    start = clock();
+    json_tape_save(&t, path);
+    bench_report("snapshot json_tape_save", bench_seconds(start), len);
+    json_tape_free(&t);
+
+    start = clock();
+    json_tape_load(&t, path, 0);
+    bench_report("snapshot json_tape_load", bench_seconds(start), len);
+    json_tape_free(&t);
+    start = clock();
+    json_tape_load(&t, path, JSON_TAPE_TRUSTED);
+    printf("%-40s %8.6f s\n", "snapshot json_tape_load trusted", bench_seconds(start));
+    start = clock();
+    sum += bench_tape_walk(&t);
+    bench_report("snapshot first walk", bench_seconds(start), len);
+    json_tape_free(&t);
+    remove(path);
+    if (sum <= 0)
+        printf("empty snapshot\n");
+}
+
+/* arrays of counters and of 64-bit IDs */
+static void bench_integer(void)
+{
+    char *json, *p, *text;
+    size_t len, size, i, k;
+    json_value v;
+    clock_t start;
+
+    for (k = 0; k < 2; k++) {
+        json = p = (char *) malloc(BENCH_LINES * 10 * 22 + 2);
+        *p++ = '[';
+        for (i = 0; i < BENCH_LINES * 10; i++)
+            p += k ? sprintf(p, "%s%llu", i ? "," : "", 1000000000000000000ULL + (unsigned long long) i * 7919)
+                   : sprintf(p, "%s%lu", i ? "," : "", (unsigned long) (i * 37 % 65536));
+        strcpy(p, "]");
+        len = p + 1 - json;
+        start = clock();
+        json_init(&v);
+        json_parse(&v, json);
+        bench_report(k ? "integer ids json_parse" : "integer counters json_parse", bench_seconds(start), len);
+        start = clock();
+        text = json_jsonify(&v, &size);
+        bench_report(k ? "integer ids json_jsonify" : "integer counters json_jsonify", bench_seconds(start), size);
+        free(text);
+        json_free(&v);
+        free(json);
+    }
+}
+
+/* metrics: series of samples, each an array of numbers */
+static void bench_doubles(void)
+{
+    static const char *names[] = { "numeric arrays json_parse", "numeric arrays packed" };
+    json_parse_options options;
+    char *json, *p, *text;
+    const double *d;
+    size_t len, size, heap, i, j, n;
+    json_value v, *series;
+    double sum;
+    clock_t start;
+    int pack;
+
+    json = p = (char *) malloc(BENCH_LINES * 10 * 12 + 2);
+    *p++ = '[';
+    for (i = 0; i < BENCH_LINES / 100; i++)
+        for (j = 0; j < 1000; j++)
+            p += sprintf(p, "%s%.3f%s", j ? "," : i ? ",[" : "[", (double) ((i * 1000 + j) * 7 % 100000) / 1000, j == 999 ? "]" : "");
+    strcpy(p, "]");
+    len = p + 1 - json;
+
+    options.shape_cache = NULL;
+    options.dedup = NULL;
+    for (pack = 0; pack < 2; pack++) {
+        options.flags = pack ? JSON_PARSE_PACK : 0;
+        heap = BENCH_HEAP();
+        start = clock();
+        json_init(&v);
+        json_parse_ex(&v, json, &options);
+        bench_report(names[pack], bench_seconds(start), len);
+        printf("%-40s %8.2f MB\n", "    heap", (BENCH_HEAP() - heap) / (1024.0 * 1024));
+        start = clock();
+        text = json_jsonify(&v, &size);
+        bench_report("    json_jsonify", bench_seconds(start), size);
+        free(text);
+        start = clock();
+        sum = 0;
+        for (i = 0; i < json_get_array_size(&v); i++) {
+            series = json_get_array_element(&v, i);
+            if ((d = json_get_array_doubles(series, &n)) != NULL)
+                for (j = 0; j < n; j++)
+                    sum += d[j];
+            else
+                for (j = 0; j < n; j++)
+                    sum += json_get_number(json_get_array_element(series, j));
+        }
+        bench_report("    sum", bench_seconds(start), BENCH_LINES * 10 * sizeof(double));
+        printf("%-40s %8.0f\n", "    checksum", sum);
+        json_free(&v);
+    }
+    free(json);
+}
+
+/* aggregate two fields of the NDJSON records as one array: walking the tree, and over columns */
+static void bench_shred(void)
+{
+    static const char *paths[] = { "/latency", "/status" };
+    json_column columns[2];
+    json_value v;
+    const json_value *row;
+    char *lines, *json, *p, *q;
+    size_t len, i, count = 0, rounds;
+    double sum = 0;
+    clock_t start;
+
+    lines = bench_ndjson(BENCH_LINES, &len);
+    json = p = (char *) malloc(len + 2);
+    *p++ = '[';
+    for (i = 0, q = lines; i < BENCH_LINES; i++, q += strlen(q) + 1)
+        p += sprintf(p, "%s%s", i ? "," : "", q);
+    strcpy(p, "]");
+    json_init(&v);
+    json_parse(&v, json);
+
+    start = clock();
+    for (rounds = 0; rounds < 10; rounds++)
+        for (i = 0; i < BENCH_LINES; i++) {
+            row = json_get_array_element(&v, i);
+            sum += json_get_number(json_get_object_value(row, "latency"));
+            count += json_get_number(json_get_object_value(row, "status")) == 404;
+        }
+    bench_report("records scan tree x10", bench_seconds(start), BENCH_LINES * 10 * 2 * sizeof(double));
+
+    start = clock();
+    json_shred(columns, &v, paths, 2);
+    bench_report("records json_shred", bench_seconds(start), BENCH_LINES * 2 * sizeof(double));
+    start = clock();
+    for (rounds = 0; rounds < 10; rounds++)
+        for (i = 0; i < BENCH_LINES; i++) {
+            sum -= columns[0].numbers[i];
+            count -= columns[1].numbers[i] == 404;
+        }
+    bench_report("records scan columns x10", bench_seconds(start), BENCH_LINES * 10 * 2 * sizeof(double));
+    printf("%-40s %8.0f %8lu\n", "records checksum (0 0)", sum, (unsigned long) count);
+    json_column_free(&columns[0]);
+    json_column_free(&columns[1]);
+    json_free(&v);
+    free(json);
+    free(lines);
+}
+
+/* a window of log lines kept parsed: repeated hosts, agents, paths and small subobjects */
+static void bench_dedup(void)
+{
+    static const char *agents[] = {
+        "Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36",
+        "Mozilla/5.0 (Macintosh; Intel Mac OS X 14_2) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/17.2 Safari/605.1.15",
+        "Mozilla/5.0 (X11; Linux x86_64; rv:121.0) Gecko/20100101 Firefox/121.0",
+        "curl/8.5.0"
+    };
+    json_parse_options options;
+    json_dedup_stats stats;
+    json_value *window;
+    char *buf, *p;
+    size_t len, heap, i;
+    clock_t start;
+    int mode;
+    static const char *names[] = { "log window json_parse", "log window shape cache", "log window shape cache + dedup" };
+
+    buf = p = (char *) malloc(BENCH_LINES * 512);
+    for (i = 0; i < BENCH_LINES; i++)
+        p += sprintf(p, "{\"ts\": %lu, \"host\": \"web-%02lu.eu-west.example.com\", \"method\": \"%s\", \"path\": \"/api/v1/items/%lu\", "
+                        "\"status\": %d, \"agent\": \"%s\", \"geo\": {\"dc\": \"eu-west-%lu\", \"rack\": %lu}}",
+                     (unsigned long) (1500000000 + i), (unsigned long) (i % 32), i % 5 ? "GET" : "POST", (unsigned long) (i % 100),
+                     i % 7 ? 200 : 404, agents[i % 4], (unsigned long) (i % 3), (unsigned long) (i % 8)) + 1;
+    len = p - buf;
+    window = (json_value *) malloc(sizeof(json_value) * BENCH_LINES);
+    options.flags = 0;
+    for (mode = 0; mode < 3; mode++) {
+        options.shape_cache = mode ? json_shape_cache_new() : NULL;
+        options.dedup = mode == 2 ? json_dedup_new(4) : NULL;
+        heap = BENCH_HEAP();
+        start = clock();
+        for (i = 0, p = buf; i < BENCH_LINES; i++, p += strlen(p) + 1) {
+            json_init(&window[i]);
+            json_parse_ex(&window[i], p, &options);
+        }
+        bench_report(names[mode], bench_seconds(start), len);
+        printf("%-40s %8.2f MB\n", "    heap", (BENCH_HEAP() - heap) / (1024.0 * 1024));
+        if (options.dedup) {
+            json_dedup_get_stats(options.dedup, &stats);
+            printf("%-40s %8.2f x %8lu entries %8.2f MB saved\n", "    dedup ratio", (double) stats.lookups / (stats.lookups - stats.hits),
+                   (unsigned long) stats.entries, stats.bytes_saved / (1024.0 * 1024));
+            json_dedup_free(options.dedup);
+        }
+        json_shape_cache_free(options.shape_cache);
+        for (i = 0; i < BENCH_LINES; i++)
+            json_free(&window[i]);
+    }
+    free(window);
+    free(buf);
+}
+
+int main(void)
+{
+    bench_shape();
+    bench_tape();
+    bench_compact();
+    bench_object();
+    bench_copy();
+    bench_share();
+    bench_equal();
+    bench_diff();
+    bench_pointer();
+    bench_path();
+    bench_extract();
+    bench_struct();
+    bench_jsonify_struct();
+    bench_writer();
+    bench_jsonify_string();
+    bench_format();
+    bench_binary();
+    bench_tape_snapshot();
+    bench_integer();
+    bench_lazy();
+    bench_doubles();
+    bench_shred();
+    bench_dedup();
+    return 0;
+}
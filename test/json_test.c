@@ -86,6 +86,87 @@ static void test_parse_number(void)
     TEST_PARSE_NUMBER(0.0, "1E-10000");
 }
 
+/* 'json' is an exact integer: it jsonifies back to itself and reads as 'i' and 'u' */
+#define TEST_PARSE_INTEGER(i, u, json) \
+    do { \
+        json_value v; \
+        char *p; \
+        size_t len; \
+        json_init(&v); \
+        ASSERT_EQ_INT(JSON_PARSE_OK, json_parse(&v, json)); \
+        ASSERT_EQ_INT(JSON_NUMBER, json_get_type(&v)); \
+        ASSERT_EQ_BASE((int64_t) (i) == json_get_int64(&v), (long long) (i), (long long) json_get_int64(&v), "%lld"); \
+        ASSERT_EQ_BASE((uint64_t) (u) == json_get_uint64(&v), (unsigned long long) (u), (unsigned long long) json_get_uint64(&v), "%llu"); \
+        p = json_jsonify(&v, &len); \
+        ASSERT_EQ_STRING(json, p, len); \
+        free(p); \
+        json_free(&v); \
+    } while (0)
+
+static void test_parse_integer(void)
+{
+    json_value a, b;
+    char *p;
+    size_t len;
+
+    TEST_PARSE_INTEGER(0, 0, "0");
+    TEST_PARSE_INTEGER(-1, 0, "-1");
+    TEST_PARSE_INTEGER(1234567, 1234567, "1234567");
+    TEST_PARSE_INTEGER(9007199254740993LL, 9007199254740993ULL, "9007199254740993");
+    TEST_PARSE_INTEGER(-9007199254740993LL, 0, "-9007199254740993");
+    TEST_PARSE_INTEGER(INT64_MAX, (uint64_t) INT64_MAX, "9223372036854775807");
+    TEST_PARSE_INTEGER(INT64_MIN, 0, "-9223372036854775808");
+    TEST_PARSE_INTEGER(INT64_MAX, (uint64_t) INT64_MAX + 1, "9223372036854775808");
+    TEST_PARSE_INTEGER(INT64_MAX, UINT64_MAX, "18446744073709551615");
+    TEST_PARSE_NUMBER(9007199254740993.0, "9007199254740993");
+    TEST_PARSE_NUMBER(18446744073709551616.0, "18446744073709551616");
+    TEST_PARSE_NUMBER(-9223372036854775809.0, "-9223372036854775809");
+
+    /* the rest are doubles, and read as integers truncated and clamped */
+    json_init(&a);
+    json_parse(&a, "-0");
+    p = json_jsonify(&a, &len);
+    ASSERT_EQ_STRING("-0", p, len);
+    free(p);
+    json_parse(&a, "1.9");
+    ASSERT_EQ_BASE(1 == json_get_int64(&a), 1, (int) json_get_int64(&a), "%d");
+    json_parse(&a, "-1e30");
+    ASSERT_EQ_BASE(INT64_MIN == json_get_int64(&a), 0, 0, "%d");
+    ASSERT_EQ_BASE(0 == json_get_uint64(&a), 0, 0, "%d");
+    json_parse(&a, "1e30");
+    ASSERT_EQ_BASE(INT64_MAX == json_get_int64(&a), 0, 0, "%d");
+    ASSERT_EQ_BASE(UINT64_MAX == json_get_uint64(&a), 0, 0, "%d");
+
+    /* integers that share a double are told apart, and an integer equals the same double */
+    json_init(&b);
+    json_parse(&a, "9007199254740993");
+    json_parse(&b, "9007199254740992");
+    ASSERT_EQ_INT(0, json_equal(&a, &b));
+    ASSERT_EQ_DOUBLE(json_get_number(&a), json_get_number(&b));
+    json_set_number(&b, 5);
+    json_set_int64(&a, 5);
+    ASSERT_EQ_INT(1, json_equal(&a, &b));
+    json_set_uint64(&a, UINT64_MAX);
+    json_copy(&b, &a);
+    ASSERT_EQ_INT(1, json_equal(&a, &b));
+    p = json_jsonify(&b, &len);
+    ASSERT_EQ_STRING("18446744073709551615", p, len);
+    free(p);
+
+    /* and go through the binary formats exactly */
+    p = json_to_cbor(&a, &len);
+    ASSERT_EQ_STRING("\x1B\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF", p, len);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_from_cbor(&b, p, len));
+    ASSERT_EQ_INT(1, json_equal(&a, &b));
+    free(p);
+    json_set_int64(&a, -9007199254740993LL);
+    p = json_to_msgpack(&a, &len);
+    ASSERT_EQ_STRING("\xD3\xFF\xDF\xFF\xFF\xFF\xFF\xFF\xFF", p, len);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_from_msgpack(&b, p, len));
+    ASSERT_EQ_BASE(-9007199254740993LL == json_get_int64(&b), 0, 0, "%d");
+    free(p);
+}
+
 static void test_parse_string(void)
 {
     TEST_PARSE_STRING("", "\"\"");
@@ -105,6 +186,7 @@ static void test_parse_string(void)
     TEST_PARSE_STRING("\xE2\x82\xAC", "\"\\u20AC\"");
     TEST_PARSE_STRING("\xF0\x9D\x84\x9E", "\"\\ud834\\udd1e\"");
     TEST_PARSE_STRING("\xF0\x9D\x84\x9E", "\"\\uD834\\uDD1E\"");
+    TEST_PARSE_STRING("\xE2\x82\xAC", "\"\xE2\x82\xAC\"");
 }
 
 static void test_parse_array(void)
@@ -537,6 +619,80 @@ static void test_jsonify_object(void)
     }
 }
 
+#define TEST_JSONIFY_EX(expect, string, len, jsonify_flags) \
+    do { \
+        json_value v; \
+        json_jsonify_options options; \
+        char *p; \
+        size_t n; \
+        json_init(&v); \
+        json_set_string(&v, string, len); \
+        options.flags = jsonify_flags; \
+        p = json_jsonify_ex(&v, &n, &options); \
+        ASSERT_EQ_STRING(expect, p, n); \
+        free(p); \
+        json_free(&v); \
+    } while (0)
+
+static void test_jsonify_options(void)
+{
+    json_value v, s;
+    json_jsonify_options options;
+    char long_string[100], expect[200], *p;
+    size_t len, i;
+
+    TEST_JSONIFY_EX("\"a\\/b\"", "a/b", 3, 0);
+    TEST_JSONIFY_EX("\"a/b\"", "a/b", 3, JSON_JSONIFY_UNESCAPED_SLASH);
+    TEST_JSONIFY_EX("\"\\u20AC/\"", "\xE2\x82\xAC/", 4, JSON_JSONIFY_UNESCAPED_SLASH);
+    TEST_JSONIFY_EX("\"\xC2\xA2 \xE2\x82\xAC \xF0\x9D\x84\x9E\"", "\xC2\xA2 \xE2\x82\xAC \xF0\x9D\x84\x9E", 11, JSON_JSONIFY_RAW_UTF8);
+    TEST_JSONIFY_EX("\"\xE2\x82\xAC\\/\\n\\u0001\"", "\xE2\x82\xAC/\n\x01", 6, JSON_JSONIFY_RAW_UTF8);
+    TEST_JSONIFY_EX("\"\xE2\x82\xAC/\"", "\xE2\x82\xAC/", 4, JSON_JSONIFY_RAW_UTF8 | JSON_JSONIFY_UNESCAPED_SLASH);
+
+    /* escapes at every offset of runs longer than a scan block */
+    for (i = 0; i < 40; i++) {
+        memset(long_string, 'a', 40);
+        long_string[i] = (i & 1) ? '\"' : '\x1F';
+        json_init(&v);
+        json_set_string(&v, long_string, 40);
+        p = json_jsonify(&v, &len);
+        memset(expect, 'a', sizeof(expect));
+        expect[0] = '\"';
+        memcpy(expect + i + 1, (i & 1) ? "\\\"" : "\\u001F", (i & 1) ? 2 : 6);
+        expect[(i & 1) ? 42 : 46] = '\"';
+        expect[(i & 1) ? 43 : 47] = '\0';
+        ASSERT_EQ_BASE(len == ((i & 1) ? 43u : 47u) && !memcmp(expect, p, len), expect, p, "%s");
+        free(p);
+        json_free(&v);
+    }
+    memset(long_string, 'a', 40);
+    memcpy(long_string + 37, "\xE2\x82\xAC", 3);
+    options.flags = JSON_JSONIFY_RAW_UTF8;
+    json_init(&v);
+    json_set_string(&v, long_string, 40);
+    p = json_jsonify_ex(&v, &len, &options);
+    ASSERT_EQ_SIZE_T(42, len);
+    free(p);
+    json_free(&v);
+    json_set_string(&v, long_string, 39);
+    ASSERT_EQ_POINTER(NULL, json_jsonify_ex(&v, NULL, &options));
+    json_free(&v);
+
+    /* raw UTF-8 reads back through the parser */
+    json_init(&v);
+    json_init(&s);
+    json_set_string(&s, "\xE6\x97\xA5\xE6\x9C\xAC\xE8\xAA\x9E / \xF0\x9F\x98\x80", 16);
+    json_set_array(&v, 0, &s, NULL);
+    options.flags = JSON_JSONIFY_RAW_UTF8 | JSON_JSONIFY_UNESCAPED_SLASH;
+    p = json_jsonify_ex(&v, &len, &options);
+    ASSERT_EQ_STRING("[\"\xE6\x97\xA5\xE6\x9C\xAC\xE8\xAA\x9E / \xF0\x9F\x98\x80\"]", p, len);
+    json_free(&v);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse(&v, p));
+    ASSERT_EQ_STRING("\xE6\x97\xA5\xE6\x9C\xAC\xE8\xAA\x9E / \xF0\x9F\x98\x80", json_get_string(json_get_array_element(&v, 0)),
+                     json_get_string_length(json_get_array_element(&v, 0)));
+    json_free(&v);
+    free(p);
+}
+
 static void test_modify_array(void)
 {
     json_value a, e, *p;
@@ -553,6 +709,194 @@ static void test_modify_array(void)
     TEST_JSONIFY_OK("[false]", &a);
 }
 
+static void test_array_push(void)
+{
+    json_value a, e;
+    size_t i;
+
+    json_init(&a);
+    for (i = 0; i < 100; i++) {
+        json_init(&e);
+        json_set_number(&e, (double) i);
+        json_array_push(&a, 0, &e);
+    }
+    ASSERT_EQ_SIZE_T(100, json_get_array_size(&a));
+    ASSERT_EQ_INT(1, a.array_capacity >= 100 && a.array_capacity < 200);
+    for (i = 0; i < 100; i++)
+        ASSERT_EQ_DOUBLE((double) i, json_get_number(json_get_array_element(&a, i)));
+    for (i = 0; i < 98; i++)
+        json_array_remove(&a, 1);
+    TEST_JSONIFY_OK("[0, 99]", &a);
+
+    json_init(&a);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse(&a, "[\"b\"]"));
+    json_array_reserve(&a, 8);
+    ASSERT_EQ_SIZE_T(8, a.array_capacity);
+    json_init(&e);
+    json_set_string(&e, "a", 1);
+    json_array_insert(&a, 0, 1, &e);
+    json_free(&e);
+    /* deepcopy of an element of itself */
+    json_array_insert(&a, 2, 1, json_get_array_element(&a, 0));
+    json_array_insert(&a, 1, 1, json_get_array_element(&a, 2));
+    TEST_JSONIFY_OK("[\"a\", \"a\", \"b\", \"a\"]", &a);
+
+    json_init(&a);
+    json_set_array(&a, 0, NULL);
+    json_init(&e);
+    json_set_true(&e);
+    json_array_push(&a, 0, &e);
+    json_array_remove(&a, 0);
+    json_array_push(&a, 0, &e);
+    TEST_JSONIFY_OK("[true]", &a);
+
+    /* other values are freed first, a reference releases what it shares */
+    json_init(&a);
+    json_set_string(&a, "s", 1);
+    json_array_reserve(&a, 4);
+    ASSERT_EQ_SIZE_T(0, json_get_array_size(&a));
+    json_free(&a);
+    json_set_string(&e, "shared", 6);
+    json_share(&a, &e);
+    json_array_push(&a, 0, &e);
+    TEST_JSONIFY_OK("[\"shared\"]", &a);
+}
+
+static void test_array_doubles(void)
+{
+    json_parse_options options;
+    json_value a, b, patch, *c, *e;
+    json_pointer *p;
+    const double *d;
+    char *cbor;
+    size_t n, len;
+
+    options.shape_cache = NULL;
+    options.dedup = NULL;
+    options.flags = JSON_PARSE_PACK;
+
+    /* Arrays of numbers are packed when asked to */
+    json_init(&a);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse_ex(&a, "[1, 2.5, -3e2, 9007199254740992, -0]", &options));
+    ASSERT_EQ_INT(JSON_FLAG_PACKED, a.flags);
+    d = json_get_array_doubles(&a, &n);
+    ASSERT_EQ_SIZE_T(5, n);
+    ASSERT_EQ_POINTER((const double *) a.array_doubles, d);
+    ASSERT_EQ_DOUBLE(2.5, d[1]);
+    ASSERT_EQ_DOUBLE(-300.0, d[2]);
+    ASSERT_EQ_DOUBLE(9007199254740992.0, d[3]);
+    json_copy(&b, &a);
+    ASSERT_EQ_INT(JSON_FLAG_PACKED, b.flags);
+    ASSERT_EQ_INT(1, json_equal(&a, &b));
+
+    /* Only json_array_unpack and json_array_pack convert the array */
+    json_array_unpack(&b);
+    ASSERT_EQ_INT(0, b.flags);
+    ASSERT_EQ_POINTER(NULL, json_get_array_doubles(&b, &n));
+    ASSERT_EQ_INT(1, json_equal(&a, &b));
+    ASSERT_EQ_INT(1, json_hash(&a) == json_hash(&b));
+    json_array_pack(&b);
+    ASSERT_EQ_INT(JSON_FLAG_PACKED, b.flags);
+    ASSERT_EQ_DOUBLE(1.0, json_get_array_doubles(&b, &n)[0]);
+    json_free(&b);
+    TEST_JSONIFY_OK("[1, 2.5, -300, 9007199254740992, -0]", &a);
+
+    /* Reading the numbers keeps the elements handed out before */
+    json_init(&a);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse(&a, "[1, 2, 3]"));
+    ASSERT_EQ_INT(0, a.flags);
+    e = json_get_array_element(&a, 0);
+    ASSERT_EQ_POINTER(NULL, json_get_array_doubles(&a, &n));
+    ASSERT_EQ_SIZE_T(3, n);
+    ASSERT_EQ_POINTER(json_get_array_element(&a, 0), e);
+    ASSERT_EQ_DOUBLE(1.0, json_get_number(e));
+    json_free(&a);
+
+    /* Other arrays are not packed */
+    json_init(&a);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse_ex(&a, "[1, 9007199254740993]", &options));
+    ASSERT_EQ_INT(0, a.flags);
+    ASSERT_EQ_POINTER(NULL, json_get_array_doubles(&a, &n));
+    ASSERT_EQ_SIZE_T(2, n);
+    TEST_JSONIFY_OK("[1, 9007199254740993]", &a);
+    json_init(&a);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse_ex(&a, "[1, \"a\"]", &options));
+    ASSERT_EQ_POINTER(NULL, json_get_array_doubles(&a, &n));
+    json_array_pack(&a);
+    ASSERT_EQ_INT(0, a.flags);
+    json_free(&a);
+    json_init(&a);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse_ex(&a, "[]", &options));
+    ASSERT_EQ_POINTER(NULL, json_get_array_doubles(&a, &n));
+    ASSERT_EQ_SIZE_T(0, n);
+    json_free(&a);
+
+    /* Readers take the elements as copies, modifications and patches unpack */
+    json_init(&a);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse_ex(&a, "[[1, 2, 3], [1, 5, 3]]", &options));
+    ASSERT_EQ_POINTER(NULL, json_get_array_element(json_get_array_element(&a, 1), 1));
+    for (n = 0; n < 3; n++) {
+        c = (json_value *) json_array_at(json_get_array_element(&a, 1), n, &b);
+        ASSERT_EQ_POINTER(&b, c);
+        ASSERT_EQ_INT(JSON_NUMBER, json_get_type(c));
+        ASSERT_EQ_DOUBLE(n == 1 ? 5.0 : (double) (n + 1), json_get_number(c));
+    }
+    p = json_pointer_compile("/1/1");
+    ASSERT_EQ_POINTER(&b, json_pointer_get(&a, p, &b));
+    ASSERT_EQ_DOUBLE(5.0, json_get_number(&b));
+    json_init(&patch);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse(&patch, "[{\"op\": \"test\", \"path\": \"/1/1\", \"value\": 5}, {\"op\": \"copy\", \"from\": \"/1/1\", \"path\": \"/-\"}]"));
+    json_copy(&b, &a);
+    ASSERT_EQ_INT(JSON_PATCH_OK, json_patch_apply(&b, &patch));
+    json_free(&patch);
+    TEST_JSONIFY_OK("[[1, 2, 3], [1, 5, 3], 5]", &b);
+    json_init(&patch);
+    json_diff(&patch, json_get_array_element(&a, 0), json_get_array_element(&a, 1));
+    ASSERT_EQ_INT(JSON_FLAG_PACKED, json_get_array_element(&a, 0)->flags);
+    ASSERT_EQ_INT(JSON_PATCH_OK, json_patch_apply(json_get_array_element(&a, 0), &patch));
+    json_free(&patch);
+    ASSERT_EQ_INT(0, json_get_array_element(&a, 0)->flags);
+    json_pointer_free(p);
+    ASSERT_EQ_DOUBLE(5.0, json_get_number(json_pointer_get(&a, p = json_pointer_compile("/0/1"), &b)));
+    json_pointer_free(p);
+    json_init(&b);
+    json_set_true(&b);
+    json_array_push(json_get_array_element(&a, 1), 0, &b);
+    TEST_JSONIFY_OK("[[1, 5, 3], [1, 5, 3, true]]", &a);
+    json_init(&a);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse_ex(&a, "[1, 2]", &options));
+    json_init(&patch);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse(&patch, "[{\"op\": \"replace\", \"path\": \"/0\", \"value\": \"x\"}, {\"op\": \"remove\", \"path\": \"/1\"}]"));
+    ASSERT_EQ_INT(JSON_PATCH_OK, json_patch_apply(&a, &patch));
+    json_free(&patch);
+    TEST_JSONIFY_OK("[\"x\"]", &a);
+
+    /* Decoded arrays are packed on request, compacted and lazily parsed ones are not */
+    json_init(&a);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse_ex(&a, "{\"a\": [0.5, 1, 2]}", &options));
+    cbor = json_to_cbor(&a, &len);
+    json_init(&b);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_from_cbor(&b, cbor, len));
+    free(cbor);
+    ASSERT_EQ_INT(0, json_get_object_value(&b, "a")->flags);
+    ASSERT_EQ_INT(1, json_equal(&a, &b));
+    json_array_pack(json_get_object_value(&b, "a"));
+    ASSERT_EQ_INT(JSON_FLAG_PACKED, json_get_object_value(&b, "a")->flags);
+    json_free(&b);
+    c = json_compact(&a);
+    ASSERT_EQ_POINTER(NULL, json_get_array_doubles(json_get_object_value(c, "a"), &n));
+    TEST_JSONIFY_OK("{\"a\": [0.5, 1, 2]}", c);
+    free(c);
+    options.flags = JSON_PARSE_LAZY | JSON_PARSE_PACK;
+    json_init(&a);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse_ex(&a, "[1.50, 2]", &options));
+    ASSERT_EQ_INT(0, a.flags);
+    json_array_pack(&a);
+    d = json_get_array_doubles(&a, &n);
+    ASSERT_EQ_DOUBLE(1.5, d[0]);
+    TEST_JSONIFY_OK("[1.5, 2]", &a);
+}
+
 static void test_modify_object(void)
 {
     json_value o, t, *v;
@@ -571,12 +915,1936 @@ static void test_modify_object(void)
     TEST_JSONIFY_OK("{\"True\": false}", &o);
 }
 
+static void test_parse_shape(void)
+{
+    json_shape_cache *cache;
+    json_parse_options options;
+    json_value a, b, c, *e;
+    size_t i;
+
+    cache = json_shape_cache_new();
+    options.shape_cache = cache;
+    options.dedup = NULL;
+    options.flags = 0;
+    json_init(&a);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse_ex(&a, "{\"id\": 1, \"name\": \"a\", \"tags\": [{\"k\": 0}, {\"k\": 1}]}", &options));
+    json_init(&b);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse_ex(&b, "{\"id\":2,\"name\":\"b\",\"tags\":[]}", &options));
+    ASSERT_EQ_SIZE_T(3, json_get_object_size(&b));
+    for (i = 0; i < 3; i++) {
+        ASSERT_EQ_POINTER(json_get_object_key(&a, i), json_get_object_key(&b, i));
+        ASSERT_EQ_SIZE_T(json_get_object_key_length(&a, i), json_get_object_key_length(&b, i));
+    }
+    ASSERT_EQ_DOUBLE(2.0, json_get_number(json_get_object_value(&b, "id")));
+    ASSERT_EQ_STRING("b", json_get_string(json_get_object_value(&b, "name")), json_get_string_length(json_get_object_value(&b, "name")));
+    e = json_get_object_value(&a, "tags");
+    ASSERT_EQ_POINTER(json_get_object_key(json_get_array_element(e, 0), 0), json_get_object_key(json_get_array_element(e, 1), 0));
+    ASSERT_EQ_POINTER(NULL, json_get_object_value(&a, "none"));
+
+    /* Different order, escaped keys, and errors */
+    json_init(&c);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse_ex(&c, "{\"name\": \"c\", \"i\\u0064\": 3}", &options));
+    ASSERT_EQ_STRING("name", json_get_object_key(&c, 0), json_get_object_key_length(&c, 0));
+    ASSERT_EQ_DOUBLE(3.0, json_get_number(json_get_object_value(&c, "id")));
+    json_free(&c);
+    json_init(&c);
+    ASSERT_EQ_INT(JSON_PARSE_ERROR, json_parse_ex(&c, "{\"id\": 1, \"name\": }", &options));
+    ASSERT_EQ_INT(JSON_PARSE_ERROR, json_parse_ex(&c, "{\"id\": 1, \"name\"", &options));
+    ASSERT_EQ_INT(JSON_PARSE_ERROR, json_parse_ex(&c, "{\"id\": 1, \"nam", &options));
+    ASSERT_EQ_INT(JSON_NULL, json_get_type(&c));
+
+    /* Index of large objects */
+    json_init(&c);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse_ex(&c, "{\"0\":0,\"1\":1,\"2\":2,\"3\":3,\"4\":4,\"5\":5,\"6\":6,\"7\":7,\"8\":8,\"9\":9}", &options));
+    ASSERT_EQ_DOUBLE(0.0, json_get_number(json_get_object_value(&c, "0")));
+    ASSERT_EQ_DOUBLE(9.0, json_get_number(json_get_object_value(&c, "9")));
+    ASSERT_EQ_POINTER(NULL, json_get_object_value(&c, "10"));
+    json_free(&c);
+
+    /* Documents outlive the cache, and modified objects own their keys */
+    json_shape_cache_free(cache);
+    json_init(&c);
+    json_set_true(&c);
+    json_object_append(&b, 0, "ok", (size_t) 2, &c, NULL);
+    TEST_JSONIFY_OK("{\"id\": 2, \"name\": \"b\", \"tags\": [], \"ok\": true}", &b);
+    TEST_JSONIFY_OK("{\"id\": 1, \"name\": \"a\", \"tags\": [{\"k\": 0}, {\"k\": 1}]}", &a);
+}
+
+static void test_parse_lazy(void)
+{
+    static const char *valid[] = {
+        "1.7976931348623157e308", "-1.7976931348623157e308", "0.00001e310", "1000e305", "1e-400", "0e99999999999", "-0.0E+400"
+    };
+    static const char *invalid[] = {
+        "1e309", "-1e309", "1.8e308", "10e308", "0.1e311", "1e99999999999", "01", "1.", "\"\\x\"", "\"\\ud800\"", "\"a\nb\"", "[\"a\", 1",
+        "{\"a\": 1.}", "{\"a\" 1}"
+    };
+    json_parse_options options;
+    json_value v, w, *e;
+    char *json;
+    size_t i;
+
+    options.shape_cache = NULL;
+    options.dedup = NULL;
+    options.flags = JSON_PARSE_LAZY;
+    json = (char *) malloc(256);
+    strcpy(json, "{\"id\": 18446744073709551615, \"pi\": 3.1400, \"s\": \"a\\u00e9\\n\\/\", \"e\": 1E2, \"a\": [-0, \"\\ud834\\udd1e\"]}");
+    json_init(&v);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse_ex(&v, json, &options));
+    e = json_get_object_value(&v, "pi");
+    ASSERT_EQ_INT(JSON_NUMBER, json_get_type(e));
+    ASSERT_EQ_INT(JSON_FLAG_RAW, e->flags);
+
+    /* Undecoded values are copied as they were written */
+    TEST_JSONIFY_OK("{\"id\": 18446744073709551615, \"pi\": 3.1400, \"s\": \"a\\u00e9\\n\\/\", \"e\": 1E2, \"a\": [-0, \"\\ud834\\udd1e\"]}", &v);
+
+    /* Reading decodes in place, once */
+    json_init(&v);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse_ex(&v, json, &options));
+    e = json_get_object_value(&v, "pi");
+    ASSERT_EQ_DOUBLE(3.14, json_get_number(e));
+    ASSERT_EQ_INT(0, e->flags);
+    e = json_get_object_value(&v, "id");
+    ASSERT_EQ_INT(1, UINT64_MAX == json_get_uint64(e));
+    ASSERT_EQ_INT(JSON_FLAG_UINT64, e->flags);
+    e = json_get_object_value(&v, "s");
+    ASSERT_EQ_SIZE_T(5, json_get_string_length(e));
+    ASSERT_EQ_STRING("a\xC3\xA9\n/", json_get_string(e), json_get_string_length(e));
+    ASSERT_EQ_INT(0, e->flags);
+    ASSERT_EQ_STRING("\xF0\x9D\x84\x9E", json_get_string(json_get_array_element(json_get_object_value(&v, "a"), 1)), 4);
+    ASSERT_EQ_INT(JSON_FLAG_RAW, json_get_object_value(&v, "e")->flags);
+    TEST_JSONIFY_OK("{\"id\": 18446744073709551615, \"pi\": 3.1400000000000001, \"s\": \"a\\u00E9\\n\\/\", \"e\": 1E2, \"a\": [-0, \"\\uD834\\uDD1E\"]}", &v);
+
+    /* Copies and the other readers decode, and do not borrow the text */
+    json_init(&v);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse_ex(&v, json, &options));
+    json_init(&w);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse(&w, json));
+    ASSERT_EQ_INT(1, json_equal(&v, &w));
+    json_free(&w);
+    json_init(&w);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse_ex(&w, json, &options));
+    ASSERT_EQ_INT(1, json_hash(&v) == json_hash(&w));
+    json_free(&w);
+    json_copy(&w, &v);
+    memset(json, ' ', strlen(json));
+    json_free(&v);
+    TEST_JSONIFY_OK("{\"id\": 18446744073709551615, \"pi\": 3.1400000000000001, \"s\": \"a\\u00E9\\n\\/\", \"e\": 100, \"a\": [-0, \"\\uD834\\uDD1E\"]}", &w);
+    free(json);
+
+    /* The same documents as json_parse are accepted */
+    for (i = 0; i < sizeof(valid) / sizeof(valid[0]); i++) {
+        json_init(&v);
+        ASSERT_EQ_INT(JSON_PARSE_OK, json_parse_ex(&v, valid[i], &options));
+        json_init(&w);
+        ASSERT_EQ_INT(JSON_PARSE_OK, json_parse(&w, valid[i]));
+        ASSERT_EQ_INT(1, json_equal(&v, &w));
+        json_free(&v);
+        json_free(&w);
+    }
+    for (i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+        json_init(&v);
+        ASSERT_EQ_INT(JSON_PARSE_ERROR, json_parse_ex(&v, invalid[i], &options));
+        ASSERT_EQ_INT(JSON_PARSE_ERROR, json_parse(&v, invalid[i]));
+    }
+
+    /* Setting a value drops its slice */
+    json_init(&v);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse_ex(&v, "[\"x\", 2]", &options));
+    json_free(json_get_array_element(&v, 0));
+    json_set_number(json_get_array_element(&v, 0), 1);
+    json_set_string(json_get_array_element(&v, 1), "y", 1);
+    TEST_JSONIFY_OK("[1, \"y\"]", &v);
+}
+
+static void test_parse_dedup(void)
+{
+    json_parse_options options;
+    json_dedup_stats stats;
+    json_dedup *dedup;
+    json_value a, b, e, patch, *x, *y;
+    size_t n;
+    const char *json = "[{\"host\": \"web-1\", \"geo\": {\"dc\": \"eu\", \"rack\": 4}, \"tags\": [\"a\", \"b\"]}, "
+                       "{\"host\": \"web-1\", \"geo\": {\"dc\": \"eu\", \"rack\": 4}, \"tags\": [\"a\", \"b\"]}, "
+                       "{\"host\": \"web-2\", \"geo\": {\"rack\": 4, \"dc\": \"eu\"}, \"tags\": [\"b\", \"a\"]}]";
+
+    dedup = json_dedup_new(2);
+    options.shape_cache = NULL;
+    options.flags = 0;
+    options.dedup = dedup;
+    json_init(&a);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse_ex(&a, json, &options));
+
+    /* Identical strings and small subtrees share their storage */
+    x = json_get_array_element(&a, 0);
+    y = json_get_array_element(&a, 1);
+    ASSERT_EQ_POINTER(json_get_string(json_get_object_value(x, "host")), json_get_string(json_get_object_value(y, "host")));
+    ASSERT_EQ_POINTER(json_get_object_value(x, "geo")->shared, json_get_object_value(y, "geo")->shared);
+    ASSERT_EQ_POINTER(json_get_object_value(x, "tags")->shared, json_get_object_value(y, "tags")->shared);
+    /* the whole records are larger than max_subtree */
+    ASSERT_EQ_INT(0, x->flags & JSON_FLAG_SHARED);
+    /* members in another order are not identical */
+    y = json_get_array_element(&a, 2);
+    ASSERT_EQ_INT(0, json_get_object_value(x, "geo")->shared == json_get_object_value(y, "geo")->shared);
+    ASSERT_EQ_POINTER(json_get_string(json_get_array_element(json_get_object_value(x, "tags"), 0)),
+                      json_get_string(json_get_array_element(json_get_object_value(y, "tags"), 1)));
+
+    /* A second document shares with the first, and outlives the table */
+    json_init(&b);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse_ex(&b, "[\"web-1\", 1, -0, 0, [-0], [0]]", &options));
+    ASSERT_EQ_POINTER(json_get_string(json_get_object_value(x, "host")), json_get_string(json_get_array_element(&b, 0)));
+    json_dedup_get_stats(dedup, &stats);
+    ASSERT_EQ_SIZE_T(21, stats.lookups);
+    ASSERT_EQ_SIZE_T(10, stats.hits);
+    ASSERT_EQ_SIZE_T(11, stats.entries);
+    /* "web-1" twice, "eu" twice, "a" and "b" twice, the members of "geo" and the elements of "tags" */
+    ASSERT_EQ_SIZE_T(6 * 2 + 3 * 2 + 2 * 4 + sizeof(json_object) * 2 + 3 + 5 + sizeof(json_value) * 2, stats.bytes_saved);
+
+    /* Modifying copies on write, jsonify is unchanged */
+    json_init(&e);
+    json_set_number(&e, 5);
+    json_object_set(json_get_object_value(json_get_array_element(&a, 0), "geo"), "rack", 4, 0, &e);
+    TEST_JSONIFY_OK("[{\"host\": \"web-1\", \"geo\": {\"dc\": \"eu\", \"rack\": 5}, \"tags\": [\"a\", \"b\"]}, "
+                    "{\"host\": \"web-1\", \"geo\": {\"dc\": \"eu\", \"rack\": 4}, \"tags\": [\"a\", \"b\"]}, "
+                    "{\"host\": \"web-2\", \"geo\": {\"rack\": 4, \"dc\": \"eu\"}, \"tags\": [\"b\", \"a\"]}]", &a);
+
+    /* Pruning drops the values only the table holds */
+    ASSERT_EQ_SIZE_T(8, json_dedup_prune(dedup));
+    json_dedup_get_stats(dedup, &stats);
+    ASSERT_EQ_SIZE_T(3, stats.entries);
+    json_dedup_free(dedup);
+    TEST_JSONIFY_OK("[\"web-1\", 1, -0, 0, [-0], [0]]", &b);
+
+    /* Packed arrays stay packed in the table whatever the documents do */
+    dedup = json_dedup_new(8);
+    options.flags = JSON_PARSE_PACK;
+    options.dedup = dedup;
+    json_init(&a);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse_ex(&a, "[[1, 2], [1, 2]]", &options));
+    x = json_get_array_element(&a, 0);
+    y = json_get_array_element(&a, 1);
+    ASSERT_EQ_POINTER(x->shared, y->shared);
+    ASSERT_EQ_DOUBLE(2.0, json_get_array_doubles(x, &n)[1]);
+    json_init(&patch);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse(&patch, "[{\"op\": \"add\", \"path\": \"/0/-\", \"value\": 3}]"));
+    ASSERT_EQ_INT(JSON_PATCH_OK, json_patch_apply(&a, &patch));
+    json_init(&b);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse_ex(&b, "[[1, 2]]", &options));
+    ASSERT_EQ_POINTER(y->shared, json_get_array_element(&b, 0)->shared);
+    json_dedup_get_stats(dedup, &stats);
+    ASSERT_EQ_SIZE_T(5, stats.lookups);
+    ASSERT_EQ_SIZE_T(2, stats.hits);
+    ASSERT_EQ_SIZE_T(3, stats.entries);
+    json_free(&b);
+    json_dedup_free(dedup);
+    json_free(&patch);
+    TEST_JSONIFY_OK("[[1, 2, 3], [1, 2]]", &a);
+}
+
+static void test_object_set(void)
+{
+    json_shape_cache *cache;
+    json_parse_options options;
+    json_value o, e, shaped;
+    char key[8];
+    int present[64];
+    size_t i, n;
+
+    json_init(&o);
+    json_init(&e);
+    json_set_number(&e, 1.0);
+    json_object_set(&o, "a", 1, 0, &e);
+    json_set_number(&e, 2.0);
+    json_object_set(&o, "b", 1, 0, &e);
+    json_set_number(&e, 3.0);
+    json_object_set(&o, "a", 1, 0, &e);
+    json_object_append(&o, 0, "c", (size_t) 1, &e, NULL);
+    ASSERT_EQ_INT(0, json_object_remove(&o, "d", 1));
+    ASSERT_EQ_INT(1, json_object_remove(&o, "c", 1));
+    json_object_set(&o, "d", 1, 1, json_get_object_value(&o, "b"));
+    TEST_JSONIFY_OK("{\"a\": 3, \"b\": 2, \"d\": 2}", &o);
+
+    /* random operations on an indexed object against a reference */
+    json_init(&o);
+    memset(present, 0, sizeof(present));
+    srand(1);
+    for (i = 0; i < 2000; i++) {
+        int k = rand() % 64;
+        sprintf(key, "k%d", k);
+        if (rand() % 3) {
+            json_set_number(&e, (double) k);
+            json_object_set(&o, key, strlen(key), 0, &e);
+            present[k] = 1;
+        } else {
+            ASSERT_EQ_INT(present[k], json_object_remove(&o, key, strlen(key)));
+            present[k] = 0;
+        }
+    }
+    for (i = 0, n = 0; i < 64; i++) {
+        json_value *v;
+        sprintf(key, "k%d", (int) i);
+        v = json_get_object_value_n(&o, key, strlen(key));
+        n += present[i];
+        ASSERT_EQ_INT(present[i], v != NULL);
+        if (v)
+            ASSERT_EQ_DOUBLE((double) i, json_get_number(v));
+    }
+    ASSERT_EQ_SIZE_T(n, json_get_object_size(&o));
+    for (i = 0; i < json_get_object_size(&o); i++)
+        ASSERT_EQ_POINTER(json_get_object_value_index(&o, i), json_get_object_value_n(&o, json_get_object_key(&o, i), json_get_object_key_length(&o, i)));
+    json_free(&o);
+
+    /* parsed and shaped objects */
+    json_init(&o);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse(&o, "{\"0\":0,\"1\":1,\"2\":2,\"3\":3,\"4\":4,\"5\":5,\"6\":6,\"7\":7,\"8\":8}"));
+    ASSERT_EQ_INT(1, json_object_remove(&o, "0", 1));
+    ASSERT_EQ_INT(1, json_object_remove(&o, "8", 1));
+    ASSERT_EQ_INT(1, json_object_remove(&o, "4", 1));
+    json_set_null(&e);
+    json_object_set(&o, "9", 1, 0, &e);
+    TEST_JSONIFY_OK("{\"1\": 1, \"2\": 2, \"3\": 3, \"5\": 5, \"6\": 6, \"7\": 7, \"9\": null}", &o);
+
+    cache = json_shape_cache_new();
+    options.shape_cache = cache;
+    options.dedup = NULL;
+    options.flags = 0;
+    json_init(&shaped);
+    json_init(&o);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse_ex(&shaped, "{\"a\": 1, \"b\": 2}", &options));
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse_ex(&o, "{\"a\": 1, \"b\": 2}", &options));
+    json_set_true(&e);
+    json_object_set(&o, "b", 1, 0, &e);
+    ASSERT_EQ_POINTER(json_get_object_key(&shaped, 1), json_get_object_key(&o, 1));
+    json_object_set(&o, "c", 1, 0, &e);
+    ASSERT_EQ_INT(1, json_object_remove(&o, "a", 1));
+    TEST_JSONIFY_OK("{\"b\": true, \"c\": true}", &o);
+    TEST_JSONIFY_OK("{\"a\": 1, \"b\": 2}", &shaped);
+    json_shape_cache_free(cache);
+}
+
+static void test_copy(void)
+{
+    json_shape_cache *cache;
+    json_parse_options options;
+    json_value a, b, *c;
+
+    json_init(&a);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse(&a, "{\"s\": \"str\", \"a\": [1, [], {}], \"o\": {\"t\": true}, \"n\": null}"));
+    json_init(&b);
+    json_copy(&b, &a);
+    json_get_string(json_get_object_value(&a, "s"))[0] = 'S';
+    json_free(&a);
+    ASSERT_EQ_SIZE_T(3, json_get_object_value(&b, "a")->array_capacity);
+    json_move(&a, &b);
+    ASSERT_EQ_INT(JSON_NULL, json_get_type(&b));
+    json_set_number(&b, 1.0);
+    json_swap(&a, &b);
+    ASSERT_EQ_DOUBLE(1.0, json_get_number(&a));
+    TEST_JSONIFY_OK("{\"s\": \"str\", \"a\": [1, [], {}], \"o\": {\"t\": true}, \"n\": null}", &b);
+
+    /* shaped objects keep sharing the keys, compacted trees become owned */
+    cache = json_shape_cache_new();
+    options.shape_cache = cache;
+    options.dedup = NULL;
+    options.flags = 0;
+    json_init(&a);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse_ex(&a, "{\"k\": [\"v\"]}", &options));
+    json_shape_cache_free(cache);
+    json_init(&b);
+    json_copy(&b, &a);
+    ASSERT_EQ_POINTER(json_get_object_key(&a, 0), json_get_object_key(&b, 0));
+    c = json_compact(&a);
+    json_init(&a);
+    json_copy(&a, c);
+    free(c);
+    json_object_set(&a, "k", 1, 0, &b);
+    TEST_JSONIFY_OK("{\"k\": {\"k\": [\"v\"]}}", &a);
+}
+
+static void test_share(void)
+{
+    json_value sub, a, o, b, *e;
+
+    json_init(&sub);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse(&sub, "{\"x\": [1, 2], \"y\": \"s\"}"));
+    json_init(&a);
+    json_set_array(&a, JSON_SHARE, &sub, &sub, NULL);
+    ASSERT_EQ_INT(JSON_FLAG_SHARED, sub.flags);
+    ASSERT_EQ_INT(JSON_OBJECT, json_get_type(json_get_array_element(&a, 0)));
+    ASSERT_EQ_POINTER(json_get_object_value(json_get_array_element(&a, 0), "x"), json_get_object_value(json_get_array_element(&a, 1), "x"));
+    json_init(&o);
+    json_object_set(&o, "s", 1, JSON_SHARE, &sub);
+    json_object_append(&o, JSON_SHARE, "t", (size_t) 1, &sub, NULL);
+    json_array_push(&a, JSON_SHARE, json_get_object_value(&o, "s"));
+    /* copying a reference does not copy the value */
+    json_init(&b);
+    json_copy(&b, &a);
+    ASSERT_EQ_POINTER(json_get_object_value(json_get_array_element(&a, 2), "y"), json_get_object_value(json_get_array_element(&b, 2), "y"));
+    json_free(&sub);
+    json_free(&a);
+    TEST_JSONIFY_OK("[{\"x\": [1, 2], \"y\": \"s\"}, {\"x\": [1, 2], \"y\": \"s\"}, {\"x\": [1, 2], \"y\": \"s\"}]", &b);
+
+    /* copy on write */
+    e = json_get_object_value(&o, "s");
+    json_object_set(e, "z", 1, 1, json_get_object_value(e, "y"));
+    json_array_push(json_get_object_value(e, "x"), 1, json_get_object_value(e, "x"));
+    ASSERT_EQ_INT(1, json_object_remove(json_get_object_value(&o, "t"), "x", 1));
+    TEST_JSONIFY_OK("{\"s\": {\"x\": [1, 2, [1, 2]], \"y\": \"s\", \"z\": \"s\"}, \"t\": {\"y\": \"s\"}}", &o);
+
+    /* the last reference takes the value over */
+    json_init(&sub);
+    json_set_string(&sub, "v", 1);
+    json_init(&a);
+    json_share(&a, &sub);
+    json_free(&sub);
+    ASSERT_EQ_INT(JSON_FLAG_SHARED, a.flags);
+    json_unshare(&a);
+    ASSERT_EQ_INT(0, a.flags);
+    ASSERT_EQ_STRING("v", json_get_string(&a), json_get_string_length(&a));
+    json_free(&a);
+}
+
+#define TEST_EQUAL(expect, json1, json2) \
+    do { \
+        json_value a, b; \
+        json_init(&a); \
+        json_init(&b); \
+        ASSERT_EQ_INT(JSON_PARSE_OK, json_parse(&a, json1)); \
+        ASSERT_EQ_INT(JSON_PARSE_OK, json_parse(&b, json2)); \
+        ASSERT_EQ_INT(expect, json_equal(&a, &b)); \
+        ASSERT_EQ_INT(expect, json_equal(&b, &a)); \
+        if (expect) \
+            ASSERT_EQ_INT(1, json_hash(&a) == json_hash(&b)); \
+        json_free(&a); \
+        json_free(&b); \
+    } while (0)
+
+static void test_equal(void)
+{
+    json_value a, b, c;
+
+    TEST_EQUAL(1, "null", "null");
+    TEST_EQUAL(0, "null", "false");
+    TEST_EQUAL(1, "-0", "0");
+    TEST_EQUAL(0, "1", "1.5");
+    TEST_EQUAL(1, "\"a\\u0000b\"", "\"a\\u0000b\"");
+    TEST_EQUAL(0, "\"a\\u0000b\"", "\"a\\u0000c\"");
+    TEST_EQUAL(1, "[1, [2, {}]]", "[1, [2, {}]]");
+    TEST_EQUAL(0, "[1, 2]", "[2, 1]");
+    TEST_EQUAL(0, "[1, 2]", "[1, 2, 3]");
+    TEST_EQUAL(1, "{\"a\": 1, \"b\": [true], \"c\": {\"d\": null}}", "{\"c\": {\"d\": null}, \"a\": 1, \"b\": [true]}");
+    TEST_EQUAL(0, "{\"a\": 1, \"b\": 2}", "{\"a\": 1, \"c\": 2}");
+    TEST_EQUAL(0, "{\"a\": 1, \"b\": 2}", "{\"a\": 2, \"b\": 1}");
+    TEST_EQUAL(0, "{\"a\": 1}", "{\"a\": 1, \"b\": 2}");
+    TEST_EQUAL(0, "{\"a\": {}}", "{\"a\": []}");
+
+    /* numbers compare exactly, so equality is transitive */
+    TEST_EQUAL(1, "9007199254740992", "9007199254740992.0");
+    TEST_EQUAL(0, "9007199254740993", "9007199254740992.0");
+    TEST_EQUAL(0, "9007199254740993", "9007199254740992");
+    TEST_EQUAL(1, "-9223372036854775808", "-9223372036854775808.0");
+    TEST_EQUAL(0, "9223372036854775807", "9223372036854775808.0");
+    TEST_EQUAL(1, "18446744073709551615", "18446744073709551615");
+    TEST_EQUAL(0, "18446744073709551615", "18446744073709551616.0");
+
+    /* repeated keys compare as a multiset of members */
+    TEST_EQUAL(0, "{\"x\": 1, \"x\": 1}", "{\"x\": 1, \"y\": 2}");
+    TEST_EQUAL(0, "{\"x\": 1, \"x\": 1, \"y\": 2}", "{\"x\": 1, \"y\": 2, \"y\": 2}");
+    TEST_EQUAL(0, "{\"x\": 1, \"x\": 2}", "{\"x\": 1, \"x\": 3}");
+    TEST_EQUAL(1, "{\"x\": 1, \"x\": 2}", "{\"x\": 2, \"x\": 1}");
+    TEST_EQUAL(1, "{\"y\": 1, \"x\": 1, \"x\": 2}", "{\"x\": 2, \"x\": 1, \"y\": 1}");
+    TEST_EQUAL(1, "{\"x\": 1, \"y\": 1, \"x\": 2}", "{\"x\": 1, \"x\": 2, \"y\": 1}");
+    TEST_EQUAL(0, "{\"x\": 1, \"y\": 1, \"x\": 2}", "{\"x\": 2, \"x\": 2, \"y\": 1}");
+
+    /* hashes of shared values are cached */
+    json_init(&a);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse(&a, "{\"k\": [1, 2, 3]}"));
+    json_init(&b);
+    json_copy(&b, &a);
+    json_init(&c);
+    json_share(&c, &a);
+    ASSERT_EQ_INT(1, json_equal(&a, &c));
+    ASSERT_EQ_INT(1, json_equal(&b, &c));
+    json_free(&c);
+    json_share(&c, &b);
+    ASSERT_EQ_INT(1, json_equal(&a, &b));
+    ASSERT_EQ_INT(1, json_hash(&a) == json_hash(&b));
+    json_free(&c);
+    json_set_number(json_get_array_element(json_get_object_value(json_unshare(&b), "k"), 2), 4.0);
+    ASSERT_EQ_INT(0, json_equal(&a, &b));
+    json_free(&a);
+    json_free(&b);
+}
+
+#define TEST_DIFF(expect, json1, json2) \
+    do { \
+        json_value a, b, patch; \
+        json_init(&a); \
+        json_init(&b); \
+        json_init(&patch); \
+        ASSERT_EQ_INT(JSON_PARSE_OK, json_parse(&a, json1)); \
+        ASSERT_EQ_INT(JSON_PARSE_OK, json_parse(&b, json2)); \
+        json_diff(&patch, &a, &b); \
+        TEST_JSONIFY_OK(expect, &patch); \
+        json_free(&a); \
+        json_free(&b); \
+    } while (0)
+
+static void test_diff(void)
+{
+    json_value a, b, sub, patch;
+    size_t i;
+
+    TEST_DIFF("[]",
+        "1", "1");
+    TEST_DIFF("[]",
+        "{\"a\": [1, {\"b\": null}], \"c\": \"s\"}", "{\"c\": \"s\", \"a\": [1, {\"b\": null}]}");
+    TEST_DIFF("[{\"op\": \"replace\", \"path\": \"\", \"value\": 2}]",
+        "1", "2");
+    TEST_DIFF("[{\"op\": \"replace\", \"path\": \"\", \"value\": {\"a\": 1}}]",
+        "[1]", "{\"a\": 1}");
+    TEST_DIFF("[{\"op\": \"remove\", \"path\": \"\\/b\"}, {\"op\": \"replace\", \"path\": \"\\/c\", \"value\": 4}, {\"op\": \"add\", \"path\": \"\\/d\", \"value\": [5]}]",
+        "{\"a\": 1, \"b\": 2, \"c\": 3}", "{\"d\": [5], \"a\": 1, \"c\": 4}");
+    TEST_DIFF("[{\"op\": \"replace\", \"path\": \"\\/a~1b~0\", \"value\": 2}]",
+        "{\"a/b~\": 1}", "{\"a/b~\": 2}");
+    TEST_DIFF("[{\"op\": \"remove\", \"path\": \"\\/1\"}, {\"op\": \"add\", \"path\": \"\\/3\", \"value\": 5}]",
+        "[1, 2, 3, 4]", "[1, 3, 4, 5]");
+    TEST_DIFF("[{\"op\": \"replace\", \"path\": \"\\/1\\/v\", \"value\": 2}]",
+        "[0, {\"id\": 1, \"v\": 1}, {\"id\": 2}]", "[0, {\"id\": 1, \"v\": 2}, {\"id\": 2}]");
+    TEST_DIFF("[{\"op\": \"add\", \"path\": \"\\/0\", \"value\": 1}, {\"op\": \"add\", \"path\": \"\\/1\", \"value\": 2}]",
+        "[]", "[1, 2]");
+    TEST_DIFF("[{\"op\": \"remove\", \"path\": \"\\/0\"}, {\"op\": \"remove\", \"path\": \"\\/0\"}]",
+        "[1, 2]", "[]");
+    TEST_DIFF("[{\"op\": \"add\", \"path\": \"\\/0\", \"value\": 0}, {\"op\": \"replace\", \"path\": \"\\/3\", \"value\": 4}]",
+        "[1, 2, 3]", "[0, 1, 2, 4]");
+
+    /* long arrays are anchored on unique elements */
+    json_init(&a);
+    for (i = 0; i < 2000; i++) {
+        json_set_number(&sub, (double) i);
+        json_array_push(&a, 0, &sub);
+    }
+    json_init(&b);
+    json_copy(&b, &a);
+    json_array_remove(&b, 5);
+    json_set_number(&sub, -1.0);
+    json_array_insert(&b, 1000, 0, &sub);
+    json_set_number(json_get_array_element(&b, 1500), -2.0);
+    json_init(&patch);
+    json_diff(&patch, &a, &b);
+    TEST_JSONIFY_OK("[{\"op\": \"remove\", \"path\": \"\\/5\"}, {\"op\": \"add\", \"path\": \"\\/1000\", \"value\": -1}, "
+                    "{\"op\": \"replace\", \"path\": \"\\/1500\", \"value\": -2}]", &patch);
+    json_free(&a);
+    json_free(&b);
+
+    /* shared values are skipped without walking them */
+    json_init(&sub);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse(&sub, "{\"big\": [1, 2, 3]}"));
+    json_init(&a);
+    json_object_set(&a, "x", 1, JSON_SHARE, &sub);
+    json_init(&b);
+    json_object_set(&b, "y", 1, 0, &sub);
+    json_init(&sub);
+    json_set_null(&sub);
+    json_object_set(&b, "x", 1, JSON_SHARE, json_get_object_value(&b, "y"));
+    json_object_set(&b, "z", 1, 0, &sub);
+    json_init(&patch);
+    json_diff(&patch, &a, &b);
+    TEST_JSONIFY_OK("[{\"op\": \"add\", \"path\": \"\\/y\", \"value\": {\"big\": [1, 2, 3]}}, {\"op\": \"add\", \"path\": \"\\/z\", \"value\": null}]", &patch);
+    json_free(&a);
+    json_free(&b);
+}
+
+#define TEST_PATCH(result, expect, json, patch_json) \
+    do { \
+        json_value v, patch; \
+        json_init(&v); \
+        json_init(&patch); \
+        ASSERT_EQ_INT(JSON_PARSE_OK, json_parse(&v, json)); \
+        ASSERT_EQ_INT(JSON_PARSE_OK, json_parse(&patch, patch_json)); \
+        ASSERT_EQ_INT(result, json_patch_apply(&v, &patch)); \
+        TEST_JSONIFY_OK(expect, &v); \
+        json_free(&patch); \
+    } while (0)
+
+#define TEST_MERGE_PATCH(expect, json, patch_json) \
+    do { \
+        json_value v, patch; \
+        json_init(&v); \
+        json_init(&patch); \
+        ASSERT_EQ_INT(JSON_PARSE_OK, json_parse(&v, json)); \
+        ASSERT_EQ_INT(JSON_PARSE_OK, json_parse(&patch, patch_json)); \
+        json_merge_patch_apply(&v, &patch); \
+        TEST_JSONIFY_OK(expect, &v); \
+        json_free(&patch); \
+    } while (0)
+
+static unsigned long test_random_state = 1;
+
+static size_t test_random(size_t n)
+{
+    test_random_state = test_random_state * 1103515245 + 12345;
+    return (test_random_state >> 16) % n;
+}
+
+static void test_random_value(json_value *v, int depth)
+{
+    json_value e;
+    char s[2];
+    size_t n;
+
+    json_init(v);
+    switch (test_random(depth > 0 ? 5 : 3)) {
+    case 0:
+        json_set_number(v, (double) test_random(10));
+        break;
+    case 1:
+        s[0] = (char) ('a' + test_random(4));
+        json_set_string(v, s, 1);
+        break;
+    case 2:
+        json_set_null(v);
+        break;
+    case 3:
+        json_array_reserve(v, 0);
+        for (n = test_random(6); n; n--) {
+            test_random_value(&e, depth - 1);
+            json_array_push(v, 0, &e);
+        }
+        break;
+    default:
+        json_object_append(v, 0, NULL);
+        for (n = test_random(6); n; n--) {
+            s[0] = (char) ('a' + test_random(8));
+            test_random_value(&e, depth - 1);
+            json_object_set(v, s, 1, 0, &e);
+        }
+        break;
+    }
+}
+
+static void test_random_change(json_value *v, int depth)
+{
+    json_value e;
+    char s[2];
+    size_t i;
+
+    if (test_random(8) == 0) {
+        json_free(v);
+        test_random_value(v, depth);
+    } else if (json_get_type(v) == JSON_ARRAY) {
+        for (i = 0; i < json_get_array_size(v); i++)
+            test_random_change(json_get_array_element(v, i), depth - 1);
+        if (test_random(3) == 0 && json_get_array_size(v))
+            json_array_remove(v, test_random(json_get_array_size(v)));
+        if (test_random(3) == 0) {
+            test_random_value(&e, depth - 1);
+            json_array_insert(v, test_random(json_get_array_size(v) + 1), 0, &e);
+        }
+    } else if (json_get_type(v) == JSON_OBJECT) {
+        for (i = 0; i < json_get_object_size(v); i++)
+            test_random_change(json_get_object_value_index(v, i), depth - 1);
+        if (test_random(3) == 0 && json_get_object_size(v)) {
+            i = test_random(json_get_object_size(v));
+            json_object_remove(v, json_get_object_key(v, i), json_get_object_key_length(v, i));
+        }
+        if (test_random(3) == 0) {
+            s[0] = (char) ('a' + test_random(8));
+            test_random_value(&e, depth - 1);
+            json_object_set(v, s, 1, 0, &e);
+        }
+    }
+}
+
+static void test_patch(void)
+{
+    json_value v, patch, b, op;
+    char *before, *after, *moved;
+    size_t i, len;
+    int equal;
+
+    TEST_PATCH(JSON_PATCH_OK, "{\"foo\": \"bar\", \"baz\": \"qux\"}",
+        "{\"foo\": \"bar\"}",
+        "[{\"op\": \"add\", \"path\": \"/baz\", \"value\": \"qux\"}]");
+    TEST_PATCH(JSON_PATCH_OK, "{\"foo\": [\"bar\", \"qux\", \"baz\"]}",
+        "{\"foo\": [\"bar\", \"baz\"]}",
+        "[{\"op\": \"add\", \"path\": \"/foo/1\", \"value\": \"qux\"}]");
+    TEST_PATCH(JSON_PATCH_OK, "{\"foo\": \"bar\"}",
+        "{\"baz\": \"qux\", \"foo\": \"bar\"}",
+        "[{\"op\": \"remove\", \"path\": \"/baz\"}]");
+    TEST_PATCH(JSON_PATCH_OK, "{\"foo\": [\"bar\", \"baz\"]}",
+        "{\"foo\": [\"bar\", \"qux\", \"baz\"]}",
+        "[{\"op\": \"remove\", \"path\": \"/foo/1\"}]");
+    TEST_PATCH(JSON_PATCH_OK, "{\"baz\": \"boo\", \"foo\": \"bar\"}",
+        "{\"baz\": \"qux\", \"foo\": \"bar\"}",
+        "[{\"op\": \"replace\", \"path\": \"/baz\", \"value\": \"boo\"}]");
+    TEST_PATCH(JSON_PATCH_OK, "{\"foo\": {\"bar\": \"baz\"}, \"qux\": {\"corge\": \"grault\", \"thud\": \"fred\"}}",
+        "{\"foo\": {\"bar\": \"baz\", \"waldo\": \"fred\"}, \"qux\": {\"corge\": \"grault\"}}",
+        "[{\"op\": \"move\", \"from\": \"/foo/waldo\", \"path\": \"/qux/thud\"}]");
+    TEST_PATCH(JSON_PATCH_OK, "{\"foo\": [\"all\", \"cows\", \"eat\", \"grass\"]}",
+        "{\"foo\": [\"all\", \"grass\", \"cows\", \"eat\"]}",
+        "[{\"op\": \"move\", \"from\": \"/foo/1\", \"path\": \"/foo/3\"}]");
+    TEST_PATCH(JSON_PATCH_OK, "{\"baz\": \"qux\", \"foo\": [\"a\", 2, \"c\"]}",
+        "{\"baz\": \"qux\", \"foo\": [\"a\", 2, \"c\"]}",
+        "[{\"op\": \"test\", \"path\": \"/baz\", \"value\": \"qux\"}, {\"op\": \"test\", \"path\": \"/foo/1\", \"value\": 2}]");
+    TEST_PATCH(JSON_PATCH_ERROR, "{\"baz\": \"qux\"}",
+        "{\"baz\": \"qux\"}",
+        "[{\"op\": \"test\", \"path\": \"/baz\", \"value\": \"bar\"}]");
+    TEST_PATCH(JSON_PATCH_OK, "{\"foo\": \"bar\", \"child\": {\"grandchild\": {}}}",
+        "{\"foo\": \"bar\"}",
+        "[{\"op\": \"add\", \"path\": \"/child\", \"value\": {\"grandchild\": {}}}]");
+    TEST_PATCH(JSON_PATCH_ERROR, "{\"foo\": \"bar\"}",
+        "{\"foo\": \"bar\"}",
+        "[{\"op\": \"add\", \"path\": \"/baz/bat\", \"value\": \"qux\"}]");
+    TEST_PATCH(JSON_PATCH_OK, "{\"/\": 8, \"~1\": 10}",
+        "{\"/\": 9, \"~1\": 10}",
+        "[{\"op\": \"test\", \"path\": \"/~01\", \"value\": 10}, {\"op\": \"replace\", \"path\": \"/~1\", \"value\": 8}]");
+    TEST_PATCH(JSON_PATCH_OK, "{\"foo\": [\"bar\", [\"abc\", \"def\"]]}",
+        "{\"foo\": [\"bar\"]}",
+        "[{\"op\": \"add\", \"path\": \"/foo/-\", \"value\": [\"abc\", \"def\"]}]");
+    TEST_PATCH(JSON_PATCH_OK, "[1, 1]",
+        "{\"a\": 1}",
+        "[{\"op\": \"add\", \"path\": \"\", \"value\": [1]}, {\"op\": \"copy\", \"from\": \"/0\", \"path\": \"/-\"}]");
+    TEST_PATCH(JSON_PATCH_OK, "{\"b\": 1}",
+        "{\"a\": {\"b\": 1}}",
+        "[{\"op\": \"move\", \"from\": \"/a\", \"path\": \"\"}]");
+    TEST_PATCH(JSON_PATCH_ERROR, "{\"a\": 1, \"b\": [1, 2], \"c\": {\"d\": 1}}",
+        "{\"a\": 1, \"b\": [1, 2], \"c\": {\"d\": 1}}",
+        "[{\"op\": \"remove\", \"path\": \"/a\"}, {\"op\": \"add\", \"path\": \"/b/0\", \"value\": 0}, {\"op\": \"move\", \"from\": \"/c/d\", \"path\": \"/e\"}, {\"op\": \"replace\", \"path\": \"/b/1\", \"value\": 9}, {\"op\": \"copy\", \"from\": \"/b\", \"path\": \"/f\"}, {\"op\": \"move\", \"from\": \"/b/0\", \"path\": \"/a\"}, {\"op\": \"test\", \"path\": \"/e\", \"value\": 2}]");
+    TEST_PATCH(JSON_PATCH_ERROR, "{\"a\": {\"b\": 1}}",
+        "{\"a\": {\"b\": 1}}",
+        "[{\"op\": \"move\", \"from\": \"/a\", \"path\": \"/a/c\"}]");
+    TEST_PATCH(JSON_PATCH_OK, "{\"a\": {\"b\": 1}}",
+        "{\"a\": {\"b\": 1}}",
+        "[{\"op\": \"move\", \"from\": \"/a\", \"path\": \"/a\"}]");
+    TEST_PATCH(JSON_PATCH_ERROR, "{\"a\": [1]}",
+        "{\"a\": [1]}",
+        "[{\"op\": \"replace\", \"path\": \"/a/01\", \"value\": 2}]");
+    TEST_PATCH(JSON_PATCH_ERROR, "{\"a\": [1]}",
+        "{\"a\": [1]}",
+        "[{\"op\": \"remove\", \"path\": \"/a/-\"}]");
+    TEST_PATCH(JSON_PATCH_ERROR, "{\"a\": [1]}",
+        "{\"a\": [1]}",
+        "[{\"op\": \"add\", \"path\": \"/a/2\", \"value\": 2}]");
+    TEST_PATCH(JSON_PATCH_ERROR, "{\"a\": [1]}",
+        "{\"a\": [1]}",
+        "[{\"op\": \"add\", \"path\": \"a\", \"value\": 2}]");
+    TEST_PATCH(JSON_PATCH_ERROR, "{\"a\": [1]}",
+        "{\"a\": [1]}",
+        "[{\"op\": \"add\", \"path\": \"/~2\", \"value\": 2}]");
+    TEST_PATCH(JSON_PATCH_ERROR, "{\"a\": [1]}",
+        "{\"a\": [1]}",
+        "[{\"op\": \"rename\", \"path\": \"/a\"}]");
+    TEST_PATCH(JSON_PATCH_ERROR, "{\"a\": [1]}",
+        "{\"a\": [1]}",
+        "[{\"op\": \"replace\", \"path\": \"/b\", \"value\": 2}]");
+    TEST_PATCH(JSON_PATCH_ERROR, "{\"a\": [1]}",
+        "{\"a\": [1]}",
+        "{\"op\": \"remove\", \"path\": \"/a\"}");
+    TEST_PATCH(JSON_PATCH_ERROR, "{\"\": 0, \"a\": 1, \"b\": 2}",
+        "{\"\": 0, \"a\": 1, \"b\": 2}",
+        "[{\"op\": \"remove\", \"path\": \"/a\"}, {\"op\": \"test\", \"path\": \"/b\", \"value\": 3}]");
+
+    /* the rollback keeps the order of indexed objects */
+    json_init(&v);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse(&v, "{\"k0\": \"0\", \"k1\": 1, \"k2\": 2, \"k3\": \"3\", \"k4\": 4, \"k5\": 5, \"k6\": 6, \"k7\": 7, \"k8\": 8, \"k9\": 9}"));
+    json_object_remove(&v, "none", 4);
+    before = json_jsonify(&v, &len);
+    json_init(&patch);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse(&patch, "[{\"op\": \"remove\", \"path\": \"/k5\"}, {\"op\": \"move\", \"from\": \"/k0\", \"path\": \"/k6\"}, "
+        "{\"op\": \"move\", \"from\": \"/k9\", \"path\": \"/x\"}, {\"op\": \"add\", \"path\": \"/k2\", \"value\": []}, {\"op\": \"remove\", \"path\": \"/k5\"}]"));
+    ASSERT_EQ_INT(JSON_PATCH_ERROR, json_patch_apply(&v, &patch));
+    after = json_jsonify(&v, NULL);
+    ASSERT_EQ_INT(0, memcmp(before, after, len + 1));
+    free(before);
+    free(after);
+    json_free(&patch);
+
+    /* moves take the value over */
+    moved = json_get_string(json_get_object_value(&v, "k3"));
+    json_init(&patch);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse(&patch, "[{\"op\": \"move\", \"from\": \"/k3\", \"path\": \"/m\"}]"));
+    ASSERT_EQ_INT(JSON_PATCH_OK, json_patch_apply(&v, &patch));
+    ASSERT_EQ_POINTER(moved, json_get_string(json_get_object_value(&v, "m")));
+    json_free(&patch);
+    json_free(&v);
+
+    /* json_diff and json_patch_apply round trip, every other patch fails at the end and rolls back */
+    for (i = 0, equal = 0; i < 500; i++) {
+        test_random_value(&v, 4);
+        json_init(&b);
+        json_copy(&b, &v);
+        test_random_change(&b, 4);
+        json_init(&patch);
+        json_diff(&patch, &v, &b);
+        if (i % 2) {
+            json_init(&op);
+            ASSERT_EQ_INT(JSON_PARSE_OK, json_parse(&op, "{\"op\": \"test\", \"path\": \"\", \"value\": \"never\"}"));
+            json_array_push(&patch, 0, &op);
+            before = json_jsonify(&v, &len);
+            if (json_patch_apply(&v, &patch) == JSON_PATCH_ERROR) {
+                after = json_jsonify(&v, NULL);
+                equal += !memcmp(before, after, len + 1);
+                free(after);
+            }
+            free(before);
+        } else if (json_patch_apply(&v, &patch) == JSON_PATCH_OK && json_equal(&v, &b))
+            equal++;
+        json_free(&patch);
+        json_free(&v);
+        json_free(&b);
+    }
+    ASSERT_EQ_INT(500, equal);
+}
+
+static void test_merge_patch(void)
+{
+    TEST_MERGE_PATCH("{\"a\": \"c\"}", "{\"a\": \"b\"}", "{\"a\": \"c\"}");
+    TEST_MERGE_PATCH("{\"a\": \"b\", \"b\": \"c\"}", "{\"a\": \"b\"}", "{\"b\": \"c\"}");
+    TEST_MERGE_PATCH("{}", "{\"a\": \"b\"}", "{\"a\": null}");
+    TEST_MERGE_PATCH("{\"b\": \"c\"}", "{\"a\": \"b\", \"b\": \"c\"}", "{\"a\": null}");
+    TEST_MERGE_PATCH("{\"a\": \"c\"}", "{\"a\": [\"b\"]}", "{\"a\": \"c\"}");
+    TEST_MERGE_PATCH("{\"a\": [\"b\"]}", "{\"a\": \"c\"}", "{\"a\": [\"b\"]}");
+    TEST_MERGE_PATCH("{\"a\": {\"b\": \"d\"}}", "{\"a\": {\"b\": \"c\"}}", "{\"a\": {\"b\": \"d\", \"c\": null}}");
+    TEST_MERGE_PATCH("{\"a\": [1]}", "{\"a\": [{\"b\": \"c\"}]}", "{\"a\": [1]}");
+    TEST_MERGE_PATCH("[\"c\", \"d\"]", "[\"a\", \"b\"]", "[\"c\", \"d\"]");
+    TEST_MERGE_PATCH("[\"c\"]", "{\"a\": \"b\"}", "[\"c\"]");
+    TEST_MERGE_PATCH("null", "{\"a\": \"foo\"}", "null");
+    TEST_MERGE_PATCH("{\"e\": null, \"a\": 1}", "{\"e\": null}", "{\"a\": 1}");
+    TEST_MERGE_PATCH("{\"a\": \"b\"}", "[1, 2]", "{\"a\": \"b\", \"c\": null}");
+    TEST_MERGE_PATCH("{\"a\": {\"bb\": {}}}", "{}", "{\"a\": {\"bb\": {\"ccc\": null}}}");
+}
+
+static void test_pointer(void)
+{
+    static const char json[] = "{\"foo\": [\"bar\", \"baz\"], \"\": 0, \"a/b\": 1, \"c%d\": 2, \"e^f\": 3, \"g|h\": 4, "
+                               "\"i\\\\j\": 5, \"k\\\"l\": 6, \" \": 7, \"m~n\": 8, \"01\": {\"-\": [null, {\"x\": true}]}}";
+    static const char *paths[] = { "", "/foo", "/foo/0", "/", "/a~1b", "/c%d", "/e^f", "/g|h", "/i\\j", "/k\"l", "/ ", "/m~0n",
+                                   "/01/-/1/x", "/foo/2", "/foo/-", "/foo/01", "/foo/bar", "/foo/0/x", "/none", "/01/-/1/x/y" };
+    static const int types[] = { JSON_OBJECT, JSON_ARRAY, JSON_STRING, JSON_NUMBER, JSON_NUMBER, JSON_NUMBER, JSON_NUMBER, JSON_NUMBER,
+                                 JSON_NUMBER, JSON_NUMBER, JSON_NUMBER, JSON_NUMBER, JSON_TRUE, -1, -1, -1, -1, -1, -1, -1 };
+    json_value v, s, *e;
+    json_tape t;
+    json_pointer *p;
+    size_t i, n;
+
+    json_init(&v);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse(&v, json));
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_tape_parse(&t, json));
+    for (i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+        p = json_pointer_compile(paths[i]);
+        e = json_pointer_get(&v, p, &s);
+        n = json_tape_pointer_get(&t, 0, p);
+        ASSERT_EQ_INT(types[i], e ? json_get_type(e) : -1);
+        ASSERT_EQ_INT(types[i], n || i == 0 ? json_tape_get_type(&t, n) : -1);
+        if (types[i] == JSON_NUMBER) {
+            ASSERT_EQ_DOUBLE(json_get_number(e), json_tape_get_number(&t, n));
+            ASSERT_EQ_DOUBLE((double) (i - 3), json_get_number(e));
+        }
+        json_pointer_free(p);
+    }
+    ASSERT_EQ_POINTER(json_get_array_element(json_get_object_value(&v, "foo"), 1), json_pointer_get(&v, p = json_pointer_compile_n("/foo/1/", 6), &s));
+    json_pointer_free(p);
+
+    ASSERT_EQ_POINTER(NULL, json_pointer_compile("foo"));
+    ASSERT_EQ_POINTER(NULL, json_pointer_compile("/foo~"));
+    ASSERT_EQ_POINTER(NULL, json_pointer_compile("/foo~2"));
+    json_tape_free(&t);
+    json_free(&v);
+}
+
+static int test_path_collect(void *data, json_value *match)
+{
+    json_array_push((json_value *) data, 1, match);
+    return 0;
+}
+
+/* a streamed match belongs to the callback once moved out */
+static int test_path_take(void *data, json_value *match)
+{
+    json_array_push((json_value *) data, 0, match);
+    json_init(match);
+    return 0;
+}
+
+static int test_path_first(void *data, json_value *match)
+{
+    json_array_push((json_value *) data, 1, match);
+    return 1;
+}
+
+#define TEST_PATH(expect, json, expr) \
+    do { \
+        json_value v, r; \
+        json_path *path = json_path_compile(expr); \
+        ASSERT_EQ_INT(1, path != NULL); \
+        json_init(&v); \
+        ASSERT_EQ_INT(JSON_PARSE_OK, json_parse(&v, json)); \
+        json_set_array(&r, 0, NULL); \
+        ASSERT_EQ_SIZE_T(json_path_eval(path, &v, test_path_collect, &r), json_get_array_size(&r)); \
+        TEST_JSONIFY_OK(expect, &r); \
+        json_set_array(&r, 0, NULL); \
+        ASSERT_EQ_INT(JSON_PARSE_OK, json_path_stream(path, json, test_path_take, &r)); \
+        TEST_JSONIFY_OK(expect, &r); \
+        json_path_free(path); \
+        json_free(&v); \
+    } while (0)
+
+static void test_path(void)
+{
+    static const char store[] = "{\"store\": {\"book\": ["
+                                "{\"category\": \"reference\", \"author\": \"Nigel Rees\", \"title\": \"Sayings\", \"price\": 8.5}, "
+                                "{\"category\": \"fiction\", \"author\": \"Evelyn Waugh\", \"title\": \"Sword\", \"price\": 12.25}, "
+                                "{\"category\": \"fiction\", \"author\": \"Herman Melville\", \"title\": \"Moby Dick\", \"isbn\": \"0-553\", \"price\": 8.75}, "
+                                "{\"category\": \"fiction\", \"author\": \"J. R. R. Tolkien\", \"title\": \"LOTR\", \"isbn\": \"0-395\", \"price\": 22.5}], "
+                                "\"bicycle\": {\"color\": \"red\", \"price\": 19.5}}}";
+    json_parse_options options;
+    json_value r, v;
+    json_path *path;
+
+    TEST_PATH("[\"Nigel Rees\", \"Evelyn Waugh\", \"Herman Melville\", \"J. R. R. Tolkien\"]", store, "$.store.book[*].author");
+    TEST_PATH("[\"Nigel Rees\", \"Evelyn Waugh\", \"Herman Melville\", \"J. R. R. Tolkien\"]", store, "$..author");
+    TEST_PATH("[\"red\", 19.5]", store, "$.store.bicycle.*");
+    TEST_PATH("[\"red\"]", store, "$['store'][\"bicycle\"]['color']");
+    TEST_PATH("[8.5, 12.25, 8.75, 22.5, 19.5]", store, "$..price");
+    TEST_PATH("[\"Moby Dick\"]", store, "$..book[2].title");
+    TEST_PATH("[\"LOTR\"]", store, "$..book[-1].title");
+    TEST_PATH("[\"Sayings\", \"Sword\"]", store, "$..book[0, 1].title");
+    TEST_PATH("[8.5, 12.25]", store, "$..book[:2].price");
+    TEST_PATH("[12.25, 22.5]", store, "$..book[1::2].price");
+    TEST_PATH("[8.75, 22.5]", store, "$..book[-2:].price");
+    TEST_PATH("[\"Moby Dick\", \"LOTR\"]", store, "$..book[?(@.isbn)].title");
+    TEST_PATH("[\"Sayings\", \"Moby Dick\"]", store, "$..book[?(@.price < 10)].title");
+    TEST_PATH("[\"J. R. R. Tolkien\"]", store, "$.store.book[?(@.category == 'fiction' && @.price > 20)].author");
+    TEST_PATH("[8.5, 8.75, 22.5]", store, "$..book[?(!(@.price > 10) || @['title'] == \"LOTR\")].price");
+    TEST_PATH("[]", store, "$.store.none");
+    TEST_PATH("[]", store, "$..book[4]");
+
+    TEST_PATH("[[1, {\"b\": 2}], 1, {\"b\": 2}, 2]", "{\"a\": [1, {\"b\": 2}]}", "$..*");
+    TEST_PATH("[{\"a\": 1}, 1]", "{\"a\": {\"a\": 1}}", "$..a");
+    TEST_PATH("[2, 3]", "{\"o\": {\"x\": 1, \"y\": 2, \"z\": 3}}", "$.o[?(@ > 1)]");
+    TEST_PATH("[{\"orders\": [{\"id\": 1, \"total\": 80}]}]", "{\"orders\": [{\"id\": 1, \"total\": 80}]}", "$");
+    TEST_PATH("[2]", "{\"orders\": [{\"id\": 1, \"total\": 80}, {\"id\": 2, \"total\": 120}]}", "$.orders[?(@.total > 100)].id");
+    TEST_PATH("[\"x\"]", "{\"a/b\": {\"~\": \"x\"}, \"c\": [{\"a/b\": {\"~\": \"x\"}}]}", "$.c[?(@['a/b']['~'] == 'x')]['a/b']['~']");
+
+    ASSERT_EQ_POINTER(NULL, json_path_compile(""));
+    ASSERT_EQ_POINTER(NULL, json_path_compile("store"));
+    ASSERT_EQ_POINTER(NULL, json_path_compile("$."));
+    ASSERT_EQ_POINTER(NULL, json_path_compile("$.."));
+    ASSERT_EQ_POINTER(NULL, json_path_compile("$["));
+    ASSERT_EQ_POINTER(NULL, json_path_compile("$[1:2:0]"));
+    ASSERT_EQ_POINTER(NULL, json_path_compile("$['a'"));
+    ASSERT_EQ_POINTER(NULL, json_path_compile("$[?(@.a >)]"));
+    ASSERT_EQ_POINTER(NULL, json_path_compile("$[?(@.a == {})]"));
+    ASSERT_EQ_POINTER(NULL, json_path_compile("$[?(a)]"));
+    ASSERT_EQ_POINTER(NULL, json_path_compile("$[?(@.a && )]"));
+
+    /* skipped values are only scanned, a stop leaves the rest unread */
+    path = json_path_compile("$[*]");
+    json_set_array(&r, 0, NULL);
+    ASSERT_EQ_INT(JSON_PARSE_ERROR, json_path_stream(path, "[1, 2", test_path_collect, &r));
+    ASSERT_EQ_INT(JSON_PARSE_ERROR, json_path_stream(path, "[1, 2] x", test_path_collect, &r));
+    TEST_JSONIFY_OK("[1, 2, 1, 2]", &r);
+    json_set_array(&r, 0, NULL);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_path_stream(path, "[1, 2, oops", test_path_first, &r));
+    TEST_JSONIFY_OK("[1]", &r);
+    json_path_free(path);
+    path = json_path_compile("$.b");
+    json_set_array(&r, 0, NULL);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_path_stream(path, "{\"a\": [{\"x\": \"]}\\\"\"}, 1e3], \"b\": true}", test_path_collect, &r));
+    ASSERT_EQ_INT(JSON_PARSE_ERROR, json_path_stream(path, "{\"a\": [1, \"x], \"b\": true}", test_path_collect, &r));
+    TEST_JSONIFY_OK("[true]", &r);
+    json_path_free(path);
+
+    /* the elements of packed arrays are matched as copies */
+    options.shape_cache = NULL;
+    options.dedup = NULL;
+    options.flags = JSON_PARSE_PACK;
+    json_init(&v);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse_ex(&v, "{\"a\": [1, 5, 3], \"b\": [[2, 7], [9, 4]]}", &options));
+    path = json_path_compile("$..[?(@ > 3)]");
+    json_set_array(&r, 0, NULL);
+    ASSERT_EQ_SIZE_T(4, json_path_eval(path, &v, test_path_collect, &r));
+    TEST_JSONIFY_OK("[5, 7, 9, 4]", &r);
+    json_path_free(path);
+    path = json_path_compile("$.b[?(@[1] > 5)]");
+    json_set_array(&r, 0, NULL);
+    ASSERT_EQ_SIZE_T(1, json_path_eval(path, &v, test_path_collect, &r));
+    TEST_JSONIFY_OK("[[2, 7]]", &r);
+    json_path_free(path);
+    ASSERT_EQ_INT(JSON_FLAG_PACKED, json_get_object_value(&v, "a")->flags);
+    json_free(&v);
+}
+
+#define TEST_EXTRACT(expect, json, path) \
+    do { \
+        json_value v; \
+        json_pointer *p = json_pointer_compile(path); \
+        json_init(&v); \
+        ASSERT_EQ_INT(JSON_EXTRACT_OK, json_extract(&v, json, p)); \
+        TEST_JSONIFY_OK(expect, &v); \
+        json_pointer_free(p); \
+    } while (0)
+
+#define TEST_EXTRACT_RESULT(result, json, path) \
+    do { \
+        json_value v; \
+        json_pointer *p = json_pointer_compile(path); \
+        json_init(&v); \
+        ASSERT_EQ_INT(result, json_extract(&v, json, p)); \
+        ASSERT_EQ_INT(JSON_NULL, json_get_type(&v)); \
+        json_pointer_free(p); \
+    } while (0)
+
+static void test_extract(void)
+{
+    static const char json[] = " {\"skip\": {\"s\": \"}\\\"]\", \"n\": [1, -2.5e3, true, null, [], {}]}, \"k\\u0065y\": 1, \"type\": \"order\", "
+                               "\"items\": [{\"id\": 7}, {\"id\": 8, \"tags\": [\"a\", \"b\"]}]} ";
+
+    TEST_EXTRACT("\"order\"", json, "/type");
+    TEST_EXTRACT("1", json, "/key");
+    TEST_EXTRACT("[\"a\", \"b\"]", json, "/items/1/tags");
+    TEST_EXTRACT("8", json, "/items/1/id");
+    TEST_EXTRACT("-2500", json, "/skip/n/1");
+    TEST_EXTRACT("{\"skip\": {\"s\": \"}\\\"]\", \"n\": [1, -2500, true, null, [], {}]}, \"key\": 1, \"type\": \"order\", "
+                 "\"items\": [{\"id\": 7}, {\"id\": 8, \"tags\": [\"a\", \"b\"]}]}", json, "");
+    TEST_EXTRACT_RESULT(JSON_EXTRACT_MISSING, json, "/none");
+    TEST_EXTRACT_RESULT(JSON_EXTRACT_MISSING, json, "/items/2");
+    TEST_EXTRACT_RESULT(JSON_EXTRACT_MISSING, json, "/items/-");
+    TEST_EXTRACT_RESULT(JSON_EXTRACT_MISSING, json, "/items/id");
+    TEST_EXTRACT_RESULT(JSON_EXTRACT_MISSING, json, "/type/0");
+    TEST_EXTRACT_RESULT(JSON_EXTRACT_MISSING, "{}", "/a");
+    TEST_EXTRACT_RESULT(JSON_EXTRACT_MISSING, "[]", "/0");
+
+    /* nothing after the value is read */
+    TEST_EXTRACT("\"order\"", "{\"type\": \"order\", \"body\": [1, 2, ", "/type");
+    TEST_EXTRACT("2", "[1, 2, }", "/1");
+    TEST_EXTRACT_RESULT(JSON_EXTRACT_ERROR, "{\"body\": [1, 2, \"type\": \"order\"}", "/type");
+    TEST_EXTRACT_RESULT(JSON_EXTRACT_ERROR, "{\"body\" 1, \"type\": \"order\"}", "/type");
+    TEST_EXTRACT_RESULT(JSON_EXTRACT_ERROR, "{\"body\": \"x, \"type\": 1", "/type");
+    TEST_EXTRACT_RESULT(JSON_EXTRACT_ERROR, "{\"type\": tru}", "/type");
+    TEST_EXTRACT_RESULT(JSON_EXTRACT_ERROR, "[1 2]", "/1");
+}
+
+typedef struct {
+    double lat, lon;
+} test_geo;
+
+typedef struct {
+    int64_t id;
+    char *name;
+    int score;
+    int active;
+    test_geo geo;
+    json_value tags;
+} test_record;
+
+static const json_field test_geo_fields[] = {
+    JSON_FIELD(JSON_FIELD_DOUBLE, test_geo, lat),
+    JSON_FIELD(JSON_FIELD_DOUBLE, test_geo, lon),
+    JSON_FIELD_END
+};
+
+static const json_field test_record_fields[] = {
+    JSON_FIELD(JSON_FIELD_INT64, test_record, id),
+    JSON_FIELD(JSON_FIELD_STRING, test_record, name),
+    JSON_FIELD(JSON_FIELD_INT, test_record, score),
+    JSON_FIELD(JSON_FIELD_BOOL, test_record, active),
+    JSON_FIELD_STRUCT(test_record, geo, test_geo_fields),
+    JSON_FIELD(JSON_FIELD_VALUE, test_record, tags),
+    JSON_FIELD_END
+};
+
+#define TEST_STRUCT_ERROR(schema, json) \
+    do { \
+        test_record r; \
+        char *strings = NULL; \
+        memset(&r, 0, sizeof(r)); \
+        json_init(&r.tags); \
+        ASSERT_EQ_INT(JSON_PARSE_ERROR, json_parse_struct(&r, json, schema, &strings)); \
+        ASSERT_EQ_POINTER(NULL, strings); \
+        ASSERT_EQ_POINTER(NULL, r.name); \
+        json_free(&r.tags); \
+    } while (0)
+
+static void test_shred(void)
+{
+    static const char *paths[] = { "/id", "/name", "/ok", "/geo/lat", "/none", "" };
+    static const char *invalid[] = { "/id", "id" };
+    static const char *nested[] = { "/c/1" };
+    json_parse_options options;
+    json_column columns[6];
+    json_value v;
+
+    json_init(&v);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse(&v, "[{\"id\": 1, \"name\": \"a\", \"ok\": true, \"geo\": {\"lat\": 1.5}}, "
+                                                "{\"name\": null, \"id\": 2.5, \"ok\": false}, "
+                                                "{\"id\": \"3\", \"name\": \"\\u00e9\", \"ok\": 1, \"geo\": {\"lat\": [2]}}, "
+                                                "7, "
+                                                "{\"id\": -4, \"name\": \"bc\", \"ok\": true, \"geo\": null}]"));
+    ASSERT_EQ_INT(JSON_SHRED_OK, json_shred(columns, &v, paths, 6));
+
+    ASSERT_EQ_INT(JSON_COLUMN_NUMBER, columns[0].type);
+    ASSERT_EQ_SIZE_T(5, columns[0].size);
+    ASSERT_EQ_DOUBLE(1.0, columns[0].numbers[0]);
+    ASSERT_EQ_DOUBLE(2.5, columns[0].numbers[1]);
+    ASSERT_EQ_DOUBLE(0.0, columns[0].numbers[2]);
+    ASSERT_EQ_DOUBLE(-4.0, columns[0].numbers[4]);
+    ASSERT_EQ_INT(0x13, (int) columns[0].valid[0]);
+    ASSERT_EQ_SIZE_T(1, columns[0].mismatched);
+
+    ASSERT_EQ_INT(JSON_COLUMN_STRING, columns[1].type);
+    ASSERT_EQ_INT(1, JSON_COLUMN_BIT(columns[1].valid, 2));
+    ASSERT_EQ_INT(0, JSON_COLUMN_BIT(columns[1].valid, 1));
+    ASSERT_EQ_SIZE_T(0, columns[1].mismatched);
+    ASSERT_EQ_SIZE_T(0, columns[1].offsets[0]);
+    ASSERT_EQ_SIZE_T(1, columns[1].offsets[1]);
+    ASSERT_EQ_SIZE_T(1, columns[1].offsets[2]);
+    ASSERT_EQ_SIZE_T(3, columns[1].offsets[3]);
+    ASSERT_EQ_SIZE_T(3, columns[1].offsets[4]);
+    ASSERT_EQ_SIZE_T(5, columns[1].offsets[5]);
+    ASSERT_EQ_STRING("a\xC3\xA9" "bc", columns[1].strings, columns[1].offsets[5]);
+
+    ASSERT_EQ_INT(JSON_COLUMN_BOOL, columns[2].type);
+    ASSERT_EQ_INT(0x13, (int) columns[2].valid[0]);
+    ASSERT_EQ_INT(0x11, (int) columns[2].bools[0]);
+    ASSERT_EQ_SIZE_T(1, columns[2].mismatched);
+
+    ASSERT_EQ_INT(JSON_COLUMN_NUMBER, columns[3].type);
+    ASSERT_EQ_INT(0x01, (int) columns[3].valid[0]);
+    ASSERT_EQ_SIZE_T(1, columns[3].mismatched);
+
+    ASSERT_EQ_INT(JSON_COLUMN_NULL, columns[4].type);
+    ASSERT_EQ_INT(0, (int) columns[4].valid[0]);
+    ASSERT_EQ_POINTER(NULL, columns[4].numbers);
+
+    /* "" is the row itself */
+    ASSERT_EQ_INT(JSON_COLUMN_NUMBER, columns[5].type);
+    ASSERT_EQ_INT(0x08, (int) columns[5].valid[0]);
+    ASSERT_EQ_DOUBLE(7.0, columns[5].numbers[3]);
+    ASSERT_EQ_SIZE_T(4, columns[5].mismatched);
+    json_column_free(&columns[0]);
+    json_column_free(&columns[1]);
+    json_column_free(&columns[2]);
+    json_column_free(&columns[3]);
+    json_column_free(&columns[4]);
+    json_column_free(&columns[5]);
+    json_free(&v);
+
+    /* Rows past a bitmap word of a packed array */
+    options.shape_cache = NULL;
+    options.dedup = NULL;
+    options.flags = JSON_PARSE_PACK;
+    json_init(&v);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse_ex(&v, "[0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, "
+                                                   "27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, "
+                                                   "52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 62, 63, 64, 65]", &options));
+    ASSERT_EQ_INT(JSON_FLAG_PACKED, v.flags);
+    ASSERT_EQ_INT(JSON_SHRED_OK, json_shred(columns, &v, paths + 5, 1));
+    ASSERT_EQ_SIZE_T(66, columns[0].size);
+    ASSERT_EQ_INT(1, columns[0].valid[0] == ~(uint64_t) 0 && columns[0].valid[1] == 3);
+    ASSERT_EQ_DOUBLE(65.0, columns[0].numbers[65]);
+    json_column_free(&columns[0]);
+    json_free(&v);
+
+    /* Fields inside a packed array */
+    json_init(&v);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse_ex(&v, "[{\"c\": [1, 2]}, {\"c\": [3, 4]}, {\"c\": [5, \"6\"]}]", &options));
+    ASSERT_EQ_INT(JSON_FLAG_PACKED, json_get_object_value(json_get_array_element(&v, 0), "c")->flags);
+    ASSERT_EQ_INT(JSON_SHRED_OK, json_shred(columns, &v, nested, 1));
+    ASSERT_EQ_INT(JSON_COLUMN_NUMBER, columns[0].type);
+    ASSERT_EQ_INT(0x03, (int) columns[0].valid[0]);
+    ASSERT_EQ_DOUBLE(2.0, columns[0].numbers[0]);
+    ASSERT_EQ_DOUBLE(4.0, columns[0].numbers[1]);
+    ASSERT_EQ_SIZE_T(1, columns[0].mismatched);
+    json_column_free(&columns[0]);
+    json_free(&v);
+
+    /* Errors */
+    json_init(&v);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse(&v, "{\"id\": 1}"));
+    ASSERT_EQ_INT(JSON_SHRED_ERROR, json_shred(columns, &v, paths, 1));
+    json_free(&v);
+    json_init(&v);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse(&v, "[]"));
+    ASSERT_EQ_INT(JSON_SHRED_ERROR, json_shred(columns, &v, invalid, 2));
+    ASSERT_EQ_INT(JSON_SHRED_OK, json_shred(columns, &v, paths, 1));
+    ASSERT_EQ_SIZE_T(0, columns[0].size);
+    ASSERT_EQ_INT(JSON_COLUMN_NULL, columns[0].type);
+    json_column_free(&columns[0]);
+    json_free(&v);
+}
+
+static void test_struct(void)
+{
+    json_schema *schema = json_schema_compile(test_record_fields, 0);
+    json_schema *strict = json_schema_compile(test_record_fields, JSON_SCHEMA_STRICT);
+    test_record r;
+    char *strings;
+
+    memset(&r, 0, sizeof(r));
+    json_init(&r.tags);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse_struct(&r, " {\"id\": -9007199254740993, \"name\": \"a\\u0000b\\n\", \"score\": 2147483647, \"active\": true, "
+                                                       "\"geo\": {\"lat\": 1.5, \"lon\": -2e2}, \"tags\": [\"x\", {}]} ", schema, &strings));
+    ASSERT_EQ_INT(1, r.id == -9007199254740993LL);
+    ASSERT_EQ_STRING("a\0b\n", r.name, 4);
+    ASSERT_EQ_INT(2147483647, r.score);
+    ASSERT_EQ_INT(1, r.active);
+    ASSERT_EQ_DOUBLE(1.5, r.geo.lat);
+    ASSERT_EQ_DOUBLE(-200.0, r.geo.lon);
+    TEST_JSONIFY_OK("[\"x\", {}]", &r.tags);
+    free(strings);
+
+    /* out of order, unknown, escaped and null members, fields without a member stay */
+    json_init(&r.tags);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse_struct(&r, "{\"geo\": {\"lon\": 3, \"alt\": [1, {\"lat\": 9}]}, \"extra\": {\"name\": 1}, "
+                                                       "\"sc\\u006fre\": -1e2, \"name\": \"n\", \"id\": 1.0, \"active\": null, \"name\": \"m\"}", schema, &strings));
+    ASSERT_EQ_INT(1, r.id == 1);
+    ASSERT_EQ_STRING("m", r.name, strlen(r.name));
+    ASSERT_EQ_INT(-100, r.score);
+    ASSERT_EQ_INT(1, r.active);
+    ASSERT_EQ_DOUBLE(1.5, r.geo.lat);
+    ASSERT_EQ_DOUBLE(3.0, r.geo.lon);
+    ASSERT_EQ_INT(JSON_NULL, json_get_type(&r.tags));
+    free(strings);
+
+    /* integers past 18 digits are exact up to the int64_t limits */
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse_struct(&r, "{\"id\": 1234567890123456789}", schema, &strings));
+    ASSERT_EQ_INT(1, r.id == 1234567890123456789LL);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse_struct(&r, "{\"id\": 9223372036854775807}", schema, &strings));
+    ASSERT_EQ_INT(1, r.id == INT64_MAX);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse_struct(&r, "{\"id\": -9223372036854775808}", schema, &strings));
+    ASSERT_EQ_INT(1, r.id == INT64_MIN);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse_struct(&r, "{\"id\": -1234567890123456789.0}", schema, &strings));
+    ASSERT_EQ_INT(1, r.id == -1234567890123456789LL);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse_struct(&r, "{\"id\": 922337203685477580.70e1}", schema, &strings));
+    ASSERT_EQ_INT(1, r.id == INT64_MAX);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse_struct(&r, "{\"id\": -0.0e-400}", schema, &strings));
+    ASSERT_EQ_INT(1, r.id == 0);
+    free(strings);
+
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse_struct(&r, "{}", strict, &strings));
+    ASSERT_EQ_POINTER(NULL, strings);
+    TEST_STRUCT_ERROR(strict, "{\"id\": 1, \"extra\": 2}");
+    TEST_STRUCT_ERROR(strict, "{\"geo\": {\"alt\": 2}}");
+    TEST_STRUCT_ERROR(schema, "{\"name\": \"x\", \"score\": 2147483648}");
+    TEST_STRUCT_ERROR(schema, "{\"name\": \"x\", \"score\": 1.5}");
+    TEST_STRUCT_ERROR(schema, "{\"name\": \"x\", \"id\": 01}");
+    TEST_STRUCT_ERROR(schema, "{\"name\": \"x\", \"id\": 1e19}");
+    TEST_STRUCT_ERROR(schema, "{\"name\": \"x\", \"id\": 9223372036854775808}");
+    TEST_STRUCT_ERROR(schema, "{\"name\": \"x\", \"id\": -9223372036854775809}");
+    TEST_STRUCT_ERROR(schema, "{\"name\": \"x\", \"id\": 12345678901234567890123}");
+    TEST_STRUCT_ERROR(schema, "{\"name\": \"x\", \"id\": 1234567890123456789.5}");
+    TEST_STRUCT_ERROR(schema, "{\"name\": \"x\", \"id\": 12.5e-1}");
+    TEST_STRUCT_ERROR(schema, "{\"name\": \"x\", \"id\": 1e400}");
+    TEST_STRUCT_ERROR(schema, "{\"name\": \"x\", \"id\": \"1\"}");
+    TEST_STRUCT_ERROR(schema, "{\"name\": 1}");
+    TEST_STRUCT_ERROR(schema, "{\"name\": \"x\", \"active\": 1}");
+    TEST_STRUCT_ERROR(schema, "{\"name\": \"x\", \"geo\": [1]}");
+    TEST_STRUCT_ERROR(schema, "{\"name\": \"x\", \"extra\": [}");
+    TEST_STRUCT_ERROR(schema, "{\"name\": \"x\", \"tags\": [1,]}");
+    TEST_STRUCT_ERROR(schema, "{\"name\": \"x\"} x");
+    TEST_STRUCT_ERROR(schema, "[]");
+    json_schema_free(schema);
+    json_schema_free(strict);
+}
+
+static int test_sink_collect(void *data, const char *json, size_t len)
+{
+    json_value *pieces = (json_value *) data;
+    json_value piece;
+
+    json_init(&piece);
+    json_set_string(&piece, json, len);
+    json_array_push(pieces, 0, &piece);
+    return 0;
+}
+
+static int test_sink_fail(void *data, const char *json, size_t len)
+{
+    (void) json;
+    (void) len;
+    return ++*(int *) data > 1;
+}
+
+static void test_jsonify_struct(void)
+{
+    static const json_field empty_fields[] = {JSON_FIELD_END};
+    json_schema *schema = json_schema_compile(test_record_fields, 0), *empty = json_schema_compile(empty_fields, 0);
+    test_record r, back;
+    json_value pieces;
+    char *json, *strings, *text;
+    size_t len, i, total;
+    int calls = 0;
+
+    memset(&r, 0, sizeof(r));
+    r.id = -9223372036854775807LL - 1;
+    r.name = "a\"/\n\xE2\x82\xAC";
+    r.score = -7;
+    r.active = 1;
+    r.geo.lat = 0.5;
+    r.geo.lon = -1e300;
+    json_init(&r.tags);
+    json_parse(&r.tags, "[1, {\"k\": null}]");
+    json = json_jsonify_struct(&r, schema, &len);
+    ASSERT_EQ_STRING("{\"id\": -9223372036854775808, \"name\": \"a\\\"\\/\\n\\u20AC\", \"score\": -7, \"active\": true, "
+                     "\"geo\": {\"lat\": 0.5, \"lon\": -1.0000000000000001e+300}, \"tags\": [1, {\"k\": null}]}", json, len);
+    memset(&back, 0, sizeof(back));
+    json_init(&back.tags);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse_struct(&back, json, schema, &strings));
+    ASSERT_EQ_INT(1, back.id == r.id && back.score == r.score && back.active == r.active);
+    ASSERT_EQ_DOUBLE(r.geo.lon, back.geo.lon);
+    ASSERT_EQ_INT(0, strcmp(r.name, back.name));
+    ASSERT_EQ_INT(1, json_equal(&r.tags, &back.tags));
+    json_free(&back.tags);
+    free(strings);
+    free(json);
+
+    /* a sink gets the same text in pieces */
+    r.name = text = (char *) malloc(10001);
+    memset(text, 'x', 10000);
+    text[10000] = '\0';
+    r.active = 0;
+    json = json_jsonify_struct(&r, schema, &len);
+    json_set_array(&pieces, 0, NULL);
+    ASSERT_EQ_INT(JSON_JSONIFY_OK, json_jsonify_struct_sink(&r, schema, test_sink_collect, &pieces));
+    ASSERT_EQ_INT(1, json_get_array_size(&pieces) > 1);
+    for (i = total = 0; i < json_get_array_size(&pieces); total += json_get_string_length(json_get_array_element(&pieces, i++)))
+        ASSERT_EQ_INT(0, memcmp(json + total, json_get_string(json_get_array_element(&pieces, i)), json_get_string_length(json_get_array_element(&pieces, i))));
+    ASSERT_EQ_SIZE_T(len, total);
+    ASSERT_EQ_INT(JSON_JSONIFY_ERROR, json_jsonify_struct_sink(&r, schema, test_sink_fail, &calls));
+    ASSERT_EQ_INT(2, calls);
+    json_free(&pieces);
+    free(json);
+    free(text);
+
+    r.name = NULL;
+    r.geo.lon = 2;
+    json_free(&r.tags);
+    json_init(&r.tags);
+    json = json_jsonify_struct(&r, schema, &len);
+    ASSERT_EQ_STRING("{\"id\": -9223372036854775808, \"name\": null, \"score\": -7, \"active\": false, "
+                     "\"geo\": {\"lat\": 0.5, \"lon\": 2}, \"tags\": null}", json, len);
+    free(json);
+    json = json_jsonify_struct(&r, empty, &len);
+    ASSERT_EQ_STRING("{}", json, len);
+    free(json);
+    r.name = "\xFF";
+    ASSERT_EQ_POINTER(NULL, json_jsonify_struct(&r, schema, &len));
+    ASSERT_EQ_SIZE_T(0, len);
+    json_schema_free(schema);
+    json_schema_free(empty);
+}
+
+#define TEST_WRITER_ERROR(calls) \
+    do { \
+        json_writer_reset(w); \
+        calls; \
+        ASSERT_EQ_INT(JSON_JSONIFY_ERROR, json_writer_finish(w)); \
+        ASSERT_EQ_POINTER(NULL, json_writer_get_text(w, &len)); \
+    } while (0)
+
+static void test_writer(void)
+{
+    json_writer *w = json_writer_new(NULL, NULL);
+    json_jsonify_options options;
+    json_value v, pieces;
+    const char *text;
+    size_t len, i;
+
+    json_init(&v);
+    json_parse(&v, "{\"k\": [true, null]}");
+    ASSERT_EQ_INT(JSON_JSONIFY_OK, json_writer_begin_object(w));
+    ASSERT_EQ_INT(JSON_JSONIFY_OK, json_writer_key(w, "a/\"", 3));
+    ASSERT_EQ_INT(JSON_JSONIFY_OK, json_writer_begin_array(w));
+    ASSERT_EQ_INT(JSON_JSONIFY_OK, json_writer_number(w, 1.5));
+    ASSERT_EQ_INT(JSON_JSONIFY_OK, json_writer_string(w, "x\0y", 3));
+    ASSERT_EQ_INT(JSON_JSONIFY_OK, json_writer_bool(w, 0));
+    ASSERT_EQ_INT(JSON_JSONIFY_OK, json_writer_begin_object(w));
+    ASSERT_EQ_INT(JSON_JSONIFY_OK, json_writer_end_object(w));
+    ASSERT_EQ_INT(JSON_JSONIFY_OK, json_writer_begin_array(w));
+    ASSERT_EQ_INT(JSON_JSONIFY_OK, json_writer_end_array(w));
+    ASSERT_EQ_INT(JSON_JSONIFY_OK, json_writer_end_array(w));
+    ASSERT_EQ_INT(JSON_JSONIFY_OK, json_writer_key(w, "n", 1));
+    ASSERT_EQ_INT(JSON_JSONIFY_OK, json_writer_null(w));
+    ASSERT_EQ_INT(JSON_JSONIFY_OK, json_writer_key(w, "v", 1));
+    ASSERT_EQ_INT(JSON_JSONIFY_OK, json_writer_value(w, &v));
+    ASSERT_EQ_INT(JSON_JSONIFY_OK, json_writer_end_object(w));
+    ASSERT_EQ_INT(JSON_JSONIFY_OK, json_writer_finish(w));
+    text = json_writer_get_text(w, &len);
+    ASSERT_EQ_STRING("{\"a\\/\\\"\": [1.5, \"x\\u0000y\", false, {}, []], \"n\": null, \"v\": {\"k\": [true, null]}}", text, len);
+    json_free(&v);
+
+    /* the nesting is checked, and a misuse stays until the reset */
+    TEST_WRITER_ERROR((void) 0);
+    TEST_WRITER_ERROR(json_writer_begin_array(w));
+    TEST_WRITER_ERROR(json_writer_null(w); json_writer_null(w));
+    TEST_WRITER_ERROR(json_writer_key(w, "k", 1));
+    TEST_WRITER_ERROR(json_writer_begin_array(w); json_writer_key(w, "k", 1); json_writer_end_array(w));
+    TEST_WRITER_ERROR(json_writer_begin_object(w); json_writer_null(w); json_writer_end_object(w));
+    TEST_WRITER_ERROR(json_writer_begin_object(w); json_writer_key(w, "k", 1); json_writer_end_object(w));
+    TEST_WRITER_ERROR(json_writer_begin_object(w); json_writer_key(w, "k", 1); json_writer_key(w, "k", 1));
+    TEST_WRITER_ERROR(json_writer_begin_object(w); json_writer_end_array(w));
+    TEST_WRITER_ERROR(json_writer_end_object(w));
+    TEST_WRITER_ERROR(json_writer_string(w, "\xFF", 1));
+    json_writer_reset(w);
+    ASSERT_EQ_INT(JSON_JSONIFY_OK, json_writer_number(w, -2));
+    ASSERT_EQ_INT(JSON_JSONIFY_OK, json_writer_finish(w));
+    text = json_writer_get_text(w, &len);
+    ASSERT_EQ_STRING("-2", text, len);
+    options.flags = JSON_JSONIFY_RAW_UTF8 | JSON_JSONIFY_UNESCAPED_SLASH;
+    json_writer_set_options(w, &options);
+    json_writer_reset(w);
+    ASSERT_EQ_INT(JSON_JSONIFY_OK, json_writer_string(w, "\xE2\x82\xAC/", 4));
+    ASSERT_EQ_INT(JSON_JSONIFY_OK, json_writer_finish(w));
+    text = json_writer_get_text(w, &len);
+    ASSERT_EQ_STRING("\"\xE2\x82\xAC/\"", text, len);
+    json_writer_free(w);
+
+    /* a sink gets the text in pieces */
+    json_set_array(&pieces, 0, NULL);
+    w = json_writer_new(test_sink_collect, &pieces);
+    json_writer_begin_array(w);
+    for (i = 0; i < 2000; i++)
+        json_writer_string(w, "abcd", 4);
+    json_writer_end_array(w);
+    ASSERT_EQ_INT(JSON_JSONIFY_OK, json_writer_finish(w));
+    for (i = len = 0; i < json_get_array_size(&pieces); i++)
+        len += json_get_string_length(json_get_array_element(&pieces, i));
+    ASSERT_EQ_INT(1, json_get_array_size(&pieces) > 1);
+    ASSERT_EQ_SIZE_T(2 + 2000 * 6 + 1999 * 2, len);
+    ASSERT_EQ_STRING("[\"abcd\", \"", json_get_string(json_get_array_element(&pieces, 0)), 10);
+    json_free(&pieces);
+    json_writer_free(w);
+}
+
+#define TEST_MINIFY(expect, json) \
+    do { \
+        char *p; \
+        size_t len; \
+        p = json_minify(json, &len); \
+        ASSERT_EQ_STRING(expect, p, len); \
+        free(p); \
+    } while (0)
+
+#define TEST_PRETTIFY(expect, json, indent) \
+    do { \
+        char *p; \
+        size_t len; \
+        p = json_prettify(json, indent, &len); \
+        ASSERT_EQ_STRING(expect, p, len); \
+        free(p); \
+    } while (0)
+
+#define TEST_FORMAT_ERROR(json) \
+    do { \
+        ASSERT_EQ_POINTER(NULL, json_minify(json, NULL)); \
+        ASSERT_EQ_POINTER(NULL, json_prettify(json, 2, NULL)); \
+    } while (0)
+
+static void test_format(void)
+{
+    json_value pieces;
+    char *json, *text;
+    size_t len, total, i;
+    int calls = 0;
+
+    TEST_MINIFY("null", " null ");
+    TEST_MINIFY("-1.50E+3", "\t-1.50E+3\n");
+    TEST_MINIFY("\"a b\\/\\u00e9\\uD834\\uDD1E\xE2\x82\xAC\"", " \"a b\\/\\u00e9\\uD834\\uDD1E\xE2\x82\xAC\" ");
+    TEST_MINIFY("{}", "{ }");
+    TEST_MINIFY("[]", "[\n]");
+    TEST_MINIFY("{\"a\":[1,true,false,null,{},[]],\"b\":{\"c\":\"d\"}}",
+                " { \"a\" : [ 1 , true , false , null , { } , [ ] ] ,\r\n \"b\" : { \"c\" : \"d\" } } ");
+
+    TEST_PRETTIFY("1", "1", 4);
+    TEST_PRETTIFY("{}", " {  } ", 4);
+    TEST_PRETTIFY("[\n  1,\n  [\n    2\n  ],\n  []\n]", "[1,[2],[]]", 2);
+    TEST_PRETTIFY("{\n    \"a\": {\n        \"b\": [\n            null\n        ]\n    },\n    \"c\": \"\"\n}", "{\"a\":{\"b\":[null]},\"c\":\"\"}", 4);
+    TEST_PRETTIFY("[\n1,\n2\n]", "[1, 2]", 0);
+
+    TEST_FORMAT_ERROR("");
+    TEST_FORMAT_ERROR(" ");
+    TEST_FORMAT_ERROR("nul");
+    TEST_FORMAT_ERROR("1 2");
+    TEST_FORMAT_ERROR("01");
+    TEST_FORMAT_ERROR("1.");
+    TEST_FORMAT_ERROR("\"\\x\"");
+    TEST_FORMAT_ERROR("\"\\uD834\"");
+    TEST_FORMAT_ERROR("\"\x01\"");
+    TEST_FORMAT_ERROR("\"abc");
+    TEST_FORMAT_ERROR("[1,]");
+    TEST_FORMAT_ERROR("[1 2]");
+    TEST_FORMAT_ERROR("[1}");
+    TEST_FORMAT_ERROR("{\"a\":1]");
+    TEST_FORMAT_ERROR("{\"a\" 1}");
+    TEST_FORMAT_ERROR("{1:1}");
+    TEST_FORMAT_ERROR("{\"a\":1,}");
+    TEST_FORMAT_ERROR("[[]");
+    TEST_FORMAT_ERROR("[]]");
+
+    /* a sink gets the same text in pieces */
+    json = (char *) malloc(2 + 3000 * 8);
+    for (i = 0, text = json; i < 3000; i++)
+        text += sprintf(text, i ? ", [%d]" : "[[%d]", (int) (i % 10));
+    strcpy(text, "]");
+    text = json_prettify(json, 2, &len);
+    json_init(&pieces);
+    json_set_array(&pieces, 0, NULL);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_prettify_sink(json, 2, test_sink_collect, &pieces));
+    ASSERT_EQ_INT(1, json_get_array_size(&pieces) > 1);
+    for (i = total = 0; i < json_get_array_size(&pieces); total += json_get_string_length(json_get_array_element(&pieces, i++)))
+        ASSERT_EQ_INT(0, memcmp(text + total, json_get_string(json_get_array_element(&pieces, i)), json_get_string_length(json_get_array_element(&pieces, i))));
+    ASSERT_EQ_SIZE_T(len, total);
+    ASSERT_EQ_INT(JSON_PARSE_ERROR, json_minify_sink(json, test_sink_fail, &calls));
+    ASSERT_EQ_INT(2, calls);
+    ASSERT_EQ_INT(JSON_PARSE_ERROR, json_minify_sink("[1,", test_sink_collect, &pieces));
+    json_free(&pieces);
+    free(text);
+
+    /* the minified text parses to the same value */
+    text = json_minify(json, &len);
+    ASSERT_EQ_SIZE_T(2 + 3000 * 3 + 2999, len);
+    json_init(&pieces);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse(&pieces, text));
+    ASSERT_EQ_SIZE_T(3000, json_get_array_size(&pieces));
+    json_free(&pieces);
+    free(text);
+    free(json);
+}
+
+#define TEST_BINARY(to, from, expect, json) \
+    do { \
+        json_value v, back; \
+        char *p; \
+        size_t len; \
+        json_init(&v); \
+        ASSERT_EQ_INT(JSON_PARSE_OK, json_parse(&v, json)); \
+        p = to(&v, &len); \
+        ASSERT_EQ_STRING(expect, p, len); \
+        ASSERT_EQ_INT(JSON_PARSE_OK, from(&back, p, len)); \
+        ASSERT_EQ_INT(1, json_equal(&v, &back)); \
+        free(p); \
+        json_free(&v); \
+        json_free(&back); \
+    } while (0)
+
+#define TEST_BINARY_ERROR(from, data) \
+    do { \
+        json_value v; \
+        ASSERT_EQ_INT(JSON_PARSE_ERROR, from(&v, data, sizeof(data) - 1)); \
+        ASSERT_EQ_INT(JSON_NULL, json_get_type(&v)); \
+    } while (0)
+
+static void test_cbor(void)
+{
+    json_value v, back, pieces;
+    char *p, *text;
+    size_t len, total, i;
+    int calls = 0;
+
+    /* the examples of RFC 8949, appendix A */
+    TEST_BINARY(json_to_cbor, json_from_cbor, "\x00", "0");
+    TEST_BINARY(json_to_cbor, json_from_cbor, "\x17", "23");
+    TEST_BINARY(json_to_cbor, json_from_cbor, "\x18\x18", "24");
+    TEST_BINARY(json_to_cbor, json_from_cbor, "\x19\x03\xE8", "1000");
+    TEST_BINARY(json_to_cbor, json_from_cbor, "\x1A\x00\x0F\x42\x40", "1000000");
+    TEST_BINARY(json_to_cbor, json_from_cbor, "\x1B\x00\x00\x00\xE8\xD4\xA5\x10\x00", "1000000000000");
+    TEST_BINARY(json_to_cbor, json_from_cbor, "\x20", "-1");
+    TEST_BINARY(json_to_cbor, json_from_cbor, "\x38\x63", "-100");
+    TEST_BINARY(json_to_cbor, json_from_cbor, "\x39\x03\xE7", "-1000");
+    TEST_BINARY(json_to_cbor, json_from_cbor, "\xFA\x3F\xC0\x00\x00", "1.5");
+    TEST_BINARY(json_to_cbor, json_from_cbor, "\xFA\x80\x00\x00\x00", "-0");
+    TEST_BINARY(json_to_cbor, json_from_cbor, "\xFB\x3F\xF1\x99\x99\x99\x99\x99\x9A", "1.1");
+    TEST_BINARY(json_to_cbor, json_from_cbor, "\xFB\x7E\x37\xE4\x3C\x88\x00\x75\x9C", "1.0e+300");
+    TEST_BINARY(json_to_cbor, json_from_cbor, "\xF4", "false");
+    TEST_BINARY(json_to_cbor, json_from_cbor, "\xF5", "true");
+    TEST_BINARY(json_to_cbor, json_from_cbor, "\xF6", "null");
+    TEST_BINARY(json_to_cbor, json_from_cbor, "\x60", "\"\"");
+    TEST_BINARY(json_to_cbor, json_from_cbor, "\x64\x49\x45\x54\x46", "\"IETF\"");
+    TEST_BINARY(json_to_cbor, json_from_cbor, "\x62\xC3\xBC", "\"\\u00fc\"");
+    TEST_BINARY(json_to_cbor, json_from_cbor, "\x80", "[]");
+    TEST_BINARY(json_to_cbor, json_from_cbor, "\x83\x01\x82\x02\x03\x82\x04\x05", "[1, [2, 3], [4, 5]]");
+    TEST_BINARY(json_to_cbor, json_from_cbor, "\xA0", "{}");
+    TEST_BINARY(json_to_cbor, json_from_cbor, "\xA2\x61\x61\x01\x61\x62\x82\x02\x03", "{\"a\": 1, \"b\": [2, 3]}");
+
+    /* other encoders' choices decode too */
+    json_init(&v);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_from_cbor(&v, "\xF9\x3C\x00", 3));
+    ASSERT_EQ_DOUBLE(1.0, json_get_number(&v));
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_from_cbor(&v, "\xF9\x00\x01", 3));
+    ASSERT_EQ_DOUBLE(5.960464477539063e-8, json_get_number(&v));
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_from_cbor(&v, "\xC1\x1A\x51\x4B\x67\xB0", 6));
+    ASSERT_EQ_DOUBLE(1363896240.0, json_get_number(&v));
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_from_cbor(&v, "\x3B\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF", 9));
+    ASSERT_EQ_DOUBLE(-18446744073709551616.0, json_get_number(&v));
+
+    TEST_BINARY_ERROR(json_from_cbor, "");
+    TEST_BINARY_ERROR(json_from_cbor, "\x01\x02");
+    TEST_BINARY_ERROR(json_from_cbor, "\x18");
+    TEST_BINARY_ERROR(json_from_cbor, "\x64\x49\x45");
+    TEST_BINARY_ERROR(json_from_cbor, "\x42\x01\x02");
+    TEST_BINARY_ERROR(json_from_cbor, "\x9F\x01\xFF");
+    TEST_BINARY_ERROR(json_from_cbor, "\x83\x01\x02");
+    TEST_BINARY_ERROR(json_from_cbor, "\x9B\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\x01");
+    TEST_BINARY_ERROR(json_from_cbor, "\xA1\x01\x02");
+    TEST_BINARY_ERROR(json_from_cbor, "\xA2\x61\x61\x01\x61\x62");
+    TEST_BINARY_ERROR(json_from_cbor, "\xF9\x7C\x00");
+    TEST_BINARY_ERROR(json_from_cbor, "\xF7");
+    TEST_BINARY_ERROR(json_from_cbor, "\x1C");
+
+    /* a long run of tags costs no stack */
+    p = (char *) malloc((size_t) 1 << 20);
+    memset(p, 0xC6, ((size_t) 1 << 20) - 1);
+    p[((size_t) 1 << 20) - 1] = 0x01;
+    json_init(&v);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_from_cbor(&v, p, (size_t) 1 << 20));
+    ASSERT_EQ_DOUBLE(1.0, json_get_number(&v));
+    ASSERT_EQ_INT(JSON_PARSE_ERROR, json_from_cbor(&v, p, ((size_t) 1 << 20) - 1));
+    free(p);
+
+    /* a sink gets the same bytes in pieces */
+    json_init(&v);
+    json_set_array(&v, 0, NULL);
+    for (i = 0; i < 3000; i++) {
+        json_init(&back);
+        json_set_string(&back, "abc", 3);
+        json_array_push(&v, 0, &back);
+    }
+    p = json_to_cbor(&v, &len);
+    ASSERT_EQ_SIZE_T(3 + 3000 * 4, len);
+    json_init(&pieces);
+    json_set_array(&pieces, 0, NULL);
+    ASSERT_EQ_INT(JSON_JSONIFY_OK, json_to_cbor_sink(&v, test_sink_collect, &pieces));
+    ASSERT_EQ_INT(1, json_get_array_size(&pieces) > 1);
+    for (i = total = 0; i < json_get_array_size(&pieces); total += json_get_string_length(json_get_array_element(&pieces, i++)))
+        ASSERT_EQ_INT(0, memcmp(p + total, json_get_string(json_get_array_element(&pieces, i)), json_get_string_length(json_get_array_element(&pieces, i))));
+    ASSERT_EQ_SIZE_T(len, total);
+    ASSERT_EQ_INT(JSON_JSONIFY_ERROR, json_to_cbor_sink(&v, test_sink_fail, &calls));
+    ASSERT_EQ_INT(2, calls);
+    json_free(&pieces);
+    free(p);
+    json_free(&v);
+
+    /* a document that goes through and back jsonifies the same */
+    json_init(&v);
+    json_parse(&v, "{\"id\": 12345678901, \"tags\": [\"a\", \"\\u20AC\", \"\"], \"geo\": {\"lat\": 48.8566, \"lon\": -2.35},"
+                   " \"ok\": true, \"none\": null, \"n\": -40000}");
+    text = json_jsonify(&v, &len);
+    p = json_to_cbor(&v, &len);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_from_cbor(&back, p, len));
+    free(p);
+    p = json_jsonify(&back, &len);
+    ASSERT_EQ_INT(0, strcmp(text, p));
+    free(p);
+    json_free(&back);
+    p = json_to_msgpack(&v, &len);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_from_msgpack(&back, p, len));
+    free(p);
+    p = json_jsonify(&back, &len);
+    ASSERT_EQ_INT(0, strcmp(text, p));
+    free(p);
+    free(text);
+    json_free(&back);
+    json_free(&v);
+}
+
+static void test_msgpack(void)
+{
+    json_value v;
+    int calls = 0;
+
+    TEST_BINARY(json_to_msgpack, json_from_msgpack, "\x00", "0");
+    TEST_BINARY(json_to_msgpack, json_from_msgpack, "\x7F", "127");
+    TEST_BINARY(json_to_msgpack, json_from_msgpack, "\xCC\x80", "128");
+    TEST_BINARY(json_to_msgpack, json_from_msgpack, "\xCD\x01\x00", "256");
+    TEST_BINARY(json_to_msgpack, json_from_msgpack, "\xCE\x00\x01\x00\x00", "65536");
+    TEST_BINARY(json_to_msgpack, json_from_msgpack, "\xCF\x00\x00\x00\x01\x00\x00\x00\x00", "4294967296");
+    TEST_BINARY(json_to_msgpack, json_from_msgpack, "\xFF", "-1");
+    TEST_BINARY(json_to_msgpack, json_from_msgpack, "\xE0", "-32");
+    TEST_BINARY(json_to_msgpack, json_from_msgpack, "\xD0\xDF", "-33");
+    TEST_BINARY(json_to_msgpack, json_from_msgpack, "\xD1\xFF\x7F", "-129");
+    TEST_BINARY(json_to_msgpack, json_from_msgpack, "\xD2\xFF\xFF\x7F\xFF", "-32769");
+    TEST_BINARY(json_to_msgpack, json_from_msgpack, "\xD3\xFF\xFF\xFF\xFF\x7F\xFF\xFF\xFF", "-2147483649");
+    TEST_BINARY(json_to_msgpack, json_from_msgpack, "\xCA\x3F\xC0\x00\x00", "1.5");
+    TEST_BINARY(json_to_msgpack, json_from_msgpack, "\xCB\x3F\xF1\x99\x99\x99\x99\x99\x9A", "1.1");
+    TEST_BINARY(json_to_msgpack, json_from_msgpack, "\xC0", "null");
+    TEST_BINARY(json_to_msgpack, json_from_msgpack, "\xC2", "false");
+    TEST_BINARY(json_to_msgpack, json_from_msgpack, "\xC3", "true");
+    TEST_BINARY(json_to_msgpack, json_from_msgpack, "\xA0", "\"\"");
+    TEST_BINARY(json_to_msgpack, json_from_msgpack, "\xA3" "abc", "\"abc\"");
+    TEST_BINARY(json_to_msgpack, json_from_msgpack, "\xD9\x20" "abcdefghijklmnopqrstuvwxyz012345", "\"abcdefghijklmnopqrstuvwxyz012345\"");
+    TEST_BINARY(json_to_msgpack, json_from_msgpack, "\x90", "[]");
+    TEST_BINARY(json_to_msgpack, json_from_msgpack, "\x92\x01\x91\xC0", "[1, [null]]");
+    TEST_BINARY(json_to_msgpack, json_from_msgpack, "\xDC\x00\x10\x00\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0A\x0B\x0C\x0D\x0E\x0F",
+                "[0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15]");
+    TEST_BINARY(json_to_msgpack, json_from_msgpack, "\x80", "{}");
+    TEST_BINARY(json_to_msgpack, json_from_msgpack, "\x82\xA1" "a\x01\xA1" "b\x81\xA1" "c\xC3", "{\"a\": 1, \"b\": {\"c\": true}}");
+
+    json_init(&v);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_from_msgpack(&v, "\xDA\x00\x02hi", 5));
+    ASSERT_EQ_STRING("hi", json_get_string(&v), json_get_string_length(&v));
+    json_free(&v);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_from_msgpack(&v, "\xDD\x00\x00\x00\x01\xDE\x00\x00", 8));
+    ASSERT_EQ_SIZE_T(1, json_get_array_size(&v));
+    json_free(&v);
+
+    TEST_BINARY_ERROR(json_from_msgpack, "");
+    TEST_BINARY_ERROR(json_from_msgpack, "\xC1");
+    TEST_BINARY_ERROR(json_from_msgpack, "\xC4\x01\x00");
+    TEST_BINARY_ERROR(json_from_msgpack, "\xA3" "ab");
+    TEST_BINARY_ERROR(json_from_msgpack, "\xCD\x01");
+    TEST_BINARY_ERROR(json_from_msgpack, "\x92\x01");
+    TEST_BINARY_ERROR(json_from_msgpack, "\x81\x01\x02");
+    TEST_BINARY_ERROR(json_from_msgpack, "\xDD\xFF\xFF\xFF\xFF\x01");
+    TEST_BINARY_ERROR(json_from_msgpack, "\xCB\x7F\xF8\x00\x00\x00\x00\x00\x00");
+    TEST_BINARY_ERROR(json_from_msgpack, "\x01\x01");
+
+    /* lengths past 32 bits have no encoding, the head is checked before the bytes are read */
+    if (sizeof(size_t) > 4) {
+        json_init(&v);
+        v.type = JSON_STRING;
+        v.string = (char *) "a";
+        v.string_len = (size_t) 0xFFFFFFFF + 1;
+        ASSERT_EQ_POINTER(NULL, json_to_msgpack(&v, NULL));
+        ASSERT_EQ_INT(JSON_JSONIFY_ERROR, json_to_msgpack_sink(&v, test_sink_fail, &calls));
+        ASSERT_EQ_INT(0, calls);
+        v.type = JSON_ARRAY;
+        v.array = NULL;
+        v.array_size = (size_t) 0xFFFFFFFF + 1;
+        ASSERT_EQ_POINTER(NULL, json_to_msgpack(&v, NULL));
+    }
+}
+
 static void test_jsonify_error(void)
 {
     TEST_JSONIFY_STRING_ERROR("\xC2", 1);
     TEST_JSONIFY_STRING_ERROR("\xE2\x82", 2);
     TEST_JSONIFY_STRING_ERROR("\xF0\x9D\x84", 3);
     TEST_JSONIFY_STRING_ERROR("\xFF\xFF\xFF\xFF", 4);
+    /* stray continuation, overlong, surrogate, past U+10FFFF */
+    TEST_JSONIFY_STRING_ERROR("\x80", 1);
+    TEST_JSONIFY_STRING_ERROR("\xC0\xAF", 2);
+    TEST_JSONIFY_STRING_ERROR("\xE0\x80\xAF", 3);
+    TEST_JSONIFY_STRING_ERROR("\xED\xA0\x80", 3);
+    TEST_JSONIFY_STRING_ERROR("\xF4\x90\x80\x80", 4);
+    TEST_JSONIFY_STRING_ERROR("\xC2\x41", 2);
+}
+
+static void test_tape(void)
+{
+    json_tape t;
+    json_value v;
+    size_t a, o, e;
+
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_tape_parse(&t, " {\"n\": null, \"a\": [1.5, \"x\\u0000y\", true, false, [], {}], \"o\": {\"k\": \"v\"}, \"d\": -2} "));
+    ASSERT_EQ_INT(JSON_OBJECT, json_tape_get_type(&t, 0));
+    ASSERT_EQ_SIZE_T(4, json_tape_get_object_size(&t, 0));
+    ASSERT_EQ_SIZE_T(t.size, json_tape_next(&t, 0));
+    ASSERT_EQ_STRING("a", json_tape_get_object_key(&t, 0, 1), json_tape_get_object_key_length(&t, 0, 1));
+    ASSERT_EQ_INT(JSON_NULL, json_tape_get_type(&t, json_tape_get_object_value(&t, 0, "n")));
+    a = json_tape_get_object_value(&t, 0, "a");
+    ASSERT_EQ_SIZE_T(a, json_tape_get_object_value_index(&t, 0, 1));
+    ASSERT_EQ_SIZE_T(6, json_tape_get_array_size(&t, a));
+    ASSERT_EQ_DOUBLE(1.5, json_tape_get_number(&t, json_tape_first(&t, a)));
+    e = json_tape_get_array_element(&t, a, 1);
+    ASSERT_EQ_STRING("x\0y", json_tape_get_string(&t, e), json_tape_get_string_length(&t, e));
+    ASSERT_EQ_INT(JSON_TRUE, json_tape_get_type(&t, json_tape_next(&t, e)));
+    ASSERT_EQ_SIZE_T(0, json_tape_get_array_size(&t, json_tape_get_array_element(&t, a, 4)));
+    ASSERT_EQ_SIZE_T(0, json_tape_get_object_size(&t, json_tape_get_array_element(&t, a, 5)));
+    o = json_tape_get_object_value(&t, 0, "o");
+    ASSERT_EQ_SIZE_T(o, json_tape_next(&t, a) + 2);
+    e = json_tape_get_object_value(&t, o, "k");
+    ASSERT_EQ_STRING("v", json_tape_get_string(&t, e), json_tape_get_string_length(&t, e));
+    ASSERT_EQ_DOUBLE(-2.0, json_tape_get_number(&t, json_tape_get_object_value(&t, 0, "d")));
+    ASSERT_EQ_SIZE_T(0, json_tape_get_object_value(&t, 0, "none"));
+
+    json_init(&v);
+    json_tape_to_value(&t, 0, &v);
+    TEST_JSONIFY_OK("{\"n\": null, \"a\": [1.5, \"x\\u0000y\", true, false, [], {}], \"o\": {\"k\": \"v\"}, \"d\": -2}", &v);
+    json_init(&v);
+    json_tape_to_value(&t, o, &v);
+    TEST_JSONIFY_OK("{\"k\": \"v\"}", &v);
+    json_tape_free(&t);
+
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_tape_parse(&t, "\"s\""));
+    ASSERT_EQ_STRING("s", json_tape_get_string(&t, 0), json_tape_get_string_length(&t, 0));
+    json_tape_free(&t);
+
+    /* integers keep all their digits */
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_tape_parse(&t, "[9007199254740993, -9223372036854775808, 18446744073709551615, 1.5, 3]"));
+    e = json_tape_first(&t, 0);
+    ASSERT_EQ_INT(1, json_tape_get_int64(&t, e) == 9007199254740993LL);
+    ASSERT_EQ_DOUBLE(9007199254740992.0, json_tape_get_number(&t, e));
+    ASSERT_EQ_INT(1, json_tape_get_int64(&t, e = json_tape_next(&t, e)) == INT64_MIN);
+    ASSERT_EQ_INT(1, json_tape_get_uint64(&t, e = json_tape_next(&t, e)) == UINT64_MAX);
+    ASSERT_EQ_INT(1, json_tape_get_int64(&t, e) == INT64_MAX);
+    ASSERT_EQ_INT(1, json_tape_get_int64(&t, e = json_tape_next(&t, e)) == 1);
+    ASSERT_EQ_DOUBLE(1.5, json_tape_get_number(&t, e));
+    ASSERT_EQ_DOUBLE(3.0, json_tape_get_number(&t, json_tape_next(&t, e)));
+    json_init(&v);
+    json_tape_to_value(&t, 0, &v);
+    ASSERT_EQ_INT(JSON_FLAG_UINT64, json_get_array_element(&v, 2)->flags);
+    TEST_JSONIFY_OK("[9007199254740993, -9223372036854775808, 18446744073709551615, 1.5, 3]", &v);
+    json_tape_free(&t);
+    ASSERT_EQ_INT(JSON_PARSE_ERROR, json_tape_parse(&t, "[1, {\"a\" 1}]"));
+    ASSERT_EQ_INT(JSON_PARSE_ERROR, json_tape_parse(&t, "[1,]"));
+    ASSERT_EQ_INT(JSON_PARSE_ERROR, json_tape_parse(&t, "{\"a\": \"b}"));
+    ASSERT_EQ_INT(JSON_PARSE_ERROR, json_tape_parse(&t, "[] x"));
+    ASSERT_EQ_SIZE_T(0, t.size);
+}
+
+/* 'from' with word 'k' replaced, saved with its checksum, is not attached unless trusted */
+#define TEST_TAPE_CRAFTED(from, k, word) \
+    do { \
+        json_tape crafted = *(from), s; \
+        crafted.tape = (uint64_t *) malloc(crafted.size * sizeof(uint64_t)); \
+        memcpy(crafted.tape, (from)->tape, crafted.size * sizeof(uint64_t)); \
+        crafted.tape[k] = (word); \
+        ASSERT_EQ_INT(JSON_JSONIFY_OK, json_tape_save(&crafted, path)); \
+        ASSERT_EQ_INT(JSON_PARSE_ERROR, json_tape_load(&s, path, 0)); \
+        ASSERT_EQ_POINTER(NULL, s.tape); \
+        free(crafted.tape); \
+    } while (0)
+
+static void test_tape_snapshot(void)
+{
+    static const char *path = "json_test.tape";
+    json_tape t, s;
+    json_value v;
+    uint64_t *buffer;
+    FILE *f;
+    size_t len;
+    char *text;
+
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_tape_parse(&t, "{\"n\": null, \"a\": [1.5, \"x\\u0000y\", true, false, [], {}], \"o\": {\"k\": \"\\u20AC\"}}"));
+    ASSERT_EQ_INT(JSON_JSONIFY_OK, json_tape_save(&t, path));
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_tape_load(&s, path, 0));
+    ASSERT_EQ_SIZE_T(t.size, s.size);
+    ASSERT_EQ_SIZE_T(t.strings_size, s.strings_size);
+    ASSERT_EQ_INT(0, memcmp(t.tape, s.tape, t.size * sizeof(uint64_t)));
+    ASSERT_EQ_STRING("\xE2\x82\xAC", json_tape_get_string(&s, json_tape_get_object_value(&s, json_tape_get_object_value(&s, 0, "o"), "k")), 3);
+    json_init(&v);
+    json_tape_to_value(&s, 0, &v);
+    TEST_JSONIFY_OK("{\"n\": null, \"a\": [1.5, \"x\\u0000y\", true, false, [], {}], \"o\": {\"k\": \"\\u20AC\"}}", &v);
+    json_tape_free(&s);
+    ASSERT_EQ_POINTER(NULL, s.snapshot);
+
+    /* the same bytes attached from memory, then damaged */
+    f = fopen(path, "rb");
+    fseek(f, 0, SEEK_END);
+    len = (size_t) ftell(f);
+    fseek(f, 0, SEEK_SET);
+    buffer = (uint64_t *) malloc(len + sizeof(uint64_t));
+    text = (char *) buffer;
+    ASSERT_EQ_SIZE_T(len, fread(text, 1, len, f));
+    fclose(f);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_tape_attach(&s, text, len, 0));
+    ASSERT_EQ_INT(JSON_OBJECT, json_tape_get_type(&s, 0));
+    json_tape_free(&s);
+    ASSERT_EQ_INT(JSON_PARSE_ERROR, json_tape_attach(&s, text, len - 1, 0));
+    ASSERT_EQ_INT(JSON_PARSE_ERROR, json_tape_attach(&s, text, 16, 0));
+    ASSERT_EQ_INT(JSON_PARSE_ERROR, json_tape_attach(&s, text + 1, len - 1, 0));
+    text[len - 2] ^= 1;
+    ASSERT_EQ_INT(JSON_PARSE_ERROR, json_tape_attach(&s, text, len, 0));
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_tape_attach(&s, text, len, JSON_TAPE_TRUSTED));
+    json_tape_free(&s);
+    text[len - 2] ^= 1;
+    /* the root and the last '\0' are checked even when trusted */
+    text[len - 1] = 'x';
+    ASSERT_EQ_INT(JSON_PARSE_ERROR, json_tape_attach(&s, text, len, JSON_TAPE_TRUSTED));
+    text[len - 1] = '\0';
+    buffer[5] += 1;
+    ASSERT_EQ_INT(JSON_PARSE_ERROR, json_tape_attach(&s, text, len, JSON_TAPE_TRUSTED));
+    buffer[5] -= 1;
+    /* the version */
+    text[8] ^= 1;
+    ASSERT_EQ_INT(JSON_PARSE_ERROR, json_tape_attach(&s, text, len, JSON_TAPE_TRUSTED));
+    ASSERT_EQ_POINTER(NULL, s.tape);
+    free(buffer);
+
+    /* crafted words under a valid checksum: a string past the strings, counts and ends past the containers, a bad type */
+    TEST_TAPE_CRAFTED(&t, 2, ((uint64_t) JSON_STRING << 56) | t.strings_size);
+    TEST_TAPE_CRAFTED(&t, 3, t.strings_size);
+    TEST_TAPE_CRAFTED(&t, 8, 7);
+    TEST_TAPE_CRAFTED(&t, 8, ~(uint64_t) 0);
+    TEST_TAPE_CRAFTED(&t, 7, ((uint64_t) JSON_ARRAY << 56) | t.size);
+    TEST_TAPE_CRAFTED(&t, 7, ((uint64_t) JSON_ARRAY << 56) | 8);
+    TEST_TAPE_CRAFTED(&t, 4, (uint64_t) 0x7F << 56);
+    TEST_TAPE_CRAFTED(&t, 4, (uint64_t) JSON_STRING << 56);
+    TEST_TAPE_CRAFTED(&t, 9, ((uint64_t) JSON_NUMBER << 56) | 1);
+    json_tape_free(&t);
+
+    /* integers survive the snapshot */
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_tape_parse(&t, "{\"id\": 12345678901234567891}"));
+    ASSERT_EQ_INT(JSON_JSONIFY_OK, json_tape_save(&t, path));
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_tape_load(&s, path, 0));
+    ASSERT_EQ_INT(1, json_tape_get_uint64(&s, json_tape_get_object_value(&s, 0, "id")) == 12345678901234567891ULL);
+    json_init(&v);
+    json_tape_to_value(&s, 0, &v);
+    TEST_JSONIFY_OK("{\"id\": 12345678901234567891}", &v);
+    json_tape_free(&s);
+
+    remove(path);
+    ASSERT_EQ_INT(JSON_PARSE_ERROR, json_tape_load(&s, path, 0));
+    json_tape_free(&t);
+}
+
+static void test_compact(void)
+{
+    json_shape_cache *cache;
+    json_parse_options options;
+    json_value v, e, *c;
+    char *p;
+    size_t len;
+
+    json_init(&v);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse(&v, "{\"a\": [1, \"two\", [], {}], \"b\": {\"c\": null, \"d\": \"\\u0000\"}, \"e\": true}"));
+    c = json_compact(&v);
+    ASSERT_EQ_INT(JSON_NULL, json_get_type(&v));
+    ASSERT_EQ_INT(JSON_FLAG_COMPACT, c->flags);
+    ASSERT_EQ_SIZE_T(3, json_get_object_size(c));
+    ASSERT_EQ_STRING("b", json_get_object_key(c, 1), json_get_object_key_length(c, 1));
+    ASSERT_EQ_STRING("\0", json_get_string(json_get_object_value(json_get_object_value(c, "b"), "d")), 1);
+    ASSERT_EQ_STRING("two", json_get_string(json_get_array_element(json_get_object_value(c, "a"), 1)), 3);
+    /* depth first: the members of the root come right after it */
+    ASSERT_EQ_POINTER((void *) (c + 1), (void *) c->object);
+    p = json_jsonify(c, &len);
+    ASSERT_EQ_STRING("{\"a\": [1, \"two\", [], {}], \"b\": {\"c\": null, \"d\": \"\\u0000\"}, \"e\": true}", p, len);
+    free(p);
+    /* elements can still be replaced by values without storage */
+    e = *json_get_array_element(json_get_object_value(c, "a"), 0);
+    json_free(json_get_array_element(json_get_object_value(c, "a"), 0));
+    json_set_false(json_get_array_element(json_get_object_value(c, "a"), 0));
+    ASSERT_EQ_DOUBLE(1.0, json_get_number(&e));
+    json_free(c);
+    free(c);
+
+    /* shaped and built trees */
+    cache = json_shape_cache_new();
+    options.shape_cache = cache;
+    options.dedup = NULL;
+    options.flags = 0;
+    json_init(&v);
+    ASSERT_EQ_INT(JSON_PARSE_OK, json_parse_ex(&v, "[{\"k\": 1}, {\"k\": 2}]", &options));
+    c = json_compact(&v);
+    json_shape_cache_free(cache);
+    ASSERT_EQ_DOUBLE(2.0, json_get_number(json_get_object_value(json_get_array_element(c, 1), "k")));
+    free(c);
+
+    json_init(&e);
+    json_set_string(&e, "s", 1);
+    json_init(&v);
+    json_object_append(&v, 0, "s", (size_t) 1, &e, NULL);
+    c = json_compact(&v);
+    TEST_JSONIFY_OK("{\"s\": \"s\"}", c);
+    free(c);
+
+    json_init(&v);
+    json_set_number(&v, 1.0);
+    c = json_compact(&v);
+    ASSERT_EQ_DOUBLE(1.0, json_get_number(c));
+    free(c);
 }
 
 static void test(void)
@@ -585,6 +2853,7 @@ static void test(void)
     test_parse_false();
     test_parse_null();
     test_parse_number();
+    test_parse_integer();
     test_parse_string();
     test_parse_array();
     test_parse_object();
@@ -599,9 +2868,36 @@ static void test(void)
     test_jsonify_number();
     test_jsonify_array();
     test_jsonify_object();
+    test_jsonify_options();
     test_modify_array();
+    test_array_push();
+    test_array_doubles();
     test_modify_object();
+    test_object_set();
+    test_copy();
+    test_share();
+    test_equal();
+    test_diff();
+    test_patch();
+    test_merge_patch();
+    test_pointer();
+    test_path();
+    test_extract();
+    test_shred();
+    test_struct();
+    test_jsonify_struct();
+    test_writer();
+    test_format();
+    test_cbor();
+    test_msgpack();
     test_jsonify_error();
+
+    test_parse_shape();
+    test_parse_lazy();
+    test_parse_dedup();
+    test_tape();
+    test_tape_snapshot();
+    test_compact();
 }
 
 int main(void)
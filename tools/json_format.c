@@ -0,0 +1,76 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "../src/json.h"
+
+/*
+ * json_format [-m | -i indent] [file]
+ * Minify (-m) or prettify (default, 4 spaces) the JSON in 'file', or stdin, onto stdout.
+ */
+
+static int json_format_write(void *data, const char *json, size_t len)
+{
+    return fwrite(json, 1, len, (FILE *) data) != len;
+}
+
+static char *json_format_read(FILE *in)
+{
+    char *text = NULL;
+    size_t size = 0, len = 0, n;
+
+    do {
+        if (size - len < 65536) {
+            size = size ? size + (size >> 1) : 65536 * 2;
+            text = (char *) realloc(text, size + 1);
+        }
+        n = fread(text + len, 1, size - len, in);
+        len += n;
+    } while (n);
+    if (ferror(in)) {
+        free(text);
+        return NULL;
+    }
+    text[len] = '\0';
+    return text;
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *in = stdin;
+    char *text;
+    long indent = 4;
+    int minify = 0, ret, i;
+
+    for (i = 1; i < argc && argv[i][0] == '-' && argv[i][1]; i++) {
+        if (!strcmp(argv[i], "-m"))
+            minify = 1;
+        else if (!strcmp(argv[i], "-i") && i + 1 < argc && (indent = strtol(argv[++i], NULL, 10)) >= 0)
+            ;
+        else {
+            fprintf(stderr, "usage: %s [-m | -i indent] [file]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (i < argc && !(in = fopen(argv[i], "rb"))) {
+        perror(argv[i]);
+        return 1;
+    }
+    text = json_format_read(in);
+    if (in != stdin)
+        fclose(in);
+    if (!text) {
+        perror("read");
+        return 1;
+    }
+    if (minify)
+        ret = json_minify_sink(text, json_format_write, stdout);
+    else
+        ret = json_prettify_sink(text, (size_t) indent, json_format_write, stdout);
+    free(text);
+    if (ret != JSON_PARSE_OK) {
+        fprintf(stderr, "invalid JSON\n");
+        return 1;
+    }
+    putchar('\n');
+    return 0;
+}